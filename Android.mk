@@ -22,11 +22,21 @@ source_files := \
 	list.cc \
 	hash.cc \
 	heap.cc \
+	arena.cc \
+	bitmap.cc \
+	gc.cc \
+	mark.cc \
+	mutex.cc \
+	card_table.cc \
+	los.cc \
+	alloc_tracker.cc \
 	net.cc \
 	zip.cc \
 	cart.cc \
 	debugger.cc \
 	class.cc \
+	class_table.cc \
+	class_index.cc \
 	jni_env_ext.cc \
 	java_vm_ext.cc
 
@@ -0,0 +1,295 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+
+#include "macros.h"
+#include "cart.h"
+#include "class.h"
+#include "alloc_tracker.h"
+
+#define ALLOC_TRACKER_REPORT_SZ   (ALLOC_TRACKER_TOP * 160 + 256)
+
+__thread intptr_t alloc_tracker_countdown = 0;
+static __thread uint64_t alloc_tracker_seed = 0;
+
+// Exponential distance to the next sample, xorshift64* drives it
+static intptr_t _NextCountdown(size_t interval) {
+  uint64_t x = alloc_tracker_seed;
+  if (!x) {
+    x = ((uint64_t)(uintptr_t)&alloc_tracker_seed * 0x9E3779B97F4A7C15ULL) | 1;
+  }
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  alloc_tracker_seed = x;
+  // Uniform in (0, 1]
+  double u = (double)(((x * 0x2545F4914F6CDD1DULL) >> 11) + 1) * (1.0 / 9007199254740992.0);
+  return (intptr_t)(-log(u) * (double)interval) + 1;
+}
+
+static inline size_t _SiteIndex(uintptr_t pc, const Class_t* klass) {
+  uint64_t h = ((uint64_t)pc * 0x9E3779B97F4A7C15ULL) ^ ((uint64_t)(uintptr_t)klass >> 3);
+  h ^= h >> 29;
+  return (size_t)(h & (ALLOC_TRACKER_SITES - 1));
+}
+
+// An object of sz bytes is sampled with a probability of
+// 1 - exp(-sz / interval), its sample stands for sz over that
+static void _AddSample(AllocTracker_t* tracker, const AllocSample_t* sample) {
+  double sz = (double)sample->size;
+  uint64_t estimated = (uint64_t)(sz / (1.0 - exp(-sz / (double)tracker->interval)));
+  tracker->samples++;
+  tracker->estimated_bytes += estimated;
+  size_t idx = _SiteIndex(sample->pc, sample->klass);
+  for (size_t probe = 0; probe < ALLOC_TRACKER_SITES; ++probe) {
+    AllocSite_t* site = tracker->sites + ((idx + probe) & (ALLOC_TRACKER_SITES - 1));
+    if (!site->pc) {
+      site->pc = sample->pc;
+      site->klass = sample->klass;
+      tracker->nr_sites++;
+    } else if ((site->pc != sample->pc) || (site->klass != sample->klass)) {
+      continue;
+    }
+    site->samples++;
+    site->sampled_bytes += sample->size;
+    site->estimated_bytes += estimated;
+    return;
+  }
+  tracker->other_samples++;
+  tracker->other_bytes += estimated;
+}
+
+static void _DrainLocked(AllocTracker_t* tracker, AllocTrackerRing_t* ring) {
+  size_t tail = ring->tail;
+  size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  for (; tail != head; ++tail) {
+    _AddSample(tracker, ring->samples + (tail & (ALLOC_TRACKER_RING - 1)));
+  }
+  __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+}
+
+static void _DrainAllLocked(AllocTracker_t* tracker) {
+  for (AllocTrackerRing_t* ring = tracker->rings; ring; ring = ring->Next) {
+    _DrainLocked(tracker, ring);
+  }
+}
+
+// The samples left in the ring are drained by whoever takes it over
+static void _ReleaseRing(void* arg) {
+  __atomic_store_n(&((AllocTrackerRing_t*)arg)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+// Ring of the calling thread, one left by an exited thread is reused
+static AllocTrackerRing_t* _GetRing(AllocTracker_t* tracker) {
+  AllocTrackerRing_t* ring = (AllocTrackerRing_t*)pthread_getspecific(tracker->ring_key);
+  if (ring) {
+    return ring;
+  }
+  MutexLock(&tracker->lock);
+  for (ring = tracker->rings; ring; ring = ring->Next) {
+    if (!__atomic_load_n(&ring->in_use, __ATOMIC_ACQUIRE)) {
+      break;
+    }
+  }
+  if (!ring) {
+    ring = (AllocTrackerRing_t*)malloc(sizeof(AllocTrackerRing_t));
+    if (!ring) {
+      MutexUnlock(&tracker->lock);
+      pdbg("Out of memory\n");
+      return NULL;
+    }
+    memset((void*)ring, 0, sizeof(AllocTrackerRing_t));
+    ring->Next = tracker->rings;
+    tracker->rings = ring;
+  }
+  __atomic_store_n(&ring->in_use, 1, __ATOMIC_RELAXED);
+  MutexUnlock(&tracker->lock);
+  pthread_setspecific(tracker->ring_key, (void*)ring);
+  return ring;
+}
+
+AllocTracker_t* AllocAllocTracker(ClassLinker_t* pCL, size_t interval) {
+  // Allocate a tracker structure and its site table
+  AllocTracker_t* tracker = (AllocTracker_t*)malloc(sizeof(AllocTracker_t));
+  if (!tracker) {
+    pdbg("Out of memory\n");
+    return NULL;
+  }
+  memset((void*)tracker, 0, sizeof(AllocTracker_t));
+  tracker->sites = (AllocSite_t*)calloc(ALLOC_TRACKER_SITES, sizeof(AllocSite_t));
+  if (!tracker->sites) {
+    pdbg("Out of memory\n");
+    free((void*)tracker);
+    return NULL;
+  }
+  if (pthread_key_create(&tracker->ring_key, _ReleaseRing) != 0) {
+    pdbg("Failed to create the ring key\n");
+    free((void*)tracker->sites);
+    free((void*)tracker);
+    return NULL;
+  }
+  InitMutex(&tracker->lock, "alloc tracker lock", kAllocTrackerLock);
+  tracker->class_linker = pCL;
+  tracker->interval = interval ? interval : ALLOC_TRACKER_INTERVAL;
+  tracker->enabled = 1;
+  return tracker;
+}
+
+// The allocating threads must be done with it
+void FreeAllocTracker(AllocTracker_t* tracker) {
+  pthread_key_delete(tracker->ring_key);
+  while (tracker->rings) {
+    AllocTrackerRing_t* next = tracker->rings->Next;
+    free((void*)tracker->rings);
+    tracker->rings = next;
+  }
+  DestroyMutex(&tracker->lock);
+  free((void*)tracker->sites);
+  free((void*)tracker);
+}
+
+void AllocTrackerEnable(AllocTracker_t* tracker, bool enable) {
+  __atomic_store_n(&tracker->enabled, enable ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+void AllocTrackerRecord(AllocTracker_t* tracker, uintptr_t pc, const Class_t* klass, size_t sz) {
+  alloc_tracker_countdown = _NextCountdown(tracker->interval);
+  if (!__atomic_load_n(&tracker->enabled, __ATOMIC_RELAXED)) {
+    return;
+  }
+  AllocTrackerRing_t* ring = _GetRing(tracker);
+  if (!ring) {
+    return;
+  }
+  // Only this thread moves head, the drains move tail
+  size_t head = ring->head;
+  if ((head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) == ALLOC_TRACKER_RING) {
+    MutexLock(&tracker->lock);
+    _DrainLocked(tracker, ring);
+    MutexUnlock(&tracker->lock);
+  }
+  AllocSample_t* sample = ring->samples + (head & (ALLOC_TRACKER_RING - 1));
+  sample->pc = pc;
+  sample->klass = klass;
+  sample->size = sz;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static int _CompareSites(const void* a, const void* b) {
+  uint64_t x = ((const AllocSite_t*)a)->estimated_bytes;
+  uint64_t y = ((const AllocSite_t*)b)->estimated_bytes;
+  return (x > y) ? -1 : ((x < y) ? 1 : 0);
+}
+
+size_t AllocTrackerTopSites(AllocTracker_t* tracker, AllocSite_t* sites, size_t nr) {
+  AllocSite_t* all = (AllocSite_t*)malloc(sizeof(AllocSite_t) * ALLOC_TRACKER_SITES);
+  if (!all) {
+    pdbg("Out of memory\n");
+    return 0;
+  }
+  size_t nr_all = 0;
+  MutexLock(&tracker->lock);
+  _DrainAllLocked(tracker);
+  for (size_t i = 0; i < ALLOC_TRACKER_SITES; ++i) {
+    if (tracker->sites[i].pc) {
+      all[nr_all++] = tracker->sites[i];
+    }
+  }
+  MutexUnlock(&tracker->lock);
+  qsort((void*)all, nr_all, sizeof(AllocSite_t), _CompareSites);
+  if (nr > nr_all) {
+    nr = nr_all;
+  }
+  memcpy((void*)sites, (const void*)all, sizeof(AllocSite_t) * nr);
+  free((void*)all);
+  return nr;
+}
+
+static size_t _Append(char* buf, size_t size, size_t pos, const char* fmt, ...) {
+  if (pos >= size) {
+    return pos;
+  }
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf(buf + pos, size - pos, fmt, args);
+  va_end(args);
+  return (n < 0) ? pos : pos + n;
+}
+
+// Top sites, one line each
+size_t FormatAllocSites(AllocTracker_t* tracker, char* buf, size_t size) {
+  AllocSite_t sites[ALLOC_TRACKER_TOP];
+  size_t nr = AllocTrackerTopSites(tracker, sites, ALLOC_TRACKER_TOP);
+  MutexLock(&tracker->lock);
+  uint64_t samples = tracker->samples;
+  uint64_t total = tracker->estimated_bytes;
+  uint64_t other_samples = tracker->other_samples;
+  size_t nr_sites = tracker->nr_sites;
+  MutexUnlock(&tracker->lock);
+
+  size_t pos = 0;
+  if (size) {
+    buf[0] = '\0';
+  }
+  pos = _Append(buf, size, pos, "%lu samples every %u bytes, %u sites, about %lu KB allocated\n",
+                (unsigned long)samples, (unsigned int)tracker->interval, (unsigned int)nr_sites,
+                (unsigned long)(total / 1024));
+  if (other_samples) {
+    pos = _Append(buf, size, pos, "%lu samples of sites past the table\n", (unsigned long)other_samples);
+  }
+  pos = _Append(buf, size, pos, "%10s %5s %8s %8s  %-32s %s\n",
+                "KB", "%", "samples", "avg", "class", "site");
+  for (size_t i = 0; i < nr; ++i) {
+    AllocSite_t* site = sites + i;
+    const Class_t* owner = NULL;
+    const Method_t* pMethod = NULL;
+    if (tracker->class_linker) {
+      pMethod = ClFindMethodByPc(tracker->class_linker, site->pc, &owner);
+    }
+    const char* klass = (site->klass && site->klass->class_name_str) ?
+        (const char*)site->klass->class_name_str : "?";
+    pos = _Append(buf, size, pos, "%10lu %4u%% %8lu %8lu  %-32s ",
+                  (unsigned long)(site->estimated_bytes / 1024),
+                  (unsigned int)(total ? (site->estimated_bytes * 100) / total : 0),
+                  (unsigned long)site->samples,
+                  (unsigned long)(site->sampled_bytes / site->samples),
+                  klass);
+    if (pMethod) {
+      pos = _Append(buf, size, pos, "%s.%s +0x%x\n",
+                    (owner && owner->class_name_str) ? (const char*)owner->class_name_str : "?",
+                    pMethod->method_name_str ? (const char*)pMethod->method_name_str : "?",
+                    (unsigned int)(site->pc - (uintptr_t)pMethod->method_oat_code));
+    } else {
+      pos = _Append(buf, size, pos, "pc %p\n", (void*)site->pc);
+    }
+  }
+  return pos;
+}
+
+void DumpAllocSites(AllocTracker_t* tracker) {
+  char buf[ALLOC_TRACKER_REPORT_SZ];
+  FormatAllocSites(tracker, buf, sizeof(buf));
+  fprintf(stderr, "---------------------------------------------------------------------------\n");
+  fprintf(stderr, " ALLOC site statistics\n");
+  fprintf(stderr, "---------------------------------------------------------------------------\n");
+  fprintf(stderr, "%s", buf);
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Allocation tracker header support
+ *
+ * Samples the allocations of the collector to find where they come from.
+ * Every thread counts down the bytes it allocates from a random distance
+ * drawn with a mean of the sampling interval, and the allocation that
+ * crosses zero is sampled, so every byte has the same chance to be. A
+ * sample is the return PC of the allocation, the class and the size, kept
+ * in a ring of the thread without a lock. Full rings and reports drain
+ * them into a table of allocation sites, each estimating the bytes
+ * allocated there. The PCs are mapped to their methods when reported.
+ */
+
+#ifndef CART_ALLOC_TRACKER_H_
+#define CART_ALLOC_TRACKER_H_
+
+#include <pthread.h>
+
+#include "macros.h"
+#include "mutex.h"
+#include "class.h"
+
+// Mean bytes allocated between two samples
+#define ALLOC_TRACKER_INTERVAL  (64 * 1024)
+// Samples a thread keeps before draining them, a power of 2
+#define ALLOC_TRACKER_RING      64
+// Slots of the site table, a power of 2
+#define ALLOC_TRACKER_SITES     1024
+// Sites shown in the reports
+#define ALLOC_TRACKER_TOP       16
+
+typedef struct PACKED {
+  uintptr_t       pc;
+  const Class_t*  klass;
+  size_t          size;
+} AllocSample_t;
+
+// Written by its thread only, head is published for the drains, which run
+// under the tracker lock and publish tail back. Accessed with atomic
+// operations, so it is not PACKED.
+typedef struct _AllocTrackerRing {
+  AllocSample_t             samples[ALLOC_TRACKER_RING];
+  size_t                    head;
+  size_t                    tail;
+  uint32_t                  in_use;     // cleared when its thread exits
+  struct _AllocTrackerRing* Next;
+} AllocTrackerRing_t;
+
+typedef struct PACKED {
+  uintptr_t       pc;         // 0 for an empty slot
+  const Class_t*  klass;
+  uint64_t        samples;
+  uint64_t        sampled_bytes;
+  uint64_t        estimated_bytes;
+} AllocSite_t;
+
+// Holds mutexes, so it is not PACKED
+typedef struct {
+  ClassLinker_t*        class_linker;   // maps the PCs, may be NULL
+  size_t                interval;
+  uint32_t              enabled;
+  pthread_key_t         ring_key;
+  Mutex_t               lock;
+  AllocTrackerRing_t*   rings;
+  AllocSite_t*          sites;
+  size_t                nr_sites;
+  uint64_t              samples;
+  uint64_t              estimated_bytes;
+  // Samples of the sites the table had no room for
+  uint64_t              other_samples;
+  uint64_t              other_bytes;
+} AllocTracker_t;
+
+// Bytes the calling thread allocates before its next sample
+extern __thread intptr_t alloc_tracker_countdown;
+
+AllocTracker_t* AllocAllocTracker(ClassLinker_t* pCL, size_t interval);
+void FreeAllocTracker(AllocTracker_t* tracker);
+void AllocTrackerEnable(AllocTracker_t* tracker, bool enable);
+void AllocTrackerRecord(AllocTracker_t* tracker, uintptr_t pc, const Class_t* klass, size_t sz);
+// Copies the sites estimated to allocate the most, returns how many
+size_t AllocTrackerTopSites(AllocTracker_t* tracker, AllocSite_t* sites, size_t nr);
+size_t FormatAllocSites(AllocTracker_t* tracker, char* buf, size_t size);
+void DumpAllocSites(AllocTracker_t* tracker);
+
+// True when the allocation of sz bytes is to be recorded
+static inline bool AllocTrackerCount(size_t sz) {
+  alloc_tracker_countdown -= (intptr_t)sz;
+  return alloc_tracker_countdown < 0;
+}
+
+#endif  // CART_ALLOC_TRACKER_H_
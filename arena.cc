@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "arena.h"
+
+static inline uint8_t* _ChunkData(ArenaChunk_t* chunk) {
+  return (uint8_t*)chunk + sizeof(ArenaChunk_t);
+}
+
+static ArenaChunk_t* _AllocChunk(Arena_t* pArena, size_t sz) {
+  ArenaChunk_t* chunk = (ArenaChunk_t*)malloc(sizeof(ArenaChunk_t) + sz);
+  if (!chunk) {
+    pdbg("Out of memory\n");
+    return NULL;
+  }
+  chunk->Next = NULL;
+  chunk->size = sz;
+  pArena->total_sz += sz;
+  return chunk;
+}
+
+static void _FreeChunks(ArenaChunk_t* chunk) {
+  while (chunk) {
+    ArenaChunk_t* next = chunk->Next;
+    free((void*)chunk);
+    chunk = next;
+  }
+}
+
+Arena_t* AllocArena(size_t chunk_sz) {
+  // Allocate an arena structure, chunks come with the first allocation
+  Arena_t* pArena = (Arena_t*)malloc(sizeof(Arena_t));
+  if (!pArena) {
+    pdbg("Out of memory\n");
+    return NULL;
+  }
+  memset((void*)pArena, 0, sizeof(Arena_t));
+  pArena->chunk_sz = chunk_sz ? chunk_sz : ARENA_CHUNK_SIZE;
+  return pArena;
+}
+
+void FreeArena(Arena_t* pArena) {
+  // Tables allocated from this arena must not outlive it in the statistics
+  RetireHashTablesOfArena((void*)pArena);
+  _FreeChunks(pArena->chunks);
+  free((void*)pArena);
+}
+
+// Drop everything allocated so far, the current chunk is kept for reuse
+void ResetArena(Arena_t* pArena) {
+  RetireHashTablesOfArena((void*)pArena);
+  ArenaChunk_t* keep = pArena->end ? pArena->chunks : NULL;
+  if (keep) {
+    _FreeChunks(keep->Next);
+    keep->Next = NULL;
+    pArena->pos = _ChunkData(keep);
+    pArena->total_sz = keep->size;
+  } else {
+    _FreeChunks(pArena->chunks);
+    pArena->total_sz = 0;
+  }
+  pArena->chunks = keep;
+  pArena->alloced_sz = 0;
+}
+
+void ArenaMerge(Arena_t* pArena, Arena_t* pFrom) {
+  MoveHashTablesOfArena((void*)pFrom, (void*)pArena);
+  if (pFrom->chunks) {
+    // Behind the current chunk, which keeps taking the allocations
+    ArenaChunk_t* last = pFrom->chunks;
+    while (last->Next) {
+      last = last->Next;
+    }
+    if (pArena->end) {
+      last->Next = pArena->chunks->Next;
+      pArena->chunks->Next = pFrom->chunks;
+    } else {
+      last->Next = pArena->chunks;
+      pArena->chunks = pFrom->chunks;
+    }
+  }
+  pArena->alloced_sz += pFrom->alloced_sz;
+  pArena->total_sz += pFrom->total_sz;
+  free((void*)pFrom);
+}
+
+// sz is already aligned by ArenaAlloc
+void* ArenaAllocSlow(Arena_t* pArena, size_t sz) {
+  // Requests bigger than a quarter chunk get a chunk of their own, linked
+  // behind the current one so its remaining space is not wasted
+  if (sz > (pArena->chunk_sz / 4)) {
+    ArenaChunk_t* chunk = _AllocChunk(pArena, sz);
+    if (!chunk) {
+      return NULL;
+    }
+    if (pArena->end) {
+      chunk->Next = pArena->chunks->Next;
+      pArena->chunks->Next = chunk;
+    } else {
+      chunk->Next = pArena->chunks;
+      pArena->chunks = chunk;
+    }
+    pArena->alloced_sz += sz;
+    return (void*)_ChunkData(chunk);
+  }
+
+  // Otherwise start a new current chunk, the tail of the old one is left over
+  ArenaChunk_t* chunk = _AllocChunk(pArena, pArena->chunk_sz);
+  if (!chunk) {
+    return NULL;
+  }
+  chunk->Next = pArena->chunks;
+  pArena->chunks = chunk;
+  pArena->pos = _ChunkData(chunk) + sz;
+  pArena->end = _ChunkData(chunk) + chunk->size;
+  pArena->alloced_sz += sz;
+  return (void*)_ChunkData(chunk);
+}
+
+HashTable_t* AllocHashTableFromArena(Arena_t* pArena, size_t nr) {
+  return AllocArenaHashTable((void*)pArena, nr);
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Arena header support
+ *
+ * A bump-pointer allocator for data that lives exactly as long as its owner,
+ * such as the class linker metadata. Memory is carved from malloc'ed chunks
+ * and is never freed one by one, only all at once by ResetArena/FreeArena.
+ * An arena is not locked, its owner serializes the allocations; threads
+ * allocating at once each take an arena and merge it into the shared one.
+ */
+
+#ifndef CART_ARENA_H_
+#define CART_ARENA_H_
+
+#include "hash.h"
+
+#define ARENA_CHUNK_SIZE    (64 * 1024)
+#define ARENA_ALIGN         8
+
+typedef struct PACKED _ArenaChunk {
+  struct _ArenaChunk* Next;
+  size_t              size;   // usable bytes after the header
+} ArenaChunk_t;
+
+typedef struct PACKED {
+  // Bump pointer into the current chunk
+  uint8_t*        pos;
+  uint8_t*        end;
+  // Current chunk first, then the older ones and the oversized requests
+  ArenaChunk_t*   chunks;
+  size_t          chunk_sz;
+  size_t          alloced_sz;
+  size_t          total_sz;
+} Arena_t;
+
+Arena_t* AllocArena(size_t chunk_sz);
+void FreeArena(Arena_t* pArena);
+void ResetArena(Arena_t* pArena);
+// Hands the chunks of pFrom over to pArena and frees pFrom, what was
+// allocated from it now living as long as pArena
+void ArenaMerge(Arena_t* pArena, Arena_t* pFrom);
+void* ArenaAllocSlow(Arena_t* pArena, size_t sz);
+HashTable_t* AllocHashTableFromArena(Arena_t* pArena, size_t nr);
+
+static inline void* ArenaAlloc(Arena_t* pArena, size_t sz) {
+  sz = (sz + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  if ((size_t)(pArena->end - pArena->pos) < sz) {
+    return ArenaAllocSlow(pArena, sz);
+  }
+  void* p = (void*)pArena->pos;
+  pArena->pos += sz;
+  pArena->alloced_sz += sz;
+  return p;
+}
+
+static inline size_t ArenaAllocedSize(Arena_t* pArena) {
+  return pArena->alloced_sz;
+}
+
+static inline size_t ArenaTotalSize(Arena_t* pArena) {
+  return pArena->total_sz;
+}
+
+#endif  // CART_ARENA_H_
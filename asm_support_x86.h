@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Assembly support header
+ *
+ * Offsets the stubs of entry_x86.S use into the execution environment %fs
+ * points at, and into the structures they are handed. entry_init_x86.cc
+ * checks them against the C layouts at compile time.
+ */
+
+#ifndef CART_ASM_SUPPORT_X86_H_
+#define CART_ASM_SUPPORT_X86_H_
+
+// OatCodeExecEnv_t
+#define THREAD_TOP_QUICK_FRAME_OFFSET     166
+#define THREAD_TOP_QUICK_FRAME_PC_OFFSET  170
+#define THREAD_REFS_ONLY_METHOD_OFFSET    990
+
+// Method_t
+#define METHOD_OAT_CODE_OFFSET            52
+
+// Array_t
+#define ARRAY_LENGTH_OFFSET               8
+
+// The method, 12 bytes of padding, ebp, esi, edi and the return address
+#define FRAME_SIZE_REFS_ONLY_CALLEE_SAVE  32
+
+#endif  // CART_ASM_SUPPORT_X86_H_
@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "bitmap.h"
+
+#define ALL_SET   (~(uint64_t)0)
+
+// Bits past nr_bits in the last word read as set, so they are never handed out
+static inline uint64_t _LoadWord(const uint64_t* map, size_t w, size_t nr_words, size_t nr_bits) {
+  uint64_t x = map[w];
+  if ((w == (nr_words - 1)) && (nr_bits % BITMAP_BITS_PER_WORD)) {
+    x |= ALL_SET << (nr_bits % BITMAP_BITS_PER_WORD);
+  }
+  return x;
+}
+
+// Skip words that are fully in use, returns the first word that is not
+static inline size_t _SkipFullWords(const uint64_t* map, size_t w, size_t end) {
+#if defined(__AVX2__)
+  const __m256i ones = _mm256_set1_epi64x(-1);
+  for (; (w + 4) <= end; w += 4) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(map + w));
+    if (!_mm256_testc_si256(v, ones)) {
+      break;
+    }
+  }
+#endif
+  while ((w < end) && (map[w] == ALL_SET)) {
+    w++;
+  }
+  return w;
+}
+
+// Positions of the word starting nr (<= 64) clear bits that fit in the word
+static inline uint64_t _ClearRunStarts(uint64_t x, size_t nr) {
+  uint64_t m = ~x;
+  size_t len = 1;
+  while (m && (len < nr)) {
+    size_t sh = ((nr - len) < len) ? (nr - len) : len;
+    m &= m >> sh;
+    len += sh;
+  }
+  return m;
+}
+
+size_t BitmapFindClearRun(const uint64_t* map, size_t nr_bits, size_t nr) {
+  size_t nr_words = BitmapWords(nr_bits);
+  // The clear run that reaches the end of the words scanned so far
+  size_t run = 0;
+  size_t run_start = 0;
+
+  if (!nr || (nr > nr_bits)) {
+    return nr_bits;
+  }
+  for (size_t w = 0; w < nr_words; ++w) {
+    if (!run) {
+      // Nothing to extend, whole words in use can go at once. The last word
+      // is left to the masked load.
+      w = _SkipFullWords(map, w, nr_words - 1);
+    }
+    uint64_t x = _LoadWord(map, w, nr_words, nr_bits);
+    if (x == ALL_SET) {
+      run = 0;
+      continue;
+    }
+    if (!x) {
+      if (!run) {
+        run_start = w * BITMAP_BITS_PER_WORD;
+      }
+      run += BITMAP_BITS_PER_WORD;
+      if (run >= nr) {
+        return run_start;
+      }
+      continue;
+    }
+    // Complete the run coming from the previous words with the low clear bits
+    size_t low = __builtin_ctzll(x);
+    if (run && ((run + low) >= nr)) {
+      return run_start;
+    }
+    // A run that lies within this word
+    if (nr <= BITMAP_BITS_PER_WORD) {
+      uint64_t m = _ClearRunStarts(x, nr);
+      if (m) {
+        return (w * BITMAP_BITS_PER_WORD) + __builtin_ctzll(m);
+      }
+    }
+    // Start a new run with the high clear bits
+    run = __builtin_clzll(x);
+    run_start = ((w + 1) * BITMAP_BITS_PER_WORD) - run;
+  }
+  return nr_bits;
+}
+
+static inline uint64_t _RangeMask(size_t bit, size_t nr) {
+  if (nr >= BITMAP_BITS_PER_WORD) {
+    return ALL_SET;
+  }
+  return ((((uint64_t)1) << nr) - 1) << bit;
+}
+
+void BitmapSetRange(uint64_t* map, size_t start, size_t nr) {
+  size_t w = start / BITMAP_BITS_PER_WORD;
+  size_t bit = start % BITMAP_BITS_PER_WORD;
+  // Head word
+  if (bit) {
+    size_t n = BITMAP_BITS_PER_WORD - bit;
+    if (n > nr) {
+      n = nr;
+    }
+    map[w++] |= _RangeMask(bit, n);
+    nr -= n;
+  }
+  // Whole words
+  size_t words = nr / BITMAP_BITS_PER_WORD;
+  memset(map + w, 0xFF, words * sizeof(uint64_t));
+  w += words;
+  // Tail word
+  if (nr % BITMAP_BITS_PER_WORD) {
+    map[w] |= _RangeMask(0, nr % BITMAP_BITS_PER_WORD);
+  }
+}
+
+void BitmapClearRange(uint64_t* map, size_t start, size_t nr) {
+  size_t w = start / BITMAP_BITS_PER_WORD;
+  size_t bit = start % BITMAP_BITS_PER_WORD;
+  // Head word
+  if (bit) {
+    size_t n = BITMAP_BITS_PER_WORD - bit;
+    if (n > nr) {
+      n = nr;
+    }
+    map[w++] &= ~_RangeMask(bit, n);
+    nr -= n;
+  }
+  // Whole words
+  size_t words = nr / BITMAP_BITS_PER_WORD;
+  memset(map + w, 0, words * sizeof(uint64_t));
+  w += words;
+  // Tail word
+  if (nr % BITMAP_BITS_PER_WORD) {
+    map[w] &= ~_RangeMask(0, nr % BITMAP_BITS_PER_WORD);
+  }
+}
+
+size_t BitmapCountSet(const uint64_t* map, size_t nr_bits) {
+  size_t nr_words = nr_bits / BITMAP_BITS_PER_WORD;
+  size_t cnt = 0;
+  for (size_t w = 0; w < nr_words; ++w) {
+    cnt += __builtin_popcountll(map[w]);
+  }
+  if (nr_bits % BITMAP_BITS_PER_WORD) {
+    cnt += __builtin_popcountll(map[nr_words] & _RangeMask(0, nr_bits % BITMAP_BITS_PER_WORD));
+  }
+  return cnt;
+}
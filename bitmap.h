@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Allocation bitmap support
+ *
+ * Bit i of a bitmap is bit (i % 64) of 64-bit word (i / 64), set when the
+ * slot is in use. On a little-endian machine this is also bit (i % 8) of
+ * byte (i / 8), so byte bitmaps may be passed in as long as they are 8 byte
+ * aligned and a multiple of 8 bytes long.
+ */
+
+#ifndef CART_BITMAP_H_
+#define CART_BITMAP_H_
+
+#include "macros.h"
+
+#define BITMAP_BITS_PER_WORD  64
+
+static inline size_t BitmapWords(size_t nr_bits) {
+  return (nr_bits + BITMAP_BITS_PER_WORD - 1) / BITMAP_BITS_PER_WORD;
+}
+
+static inline bool BitmapTest(const uint64_t* map, size_t idx) {
+  return (map[idx / BITMAP_BITS_PER_WORD] >> (idx % BITMAP_BITS_PER_WORD)) & 1;
+}
+
+// Lowest index of nr contiguous clear bits, nr_bits if there is none
+size_t BitmapFindClearRun(const uint64_t* map, size_t nr_bits, size_t nr);
+void BitmapSetRange(uint64_t* map, size_t start, size_t nr);
+void BitmapClearRange(uint64_t* map, size_t start, size_t nr);
+size_t BitmapCountSet(const uint64_t* map, size_t nr_bits);
+
+#endif  // CART_BITMAP_H_
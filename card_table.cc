@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "macros.h"
+#include "card_table.h"
+
+// Cards of a word of the table
+#define CARDS_PER_WORD      sizeof(uintptr_t)
+
+CardTable_t* AllocCardTable(uint8_t* heap_begin, size_t heap_sz) {
+  // Allocate a card table structure
+  CardTable_t* pCardTable = (CardTable_t*)malloc(sizeof(CardTable_t));
+  if (!pCardTable) {
+    pdbg("Out of memory\n");
+    return NULL;
+  }
+  memset((void*)pCardTable, 0, sizeof(CardTable_t));
+  pCardTable->heap_begin = heap_begin;
+  pCardTable->heap_end = heap_begin + heap_sz;
+
+  // Map the cards with room to slide them until the low byte of the biased
+  // begin is CARD_DIRTY, pages are only backed once dirtied
+  size_t nr_cards = (heap_sz + CARD_SIZE - 1) / CARD_SIZE;
+  pCardTable->mem_sz = nr_cards + 256;
+  void* p = mmap(NULL, pCardTable->mem_sz, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED) {
+    pdbg("Out of memory\n");
+    free((void*)pCardTable);
+    return NULL;
+  }
+  pCardTable->mem = (uint8_t*)p;
+  uintptr_t biased = (uintptr_t)p - ((uintptr_t)heap_begin >> CARD_SHIFT);
+  uintptr_t delta = (CARD_DIRTY - (biased & 0xff)) & 0xff;
+  pCardTable->biased_begin = (uint8_t*)(biased + delta);
+  return pCardTable;
+}
+
+void FreeCardTable(CardTable_t* pCardTable) {
+  munmap((void*)pCardTable->mem, pCardTable->mem_sz);
+  free((void*)pCardTable);
+}
+
+void CardClearRange(CardTable_t* pCardTable, uint8_t* begin, uint8_t* end) {
+  uint8_t* first = CardOf(pCardTable, begin);
+  uint8_t* last = CardOf(pCardTable, end + CARD_SIZE - 1);
+  memset((void*)first, CARD_CLEAN, last - first);
+}
+
+// Whole words of clean cards are skipped at once
+size_t CardScanDirty(CardTable_t* pCardTable, uint8_t* begin, uint8_t* end,
+                     CardVisitor_t visit, void* arg) {
+  uint8_t* card = CardOf(pCardTable, begin);
+  uint8_t* last = CardOf(pCardTable, end + CARD_SIZE - 1);
+  uint8_t* run = NULL;
+  size_t nr_dirty = 0;
+  while (card < last) {
+    if (!run && !((uintptr_t)card % CARDS_PER_WORD) && ((size_t)(last - card) >= CARDS_PER_WORD) &&
+        !*(uintptr_t*)card) {
+      card += CARDS_PER_WORD;
+      continue;
+    }
+    if (*card == CARD_DIRTY) {
+      *card = CARD_CLEAN;
+      nr_dirty++;
+      if (!run) {
+        run = card;
+      }
+    } else if (run) {
+      visit(arg, CardAddr(pCardTable, run), CardAddr(pCardTable, card));
+      run = NULL;
+    }
+    card++;
+  }
+  if (run) {
+    visit(arg, CardAddr(pCardTable, run), CardAddr(pCardTable, card));
+  }
+  return nr_dirty;
+}
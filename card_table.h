@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Card table header support
+ *
+ * A byte for every CARD_SIZE bytes of the heap, dirtied when a reference is
+ * stored into an object starting in them. The table is biased as in ART:
+ * card_table[addr >> CARD_SHIFT] is the card of addr, and the low byte of
+ * the biased address is CARD_DIRTY, so compiled code marks a card with the
+ * table register alone.
+ */
+
+#ifndef CART_CARD_TABLE_H_
+#define CART_CARD_TABLE_H_
+
+#define CARD_SHIFT          7
+#define CARD_SIZE           (1 << CARD_SHIFT)
+#define CARD_CLEAN          0
+#define CARD_DIRTY          0x70
+
+typedef struct PACKED {
+  uint8_t*  mem;            // mapping holding the table
+  size_t    mem_sz;
+  uint8_t*  biased_begin;   // what goes to tlsPtr_.card_table
+  uint8_t*  heap_begin;
+  uint8_t*  heap_end;
+} CardTable_t;
+
+// Called with the bounds of a run of dirty cards
+typedef void (*CardVisitor_t)(void* arg, uint8_t* begin, uint8_t* end);
+
+CardTable_t* AllocCardTable(uint8_t* heap_begin, size_t heap_sz);
+void FreeCardTable(CardTable_t* pCardTable);
+void CardClearRange(CardTable_t* pCardTable, uint8_t* begin, uint8_t* end);
+// Cleans the dirty cards of the range and visits them, returns how many
+// there were
+size_t CardScanDirty(CardTable_t* pCardTable, uint8_t* begin, uint8_t* end,
+                     CardVisitor_t visit, void* arg);
+
+static inline uint8_t* CardOf(CardTable_t* pCardTable, const void* addr) {
+  return pCardTable->biased_begin + ((uintptr_t)addr >> CARD_SHIFT);
+}
+
+static inline uint8_t* CardAddr(CardTable_t* pCardTable, const uint8_t* card) {
+  return (uint8_t*)((uintptr_t)(card - pCardTable->biased_begin) << CARD_SHIFT);
+}
+
+static inline void CardMark(CardTable_t* pCardTable, const void* obj) {
+  *CardOf(pCardTable, obj) = CARD_DIRTY;
+}
+
+static inline bool CardIsDirty(CardTable_t* pCardTable, const void* addr) {
+  return *CardOf(pCardTable, addr) == CARD_DIRTY;
+}
+
+#endif  // CART_CARD_TABLE_H_
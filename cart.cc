@@ -31,6 +31,7 @@
 #include "hash.h"
 #include "debugger.h"
 #include "cart.h"
+#include "class_index.h"
 #include "class.h"
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -59,6 +60,9 @@ jint JNI_CreateJavaVM(JavaVM** p_vm, JNIEnv** p_env, void* vm_args) {
   // Handle input options
   const char* cp = NULL;
   const char* bootclasspath = NULL;
+  bool huge_pages = false;
+  bool class_index_sidecar = true;
+  int class_index_threads = 0;
   for (int32_t i = 0; i < args->nOptions; ++i) {
     option = &args->options[i];
     if (!strcmp(option->optionString, "-cp")) {
@@ -67,6 +71,12 @@ jint JNI_CreateJavaVM(JavaVM** p_vm, JNIEnv** p_env, void* vm_args) {
     } else if (!strncmp(option->optionString, "-Xbootclasspath:", strlen("-Xbootclasspath:"))) {
       bootclasspath = option->optionString;
       bootclasspath += strlen("-Xbootclasspath:");
+    } else if (!strcmp(option->optionString, "-XX:+UseHugePages")) {
+      huge_pages = true;
+    } else if (!strcmp(option->optionString, "-XX:-ClassIndexSidecar")) {
+      class_index_sidecar = false;
+    } else if (!strncmp(option->optionString, "-XX:ClassIndexThreads=", strlen("-XX:ClassIndexThreads="))) {
+      class_index_threads = atoi(option->optionString + strlen("-XX:ClassIndexThreads="));
     }
   }
   if (!bootclasspath || !cp) {
@@ -97,6 +107,13 @@ jint JNI_CreateJavaVM(JavaVM** p_vm, JNIEnv** p_env, void* vm_args) {
   GenerateOat2DexCmd((const uint8_t*)cp, isa, cmd, sizeof(cmd));
   system((const char*)cmd);
 
+  // The heap and the code of the OatDex files on huge pages
+  HeapUseHugePages(huge_pages);
+  OatUseHugePages(huge_pages);
+  // The class index of each OatDex file mapped from next to it
+  ClassIndexUseSidecar(class_index_sidecar);
+  ClassIndexUseThreads(class_index_threads);
+
   // Create Java virtual machine
   java_vm_ = new cart::JavaVMExt();
   jni_env_ = java_vm_->GetJniEnvExt();
@@ -105,8 +122,9 @@ jint JNI_CreateJavaVM(JavaVM** p_vm, JNIEnv** p_env, void* vm_args) {
     return JNI_ERR;
   }
 
-  // Load classes from the OatDex files (bootcp & cp)
-  // LoadClassesOfOatDexFile(jni_env_->GetOatDexFiles(), jni_env_->GetClassLinker(), (const uint8_t*)bootcp_oatdex);
+  // Register the classes of the OatDex files (bootcp & cp), each is linked
+  // on its first use
+  LoadClassesOfOatDexFile(jni_env_->GetOatDexFiles(), jni_env_->GetClassLinker(), (const uint8_t*)bootcp_oatdex);
   LoadClassesOfOatDexFile(jni_env_->GetOatDexFiles(), jni_env_->GetClassLinker(), (const uint8_t*)cp_oatdex);
 
   // Heap information
@@ -118,7 +136,7 @@ jint JNI_CreateJavaVM(JavaVM** p_vm, JNIEnv** p_env, void* vm_args) {
 
 #if 0
   // Start debugger
-  StartDebuggerThread(&pth);
+  StartDebuggerThread(&pth, jni_env_->GetGc());
   for (;;) {}
 #endif
 
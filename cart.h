@@ -23,7 +23,9 @@
 
 // System
 #define PAGE_SIZE         4096
+#define HUGE_PAGE_SIZE    (2 * 1024 * 1024)
 #define HEAP_START_SIZE   (16 * 1024)
+#define HEAP_MAX_SIZE     (256 * 1024 * 1024)
 
 // Heap
 #define SZ_SLOT           16
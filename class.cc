@@ -20,12 +20,40 @@
 #include <string.h>
 
 #include "utils.h"
+#include "list.h"
 #include "hash.h"
+#include "class_table.h"
 #include "heap.h"
+#include "arena.h"
 #include "oat.h"
+#include "class_data.h"
+#include "class_index.h"
 #include "class.h"
 #include "cart.h"
 
+static MethodCodeMap_t* _AllocCodeMap() {
+  MethodCodeMap_t* pMap = (MethodCodeMap_t*)malloc(sizeof(MethodCodeMap_t));
+  if (!pMap) {
+    return NULL;
+  }
+  memset((void*)pMap, 0, sizeof(MethodCodeMap_t));
+  pMap->codes = (MethodCode_t*)malloc(sizeof(MethodCode_t) * CLASS_CODE_MAP_INIT);
+  if (!pMap->codes) {
+    free((void*)pMap);
+    return NULL;
+  }
+  pMap->codes_cap = CLASS_CODE_MAP_INIT;
+  pMap->sorted = true;
+  pthread_mutex_init(&pMap->lock, NULL);
+  return pMap;
+}
+
+static void _FreeCodeMap(MethodCodeMap_t* pMap) {
+  pthread_mutex_destroy(&pMap->lock);
+  free((void*)pMap->codes);
+  free((void*)pMap);
+}
+
 ClassLinker_t* AllocateClassLinker(size_t heap_size) {
   // Allocate a classlinker structure
   ClassLinker_t* pClassLinker = (ClassLinker_t*)malloc(sizeof(ClassLinker_t));
@@ -40,295 +68,799 @@ ClassLinker_t* AllocateClassLinker(size_t heap_size) {
     free((void*)pClassLinker);
     return NULL;
   }
+  // Allocate the metadata arena
+  pClassLinker->meta_arena = AllocArena(ARENA_CHUNK_SIZE);
+  if (!pClassLinker->meta_arena) {
+    pdbg("Out of memory\n");
+    FreeHeapVolume(pClassLinker->heap_vol);
+    free((void*)pClassLinker);
+    return NULL;
+  }
   // Allocate a hash table of loaded classes
-  pClassLinker->loaded_classes = AllocHashTable(pClassLinker->heap_vol, CLASSES_HASH_NR);
+  pClassLinker->loaded_classes = AllocClassTable(CLASSES_HASH_NR);
   if (!pClassLinker->loaded_classes) {
     pdbg("Out of memory\n");
+    FreeArena(pClassLinker->meta_arena);
     FreeHeapVolume(pClassLinker->heap_vol);
     free((void*)pClassLinker);
     return NULL;
   }
+  // Allocate the map of the compiled code
+  pClassLinker->code_map = _AllocCodeMap();
+  if (!pClassLinker->code_map) {
+    pdbg("Out of memory\n");
+    FreeClassTable(pClassLinker->loaded_classes);
+    FreeArena(pClassLinker->meta_arena);
+    FreeHeapVolume(pClassLinker->heap_vol);
+    free((void*)pClassLinker);
+    return NULL;
+  }
+  pClassLinker->class_indexes = NULL;
+  pthread_mutex_init(&pClassLinker->link_lock, NULL);
   // Succeed and return
   return pClassLinker;
 }
 
+static void _CloseClassIndexes(ClassLinker_t* pClassLinker) {
+  ClassIndex_t* pIndex = pClassLinker->class_indexes;
+  while (pIndex) {
+    ClassIndex_t* pNext = pIndex->Next;
+    CloseClassIndex(pIndex);
+    pIndex = pNext;
+  }
+  pClassLinker->class_indexes = NULL;
+}
+
 void FreeClassLinker(ClassLinker_t* pClassLinker) {
   FreeHeapVolume(pClassLinker->heap_vol);
-  FreeHashTable(pClassLinker->loaded_classes);
+  FreeClassTable(pClassLinker->loaded_classes);
+  _CloseClassIndexes(pClassLinker);
+  FreeArena(pClassLinker->meta_arena);
+  _FreeCodeMap(pClassLinker->code_map);
+  pthread_mutex_destroy(&pClassLinker->link_lock);
   free(pClassLinker);
 }
 
 bool RegisterOatDexFile(OatDexFile_t* pOatDexFile, ClassLinker_t* pClassLinker) {
-  DexFileData_t* pDexFileData = pOatDexFile->dex_files;
-  // Iterate each DexFileData record
-  for (; pDexFileData; pDexFileData = pDexFileData->Next) {
-    // Parse DEX classes
-    if (ParseDexClass(pDexFileData, pClassLinker, (const uint8_t*)pOatDexFile->oat_hdr) == false) {
-      pdbg("Failed to parse DEX classes");
-      return false;
-    }
+  // Map the class index of the OatDex file, or build it
+  ClassIndex_t* pIndex = OpenClassIndex(pOatDexFile);
+  if (!pIndex) {
+    pdbg("Failed to register DEX classes");
+    return false;
   }
+  // Append it, the classes of the files registered first win
+  pthread_mutex_lock(&pClassLinker->link_lock);
+  if (pClassLinker->class_indexes) {
+    LlAddObjectToTail(pClassLinker->class_indexes, pIndex);
+  } else {
+    pClassLinker->class_indexes = pIndex;
+  }
+  pthread_mutex_unlock(&pClassLinker->link_lock);
   return true;
 }
 
 bool DeregisterAllClasses(ClassLinker_t* pClassLinker) {
+  // Forget the loaded classes and the definitions before their metadata
+  // goes away
+  pthread_mutex_lock(&pClassLinker->link_lock);
+  FreeClassTable(pClassLinker->loaded_classes);
+  _CloseClassIndexes(pClassLinker);
+  pthread_mutex_lock(&pClassLinker->code_map->lock);
+  pClassLinker->code_map->nr_codes = 0;
+  pClassLinker->code_map->sorted = true;
+  pthread_mutex_unlock(&pClassLinker->code_map->lock);
+  ResetArena(pClassLinker->meta_arena);
+  pClassLinker->loaded_classes = AllocClassTable(CLASSES_HASH_NR);
+  pthread_mutex_unlock(&pClassLinker->link_lock);
+  if (!pClassLinker->loaded_classes) {
+    pdbg("Out of memory\n");
+    return false;
+  }
   return true;
 }
 
-bool ParseDexClass(DexFileData_t* pDexFileData, ClassLinker_t* pClassLinker, const uint8_t* oat_base) {
-  // Class level iteration
-  for (uint32_t class_idx = 0; class_idx < pDexFileData->nr_classes; ++class_idx) {
-    // Allocate a class
-    Class_t* pClass = (Class_t*)HeapAlloc(pClassLinker->heap_vol, sizeof(Class_t));
-    if (!pClass) {
+// Bytes a field of the given type descriptor takes in an instance
+static inline uint32_t _FieldSize(const uint8_t* type) {
+  switch (type ? type[0] : 'L') {
+    case 'Z':
+    case 'B':
+      return 1;
+    case 'C':
+    case 'S':
+      return 2;
+    case 'J':
+    case 'D':
+      return 8;
+    case 'L':
+    case '[':
+      return sizeof(Object_t*);
+    default:
+      break;
+  }
+  // int and float
+  return 4;
+}
+
+static inline bool _IsReferenceType(const uint8_t* type) {
+  return !type || (type[0] == 'L') || (type[0] == '[');
+}
+
+// Padding left in an instance by the alignment of a field
+#define CLASS_FIELD_GAPS  8
+
+typedef struct PACKED {
+  uint32_t  offset;
+  uint32_t  size;
+} FieldGap_t;
+
+static inline void _AddFieldGap(FieldGap_t* gaps, uint32_t* nr_gaps, uint32_t offset, uint32_t size) {
+  // Too many gaps only waste some bytes
+  if (size && (*nr_gaps < CLASS_FIELD_GAPS)) {
+    gaps[*nr_gaps].offset = offset;
+    gaps[(*nr_gaps)++].size = size;
+  }
+}
+
+// Offset of a field of size bytes, naturally aligned, in the first gap it
+// fits in or at the end of the instance
+static uint32_t _PlaceField(Class_t* pClass, FieldGap_t* gaps, uint32_t* nr_gaps, uint32_t size) {
+  for (uint32_t i = 0; i < *nr_gaps; ++i) {
+    uint32_t offset = (gaps[i].offset + size - 1) & ~(size - 1);
+    uint32_t end = gaps[i].offset + gaps[i].size;
+    if ((offset + size) <= end) {
+      FieldGap_t bGap = gaps[i];
+      gaps[i] = gaps[--(*nr_gaps)];
+      _AddFieldGap(gaps, nr_gaps, bGap.offset, offset - bGap.offset);
+      _AddFieldGap(gaps, nr_gaps, offset + size, end - (offset + size));
+      return offset;
+    }
+  }
+  uint32_t offset = (pClass->object_size + size - 1) & ~(size - 1);
+  _AddFieldGap(gaps, nr_gaps, pClass->object_size, offset - pClass->object_size);
+  pClass->object_size = offset + size;
+  return offset;
+}
+
+// Lay the instance fields out as ART does: the references first, then the
+// 8, 4, 2 and 1-byte fields, each kind in the order of the class_data
+static bool _LayoutInstanceFields(Class_t* pClass, DexFileData_t* pDexFileData, Field_t* fields, uint32_t nr) {
+  static const uint32_t kinds[] = { 0, 8, 4, 2, 1 };
+  uint8_t* sizes = (uint8_t*)malloc(nr);
+  if (!sizes) {
+    pdbg("Out of memory\n");
+    return false;
+  }
+  // 0 stands for a reference
+  for (uint32_t i = 0; i < nr; ++i) {
+    const uint8_t* type = GetFieldTypeStringById(pDexFileData, fields[i].field_id);
+    sizes[i] = _IsReferenceType(type) ? 0 : _FieldSize(type);
+  }
+  FieldGap_t gaps[CLASS_FIELD_GAPS];
+  uint32_t nr_gaps = 0;
+  for (uint32_t k = 0; k < (sizeof(kinds) / sizeof(kinds[0])); ++k) {
+    for (uint32_t i = 0; i < nr; ++i) {
+      if (sizes[i] != kinds[k]) {
+        continue;
+      }
+      if (!kinds[k]) {
+        fields[i].offset = _PlaceField(pClass, gaps, &nr_gaps, sizeof(Object_t*));
+        pClass->ref_offsets[pClass->nr_ref_offsets++] = fields[i].offset;
+      } else {
+        fields[i].offset = _PlaceField(pClass, gaps, &nr_gaps, kinds[k]);
+      }
+    }
+  }
+  free((void*)sizes);
+  return true;
+}
+
+// Methods without compiled code have a code offset of 0
+static bool _AddMethodCode(ClassLinker_t* pClassLinker, const Class_t* pClass,
+                           const Method_t* pMethod, const uint8_t* oat_base) {
+  if (!pMethod->method_oat_code || (pMethod->method_oat_code == oat_base) ||
+      !pMethod->method_oat_code_hdr->code_size_) {
+    return true;
+  }
+  MethodCodeMap_t* pMap = pClassLinker->code_map;
+  pthread_mutex_lock(&pMap->lock);
+  if (pMap->nr_codes == pMap->codes_cap) {
+    MethodCode_t* codes = (MethodCode_t*)realloc((void*)pMap->codes,
+                                                 sizeof(MethodCode_t) * pMap->codes_cap * 2);
+    if (!codes) {
+      pthread_mutex_unlock(&pMap->lock);
       pdbg("Out of memory\n");
       return false;
     }
-    memset((void*)pClass, 0, sizeof(Class_t));
-
-    // Assign values
-    pClass->class_id = GetClassIdOfClassDefByIdx(pDexFileData, class_idx);
-    pClass->superclass_id = GetSuperclassIdOfClassDefByIdx(pDexFileData, class_idx);
-    pClass->superclass_str = GetSuperclassStringOfClassDefByIdx(pDexFileData, class_idx);
-    pClass->class_name_str = GetClassStringOfClassDefByIdx(pDexFileData, class_idx);
-
-    // Debug messages
-    pdbg("Class ID         : %d\n", pClass->class_id);
-    pdbg("Superclass ID    : %d\n", pClass->superclass_id);
-    pdbg("Class name       : \"%s\"\n", pClass->class_name_str);
-    pdbg("Superclass name  : \"%s\"\n", pClass->superclass_str);
-
-    // Retrieve the class data header
-    const uint8_t* ptr = GetClassDataHdrPtrOfClassDefByIdx(pDexFileData, class_idx);
-    if (!ptr) {
-      pdbg("Invalid DEX format\n");
-      return false;
+    pMap->codes = codes;
+    pMap->codes_cap *= 2;
+  }
+  MethodCode_t* code = pMap->codes + pMap->nr_codes;
+  code->begin = pMethod->method_oat_code;
+  code->end = pMethod->method_oat_code + pMethod->method_oat_code_hdr->code_size_;
+  code->method = pMethod;
+  code->klass = pClass;
+  if (pMap->nr_codes && (pMap->codes[pMap->nr_codes - 1].begin > code->begin)) {
+    pMap->sorted = false;
+  }
+  pMap->nr_codes++;
+  pthread_mutex_unlock(&pMap->lock);
+  return true;
+}
+
+// Signature of a proto as JNI spells it, the types of its parameters in
+// parentheses then its return type
+static const uint8_t* _MethodSignature(DexFileData_t* pDexFileData, uint32_t proto_id,
+                                       const uint8_t* return_type, Arena_t* pArena) {
+  if (!return_type) {
+    return NULL;
+  }
+  const TypeList_t* pParams = GetProtoTypeListById(pDexFileData, proto_id);
+  uint32_t nr_params = pParams ? pParams->size_ : 0;
+
+  // Measure it
+  size_t len = 2 + strlen((const char*)return_type);
+  for (uint32_t i = 0; i < nr_params; ++i) {
+    const uint8_t* type = GetTypeStringById(pDexFileData, pParams->list_[i].type_idx_);
+    if (!type) {
+      return NULL;
     }
+    len += strlen((const char*)type);
+  }
 
-    // Decode the leb128 values
-    ClassDataHdr_t bCDH;
-    ptr = ComputeClassDataHdr(ptr, &bCDH);
+  // Write it
+  uint8_t* sig = (uint8_t*)ArenaAlloc(pArena, len + 1);
+  if (!sig) {
+    pdbg("Out of memory\n");
+    return NULL;
+  }
+  uint8_t* p = sig;
+  *p++ = '(';
+  for (uint32_t i = 0; i < nr_params; ++i) {
+    const uint8_t* type = GetTypeStringById(pDexFileData, pParams->list_[i].type_idx_);
+    size_t n = strlen((const char*)type);
+    memcpy(p, type, n);
+    p += n;
+  }
+  *p++ = ')';
+  strcpy((char*)p, (const char*)return_type);
+  return sig;
+}
+
+// Indexes the methods of a class by name and signature, at most half of
+// the slots used
+static bool _IndexMethods(Class_t* pClass, Arena_t* pArena) {
+  if (!pClass->nr_methods) {
+    return true;
+  }
+  uint32_t nr_slots = 2;
+  while (nr_slots < (pClass->nr_methods * 2)) {
+    nr_slots <<= 1;
+  }
+  pClass->method_slots = (uint32_t*)ArenaAlloc(pArena, sizeof(uint32_t) * nr_slots);
+  if (!pClass->method_slots) {
+    pdbg("Out of memory\n");
+    return false;
+  }
+  memset((void*)pClass->method_slots, 0, sizeof(uint32_t) * nr_slots);
+  pClass->method_slot_mask = nr_slots - 1;
+
+  for (uint32_t i = 0; i < pClass->nr_methods; ++i) {
+    Method_t* pMethod = pClass->methods + i;
+    if (!pMethod->method_name_str || !pMethod->method_sig_str) {
+      continue;
+    }
+    pMethod->method_name_len = strlen((const char*)pMethod->method_name_str);
+    pMethod->method_key_hash = ClMethodHash(pMethod->method_name_str, pMethod->method_name_len,
+                                            pMethod->method_sig_str);
+    uint32_t slot = (uint32_t)pMethod->method_key_hash & pClass->method_slot_mask;
+    while (pClass->method_slots[slot]) {
+      slot = (slot + 1) & pClass->method_slot_mask;
+    }
+    pClass->method_slots[slot] = i + 1;
+  }
+  return true;
+}
+
+
+// Builds a class of its definition into pArena, its superclass already
+// linked. The class is not visible until it is published.
+static Class_t* _LinkClass(const ClassDefRef_t* pDef, Class_t* pSuperClass, Arena_t* pArena) {
+  DexFileData_t* pDexFileData = pDef->dex_file;
+  const uint8_t* oat_base = pDef->oat_base;
+  uint32_t class_idx = pDef->class_idx;
+
+  // Allocate a class
+  Class_t* pClass = (Class_t*)ArenaAlloc(pArena, sizeof(Class_t));
+  if (!pClass) {
+    pdbg("Out of memory\n");
+    return NULL;
+  }
+  memset((void*)pClass, 0, sizeof(Class_t));
+
+  // Assign values
+  pClass->class_id = GetClassIdOfClassDefByIdx(pDexFileData, class_idx);
+  pClass->superclass_id = GetSuperclassIdOfClassDefByIdx(pDexFileData, class_idx);
+  pClass->superclass_str = GetSuperclassStringOfClassDefByIdx(pDexFileData, class_idx);
+  pClass->class_name_str = GetClassStringOfClassDefByIdx(pDexFileData, class_idx);
 
 #if 0
-    // Debug messages
-    pdbg("static   = 0x%X\n", bCDH.static_fields_size_);
-    pdbg("instance = 0x%X\n", bCDH.instance_fields_size_);
-    pdbg("direct   = 0x%X\n", bCDH.direct_methods_size_);
-    pdbg("virtual  = 0x%X\n", bCDH.virtual_methods_size_);
+  // Debug messages
+  pdbg("Class ID         : %d\n", pClass->class_id);
+  pdbg("Superclass ID    : %d\n", pClass->superclass_id);
+  pdbg("Class name       : \"%s\"\n", pClass->class_name_str);
+  pdbg("Superclass name  : \"%s\"\n", pClass->superclass_str);
 #endif
 
-    // Static fields
-    if (bCDH.static_fields_size_) {
-      // Allocate static field hash table
-      pClass->static_fields = AllocHashTable(pClassLinker->heap_vol, bCDH.static_fields_size_);
-      if (!pClass->static_fields) {
-        pdbg("Out of memory\n");
-        return false;
-      }
+  // Decode the class data in one pass, fields first and methods then
+  ClassDataIter_t bIter;
+  ClassDataIterInit(&bIter, GetClassDataHdrPtrOfClassDefByIdx(pDexFileData, class_idx));
+
+  // Instances start with the header and the fields of the superclass
+  pClass->object_size = CLASS_OBJECT_HDR_SIZE;
+  if (pSuperClass) {
+    pClass->object_size = pSuperClass->object_size;
+  }
 
-      // Iterate static fields
-      ClassDataField_t bCDF;
-      const uint8_t *end = ptr;
-      for (uint32_t field_idx = 0; field_idx < bCDH.static_fields_size_; ++field_idx) {
-        // Decode a method
-        end = GetStaticFieldOfClassDataByIdx(&bCDH, ptr, &bCDF, field_idx);
-
-        // Allocate a method
-        Field_t* pField = (Field_t*)HeapAlloc(pClassLinker->heap_vol, sizeof(Field_t));
-        if (!pField) {
-          pdbg("Out of memory\n");
-          return false;
-        }
-        memset((void*)pField, 0, sizeof(Field_t));
-
-        // Assign values
-        pField->field_id = bCDF.field_idx_delta_;
-        pField->field_str = GetFieldNameStringById(pDexFileData, bCDF.field_idx_delta_);
-        pField->access_flags = bCDF.access_flags_;
-
-#if 1
-        // Debug messages
-        pdbg("  (S)Field ID                : %u\n", pField->field_id);
-        pdbg("  (S)Field name              : \"%s\"\n", pField->field_str);
-        pdbg("  (S)Field access_flags      : 0x%X\n", pField->access_flags);
+  // Reference field offsets for the collector, the inherited ones first
+  uint32_t nr_super_refs = pSuperClass ? pSuperClass->nr_ref_offsets : 0;
+  if (nr_super_refs || bIter.hdr.instance_fields_size_) {
+    pClass->ref_offsets = (uint32_t*)ArenaAlloc(pArena,
+                                                sizeof(uint32_t) * (nr_super_refs + bIter.hdr.instance_fields_size_));
+    if (!pClass->ref_offsets) {
+      pdbg("Out of memory\n");
+      return NULL;
+    }
+    if (nr_super_refs) {
+      memcpy(pClass->ref_offsets, pSuperClass->ref_offsets, sizeof(uint32_t) * nr_super_refs);
+    }
+    pClass->nr_ref_offsets = nr_super_refs;
+  }
+
+#if 0
+  // Debug messages
+  pdbg("static   = 0x%X\n", bIter.hdr.static_fields_size_);
+  pdbg("instance = 0x%X\n", bIter.hdr.instance_fields_size_);
+  pdbg("direct   = 0x%X\n", bIter.hdr.direct_methods_size_);
+  pdbg("virtual  = 0x%X\n", bIter.hdr.virtual_methods_size_);
 #endif
 
-        // Insert this method
-        // InsertHashEntry(pClass->static_fields, GenHashKey(pField->field_str), (void*)pField);
-        InsertHashEntry(pClass->static_fields, pField->field_id, (void*)pField);
-      }
-      ptr = end;
-    }  // if (bCDH.static_fields_size_)
-
-    // Instance fields
-    if (bCDH.instance_fields_size_) {
-      // Allocate static field hash table
-      pClass->instance_fields = AllocHashTable(pClassLinker->heap_vol, bCDH.instance_fields_size_);
-      if (!pClass->instance_fields) {
+  // Static fields
+  if (bIter.hdr.static_fields_size_) {
+    // Allocate static field hash table
+    pClass->static_fields = AllocHashTableFromArena(pArena, bIter.hdr.static_fields_size_);
+    if (!pClass->static_fields) {
+      pdbg("Out of memory\n");
+      return NULL;
+    }
+    SetHashTableName(pClass->static_fields, "class.static_fields");
+
+    // Iterate static fields
+    for (uint32_t field_idx = 0; field_idx < bIter.hdr.static_fields_size_; ++field_idx) {
+      // Decode a field
+      ClassDataIterNext(&bIter);
+
+      // Allocate a method
+      Field_t* pField = (Field_t*)ArenaAlloc(pArena, sizeof(Field_t));
+      if (!pField) {
         pdbg("Out of memory\n");
-        return false;
+        return NULL;
       }
+      memset((void*)pField, 0, sizeof(Field_t));
 
-      // Iterate static fields
-      ClassDataField_t bCDF;
-      const uint8_t *end = ptr;
-      for (uint32_t field_idx = 0; field_idx < bCDH.instance_fields_size_; ++field_idx) {
-        // Decode a method
-        end = GetInstanceFieldOfClassDataByIdx(&bCDH, ptr, &bCDF, field_idx);
-
-        // Allocate a method
-        Field_t* pField = (Field_t*)HeapAlloc(pClassLinker->heap_vol, sizeof(Field_t));
-        if (!pField) {
-          pdbg("Out of memory\n");
-          return false;
-        }
-        memset((void*)pField, 0, sizeof(Field_t));
-
-        // Assign values
-        pField->field_id = bCDF.field_idx_delta_;
-        pField->field_str = GetFieldNameStringById(pDexFileData, bCDF.field_idx_delta_);
-        pField->access_flags = bCDF.access_flags_;
-
-#if 1
-        // Debug messages
-        pdbg("  (I)Field ID                : %u\n", pField->field_id);
-        pdbg("  (I)Field name              : \"%s\"\n", pField->field_str);
-        pdbg("  (I)Field access_flags      : 0x%X\n", pField->access_flags);
+      // Assign values
+      pField->field_id = bIter.idx;
+      pField->field_str = GetFieldNameStringById(pDexFileData, pField->field_id);
+      pField->access_flags = bIter.access_flags;
+
+#if 0
+      // Debug messages
+      pdbg("  (S)Field ID                : %u\n", pField->field_id);
+      pdbg("  (S)Field name              : \"%s\"\n", pField->field_str);
+      pdbg("  (S)Field access_flags      : 0x%X\n", pField->access_flags);
 #endif
 
-        // Insert this method
-        // InsertHashEntry(pClass->instance_fields, GenHashKey(pField->field_str), (void*)pField);
-        InsertHashEntry(pClass->instance_fields, pField->field_id, (void*)pField);
-      }
-      ptr = end;
-    }  // if (bCDH.instance_fields_size_)
+      // Insert this method
+      // InsertHashEntry(pClass->static_fields, GenHashKey(pField->field_str), (void*)pField);
+      InsertHashEntry(pClass->static_fields, pField->field_id, (void*)pField);
+    }
+  }  // if (bIter.hdr.static_fields_size_)
 
-    // Count the index for computing OAT methods
-    uint32_t oat_method_idx = 0;
+  // Instance fields
+  if (bIter.hdr.instance_fields_size_) {
+    // Allocate static field hash table
+    pClass->instance_fields = AllocHashTableFromArena(pArena, bIter.hdr.instance_fields_size_);
+    if (!pClass->instance_fields) {
+      pdbg("Out of memory\n");
+      return NULL;
+    }
+    SetHashTableName(pClass->instance_fields, "class.instance_fields");
 
-    // Direct methods
-    if (bCDH.direct_methods_size_) {
-      // Allocate direct method hash table
-      pClass->direct_methods = AllocHashTable(pClassLinker->heap_vol, bCDH.direct_methods_size_);
-      if (!pClass->direct_methods) {
-        pdbg("Out of memory\n");
-        return false;
-      }
+    // Allocate the fields, their offsets are given once all of them are known
+    Field_t* fields = (Field_t*)ArenaAlloc(pArena, sizeof(Field_t) * bIter.hdr.instance_fields_size_);
+    if (!fields) {
+      pdbg("Out of memory\n");
+      return NULL;
+    }
+    memset((void*)fields, 0, sizeof(Field_t) * bIter.hdr.instance_fields_size_);
 
-      // Iterate direct methods
-      ClassDataMethod_t bCDM;
-      const uint8_t *end = ptr;
-      for (uint32_t method_idx = 0; method_idx < bCDH.direct_methods_size_; ++method_idx, ++oat_method_idx) {
-        // Decode a method
-        end = GetDirectMethodOfClassDataByIdx(&bCDH, ptr, &bCDM, method_idx);
-
-        // Allocate a method
-        Method_t* pMethod = (Method_t*)HeapAlloc(pClassLinker->heap_vol, sizeof(Method_t));
-        if (!pMethod) {
-          pdbg("Out of memory\n");
-          return false;
-        }
-        memset((void*)pMethod, 0, sizeof(Method_t));
-
-        // Assign values
-        pMethod->method_id = bCDM.method_idx_delta_;
-        pMethod->method_name_str = GetMethodNameStringOfCDM(pDexFileData, &bCDM);
-        pMethod->method_proto_id = GetProtoIdOfCDM(pDexFileData, &bCDM);
-        pMethod->method_proto_shorty_str = GetProtoShortyStringOfCDM(pDexFileData, &bCDM);
-        pMethod->method_proto_return_type_str = GetProtoReturnTypeStringOfCDM(pDexFileData, &bCDM);
-        pMethod->method_dex_code = GetDexCodePtrOfCDM(pDexFileData, &bCDM);
-        pMethod->method_oat_code = GetOatCodePtrByIdx(pDexFileData, oat_base, class_idx, oat_method_idx);
-        pMethod->method_oat_code_hdr = GetOatQuickMethodHdrByIdx(pDexFileData, oat_base, class_idx, oat_method_idx);
-
-#if 1
-        // Debug messages
-        pdbg("  (D)Method ID               : %u\n", pMethod->method_id);
-        pdbg("  (D)Method name             : \"%s\"\n", pMethod->method_name_str);
-        pdbg("  (D)Method proto id         : %u\n", pMethod->method_proto_id);
-        pdbg("  (D)Method proto shorty     : \"%s\"\n", pMethod->method_proto_shorty_str);
-        pdbg("  (D)Method proto return type: \"%s\"\n", pMethod->method_proto_return_type_str);
-        pdbg("  (D)Method DEX code ptr     : %p\n", pMethod->method_dex_code);
-        pdbg("  (D)Method OAT code ptr     : %p\n", pMethod->method_oat_code);
-        pdbg("  (D)Method OAT code size    : %d\n", pMethod->method_oat_code_hdr->code_size_);
-        // DumpData((const uint32_t*)pMethod->method_oat_code, pMethod->method_oat_code_hdr->code_size_, 0);
+    // Iterate instance fields
+    for (uint32_t field_idx = 0; field_idx < bIter.hdr.instance_fields_size_; ++field_idx) {
+      // Decode a field
+      ClassDataIterNext(&bIter);
+
+      // Assign values
+      Field_t* pField = fields + field_idx;
+      pField->field_id = bIter.idx;
+      pField->field_str = GetFieldNameStringById(pDexFileData, pField->field_id);
+      pField->access_flags = bIter.access_flags;
+
+#if 0
+      // Debug messages
+      pdbg("  (I)Field ID                : %u\n", pField->field_id);
+      pdbg("  (I)Field name              : \"%s\"\n", pField->field_str);
+      pdbg("  (I)Field access_flags      : 0x%X\n", pField->access_flags);
 #endif
 
-        // Insert this method
-        if (pMethod->method_name_str) {
-          InsertHashEntry(pClass->direct_methods, GenHashKey(pMethod->method_name_str), (void*)pMethod);
-        } else {
-          InsertHashEntry(pClass->direct_methods, pMethod->method_id, (void*)pMethod);
-        }
-      }
-      ptr = end;
-    }  // if (bCDH.direct_methods_size_)
-
-    // Virtual methods
-    if (bCDH.virtual_methods_size_) {
-      // Allocate virtual method hash table
-      pClass->virtual_methods = AllocHashTable(pClassLinker->heap_vol, bCDH.virtual_methods_size_);
-      if (!pClass->virtual_methods) {
-        pdbg("Out of memory\n");
-        return false;
-      }
+      // Insert this method
+      // InsertHashEntry(pClass->instance_fields, GenHashKey(pField->field_str), (void*)pField);
+      InsertHashEntry(pClass->instance_fields, pField->field_id, (void*)pField);
+    }
+    if (!_LayoutInstanceFields(pClass, pDexFileData, fields, bIter.hdr.instance_fields_size_)) {
+      return NULL;
+    }
+  }  // if (bIter.hdr.instance_fields_size_)
 
-      // Iterate virtual methods
-      ClassDataMethod_t bCDM;
-      const uint8_t *end = ptr;
-      for (uint32_t method_idx = 0; method_idx < bCDH.virtual_methods_size_; ++method_idx, ++oat_method_idx) {
-        // Decode a method
-        end = GetVirtualMethodOfClassDataByIdx(&bCDH, ptr, &bCDM, method_idx);
-
-        // Allocate a method
-        Method_t* pMethod = (Method_t*)HeapAlloc(pClassLinker->heap_vol, sizeof(Method_t));
-        if (!pMethod) {
-          pdbg("Out of memory\n");
-          return false;
-        }
-        memset((void*)pMethod, 0, sizeof(Method_t));
-
-        // Assign values
-        pMethod->method_id = bCDM.method_idx_delta_;
-        pMethod->method_name_str = GetMethodNameStringOfCDM(pDexFileData, &bCDM);
-        pMethod->method_proto_id = GetProtoIdOfCDM(pDexFileData, &bCDM);
-        pMethod->method_proto_shorty_str = GetProtoShortyStringOfCDM(pDexFileData, &bCDM);
-        pMethod->method_proto_return_type_str = GetProtoReturnTypeStringOfCDM(pDexFileData, &bCDM);
-        pMethod->method_dex_code = GetDexCodePtrOfCDM(pDexFileData, &bCDM);
-        pMethod->method_oat_code = GetOatCodePtrByIdx(pDexFileData, oat_base, class_idx, oat_method_idx);
-        pMethod->method_oat_code_hdr = GetOatQuickMethodHdrByIdx(pDexFileData, oat_base, class_idx, oat_method_idx);
-
-#if 1
-        // Debug messages
-        pdbg("  (V)Method ID               : %u\n", pMethod->method_id);
-        pdbg("  (V)Method name             : \"%s\"\n", pMethod->method_name_str);
-        pdbg("  (V)Method proto id         : %u\n", pMethod->method_proto_id);
-        pdbg("  (V)Method proto shorty     : \"%s\"\n", pMethod->method_proto_shorty_str);
-        pdbg("  (V)Method proto return type: \"%s\"\n", pMethod->method_proto_return_type_str);
-        pdbg("  (V)Method DEX code ptr     : %p\n", pMethod->method_dex_code);
-        pdbg("  (V)Method OAT code ptr     : %p\n", pMethod->method_oat_code);
-        pdbg("  (V)Method OAT code hdr ptr : %p\n", pMethod->method_oat_code_hdr);
-        pdbg("  (V)Method OAT code size    : %d\n", pMethod->method_oat_code_hdr->code_size_);
-        // DumpData((const uint32_t*)pMethod->method_oat_code, pMethod->method_oat_code_hdr->code_size_, 0);
+  // Allocate the methods, their code is registered with the class
+  uint32_t nr_methods = bIter.hdr.direct_methods_size_ + bIter.hdr.virtual_methods_size_;
+  if (nr_methods) {
+    pClass->methods = (Method_t*)ArenaAlloc(pArena, sizeof(Method_t) * nr_methods);
+    if (!pClass->methods) {
+      pdbg("Out of memory\n");
+      return NULL;
+    }
+    memset((void*)pClass->methods, 0, sizeof(Method_t) * nr_methods);
+  }
+
+  // Count the index for computing OAT methods
+  uint32_t oat_method_idx = 0;
+
+  // Direct methods
+  if (bIter.hdr.direct_methods_size_) {
+    // Iterate direct methods
+    for (uint32_t method_idx = 0; method_idx < bIter.hdr.direct_methods_size_; ++method_idx, ++oat_method_idx) {
+      // Decode a method
+      ClassDataIterNext(&bIter);
+
+      // Take the next method
+      Method_t* pMethod = pClass->methods + pClass->nr_methods++;
+
+      // Assign values
+      pMethod->method_id = bIter.idx;
+      pMethod->method_access_flags = bIter.access_flags;
+      pMethod->method_name_str = GetMethodNameStringById(pDexFileData, pMethod->method_id);
+      pMethod->method_proto_id = GetMethodProtoIdById(pDexFileData, pMethod->method_id);
+      pMethod->method_proto_shorty_str = GetProtoShortyStringById(pDexFileData, pMethod->method_proto_id);
+      pMethod->method_proto_return_type_str = GetProtoReturnTypeStringById(pDexFileData, pMethod->method_proto_id);
+      pMethod->method_sig_str = _MethodSignature(pDexFileData, pMethod->method_proto_id,
+                                                 pMethod->method_proto_return_type_str, pArena);
+      pMethod->method_dex_code = GetDexCodePtrByOff(pDexFileData, bIter.code_off);
+      pMethod->method_oat_code = GetOatCodePtrByIdx(pDexFileData, oat_base, class_idx, oat_method_idx);
+      pMethod->method_oat_code_hdr = GetOatQuickMethodHdrByIdx(pDexFileData, oat_base, class_idx, oat_method_idx);
+      pMethod->method_gc_map = GetOatGcMapPtrByIdx(pDexFileData, oat_base, class_idx, oat_method_idx);
+
+#if 0
+      // Debug messages
+      pdbg("  (D)Method ID               : %u\n", pMethod->method_id);
+      pdbg("  (D)Method name             : \"%s\"\n", pMethod->method_name_str);
+      pdbg("  (D)Method proto id         : %u\n", pMethod->method_proto_id);
+      pdbg("  (D)Method proto shorty     : \"%s\"\n", pMethod->method_proto_shorty_str);
+      pdbg("  (D)Method proto return type: \"%s\"\n", pMethod->method_proto_return_type_str);
+      pdbg("  (D)Method signature        : \"%s\"\n", pMethod->method_sig_str);
+      pdbg("  (D)Method DEX code ptr     : %p\n", pMethod->method_dex_code);
+      pdbg("  (D)Method OAT code ptr     : %p\n", pMethod->method_oat_code);
+      pdbg("  (D)Method OAT code size    : %d\n", pMethod->method_oat_code_hdr->code_size_);
+      // DumpData((const uint32_t*)pMethod->method_oat_code, pMethod->method_oat_code_hdr->code_size_, 0);
 #endif
+    }
+  }  // if (bIter.hdr.direct_methods_size_)
+
+  // Virtual methods
+  if (bIter.hdr.virtual_methods_size_) {
+    // Iterate virtual methods
+    for (uint32_t method_idx = 0; method_idx < bIter.hdr.virtual_methods_size_; ++method_idx, ++oat_method_idx) {
+      // Decode a method
+      ClassDataIterNext(&bIter);
+
+      // Take the next method
+      Method_t* pMethod = pClass->methods + pClass->nr_methods++;
+
+      // Assign values
+      pMethod->method_id = bIter.idx;
+      pMethod->method_access_flags = bIter.access_flags;
+      pMethod->method_name_str = GetMethodNameStringById(pDexFileData, pMethod->method_id);
+      pMethod->method_proto_id = GetMethodProtoIdById(pDexFileData, pMethod->method_id);
+      pMethod->method_proto_shorty_str = GetProtoShortyStringById(pDexFileData, pMethod->method_proto_id);
+      pMethod->method_proto_return_type_str = GetProtoReturnTypeStringById(pDexFileData, pMethod->method_proto_id);
+      pMethod->method_sig_str = _MethodSignature(pDexFileData, pMethod->method_proto_id,
+                                                 pMethod->method_proto_return_type_str, pArena);
+      pMethod->method_dex_code = GetDexCodePtrByOff(pDexFileData, bIter.code_off);
+      pMethod->method_oat_code = GetOatCodePtrByIdx(pDexFileData, oat_base, class_idx, oat_method_idx);
+      pMethod->method_oat_code_hdr = GetOatQuickMethodHdrByIdx(pDexFileData, oat_base, class_idx, oat_method_idx);
+      pMethod->method_gc_map = GetOatGcMapPtrByIdx(pDexFileData, oat_base, class_idx, oat_method_idx);
 
-        // Insert this method
-        // InsertHashEntry(pClass->virtual_methods, GenHashKey(pMethod->method_name_str), (void*)pMethod);
-        InsertHashEntry(pClass->virtual_methods, pMethod->method_id, (void*)pMethod);
-      }
-      ptr = end;
-    }  // if (bCDH.virtual_methods_size_)
+#if 0
+      // Debug messages
+      pdbg("  (V)Method ID               : %u\n", pMethod->method_id);
+      pdbg("  (V)Method name             : \"%s\"\n", pMethod->method_name_str);
+      pdbg("  (V)Method proto id         : %u\n", pMethod->method_proto_id);
+      pdbg("  (V)Method proto shorty     : \"%s\"\n", pMethod->method_proto_shorty_str);
+      pdbg("  (V)Method proto return type: \"%s\"\n", pMethod->method_proto_return_type_str);
+      pdbg("  (V)Method signature        : \"%s\"\n", pMethod->method_sig_str);
+      pdbg("  (V)Method DEX code ptr     : %p\n", pMethod->method_dex_code);
+      pdbg("  (V)Method OAT code ptr     : %p\n", pMethod->method_oat_code);
+      pdbg("  (V)Method OAT code hdr ptr : %p\n", pMethod->method_oat_code_hdr);
+      pdbg("  (V)Method OAT code size    : %d\n", pMethod->method_oat_code_hdr->code_size_);
+      // DumpData((const uint32_t*)pMethod->method_oat_code, pMethod->method_oat_code_hdr->code_size_, 0);
+#endif
+    }
+  }  // if (bIter.hdr.virtual_methods_size_)
+
+  // Index the methods
+  if (!_IndexMethods(pClass, pArena)) {
+    return NULL;
+  }
 
-    // Insert this class
-    InsertHashEntry(pClassLinker->loaded_classes,
-                    GenHashKeyLen(pClass->class_name_str + 1,
-                                  strlen((const char*)pClass->class_name_str + 1) - 1),
-                    (void*)pClass);
-    // InsertHashEntry(pClassLinker->loaded_classes, pClass->class_id, (void*)pClass);
+  // Keyed by the key it was looked up by
+  pClass->class_key_str = pDef->key_str;
+  pClass->class_key_len = pDef->key_len;
+  pClass->class_key_hash = pDef->key_hash;
+  return pClass;
+}
+
+// Inserts a linked class and registers the code of its methods, unless
+// another thread inserted the class first; that one is returned then and
+// the memory of this one is left unused
+static Class_t* _PublishClass(ClassLinker_t* pCL, Class_t* pClass, const uint8_t* oat_base) {
+  Class_t* pFound = (Class_t*)ClassTableInsert(pCL->loaded_classes, pClass->class_key_hash,
+                                               pClass->class_key_str, pClass->class_key_len, (void*)pClass);
+  if (pFound != pClass) {
+    return pFound;
+  }
+  for (uint32_t i = 0; i < pClass->nr_methods; ++i) {
+    if (!_AddMethodCode(pCL, pClass, pClass->methods + i, oat_base)) {
+      return NULL;
+    }
+  }
+  return pClass;
+}
+
+// A thread of ClLinkAllClasses, linking into an arena of its own the
+// classes defined in the class indexes registered when it started
+typedef struct PACKED {
+  Arena_t*        arena;
+  ClassIndex_t**  class_indexes;
+  uint32_t        nr_class_indexes;
+} ClassLinkWorker_t;
+
+static Class_t* _FindClass(ClassLinker_t* pCL, const uint8_t* name, ClassLinkWorker_t* pWorker);
+
+// Links a class on its first lookup, the superclasses first. A lookup links
+// under link_lock into meta_arena, a worker without the lock into its arena;
+// of two workers linking a class at once the first to publish it wins.
+static Class_t* _DefineClass(ClassLinker_t* pCL, const ClassDefRef_t* pDef, ClassLinkWorker_t* pWorker) {
+  const uint8_t* superclass_str = GetSuperclassStringOfClassDefByIdx(pDef->dex_file, pDef->class_idx);
+  Class_t* pSuperClass = superclass_str ? _FindClass(pCL, superclass_str, pWorker) : NULL;
+  Class_t* pClass;
+  if (pWorker) {
+    pClass = _LinkClass(pDef, pSuperClass, pWorker->arena);
+    return pClass ? _PublishClass(pCL, pClass, pDef->oat_base) : NULL;
+  }
+  pthread_mutex_lock(&pCL->link_lock);
+  // Another thread may have linked it in the meantime
+  pClass = (Class_t*)ClassTableLookup(pCL->loaded_classes, pDef->key_hash, pDef->key_str, pDef->key_len);
+  if (!pClass) {
+    pClass = _LinkClass(pDef, pSuperClass, pCL->meta_arena);
+    if (pClass) {
+      pClass = _PublishClass(pCL, pClass, pDef->oat_base);
+    }
+  }
+  pthread_mutex_unlock(&pCL->link_lock);
+  return pClass;
+}
+
+static bool _FindClassDefIn(ClassIndex_t* pIndex, const uint8_t* key, size_t len, uint64_t hash,
+                            ClassDefRef_t* pDef) {
+  const ClassIndexClass_t* pEntry = ClassIndexFindClass(pIndex, key, len, hash);
+  if (!pEntry) {
+    return false;
+  }
+  pDef->dex_file = ClassIndexDexFile(pIndex, pEntry);
+  pDef->oat_base = pIndex->oat_base;
+  pDef->class_idx = pEntry->class_idx;
+  // The key of the DEX file outlives the name looked up
+  pDef->key_str = ClassIndexKey(pIndex, pEntry);
+  pDef->key_len = len;
+  pDef->key_hash = hash;
+  return true;
+}
+
+// Looks the class up in the class indexes of the registered OatDex files,
+// in the order they were registered. A worker has its own copy of the list.
+static bool _FindClassDef(ClassLinker_t* pCL, const uint8_t* key, size_t len, uint64_t hash,
+                          ClassDefRef_t* pDef, ClassLinkWorker_t* pWorker) {
+  bool found = false;
+  if (pWorker) {
+    for (uint32_t i = 0; (i < pWorker->nr_class_indexes) && !found; ++i) {
+      found = _FindClassDefIn(pWorker->class_indexes[i], key, len, hash, pDef);
+    }
+    return found;
+  }
+  pthread_mutex_lock(&pCL->link_lock);
+  ClassIndex_t* pIndex = pCL->class_indexes;
+  for (; pIndex && !found; pIndex = pIndex->Next) {
+    found = _FindClassDefIn(pIndex, key, len, hash, pDef);
+  }
+  pthread_mutex_unlock(&pCL->link_lock);
+  return found;
+}
+
+static Class_t* _FindClass(ClassLinker_t* pCL, const uint8_t* name, ClassLinkWorker_t* pWorker) {
+  const uint8_t* key;
+  size_t len;
+  if (!pCL || !name) {
+    return NULL;
+  }
+  ClassKeyOf(name, &key, &len);
+  uint64_t hash = GenHashKey64(key, len);
+  Class_t* pClass = (Class_t*)ClassTableLookup(pCL->loaded_classes, hash, key, len);
+  if (pClass) {
+    return pClass;
+  }
+  // Not linked yet
+  ClassDefRef_t bDef;
+  return _FindClassDef(pCL, key, len, hash, &bDef, pWorker) ? _DefineClass(pCL, &bDef, pWorker) : NULL;
+}
+
+// Not linked by name: a lookup would take the first registered file
+// defining the class, whichever file this one is
+bool ParseDexClass(DexFileData_t* pDexFileData, ClassLinker_t* pClassLinker, const uint8_t* oat_base) {
+  if (!pDexFileData || !pClassLinker) {
+    return false;
+  }
+  for (uint32_t class_idx = 0; class_idx < pDexFileData->nr_classes; ++class_idx) {
+    const uint8_t* key;
+    size_t len;
+    ClassKeyOf(GetClassStringOfClassDefByIdx(pDexFileData, class_idx), &key, &len);
+    uint64_t hash = GenHashKey64(key, len);
+    if (ClassTableLookup(pClassLinker->loaded_classes, hash, key, len)) {
+      continue;
+    }
+    ClassDefRef_t bDef;
+    if (_FindClassDef(pClassLinker, key, len, hash, &bDef, NULL) && (bDef.dex_file != pDexFileData)) {
+      pdbg("Class %u is shadowed by an earlier DEX file\n", class_idx);
+      continue;
+    }
+    bDef.dex_file = pDexFileData;
+    bDef.oat_base = oat_base;
+    bDef.class_idx = class_idx;
+    bDef.key_str = key;
+    bDef.key_len = len;
+    bDef.key_hash = hash;
+    if (!_DefineClass(pClassLinker, &bDef, NULL)) {
+      pdbg("Failed to link class %u\n", class_idx);
+      return false;
+    }
   }
   // Succeed and return
   return true;
 }
 
+// Accessed with atomic operations, so it is not PACKED
+typedef struct {
+  ClassLinker_t*      pCL;
+  ClassLinkWorker_t*  workers;
+  // The registered DEX files, and the first range of each
+  DexFileData_t**     dex_files;
+  uint32_t*           item_starts;
+  uint32_t            nr_dex_files;
+  bool                failed;
+} ClassLinkAll_t;
+
+// Links the classes of a range of class_defs of a DEX file
+static void _LinkClassRange(void* arg, int worker, uint32_t item) {
+  ClassLinkAll_t* pAll = (ClassLinkAll_t*)arg;
+  ClassLinkWorker_t* pWorker = pAll->workers + worker;
+  if (__atomic_load_n(&pAll->failed, __ATOMIC_RELAXED)) {
+    return;
+  }
+  if (!pWorker->arena) {
+    pWorker->arena = AllocArena(ARENA_CHUNK_SIZE);
+    if (!pWorker->arena) {
+      __atomic_store_n(&pAll->failed, true, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+  uint32_t dex_idx = 0;
+  while (item >= pAll->item_starts[dex_idx + 1]) {
+    dex_idx++;
+  }
+  DexFileData_t* pDexFileData = pAll->dex_files[dex_idx];
+  uint32_t begin = (item - pAll->item_starts[dex_idx]) * CLASS_LINK_RANGE;
+  uint32_t end = begin + CLASS_LINK_RANGE;
+  if (end > pDexFileData->nr_classes) {
+    end = pDexFileData->nr_classes;
+  }
+  for (uint32_t class_idx = begin; class_idx < end; ++class_idx) {
+    if (!_FindClass(pAll->pCL, GetClassStringOfClassDefByIdx(pDexFileData, class_idx), pWorker)) {
+      pdbg("Failed to link class %u\n", class_idx);
+      __atomic_store_n(&pAll->failed, true, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+}
+
+bool ClLinkAllClasses(ClassLinker_t* pClassLinker, int nr_threads) {
+  ClassLinkAll_t bAll;
+  memset((void*)&bAll, 0, sizeof(ClassLinkAll_t));
+  bAll.pCL = pClassLinker;
+  if (nr_threads <= 0) {
+    nr_threads = GetNrOnlineCpus();
+  }
+
+  // Take a copy of the registered class indexes and of their DEX files
+  pthread_mutex_lock(&pClassLinker->link_lock);
+  uint32_t nr_class_indexes = 0;
+  ClassIndex_t* pIndex = pClassLinker->class_indexes;
+  for (; pIndex; pIndex = pIndex->Next) {
+    nr_class_indexes++;
+    bAll.nr_dex_files += pIndex->hdr->nr_dex_files;
+  }
+  ClassIndex_t** class_indexes = (ClassIndex_t**)malloc(sizeof(ClassIndex_t*) * (nr_class_indexes + 1));
+  bAll.dex_files = (DexFileData_t**)malloc(sizeof(DexFileData_t*) * (bAll.nr_dex_files + 1));
+  bAll.item_starts = (uint32_t*)malloc(sizeof(uint32_t) * (bAll.nr_dex_files + 1));
+  bAll.workers = (ClassLinkWorker_t*)calloc(nr_threads, sizeof(ClassLinkWorker_t));
+  bool ret = class_indexes && bAll.dex_files && bAll.item_starts && bAll.workers;
+  uint32_t nr_items = 0;
+  if (ret) {
+    uint32_t i = 0;
+    uint32_t dex_idx = 0;
+    for (pIndex = pClassLinker->class_indexes; pIndex; pIndex = pIndex->Next) {
+      class_indexes[i++] = pIndex;
+      for (uint32_t d = 0; d < pIndex->hdr->nr_dex_files; ++d) {
+        bAll.dex_files[dex_idx] = pIndex->dex_files[d];
+        bAll.item_starts[dex_idx++] = nr_items;
+        nr_items += (pIndex->dex_files[d]->nr_classes + CLASS_LINK_RANGE - 1) / CLASS_LINK_RANGE;
+      }
+    }
+    bAll.item_starts[dex_idx] = nr_items;
+    for (int w = 0; w < nr_threads; ++w) {
+      bAll.workers[w].class_indexes = class_indexes;
+      bAll.workers[w].nr_class_indexes = nr_class_indexes;
+    }
+  }
+  pthread_mutex_unlock(&pClassLinker->link_lock);
+
+  if (ret) {
+    RunWorkers(nr_threads, nr_items, _LinkClassRange, (void*)&bAll);
+    // What the threads linked lives as long as the class linker
+    pthread_mutex_lock(&pClassLinker->link_lock);
+    for (int w = 0; w < nr_threads; ++w) {
+      if (bAll.workers[w].arena) {
+        ArenaMerge(pClassLinker->meta_arena, bAll.workers[w].arena);
+      }
+    }
+    pthread_mutex_unlock(&pClassLinker->link_lock);
+    ret = !bAll.failed;
+  } else {
+    pdbg("Out of memory\n");
+  }
+  free((void*)class_indexes);
+  free((void*)bAll.dex_files);
+  free((void*)bAll.item_starts);
+  free((void*)bAll.workers);
+  return ret;
+}
+
 bool LoadClassesOfOatDexFile(HashTable_t* pOatDexFiles, ClassLinker_t* pClassLinker, const uint8_t* path) {
   OatDexFile_t* pOatDexFile = NULL;
 
@@ -349,18 +881,120 @@ bool LoadClassesOfOatDexFile(HashTable_t* pOatDexFiles, ClassLinker_t* pClassLin
 }
 
 Class_t* ClFindClass(ClassLinker_t* pCL, const uint8_t* name) {
-  HashEntry_t* e = IsHashExist(pCL->loaded_classes, GenHashKey(name));
-  Class_t* pClass = (Class_t*)e->ptr;
-  return pClass;
+  return _FindClass(pCL, name, NULL);
 }
 
-Method_t* ClFindMethod(Class_t* pClass, const uint8_t* name) {
-  HashEntry_t* e = IsHashExist(pClass->direct_methods, GenHashKey(name));
-  Method_t* pMethod = (Method_t*)e->ptr;
-  return pMethod;
+// Array classes are not in the DEX files, they are made up on first use
+Class_t* ClFindArrayClass(ClassLinker_t* pCL, const uint8_t* descriptor) {
+  Class_t* pClass = ClFindClass(pCL, descriptor);
+  if (pClass || !descriptor || (descriptor[0] != '[')) {
+    return pClass;
+  }
+
+  // Allocate a class and keep a copy of the descriptor with it
+  size_t len = strlen((const char*)descriptor);
+  pthread_mutex_lock(&pCL->link_lock);
+  pClass = (Class_t*)ArenaAlloc(pCL->meta_arena, sizeof(Class_t));
+  uint8_t* name = (uint8_t*)ArenaAlloc(pCL->meta_arena, len + 1);
+  pthread_mutex_unlock(&pCL->link_lock);
+  if (!pClass || !name) {
+    pdbg("Out of memory\n");
+    return NULL;
+  }
+  memset((void*)pClass, 0, sizeof(Class_t));
+  memcpy(name, descriptor, len + 1);
+
+  // Assign values
+  pClass->class_name_str = name;
+  pClass->class_key_str = name;
+  pClass->class_key_len = len;
+  pClass->class_key_hash = GenHashKey64(name, len);
+  pClass->object_size = CLASS_ARRAY_HDR_SIZE;
+  pClass->component_size = _FieldSize(name + 1);
+  pClass->class_flags = CLASS_FLAG_ARRAY;
+  if (_IsReferenceType(name + 1)) {
+    pClass->class_flags |= CLASS_FLAG_REF_ARRAY;
+  }
+
+  // Insert this class, another thread may have been first
+  return (Class_t*)ClassTableInsert(pCL->loaded_classes, pClass->class_key_hash,
+                                    pClass->class_key_str, len, (void*)pClass);
+}
+
+// The signature moves the name hash to slots of its own, so that the
+// overloads of a name do not share a probe sequence
+uint64_t ClMethodHash(const uint8_t* name, size_t len, const uint8_t* sig) {
+  uint64_t sig_hash = GenHashKey64(sig, strlen((const char*)sig));
+  return GenHashKey64(name, len) ^ (sig_hash * 0x9E3779B97F4A7C15ULL);
+}
+
+Method_t* ClFindMethodHashed(const Class_t* pClass, uint64_t hash, const uint8_t* name, size_t len,
+                             const uint8_t* sig) {
+  if (!pClass || !pClass->method_slots) {
+    return NULL;
+  }
+  for (uint32_t slot = (uint32_t)hash & pClass->method_slot_mask; pClass->method_slots[slot];
+       slot = (slot + 1) & pClass->method_slot_mask) {
+    Method_t* pMethod = pClass->methods + (pClass->method_slots[slot] - 1);
+    if ((pMethod->method_key_hash == hash) && (pMethod->method_name_len == len) &&
+        !memcmp(pMethod->method_name_str, name, len) &&
+        !strcmp((const char*)pMethod->method_sig_str, (const char*)sig)) {
+      return pMethod;
+    }
+  }
+  return NULL;
+}
+
+Method_t* ClFindMethod(Class_t* pClass, const uint8_t* name, const uint8_t* sig) {
+  if (!pClass || !name) {
+    return NULL;
+  }
+  size_t len = strlen((const char*)name);
+  if (sig) {
+    return ClFindMethodHashed(pClass, ClMethodHash(name, len, sig), name, len, sig);
+  }
+  // In the order of the methods, the direct ones first
+  for (uint32_t i = 0; i < pClass->nr_methods; ++i) {
+    Method_t* pMethod = pClass->methods + i;
+    if (pMethod->method_name_str && !strcmp((const char*)pMethod->method_name_str, (const char*)name)) {
+      return pMethod;
+    }
+  }
+  return NULL;
+}
+
+static int _CompareCode(const void* a, const void* b) {
+  const uint8_t* x = ((const MethodCode_t*)a)->begin;
+  const uint8_t* y = ((const MethodCode_t*)b)->begin;
+  return (x < y) ? -1 : ((x > y) ? 1 : 0);
 }
 
-void ExecuteOatCode(const void* code) {
-  void (*func)() = (void (*)())code;
-  func();
+const Method_t* ClFindMethodByPc(ClassLinker_t* pCL, uintptr_t pc, const Class_t** klass) {
+  MethodCodeMap_t* pMap = pCL->code_map;
+  const MethodCode_t* found = NULL;
+  pthread_mutex_lock(&pMap->lock);
+  if (!pMap->sorted) {
+    qsort((void*)pMap->codes, pMap->nr_codes, sizeof(MethodCode_t), _CompareCode);
+    pMap->sorted = true;
+  }
+  // Last code starting at or before pc
+  size_t lo = 0;
+  size_t hi = pMap->nr_codes;
+  while (lo < hi) {
+    size_t mid = lo + ((hi - lo) / 2);
+    if ((uintptr_t)pMap->codes[mid].begin <= pc) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo && (pc < (uintptr_t)pMap->codes[lo - 1].end)) {
+    found = pMap->codes + lo - 1;
+  }
+  const Method_t* pMethod = found ? found->method : NULL;
+  if (klass) {
+    *klass = found ? found->klass : NULL;
+  }
+  pthread_mutex_unlock(&pMap->lock);
+  return pMethod;
 }
@@ -21,44 +21,145 @@
 #ifndef CART_CLASS_H_
 #define CART_CLASS_H_
 
+#include <pthread.h>
+
 #include "hash.h"
+#include "class_table.h"
 #include "heap.h"
+#include "arena.h"
 #include "oat.h"
+#include "class_index.h"
+
+struct _Class;
+
+// Header of every object: class and monitor, the 8 bytes of a 32-bit ART
+// object. References are pointers, so they are 4 bytes on the x86 target.
+typedef struct PACKED {
+  struct _Class*  klass;
+  uint32_t        monitor;
+} Object_t;
+
+typedef struct PACKED {
+  Object_t        obj;
+  uint32_t        length;
+  uint8_t         data[0];
+} Array_t;
+
+#define CLASS_OBJECT_HDR_SIZE   sizeof(Object_t)
+#define CLASS_ARRAY_HDR_SIZE    sizeof(Array_t)
+
+// Class_t flags
+#define CLASS_FLAG_ARRAY        0x1
+#define CLASS_FLAG_REF_ARRAY    0x2   // elements are references
+
+// Access flags of a method in the class_data
+#define CLASS_ACC_STATIC        0x0008
+
+#define CLASS_CODE_MAP_INIT     256
+// Classes per range of work of ClLinkAllClasses
+#define CLASS_LINK_RANGE        256
 
 typedef struct PACKED {
   uint32_t        field_id;
   const uint8_t*  field_str;
   uint32_t        access_flags;
+  // Byte offset in an instance, instance fields only
+  uint32_t        offset;
 } Field_t;
 
 typedef struct PACKED {
   uint32_t                    method_id;
+  uint32_t                    method_access_flags;
   const uint8_t*              method_name_str;
+  uint32_t                    method_name_len;
+  // ClMethodHash of the name and signature
+  uint64_t                    method_key_hash;
   uint32_t                    method_type_id;
   const uint8_t*              method_type_str;
   uint32_t                    method_proto_id;
   const uint8_t*              method_proto_shorty_str;
   const uint8_t*              method_proto_return_type_str;
+  // Signature as JNI spells it, "(I[Ljava/lang/String;)V"
+  const uint8_t*              method_sig_str;
   const uint16_t*             method_dex_code;
   const uint8_t*              method_oat_code;
   const OatQuickMethodHdr_t*  method_oat_code_hdr;
+  // Reference bitmaps of the vregs at each safepoint, NULL if there is none
+  const uint8_t*              method_gc_map;
 } Method_t;
 
-typedef struct PACKED {
+typedef struct PACKED _Class {
   uint32_t        class_id;
   uint32_t        superclass_id;
   const uint8_t*  superclass_str;
   const uint8_t*  class_name_str;
+  // Lookup key of the class, the descriptor without 'L' and ';'
+  const uint8_t*  class_key_str;
+  uint32_t        class_key_len;
+  uint64_t        class_key_hash;
+  // Bytes of an instance, header and inherited fields included
+  uint32_t        object_size;
+  uint32_t        class_flags;
+  // Bytes of an element, array classes only
+  uint32_t        component_size;
+  // Offsets of the reference fields of an instance, inherited ones first
+  uint32_t*       ref_offsets;
+  uint32_t        nr_ref_offsets;
 
   HashTable_t*    static_fields;
   HashTable_t*    instance_fields;
-  HashTable_t*    direct_methods;
-  HashTable_t*    virtual_methods;
+  // Every method, the direct ones first, in the order of the class_data
+  Method_t*       methods;
+  uint32_t        nr_methods;
+  // Index of the methods by name and signature: open addressing on their
+  // hash, each slot 1 + the index of a method, 0 if it is free
+  uint32_t*       method_slots;
+  uint32_t        method_slot_mask;
 } Class_t;
 
 typedef struct PACKED {
-  HashTable_t* loaded_classes;
-  HeapVolume_t* heap_vol;
+  const uint8_t*  begin;
+  const uint8_t*  end;
+  const Method_t* method;
+  const Class_t*  klass;
+} MethodCode_t;
+
+// Compiled code of the loaded methods, sorted by address on the first
+// lookup after an insertion. Holds a pthread mutex, so it is not PACKED.
+typedef struct {
+  MethodCode_t*   codes;
+  size_t          nr_codes;
+  size_t          codes_cap;
+  bool            sorted;
+  pthread_mutex_t lock;
+} MethodCodeMap_t;
+
+// Where a class of a registered DEX file is defined, as found in the class
+// index of its OatDex file when the class is first looked up
+typedef struct PACKED {
+  DexFileData_t*  dex_file;
+  const uint8_t*  oat_base;
+  uint32_t        class_idx;
+  // Lookup key of the class, as in Class_t
+  const uint8_t*  key_str;
+  uint32_t        key_len;
+  uint64_t        key_hash;
+} ClassDefRef_t;
+
+// Holds a pthread mutex, so it is not PACKED
+typedef struct {
+  ClassTable_t*     loaded_classes;
+  // Of the registered OatDex files, the first one defining a class wins
+  ClassIndex_t*     class_indexes;
+  HeapVolume_t*     heap_vol;
+  // Class_t, Field_t, Method_t and their tables, freed all at once. The
+  // threads of ClLinkAllClasses link into arenas of their own merged into
+  // it when done.
+  Arena_t*          meta_arena;
+  MethodCodeMap_t*  code_map;
+  // Serializes linking and the meta_arena allocations, never taken by
+  // lookups of linked classes
+  pthread_mutex_t   link_lock;
 } ClassLinker_t;
 
 ClassLinker_t* AllocateClassLinker(size_t heap_size);
@@ -66,12 +167,31 @@ void FreeClassLinker(ClassLinker_t* pClassLinker);
 
 bool RegisterOatDexFile(OatDexFile_t* pOatDexFile, ClassLinker_t* pClassLinker);
 bool DeregisterAllClasses(ClassLinker_t* pClassLinker);
+// Links every class of a registered DEX file from that file and the OAT
+// code at oat_base, instead of on first lookup. Classes an earlier
+// registered file defines as well are shadowed and not linked again.
 bool ParseDexClass(DexFileData_t* pDexFileData, ClassLinker_t* pClassLinker, const uint8_t* oat_base);
+// Links every class of the registered OatDex files on nr_threads threads,
+// 0 for one per online processor, each taking ranges of the class_defs of
+// a DEX file. The same classes are linked whatever the number of threads.
+// Not to be called while the classes are deregistered.
+bool ClLinkAllClasses(ClassLinker_t* pClassLinker, int nr_threads);
 bool LoadClassesOfOatDexFile(HashTable_t* pOatDexFiles, ClassLinker_t* pClassLinker, const uint8_t* path);
 
+// Links the class on its first lookup
 Class_t* ClFindClass(ClassLinker_t* pCL, const uint8_t* name);
-Method_t* ClFindMethod(Class_t* pClass, const uint8_t* name);
-void ExecuteOatCode(const void* code);
+Class_t* ClFindArrayClass(ClassLinker_t* pCL, const uint8_t* descriptor);
+// Method of the class of this name and signature, or of this name only,
+// the first direct one then, if sig is NULL. A lookup by name only walks
+// the methods.
+Method_t* ClFindMethod(Class_t* pClass, const uint8_t* name, const uint8_t* sig);
+// The key of a method, hashed once to look it up in a class and its
+// superclasses with ClFindMethodHashed
+uint64_t ClMethodHash(const uint8_t* name, size_t len, const uint8_t* sig);
+Method_t* ClFindMethodHashed(const Class_t* pClass, uint64_t hash, const uint8_t* name, size_t len,
+                             const uint8_t* sig);
+// Method whose compiled code holds pc, and its class when klass is given
+const Method_t* ClFindMethodByPc(ClassLinker_t* pCL, uintptr_t pc, const Class_t** klass);
 
 #endif  // CART_CLASS_H_
 
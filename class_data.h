@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Class data iterator header support
+ *
+ * A class_data_item is a header of four LEB128 counts followed by the
+ * static fields, the instance fields, the direct methods and the virtual
+ * methods, all LEB128 encoded. Each list starts with an absolute field or
+ * method id and goes on with deltas from the previous one. The iterator
+ * decodes them in a single pass and keeps the ids absolute. It only needs
+ * this header, so the tools that do not link oat.cc share it.
+ */
+
+#ifndef CART_CLASS_DATA_H_
+#define CART_CLASS_DATA_H_
+
+#include <stdint.h>
+
+#include "oat.h"
+
+typedef struct PACKED {
+  const uint8_t*  ptr;            // next item
+  ClassDataHdr_t  hdr;
+  uint32_t        pos;            // items decoded so far
+  // Last item decoded
+  uint32_t        idx;            // field or method id
+  uint32_t        access_flags;
+  uint32_t        code_off;       // 0 for fields, abstract and native methods
+} ClassDataIter_t;
+
+static inline uint32_t _ClassDataLeb128(const uint8_t** data) {
+  const uint8_t* ptr = *data;
+  uint32_t result = 0;
+  for (uint32_t shift = 0; shift < 35; shift += 7) {
+    uint8_t cur = *(ptr++);
+    result |= (uint32_t)(cur & 0x7f) << shift;
+    if (cur <= 0x7f) {
+      break;
+    }
+  }
+  *data = ptr;
+  return result;
+}
+
+static inline uint32_t ClassDataNrFields(const ClassDataIter_t* it) {
+  return it->hdr.static_fields_size_ + it->hdr.instance_fields_size_;
+}
+
+static inline uint32_t ClassDataNrMethods(const ClassDataIter_t* it) {
+  return it->hdr.direct_methods_size_ + it->hdr.virtual_methods_size_;
+}
+
+// NULL class data, as classes without members have, reads as empty
+static inline void ClassDataIterInit(ClassDataIter_t* it, const uint8_t* class_data) {
+  const uint8_t* ptr = class_data;
+  it->ptr = class_data;
+  it->pos = 0;
+  it->idx = 0;
+  it->access_flags = 0;
+  it->code_off = 0;
+  if (!class_data) {
+    it->hdr.static_fields_size_ = 0;
+    it->hdr.instance_fields_size_ = 0;
+    it->hdr.direct_methods_size_ = 0;
+    it->hdr.virtual_methods_size_ = 0;
+    return;
+  }
+  it->hdr.static_fields_size_ = _ClassDataLeb128(&ptr);
+  it->hdr.instance_fields_size_ = _ClassDataLeb128(&ptr);
+  it->hdr.direct_methods_size_ = _ClassDataLeb128(&ptr);
+  it->hdr.virtual_methods_size_ = _ClassDataLeb128(&ptr);
+  it->ptr = ptr;
+}
+
+// Decodes the next item, false past the last one
+static inline bool ClassDataIterNext(ClassDataIter_t* it) {
+  uint32_t nr_fields = ClassDataNrFields(it);
+  if (it->pos >= (nr_fields + ClassDataNrMethods(it))) {
+    return false;
+  }
+  // The first item of each list holds its id, not a delta
+  if ((it->pos == it->hdr.static_fields_size_) || (it->pos == nr_fields) ||
+      (it->pos == (nr_fields + it->hdr.direct_methods_size_))) {
+    it->idx = 0;
+  }
+  const uint8_t* ptr = it->ptr;
+  it->idx += _ClassDataLeb128(&ptr);
+  it->access_flags = _ClassDataLeb128(&ptr);
+  it->code_off = (it->pos >= nr_fields) ? _ClassDataLeb128(&ptr) : 0;
+  it->ptr = ptr;
+  it->pos++;
+  return true;
+}
+
+// Moves to the first method, ClassDataIterNext decodes it next
+static inline void ClassDataIterSkipFields(ClassDataIter_t* it) {
+  while ((it->pos < ClassDataNrFields(it)) && ClassDataIterNext(it)) {}
+}
+
+#endif  // CART_CLASS_DATA_H_
@@ -0,0 +1,584 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "hash.h"
+#include "oat.h"
+#include "class_index.h"
+#include "cart.h"
+
+// A class key of the OatDex file while the index is built
+typedef struct PACKED {
+  uint64_t        hash;
+  const uint8_t*  key;
+  uint32_t        len;
+  uint32_t        dex_idx;
+  uint32_t        class_idx;
+  uint32_t        bucket;
+} ClassIndexKey_t;
+
+// Work shared by the threads building an index. Keys are hashed by ranges
+// of the class_defs of each DEX file, each range writing entries of its own
+// only, so the image comes out the same whatever the number of threads.
+typedef struct PACKED {
+  ClassIndex_t*           pIndex;
+  uint32_t                nr_dex_files;
+  uint32_t                nr_buckets;
+  // Per DEX file, its first class in defs and its first range
+  uint32_t*               dex_starts;
+  uint32_t*               item_starts;
+  ClassIndexKey_t*        defs;
+  // Keys of the same hash as a kept key, but another name
+  ClassIndexKey_t*        overflow;
+  uint32_t                nr_overflow;
+  // Image being filled
+  const ClassIndexKey_t*  keys;
+  const uint32_t*         slots;
+} ClassIndexBuild_t;
+
+// Classes or slots per range of work
+#define CLASS_INDEX_RANGE           1024
+// Fewer classes are built on the calling thread alone
+#define CLASS_INDEX_PARALLEL_MIN    (4 * CLASS_INDEX_RANGE)
+
+static bool class_index_sidecar = true;
+static int class_index_threads = 0;
+
+void ClassIndexUseSidecar(bool enable) {
+  class_index_sidecar = enable;
+}
+
+void ClassIndexUseThreads(int nr_threads) {
+  class_index_threads = (nr_threads > 0) ? nr_threads : 0;
+}
+
+static int _NrThreads(uint32_t nr_classes) {
+  if (class_index_threads) {
+    return class_index_threads;
+  }
+  return (nr_classes < CLASS_INDEX_PARALLEL_MIN) ? 1 : GetNrOnlineCpus();
+}
+
+// Multiply-shift instead of a division, the high bits of the hash scaled
+// to the range
+static inline uint32_t _BucketOf(uint64_t hash, uint32_t nr_buckets) {
+  return (uint32_t)(((hash >> 32) * nr_buckets) >> 32);
+}
+
+// The seed remixes the whole hash, so that the keys of a bucket move to
+// other slots independently of each other
+static inline uint32_t _SlotOf(uint64_t hash, uint32_t seed, uint32_t nr_slots) {
+  uint64_t h = hash + ((uint64_t)seed * 0x9E3779B97F4A7C15ULL);
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDULL;
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53ULL;
+  h ^= h >> 33;
+  return (uint32_t)(((h >> 32) * nr_slots) >> 32);
+}
+
+static inline uint32_t _Align8(uint32_t off) {
+  return (off + 7) & ~7U;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Build                                                                     //
+///////////////////////////////////////////////////////////////////////////////
+
+// Largest buckets first
+static int _CompareBucketSize(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return (x > y) ? -1 : ((x < y) ? 1 : 0);
+}
+
+// Hashes the keys of a range of class_defs of a DEX file into their place
+// in defs, a class without a name is left out with a NULL key
+static void _HashKeys(void* arg, int worker, uint32_t item) {
+  ClassIndexBuild_t* pBuild = (ClassIndexBuild_t*)arg;
+  uint32_t dex_idx = 0;
+  while (item >= pBuild->item_starts[dex_idx + 1]) {
+    dex_idx++;
+  }
+  DexFileData_t* pDexFileData = pBuild->pIndex->dex_files[dex_idx];
+  ClassIndexKey_t* defs = pBuild->defs + pBuild->dex_starts[dex_idx];
+  uint32_t begin = (item - pBuild->item_starts[dex_idx]) * CLASS_INDEX_RANGE;
+  uint32_t end = begin + CLASS_INDEX_RANGE;
+  if (end > pDexFileData->nr_classes) {
+    end = pDexFileData->nr_classes;
+  }
+  for (uint32_t class_idx = begin; class_idx < end; ++class_idx) {
+    ClassIndexKey_t* pKey = defs + class_idx;
+    const uint8_t* name = GetClassStringOfClassDefByIdx(pDexFileData, class_idx);
+    if (!name) {
+      pKey->key = NULL;
+      continue;
+    }
+    const uint8_t* key;
+    size_t len;
+    ClassKeyOf(name, &key, &len);
+    pKey->hash = GenHashKey64(key, len);
+    pKey->key = key;
+    pKey->len = len;
+    pKey->dex_idx = dex_idx;
+    pKey->class_idx = class_idx;
+    pKey->bucket = _BucketOf(pKey->hash, pBuild->nr_buckets);
+  }
+}
+
+static inline bool _SameKey(const ClassIndexKey_t* a, const ClassIndexKey_t* b) {
+  return (a->len == b->len) && !memcmp(a->key, b->key, a->len);
+}
+
+// A key of the same hash as a kept one goes to the overflow, unless it is
+// there already
+static bool _AddOverflow(ClassIndexBuild_t* pBuild, const ClassIndexKey_t* pKey) {
+  for (uint32_t i = 0; i < pBuild->nr_overflow; ++i) {
+    if (_SameKey(pBuild->overflow + i, pKey)) {
+      pdbg("Class \"%.*s\" is already registered\n", (int)pKey->len, pKey->key);
+      return true;
+    }
+  }
+  ClassIndexKey_t* overflow = (ClassIndexKey_t*)realloc((void*)pBuild->overflow,
+                                                        sizeof(ClassIndexKey_t) * (pBuild->nr_overflow + 1));
+  if (!overflow) {
+    return false;
+  }
+  pBuild->overflow = overflow;
+  pBuild->overflow[pBuild->nr_overflow++] = *pKey;
+  return true;
+}
+
+// Collects the keys of the classes grouped by bucket, in the order they
+// are defined, the later definitions of a key dropped. starts[b] is set to
+// the first key of bucket b, starts[nr_buckets] to how many are kept. A
+// key colliding with a kept one goes to the overflow of pBuild.
+static bool _CollectKeys(ClassIndexBuild_t* pBuild, int nr_threads, uint32_t nr_classes,
+                         ClassIndexKey_t* keys, uint32_t* starts) {
+  uint32_t nr_buckets = pBuild->nr_buckets;
+  pBuild->defs = (ClassIndexKey_t*)malloc(sizeof(ClassIndexKey_t) * (nr_classes + 1));
+  if (!pBuild->defs) {
+    return false;
+  }
+  // Each DEX file in ranges of class_defs, hashed by any thread, every
+  // class at the place of its definition
+  RunWorkers(nr_threads, pBuild->item_starts[pBuild->nr_dex_files], _HashKeys, (void*)pBuild);
+  memset((void*)starts, 0, sizeof(uint32_t) * (nr_buckets + 1));
+  for (uint32_t i = 0; i < nr_classes; ++i) {
+    if (pBuild->defs[i].key) {
+      starts[pBuild->defs[i].bucket + 1]++;
+    }
+  }
+
+  // Counting sort by bucket, which keeps the order of definition
+  for (uint32_t b = 0; b < nr_buckets; ++b) {
+    starts[b + 1] += starts[b];
+  }
+  for (uint32_t i = 0; i < nr_classes; ++i) {
+    if (pBuild->defs[i].key) {
+      keys[starts[pBuild->defs[i].bucket]++] = pBuild->defs[i];
+    }
+  }
+  for (uint32_t b = nr_buckets; b > 0; --b) {
+    starts[b] = starts[b - 1];
+  }
+  starts[0] = 0;
+  free((void*)pBuild->defs);
+  pBuild->defs = NULL;
+
+  // The first definition of a key wins
+  uint32_t kept = 0;
+  for (uint32_t b = 0; b < nr_buckets; ++b) {
+    uint32_t first = kept;
+    for (uint32_t i = starts[b]; i < starts[b + 1]; ++i) {
+      uint32_t k = first;
+      while ((k < kept) && (keys[k].hash != keys[i].hash)) {
+        k++;
+      }
+      if (k == kept) {
+        keys[kept++] = keys[i];
+      } else if (_SameKey(keys + k, keys + i)) {
+        pdbg("Class \"%.*s\" is already registered\n", (int)keys[i].len, keys[i].key);
+      } else if (!_AddOverflow(pBuild, keys + i)) {
+        return false;
+      }
+    }
+    starts[b] = first;
+  }
+  starts[nr_buckets] = kept;
+  return true;
+}
+
+// Finds a seed per bucket so that every key gets a slot of its own, the
+// largest buckets placed first while most slots are free. slots is set to
+// the key of each slot.
+static bool _PlaceKeys(const ClassIndexKey_t* keys, const uint32_t* starts, uint32_t* seeds,
+                       uint32_t nr_buckets, uint32_t* slots, uint32_t nr_slots) {
+  uint64_t* order = (uint64_t*)malloc(sizeof(uint64_t) * nr_buckets);
+  uint32_t* tried = (uint32_t*)malloc(sizeof(uint32_t) * (starts[nr_buckets] + 1));
+  if (!order || !tried) {
+    free((void*)order);
+    free((void*)tried);
+    return false;
+  }
+  for (uint32_t b = 0; b < nr_buckets; ++b) {
+    order[b] = ((uint64_t)(starts[b + 1] - starts[b]) << 32) | b;
+  }
+  qsort((void*)order, nr_buckets, sizeof(uint64_t), _CompareBucketSize);
+  memset((void*)seeds, 0, sizeof(uint32_t) * nr_buckets);
+  memset((void*)slots, 0xFF, sizeof(uint32_t) * nr_slots);
+
+  bool ret = true;
+  for (uint32_t i = 0; i < nr_buckets; ++i) {
+    uint32_t b = (uint32_t)order[i];
+    uint32_t size = (uint32_t)(order[i] >> 32);
+    if (!size) {
+      break;
+    }
+    uint32_t seed = 0;
+    for (; seed < CLASS_INDEX_MAX_SEED; ++seed) {
+      uint32_t j = 0;
+      for (; j < size; ++j) {
+        uint32_t slot = _SlotOf(keys[starts[b] + j].hash, seed, nr_slots);
+        bool taken = (slots[slot] != CLASS_INDEX_EMPTY);
+        for (uint32_t t = 0; (t < j) && !taken; ++t) {
+          taken = (tried[t] == slot);
+        }
+        if (taken) {
+          break;
+        }
+        tried[j] = slot;
+      }
+      if (j == size) {
+        break;
+      }
+    }
+    if (seed == CLASS_INDEX_MAX_SEED) {
+      ret = false;
+      break;
+    }
+    seeds[b] = seed;
+    for (uint32_t j = 0; j < size; ++j) {
+      slots[tried[j]] = starts[b] + j;
+    }
+  }
+  free((void*)order);
+  free((void*)tried);
+  return ret;
+}
+
+static void _FillClass(ClassIndexBuild_t* pBuild, ClassIndexClass_t* pClass, const ClassIndexKey_t* pKey) {
+  pClass->key_hash = pKey->hash;
+  pClass->dex_idx = pKey->dex_idx;
+  pClass->class_idx = pKey->class_idx;
+  pClass->key_off = pKey->key - pBuild->pIndex->dex_files[pKey->dex_idx]->dex_file_ptr;
+  pClass->key_len = pKey->len;
+}
+
+// Fills the slots of the image, and the overflow after them
+static void _FillImage(ClassIndexBuild_t* pBuild, uint8_t* image) {
+  const ClassIndexHdr_t* hdr = (const ClassIndexHdr_t*)image;
+  ClassIndexClass_t* classes = (ClassIndexClass_t*)(image + hdr->classes_off);
+  for (uint32_t slot = 0; slot < hdr->nr_slots; ++slot) {
+    if (pBuild->slots[slot] == CLASS_INDEX_EMPTY) {
+      classes[slot].class_idx = CLASS_INDEX_EMPTY;
+    } else {
+      _FillClass(pBuild, classes + slot, pBuild->keys + pBuild->slots[slot]);
+    }
+  }
+  for (uint32_t i = 0; i < hdr->nr_overflow; ++i) {
+    _FillClass(pBuild, classes + hdr->nr_slots + i, pBuild->overflow + i);
+  }
+}
+
+// Builds the image of the index into memory, its header given the identity
+// of the OatDex file
+static uint8_t* _BuildImage(ClassIndex_t* pIndex, const ClassIndexHdr_t* pId) {
+  ClassIndexBuild_t bBuild;
+  memset((void*)&bBuild, 0, sizeof(ClassIndexBuild_t));
+  bBuild.pIndex = pIndex;
+  bBuild.nr_dex_files = pId->nr_dex_files;
+  bBuild.dex_starts = (uint32_t*)malloc(sizeof(uint32_t) * (pId->nr_dex_files + 1));
+  bBuild.item_starts = (uint32_t*)malloc(sizeof(uint32_t) * (pId->nr_dex_files + 1));
+  if (!bBuild.dex_starts || !bBuild.item_starts) {
+    pdbg("Out of memory\n");
+    free((void*)bBuild.dex_starts);
+    free((void*)bBuild.item_starts);
+    return NULL;
+  }
+  uint32_t nr_classes = 0;
+  uint32_t nr_items = 0;
+  for (uint32_t dex_idx = 0; dex_idx < pId->nr_dex_files; ++dex_idx) {
+    bBuild.dex_starts[dex_idx] = nr_classes;
+    bBuild.item_starts[dex_idx] = nr_items;
+    nr_classes += pIndex->dex_files[dex_idx]->nr_classes;
+    nr_items += (pIndex->dex_files[dex_idx]->nr_classes + CLASS_INDEX_RANGE - 1) / CLASS_INDEX_RANGE;
+  }
+  bBuild.dex_starts[pId->nr_dex_files] = nr_classes;
+  bBuild.item_starts[pId->nr_dex_files] = nr_items;
+  int nr_threads = _NrThreads(nr_classes);
+  uint32_t nr_buckets = (nr_classes / CLASS_INDEX_BUCKET_KEYS) + 1;
+  bBuild.nr_buckets = nr_buckets;
+  ClassIndexKey_t* keys = (ClassIndexKey_t*)malloc(sizeof(ClassIndexKey_t) * (nr_classes + 1));
+  uint32_t* starts = (uint32_t*)malloc(sizeof(uint32_t) * (nr_buckets + 1));
+  uint32_t* seeds = (uint32_t*)malloc(sizeof(uint32_t) * nr_buckets);
+  uint32_t* slots = NULL;
+  uint8_t* image = NULL;
+
+  // Hash the keys and find their slots, with more room each time that fails
+  uint32_t nr_keys = 0;
+  uint32_t nr_slots = 0;
+  bool placed = false;
+  if (keys && starts && seeds && _CollectKeys(&bBuild, nr_threads, nr_classes, keys, starts)) {
+    nr_keys = starts[nr_buckets];
+    for (uint32_t extra = (nr_keys / 4) + 1; !placed && (extra <= (nr_keys * 2) + 1); extra *= 2) {
+      nr_slots = nr_keys + extra;
+      free((void*)slots);
+      slots = (uint32_t*)malloc(sizeof(uint32_t) * nr_slots);
+      placed = slots && _PlaceKeys(keys, starts, seeds, nr_buckets, slots, nr_slots);
+    }
+  }
+
+  if (placed) {
+    // Allocate the image
+    uint32_t seeds_off = _Align8(sizeof(ClassIndexHdr_t));
+    uint32_t classes_off = _Align8(seeds_off + (sizeof(uint32_t) * nr_buckets));
+    uint32_t size = classes_off + (sizeof(ClassIndexClass_t) * (nr_slots + bBuild.nr_overflow));
+    image = (uint8_t*)calloc(1, size);
+    if (image) {
+      ClassIndexHdr_t* hdr = (ClassIndexHdr_t*)image;
+      memcpy((void*)hdr, (const void*)pId, sizeof(ClassIndexHdr_t));
+      hdr->nr_classes = nr_keys;
+      hdr->nr_buckets = nr_buckets;
+      hdr->nr_slots = nr_slots;
+      hdr->nr_overflow = bBuild.nr_overflow;
+      hdr->seeds_off = seeds_off;
+      hdr->classes_off = classes_off;
+      hdr->file_size = size;
+      memcpy((void*)(image + seeds_off), (const void*)seeds, sizeof(uint32_t) * nr_buckets);
+      bBuild.keys = keys;
+      bBuild.slots = slots;
+      _FillImage(&bBuild, image);
+    }
+  }
+  if (!image) {
+    pdbg("Failed to build the class index\n");
+  }
+  free((void*)bBuild.dex_starts);
+  free((void*)bBuild.item_starts);
+  free((void*)bBuild.overflow);
+  free((void*)keys);
+  free((void*)starts);
+  free((void*)seeds);
+  free((void*)slots);
+  return image;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Sidecar                                                                   //
+///////////////////////////////////////////////////////////////////////////////
+
+// Identity of the OatDex file, false if it can not be told
+static bool _GetIdentity(OatDexFile_t* pOatDexFile, ClassIndexHdr_t* pId) {
+  struct stat st;
+  if (fstat(pOatDexFile->fd, &st)) {
+    return false;
+  }
+  pId->oat_checksum = pOatDexFile->oat_hdr->adler32_checksum_;
+  pId->oat_size = st.st_size;
+  pId->oat_mtime_ns = ((uint64_t)st.st_mtim.tv_sec * 1000000000ULL) + st.st_mtim.tv_nsec;
+  pId->oat_ino = st.st_ino;
+  pId->oat_dev = st.st_dev;
+  return true;
+}
+
+static bool _IsValidImage(const uint8_t* image, size_t size, const ClassIndexHdr_t* pId) {
+  const ClassIndexHdr_t* hdr = (const ClassIndexHdr_t*)image;
+  if ((size < sizeof(ClassIndexHdr_t)) || (hdr->magic != CLASS_INDEX_MAGIC) ||
+      (hdr->version != CLASS_INDEX_VERSION) || (hdr->file_size != size)) {
+    return false;
+  }
+  // Built of this very file
+  if ((hdr->oat_checksum != pId->oat_checksum) || (hdr->dex_checksum != pId->dex_checksum) ||
+      (hdr->oat_size != pId->oat_size) || (hdr->oat_mtime_ns != pId->oat_mtime_ns) ||
+      (hdr->oat_ino != pId->oat_ino) || (hdr->oat_dev != pId->oat_dev) ||
+      (hdr->nr_dex_files != pId->nr_dex_files)) {
+    return false;
+  }
+  // Tables inside the file
+  return hdr->nr_buckets && hdr->nr_slots &&
+         ((hdr->seeds_off + ((uint64_t)sizeof(uint32_t) * hdr->nr_buckets)) <= size) &&
+         ((hdr->classes_off + ((uint64_t)sizeof(ClassIndexClass_t) * (hdr->nr_slots + (uint64_t)hdr->nr_overflow))) <= size);
+}
+
+static uint8_t* _MapSidecar(const char* path, const ClassIndexHdr_t* pId, size_t* map_sz) {
+  int32_t fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) || (st.st_size < (off_t)sizeof(ClassIndexHdr_t))) {
+    close(fd);
+    return NULL;
+  }
+  void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    return NULL;
+  }
+  if (!_IsValidImage((const uint8_t*)p, st.st_size, pId)) {
+    pdbg("Class index %s is stale, rebuilding it\n", path);
+    munmap(p, st.st_size);
+    return NULL;
+  }
+  *map_sz = st.st_size;
+  return (uint8_t*)p;
+}
+
+// Written aside and renamed, so that a concurrent load maps either the old
+// or the new index, never half of one
+static void _WriteSidecar(const char* path, const uint8_t* image, size_t size) {
+  char tmp[PATH_MAX + 16];
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+  int32_t fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    pdbg("Failed to write class index %s\n", path);
+    return;
+  }
+  size_t done = 0;
+  while (done < size) {
+    ssize_t n = write(fd, image + done, size - done);
+    if (n <= 0) {
+      break;
+    }
+    done += n;
+  }
+  close(fd);
+  if ((done != size) || rename(tmp, path)) {
+    pdbg("Failed to write class index %s\n", path);
+    unlink(tmp);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Class index                                                               //
+///////////////////////////////////////////////////////////////////////////////
+
+ClassIndex_t* OpenClassIndex(OatDexFile_t* pOatDexFile) {
+  uint32_t nr_dex_files = 0;
+  DexFileData_t* pDexFileData = pOatDexFile->dex_files;
+  for (; pDexFileData; pDexFileData = pDexFileData->Next) {
+    nr_dex_files++;
+  }
+
+  // Allocate a handle, the DEX files by index after it
+  ClassIndex_t* pIndex = (ClassIndex_t*)malloc(sizeof(ClassIndex_t) + (sizeof(DexFileData_t*) * nr_dex_files));
+  if (!pIndex) {
+    pdbg("Out of memory\n");
+    return NULL;
+  }
+  memset((void*)pIndex, 0, sizeof(ClassIndex_t));
+  pIndex->oat_base = (const uint8_t*)pOatDexFile->oat_hdr;
+  pIndex->dex_files = (DexFileData_t**)(pIndex + 1);
+
+  // Identify the OatDex file
+  ClassIndexHdr_t bId;
+  memset((void*)&bId, 0, sizeof(ClassIndexHdr_t));
+  bId.magic = CLASS_INDEX_MAGIC;
+  bId.version = CLASS_INDEX_VERSION;
+  bId.nr_dex_files = nr_dex_files;
+  uint32_t dex_idx = 0;
+  for (pDexFileData = pOatDexFile->dex_files; pDexFileData; pDexFileData = pDexFileData->Next) {
+    pIndex->dex_files[dex_idx++] = pDexFileData;
+    uint32_t checksum = ((const DexHdr_t*)pDexFileData->dex_file_ptr)->checksum_;
+    bId.dex_checksum = ((bId.dex_checksum << 5) | (bId.dex_checksum >> 27)) ^ checksum;
+  }
+  bool sidecar = class_index_sidecar && _GetIdentity(pOatDexFile, &bId);
+  char path[PATH_MAX + sizeof(CLASS_INDEX_SUFFIX)];
+  snprintf(path, sizeof(path), "%s" CLASS_INDEX_SUFFIX, (const char*)pOatDexFile->file_name);
+
+  // Map the sidecar, or build the index and write it out for the next load
+  size_t map_sz = 0;
+  uint8_t* image = sidecar ? _MapSidecar(path, &bId, &map_sz) : NULL;
+  pIndex->map_sz = map_sz;
+  if (!image) {
+    image = _BuildImage(pIndex, &bId);
+    if (!image) {
+      free((void*)pIndex);
+      return NULL;
+    }
+    if (sidecar) {
+      _WriteSidecar(path, image, ((const ClassIndexHdr_t*)image)->file_size);
+    }
+  }
+  pIndex->hdr = (const ClassIndexHdr_t*)image;
+  pIndex->seeds = (const uint32_t*)(image + pIndex->hdr->seeds_off);
+  pIndex->classes = (const ClassIndexClass_t*)(image + pIndex->hdr->classes_off);
+  return pIndex;
+}
+
+void CloseClassIndex(ClassIndex_t* pIndex) {
+  if (pIndex->map_sz) {
+    munmap((void*)pIndex->hdr, pIndex->map_sz);
+  } else {
+    free((void*)pIndex->hdr);
+  }
+  free((void*)pIndex);
+}
+
+// The entry is checked against the DEX files, a sidecar may be corrupt
+static bool _IsKeyOf(const ClassIndex_t* pIndex, const ClassIndexClass_t* pClass, const uint8_t* key, size_t len) {
+  if (pClass->dex_idx >= pIndex->hdr->nr_dex_files) {
+    return false;
+  }
+  DexFileData_t* pDexFileData = ClassIndexDexFile(pIndex, pClass);
+  return (pClass->class_idx < pDexFileData->nr_classes) && (pClass->key_len == len) &&
+         ((pClass->key_off + (uint64_t)len) <= ((const DexHdr_t*)pDexFileData->dex_file_ptr)->file_size_) &&
+         !memcmp(pDexFileData->dex_file_ptr + pClass->key_off, key, len);
+}
+
+const ClassIndexClass_t* ClassIndexFindClass(const ClassIndex_t* pIndex, const uint8_t* key,
+                                             size_t len, uint64_t hash) {
+  const ClassIndexHdr_t* hdr = pIndex->hdr;
+  uint32_t seed = pIndex->seeds[_BucketOf(hash, hdr->nr_buckets)];
+  const ClassIndexClass_t* pClass = pIndex->classes + _SlotOf(hash, seed, hdr->nr_slots);
+  if ((pClass->class_idx == CLASS_INDEX_EMPTY) || (pClass->key_hash != hash)) {
+    return NULL;
+  }
+  // Any key lands on some slot, compare the key of its class
+  if (_IsKeyOf(pIndex, pClass, key, len)) {
+    return pClass;
+  }
+  // The hash of another key
+  const ClassIndexClass_t* pOverflow = pIndex->classes + hdr->nr_slots;
+  for (uint32_t i = 0; i < hdr->nr_overflow; ++i) {
+    if ((pOverflow[i].key_hash == hash) && _IsKeyOf(pIndex, pOverflow + i, key, len)) {
+      return pOverflow + i;
+    }
+  }
+  return NULL;
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Class index header support
+ *
+ * The class index of an OatDex file maps the lookup key of each of its
+ * classes to the DEX file and the class_def defining it with a perfect
+ * hash. Each key hashes to a bucket, whose seed picks its slot; the seeds
+ * are chosen when the index is built so that no two keys share a slot, and
+ * a lookup is one probe. The rare key whose 64-bit hash is that of another
+ * key is kept past the slots, and searched when the probe finds the other
+ * key. The index is built on the first load of the file,
+ * its DEX files split in ranges of classes hashed on a pool of threads, and
+ * written next to it; later loads map it and check that it was built of
+ * the same file, rebuilding it if not.
+ */
+
+#ifndef CART_CLASS_INDEX_H_
+#define CART_CLASS_INDEX_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#include "macros.h"
+#include "oat.h"
+
+// The index of "x.oat" is "x.oat.cidx"
+#define CLASS_INDEX_SUFFIX      ".cidx"
+#define CLASS_INDEX_MAGIC       0x78646963  // "cidx"
+#define CLASS_INDEX_VERSION     3
+// class_idx of a free slot
+#define CLASS_INDEX_EMPTY       0xFFFFFFFF
+// Keys per bucket and slots per key, on average
+#define CLASS_INDEX_BUCKET_KEYS 4
+#define CLASS_INDEX_MAX_SEED    (1 << 16)
+
+typedef struct PACKED {
+  uint32_t  magic;
+  uint32_t  version;
+  // The OatDex file the index was built of
+  uint32_t  oat_checksum;       // adler32_checksum_ of its OAT header
+  uint32_t  dex_checksum;       // checksum_ of its DEX files, combined
+  uint64_t  oat_size;
+  uint64_t  oat_mtime_ns;
+  uint64_t  oat_ino;
+  uint64_t  oat_dev;
+  uint32_t  nr_dex_files;
+  // Tables, 8-byte aligned
+  uint32_t  nr_classes;
+  uint32_t  nr_buckets;
+  uint32_t  nr_slots;
+  uint32_t  seeds_off;          // uint32_t per bucket
+  uint32_t  classes_off;        // ClassIndexClass_t per slot, then the overflow
+  uint32_t  nr_overflow;        // keys of the same hash as a key in a slot
+  uint32_t  pad;
+  uint64_t  file_size;
+} ClassIndexHdr_t;
+
+typedef struct PACKED {
+  uint64_t  key_hash;           // GenHashKey64 of the lookup key
+  uint32_t  dex_idx;            // DEX file, in the order of the dex_files list
+  uint32_t  class_idx;          // CLASS_INDEX_EMPTY if the slot is free
+  // Lookup key in the DEX file, compared without going through the ids
+  uint32_t  key_off;
+  uint32_t  key_len;
+} ClassIndexClass_t;
+
+// Not PACKED, it is linked with LlAddObjectToTail
+typedef struct _ClassIndex {
+  // Linklist, in the order the OatDex files were registered
+  struct _ClassIndex*       Next;
+  const ClassIndexHdr_t*    hdr;
+  const uint32_t*           seeds;
+  const ClassIndexClass_t*  classes;
+  // Bytes mapped of the sidecar, 0 if the index was built in memory
+  size_t                    map_sz;
+  const uint8_t*            oat_base;
+  DexFileData_t**           dex_files;  // by dex_idx
+} ClassIndex_t;
+
+// A type descriptor "Ljava/lang/String;" is looked up as "java/lang/String",
+// any other name (arrays, primitives, internal names) is used as it is
+static inline void ClassKeyOf(const uint8_t* name, const uint8_t** key, size_t* len) {
+  size_t n = strlen((const char*)name);
+  if ((n >= 2) && (name[0] == 'L') && (name[n - 1] == ';')) {
+    *key = name + 1;
+    *len = n - 2;
+  } else {
+    *key = name;
+    *len = n;
+  }
+}
+
+// Whether the index is read from and written to the sidecar, or built in
+// memory on every load. Enabled by default.
+void ClassIndexUseSidecar(bool enable);
+// Threads building an index, 0 for one per online processor on files of
+// enough classes. The index is the same whatever their number.
+void ClassIndexUseThreads(int nr_threads);
+ClassIndex_t* OpenClassIndex(OatDexFile_t* pOatDexFile);
+void CloseClassIndex(ClassIndex_t* pIndex);
+
+// NULL if no class of the OatDex file has this key
+const ClassIndexClass_t* ClassIndexFindClass(const ClassIndex_t* pIndex, const uint8_t* key,
+                                             size_t len, uint64_t hash);
+
+static inline DexFileData_t* ClassIndexDexFile(const ClassIndex_t* pIndex, const ClassIndexClass_t* pClass) {
+  return pIndex->dex_files[pClass->dex_idx];
+}
+
+static inline const uint8_t* ClassIndexKey(const ClassIndex_t* pIndex, const ClassIndexClass_t* pClass) {
+  return pIndex->dex_files[pClass->dex_idx]->dex_file_ptr + pClass->key_off;
+}
+
+#endif  // CART_CLASS_INDEX_H_
@@ -0,0 +1,356 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include "hash.h"
+#include "class_table.h"
+
+#define CLASS_TABLE_MIN_NR      16
+
+// Identifies the calling thread among the reader records of a table. The
+// record last used is cached by the id of its table, as a table allocated
+// where a freed one was must not be taken for it.
+static __thread uint8_t tls_reader_token;
+static __thread size_t tls_reader_tbl_id = 0;
+static __thread ClassTableReader_t* tls_reader = NULL;
+static size_t class_table_next_id = 0;
+
+static ClassTableArray_t* _AllocClassTableArray(size_t nr) {
+  ClassTableArray_t* arr = (ClassTableArray_t*)malloc(sizeof(ClassTableArray_t));
+  if (!arr) {
+    return NULL;
+  }
+  memset(arr, 0, sizeof(ClassTableArray_t));
+  arr->slots = (ClassTableEntry_t**)calloc(nr, sizeof(ClassTableEntry_t*));
+  if (!arr->slots) {
+    free(arr);
+    return NULL;
+  }
+  arr->nr = nr;
+  return arr;
+}
+
+static void _FreeClassTableArray(ClassTableArray_t* arr) {
+  free(arr->slots);
+  free(arr);
+}
+
+static inline size_t _SlotOf(ClassTableArray_t* arr, uint64_t hash) {
+  // Fold the upper half in, the hash is already well mixed
+  return (size_t)(hash ^ (hash >> 32)) & (arr->nr - 1);
+}
+
+// Grow once three quarters of the slots are used
+static inline bool _IsArrayFull(ClassTableArray_t* arr) {
+  return (__atomic_load_n(&arr->cnt, __ATOMIC_RELAXED) * 4) >= (arr->nr * 3);
+}
+
+static inline bool _IsEntryMatch(ClassTableEntry_t* e, uint64_t hash, const uint8_t* str, size_t len) {
+  return (e->hash == hash) && (e->len == len) && !memcmp(e->str, str, len);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Epoch based reclamation                                                   //
+///////////////////////////////////////////////////////////////////////////////
+
+static ClassTableReader_t* _GetReader(ClassTable_t* tbl) {
+  if (tls_reader_tbl_id == tbl->id) {
+    return tls_reader;
+  }
+  // Reuse the record this thread registered before, if any
+  ClassTableReader_t* r = __atomic_load_n(&tbl->readers, __ATOMIC_ACQUIRE);
+  for (; r; r = r->Next) {
+    if (r->owner == (const void*)&tls_reader_token) {
+      break;
+    }
+  }
+  if (!r) {
+    r = (ClassTableReader_t*)malloc(sizeof(ClassTableReader_t));
+    if (!r) {
+      return NULL;
+    }
+    r->epoch = 0;
+    r->owner = (const void*)&tls_reader_token;
+    // Push onto the reader list, records live until the table is freed
+    r->Next = __atomic_load_n(&tbl->readers, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&tbl->readers, &r->Next, r, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+  }
+  tls_reader_tbl_id = tbl->id;
+  tls_reader = r;
+  return r;
+}
+
+static inline ClassTableArray_t* _EnterEpoch(ClassTable_t* tbl, ClassTableReader_t* r) {
+  // The epoch must be visible before the array pointer is loaded
+  __atomic_store_n(&r->epoch, __atomic_load_n(&tbl->epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+  return __atomic_load_n(&tbl->array, __ATOMIC_SEQ_CST);
+}
+
+static inline void _LeaveEpoch(ClassTableReader_t* r) {
+  __atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+}
+
+// Free every retired array no reader can still be looking at, the caller
+// holds tbl->lock
+static void _ReclaimClassTableArrays(ClassTable_t* tbl) {
+  size_t min_epoch = __atomic_load_n(&tbl->epoch, __ATOMIC_SEQ_CST);
+  ClassTableReader_t* r = __atomic_load_n(&tbl->readers, __ATOMIC_ACQUIRE);
+  for (; r; r = r->Next) {
+    size_t e = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST);
+    if (e && (e < min_epoch)) {
+      min_epoch = e;
+    }
+  }
+  ClassTableArray_t** pp = &tbl->retired;
+  while (*pp) {
+    ClassTableArray_t* arr = *pp;
+    // Readers of a later epoch loaded the array that replaced this one
+    if (arr->retire_epoch < min_epoch) {
+      *pp = arr->Next;
+      _FreeClassTableArray(arr);
+    } else {
+      pp = &arr->Next;
+    }
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Growing                                                                   //
+///////////////////////////////////////////////////////////////////////////////
+
+// Replace arr by an array twice as large, unless somebody else already did
+static bool _GrowClassTable(ClassTable_t* tbl, ClassTableArray_t* arr) {
+  pthread_mutex_lock(&tbl->lock);
+  if (__atomic_load_n(&tbl->array, __ATOMIC_ACQUIRE) != arr) {
+    pthread_mutex_unlock(&tbl->lock);
+    return true;
+  }
+
+  // Stop new inserters and wait for the ones in flight
+  __atomic_store_n(&arr->frozen, 1, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&arr->inserters, __ATOMIC_SEQ_CST)) {
+    sched_yield();
+  }
+
+  ClassTableArray_t* new_arr = _AllocClassTableArray(arr->nr * 2);
+  if (!new_arr) {
+    // Let the inserters carry on with the old array
+    __atomic_store_n(&arr->frozen, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&tbl->lock);
+    pdbg("Out of memory\n");
+    return false;
+  }
+
+  // Copy the entries over, nobody else writes either array now
+  for (size_t i = 0; i < arr->nr; ++i) {
+    ClassTableEntry_t* e = arr->slots[i];
+    if (!e) {
+      continue;
+    }
+    size_t slot = _SlotOf(new_arr, e->hash);
+    while (new_arr->slots[slot]) {
+      slot = (slot + 1) & (new_arr->nr - 1);
+    }
+    new_arr->slots[slot] = e;
+    new_arr->cnt++;
+  }
+
+  // Publish the new array, then retire the old one in the current epoch
+  __atomic_store_n(&tbl->array, new_arr, __ATOMIC_SEQ_CST);
+  arr->retire_epoch = __atomic_fetch_add(&tbl->epoch, 1, __ATOMIC_SEQ_CST);
+  arr->Next = tbl->retired;
+  tbl->retired = arr;
+  _ReclaimClassTableArrays(tbl);
+
+  pthread_mutex_unlock(&tbl->lock);
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Statistics                                                                //
+///////////////////////////////////////////////////////////////////////////////
+
+// Shape of the table for the hash table report, lookups are not counted to
+// keep the read path free of shared writes
+static void _GetClassTableInfo(void* arg, HashTableInfo_t* info) {
+  ClassTable_t* tbl = (ClassTable_t*)arg;
+  ClassTableReader_t* r = _GetReader(tbl);
+  if (!r) {
+    return;
+  }
+  ClassTableArray_t* arr = _EnterEpoch(tbl, r);
+  info->name = "class.loaded_classes";
+  info->tables = 1;
+  info->capacity = arr->nr;
+  for (size_t i = 0; i < arr->nr; ++i) {
+    ClassTableEntry_t* e = __atomic_load_n(&arr->slots[i], __ATOMIC_ACQUIRE);
+    if (!e) {
+      continue;
+    }
+    info->entries++;
+    size_t distance = (i - _SlotOf(arr, e->hash)) & (arr->nr - 1);
+    if (distance) {
+      info->displaced++;
+      info->distance += distance;
+      if (distance > info->max_distance) {
+        info->max_distance = distance;
+      }
+    }
+  }
+  _LeaveEpoch(r);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Interface                                                                 //
+///////////////////////////////////////////////////////////////////////////////
+
+ClassTable_t* AllocClassTable(size_t nr) {
+  size_t cap = CLASS_TABLE_MIN_NR;
+  // Power of two that holds nr entries below the load limit
+  while ((cap * 3) <= (nr * 4)) {
+    cap <<= 1;
+  }
+
+  ClassTable_t* tbl = (ClassTable_t*)malloc(sizeof(ClassTable_t));
+  if (!tbl) {
+    return NULL;
+  }
+  memset(tbl, 0, sizeof(ClassTable_t));
+  tbl->array = _AllocClassTableArray(cap);
+  if (!tbl->array) {
+    free(tbl);
+    return NULL;
+  }
+  tbl->epoch = 1;
+  tbl->id = __atomic_add_fetch(&class_table_next_id, 1, __ATOMIC_RELAXED);
+  pthread_mutex_init(&tbl->lock, NULL);
+  RegisterHashStatsSource(_GetClassTableInfo, (void*)tbl);
+  return tbl;
+}
+
+// No reader or inserter may be running when the table is freed
+void FreeClassTable(ClassTable_t* tbl) {
+  ClassTableArray_t* arr = tbl->array;
+  UnregisterHashStatsSource(_GetClassTableInfo, (void*)tbl);
+  for (size_t i = 0; i < arr->nr; ++i) {
+    free(arr->slots[i]);
+  }
+  _FreeClassTableArray(arr);
+  while (tbl->retired) {
+    arr = tbl->retired;
+    tbl->retired = arr->Next;
+    _FreeClassTableArray(arr);
+  }
+  while (tbl->readers) {
+    ClassTableReader_t* r = tbl->readers;
+    tbl->readers = r->Next;
+    free(r);
+  }
+  pthread_mutex_destroy(&tbl->lock);
+  free(tbl);
+}
+
+void* ClassTableLookup(ClassTable_t* tbl, uint64_t hash, const uint8_t* str, size_t len) {
+  ClassTableReader_t* r = _GetReader(tbl);
+  if (!r) {
+    return NULL;
+  }
+  void* ptr = NULL;
+  ClassTableArray_t* arr = _EnterEpoch(tbl, r);
+  size_t slot = _SlotOf(arr, hash);
+  for (size_t i = 0; i < arr->nr; ++i) {
+    ClassTableEntry_t* e = __atomic_load_n(&arr->slots[slot], __ATOMIC_ACQUIRE);
+    // An empty slot terminates the probe sequence
+    if (!e) {
+      break;
+    }
+    if (_IsEntryMatch(e, hash, str, len)) {
+      ptr = e->ptr;
+      break;
+    }
+    slot = (slot + 1) & (arr->nr - 1);
+  }
+  _LeaveEpoch(r);
+  return ptr;
+}
+
+// Return the value registered for the key, which is ptr unless another
+// thread registered the same key first, or NULL when out of memory
+void* ClassTableInsert(ClassTable_t* tbl, uint64_t hash, const uint8_t* str, size_t len, void* ptr) {
+  ClassTableReader_t* r = _GetReader(tbl);
+  if (!r) {
+    return NULL;
+  }
+  ClassTableEntry_t* new_e = (ClassTableEntry_t*)malloc(sizeof(ClassTableEntry_t));
+  if (!new_e) {
+    return NULL;
+  }
+  new_e->hash = hash;
+  new_e->str = str;
+  new_e->len = len;
+  new_e->ptr = ptr;
+
+  for (;;) {
+    // The epoch keeps arr from being freed under us by a concurrent grow
+    ClassTableArray_t* arr = _EnterEpoch(tbl, r);
+    // Register as an inserter, then make sure the array is still writable
+    __atomic_add_fetch(&arr->inserters, 1, __ATOMIC_SEQ_CST);
+    bool grow = __atomic_load_n(&arr->frozen, __ATOMIC_SEQ_CST) ||
+                _IsArrayFull(arr);
+    if (!grow) {
+      size_t slot = _SlotOf(arr, hash);
+      for (size_t i = 0; i < arr->nr; ++i) {
+        ClassTableEntry_t* e = __atomic_load_n(&arr->slots[slot], __ATOMIC_ACQUIRE);
+        if (!e) {
+          // Claim the empty slot, on failure e is the entry that won it
+          if (__atomic_compare_exchange_n(&arr->slots[slot], &e, new_e, false,
+                                          __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+            __atomic_add_fetch(&arr->cnt, 1, __ATOMIC_RELAXED);
+            __atomic_sub_fetch(&arr->inserters, 1, __ATOMIC_SEQ_CST);
+            _LeaveEpoch(r);
+            return ptr;
+          }
+        }
+        if (_IsEntryMatch(e, hash, str, len)) {
+          __atomic_sub_fetch(&arr->inserters, 1, __ATOMIC_SEQ_CST);
+          _LeaveEpoch(r);
+          free(new_e);
+          return e->ptr;
+        }
+        slot = (slot + 1) & (arr->nr - 1);
+      }
+    }
+    // Frozen, past the load limit or full: grow and retry on the new array
+    __atomic_sub_fetch(&arr->inserters, 1, __ATOMIC_SEQ_CST);
+    _LeaveEpoch(r);
+    if (_GrowClassTable(tbl, arr) == false) {
+      free(new_e);
+      return NULL;
+    }
+  }
+}
+
+size_t ClassTableSize(ClassTable_t* tbl) {
+  ClassTableArray_t* arr = __atomic_load_n(&tbl->array, __ATOMIC_ACQUIRE);
+  return __atomic_load_n(&arr->cnt, __ATOMIC_RELAXED);
+}
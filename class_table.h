@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Concurrent class table support
+ *
+ * Lookups never take a lock: a reader announces the epoch it runs in, loads
+ * the current slot array and probes it. Inserters claim empty slots with a
+ * CAS. Growing the table freezes the old slot array, waits for in-flight
+ * inserters to drain, copies the entries into a new array and publishes it.
+ * The old array is retired and only freed once every reader that could
+ * still see it has left its epoch.
+ */
+
+#ifndef CART_CLASS_TABLE_H_
+#define CART_CLASS_TABLE_H_
+
+#include <pthread.h>
+
+#include "macros.h"
+
+// Structures below are accessed with atomic operations and must stay
+// naturally aligned, so they are not PACKED
+
+typedef struct {
+  uint64_t        hash;
+  const uint8_t*  str;
+  size_t          len;
+  void*           ptr;
+} ClassTableEntry_t;
+
+typedef struct _ClassTableArray {
+  size_t                    nr;
+  size_t                    cnt;
+  uint32_t                  inserters;
+  uint32_t                  frozen;
+  size_t                    retire_epoch;
+  struct _ClassTableArray*  Next;
+  ClassTableEntry_t**       slots;
+} ClassTableArray_t;
+
+typedef struct _ClassTableReader {
+  // Epoch the reader entered in, 0 when quiescent
+  size_t                    epoch;
+  const void*               owner;
+  struct _ClassTableReader* Next;
+} ClassTableReader_t;
+
+typedef struct {
+  // Unique among the tables ever allocated, never 0
+  size_t              id;
+  ClassTableArray_t*  array;
+  size_t              epoch;
+  ClassTableReader_t* readers;
+  // Retired slot arrays waiting for the readers to drain
+  ClassTableArray_t*  retired;
+  // Serializes growing the table, never taken by readers
+  pthread_mutex_t     lock;
+} ClassTable_t;
+
+ClassTable_t* AllocClassTable(size_t nr);
+void FreeClassTable(ClassTable_t* tbl);
+void* ClassTableInsert(ClassTable_t* tbl, uint64_t hash, const uint8_t* str, size_t len, void* ptr);
+void* ClassTableLookup(ClassTable_t* tbl, uint64_t hash, const uint8_t* str, size_t len);
+size_t ClassTableSize(ClassTable_t* tbl);
+
+#endif  // CART_CLASS_TABLE_H_
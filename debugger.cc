@@ -15,6 +15,7 @@
  */
 
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/stat.h>
@@ -25,10 +26,82 @@
 #include "macros.h"
 #include "utils.h"
 #include "net.h"
+#include "hash.h"
+#include "thread.h"
 #include "debugger.h"
 #include "cart.h"
 
+#define HASH_REPORT_SZ    (16 * 1024)
+#define ALLOC_REPORT_SZ   (8 * 1024)
+
+// Split the report into packets, the last one is empty
+static void SendTextReport(int32_t sd, uint32_t op, const char* report, size_t len) {
+  DebuggerPktRepText_t pkt;
+  size_t pos = 0;
+  do {
+    size_t n = len - pos;
+    if (n > sizeof(pkt.text)) {
+      n = sizeof(pkt.text);
+    }
+    memset(&pkt, 0, sizeof(pkt));
+    pkt.op = op;
+    pkt.len = n;
+    if (n) {
+      memcpy(pkt.text, report + pos, n);
+    }
+    transferSocket(sd, &pkt, sizeof(pkt));
+    pos += n;
+    if (!n) {
+      break;
+    }
+  } while (true);
+}
+
+static void SendHashReport(int32_t sd) {
+  char* report = (char*)malloc(HASH_REPORT_SZ);
+  size_t len = 0;
+  if (report) {
+    len = FormatHashTableStats(report, HASH_REPORT_SZ);
+    if (len >= HASH_REPORT_SZ) {
+      len = HASH_REPORT_SZ - 1;
+    }
+  }
+  SendTextReport(sd, OP_REP_HASH, report, len);
+  free(report);
+}
+
+static void SendAllocReport(int32_t sd, AllocTracker_t* tracker) {
+  char* report = (char*)malloc(ALLOC_REPORT_SZ);
+  size_t len = 0;
+  if (report && tracker) {
+    len = FormatAllocSites(tracker, report, ALLOC_REPORT_SZ);
+    if (len >= ALLOC_REPORT_SZ) {
+      len = ALLOC_REPORT_SZ - 1;
+    }
+  }
+  SendTextReport(sd, OP_REP_ALLOC, report, len);
+  free(report);
+}
+
+static void SendCompactReport(int32_t sd, Gc_t* pGc) {
+  DebuggerPktRepCompact_t pkt;
+  GcStats_t bStats;
+  GcGetStats(pGc, &bStats);
+  memset(&pkt, 0, sizeof(pkt));
+  pkt.op = OP_REP_COMPACT;
+  pkt.Pending = bStats.compact_pending;
+  pkt.Compactions = (uint32_t)bStats.compactions;
+  pkt.FragmentationBefore = bStats.fragmentation_before;
+  pkt.FragmentationAfter = bStats.fragmentation_after;
+  pkt.ThroughputMBs = bStats.total_compact_ns ?
+      (uint32_t)((bStats.compacted_bytes * 1000ULL) / bStats.total_compact_ns) : 0;
+  pkt.ObjectsMoved = bStats.compacted_objects;
+  pkt.BytesMoved = bStats.compacted_bytes;
+  transferSocket(sd, &pkt, sizeof(pkt));
+}
+
 static void* DebuggerThread(void* arg) {
+  Gc_t* pGc = (Gc_t*)arg;
   int32_t sts = -1;
   int32_t sfd;
   int32_t sd;
@@ -64,39 +137,91 @@ static void* DebuggerThread(void* arg) {
       case OP_GC_HEAP:
         pdbg("OP_GC_HEAP OP code\n");
         break;
+      case OP_SUB_HASH:
+        pdbg("OP_SUB_HASH OP code\n");
+        break;
+      case OP_COMPACT_HEAP:
+        pdbg("OP_COMPACT_HEAP OP code\n");
+        break;
+      case OP_SUB_ALLOC:
+        pdbg("OP_SUB_ALLOC OP code\n");
+        break;
+      case OP_STP_ALLOC:
+        pdbg("OP_STP_ALLOC OP code\n");
+        break;
       default:
         pdbg("Invalid PACKET OP code\n");
         break;
     }
 
+    // One-shot hash table report, then wait for the next connection
+    if (pDebuggerPktComm->op == OP_SUB_HASH) {
+      SendHashReport(sd);
+      deinitializeSocket(sd);
+      continue;
+    }
+    // One-shot as well, the mutator compacts at its next safepoint
+    if (pDebuggerPktComm->op == OP_COMPACT_HEAP) {
+      if (pGc) {
+        GcRequestCompaction(pGc);
+        SendCompactReport(sd, pGc);
+      }
+      deinitializeSocket(sd);
+      continue;
+    }
+
+    // Allocation sites sampled so far, the VM keeps running
+    if (pDebuggerPktComm->op == OP_SUB_ALLOC) {
+      AllocTracker_t* tracker = pGc ? pGc->alloc_tracker : NULL;
+      if (tracker) {
+        AllocTrackerEnable(tracker, true);
+      }
+      SendAllocReport(sd, tracker);
+      deinitializeSocket(sd);
+      continue;
+    }
+    if (pDebuggerPktComm->op == OP_STP_ALLOC) {
+      if (pGc && pGc->alloc_tracker) {
+        AllocTrackerEnable(pGc->alloc_tracker, false);
+      }
+      deinitializeSocket(sd);
+      continue;
+    }
+
+    // Heap reports every two seconds until the client goes away
     DebuggerPktRepHeap_t* pArtdbgPktRepHeap = (DebuggerPktRepHeap_t*)packet;
-    while (true) {
-      // Update data
+    while (pGc) {
+      GcHeapInfo_t bInfo;
+      RuntimeStats_t bStats;
+      GcGetHeapInfo(pGc, &bInfo);
+      GcGetRuntimeStats(pGc, &bStats);
       memset(packet, 0, sizeof(packet));
       pArtdbgPktRepHeap->x.rep_heap.op = OP_REP_HEAP;
-      pArtdbgPktRepHeap->x.rep_heap.TotalMemory = 100;  // HeapAllocedSize
-      pArtdbgPktRepHeap->x.rep_heap.FreeMemory = 90;  // HeapFreeSize
-      pArtdbgPktRepHeap->x.rep_heap.MaxMemory = 30;  // HeapAvailableSize
-      pArtdbgPktRepHeap->x.rep_heap.FreeMemoryUntilGC = 10;
-      pArtdbgPktRepHeap->x.rep_heap.FreeMemoryUntilOOME = 10;
-      pArtdbgPktRepHeap->x.rep_heap.BytesAllocated = 11;
-      pArtdbgPktRepHeap->x.rep_heap.BytesAllocatedEver = 9;
-      pArtdbgPktRepHeap->x.rep_heap.BytesFreedEver = 6;
+      pArtdbgPktRepHeap->x.rep_heap.TotalMemory = (uint32_t)bInfo.total;
+      pArtdbgPktRepHeap->x.rep_heap.FreeMemory = (uint32_t)bInfo.free;
+      pArtdbgPktRepHeap->x.rep_heap.MaxMemory = (uint32_t)bInfo.max;
+      pArtdbgPktRepHeap->x.rep_heap.FreeMemoryUntilGC = (uint32_t)bInfo.until_gc;
+      pArtdbgPktRepHeap->x.rep_heap.FreeMemoryUntilOOME = (uint32_t)bInfo.until_oome;
+      pArtdbgPktRepHeap->x.rep_heap.BytesAllocated = (uint32_t)bInfo.alloced;
+      pArtdbgPktRepHeap->x.rep_heap.BytesAllocatedEver = bStats.allocated_bytes;
+      pArtdbgPktRepHeap->x.rep_heap.BytesFreedEver = bStats.freed_bytes;
       // Send it out
-      transferSocket(sd, packet, sizeof(packet));
+      if (!transferSocket(sd, packet, sizeof(packet))) {
+        break;
+      }
       sleep(2);
     }
+    deinitializeSocket(sd);
   }
 
-  // Close the connection
-  deinitializeSocket(sd);
+  // Close the listening socket, connections are closed as they end
   deinitializeSocket(sfd);
   pdbg("Debugger cleaned up\n");
   return NULL;
 }
 
-void StartDebuggerThread(pthread_t* pth) {
+void StartDebuggerThread(pthread_t* pth, Gc_t* pGc) {
   pdbg("StartDebuggerThread entering\n");
-  pthread_create(pth, NULL, DebuggerThread, NULL);
+  pthread_create(pth, NULL, DebuggerThread, (void*)pGc);
   pdbg("StartDebuggerThread exiting\n");
 }
@@ -19,6 +19,8 @@
 
 #include <pthread.h>
 
+#include "gc.h"
+
 #define PACKET_SZ 512
 
 enum {
@@ -27,6 +29,13 @@ enum {
   OP_STP_HEAP,
   OP_GC_HEAP,
   OP_EXIT,
+  OP_SUB_HASH,
+  OP_REP_HASH,
+  OP_COMPACT_HEAP,
+  OP_REP_COMPACT,
+  OP_SUB_ALLOC,
+  OP_REP_ALLOC,
+  OP_STP_ALLOC,
 };
 
 typedef struct {
@@ -51,7 +60,33 @@ typedef struct {
   } x;
 } DebuggerPktRepHeap_t;
 
-void StartDebuggerThread(pthread_t* pth);
+// Text report, sent as chunks and ended by an empty chunk. OP_SUB_HASH is
+// answered with the hash tables, OP_SUB_ALLOC with the top allocation sites
+// after turning the sampling on, OP_STP_ALLOC turns it off.
+typedef struct {
+  uint32_t op;
+  uint32_t len;
+  char text[PACKET_SZ - (2 * sizeof(uint32_t))];
+} DebuggerPktRepText_t;
+
+typedef DebuggerPktRepText_t DebuggerPktRepHash_t;
+typedef DebuggerPktRepText_t DebuggerPktRepAlloc_t;
+
+// Compaction report, answering OP_COMPACT_HEAP. The compaction it asks for
+// happens at the next safepoint of the mutator, when compiled code returns.
+// The report is of the last one done.
+typedef struct {
+  uint32_t op;
+  uint32_t Pending;
+  uint32_t Compactions;
+  uint32_t FragmentationBefore;   // percent
+  uint32_t FragmentationAfter;
+  uint32_t ThroughputMBs;
+  uint64_t ObjectsMoved;
+  uint64_t BytesMoved;
+} DebuggerPktRepCompact_t;
+
+void StartDebuggerThread(pthread_t* pth, Gc_t* pGc);
 
 #endif  // CART_DEBUGGER_H_
 
@@ -23,14 +23,24 @@
 
 #include "macros.h"
 #include "thread.h"
+#include "heap.h"
+#include "gc.h"
 
 typedef struct PACKED {
   tls_32bit_sized_values_t  tls32_;
   tls_64bit_sized_values_t  tls64_;
   tls_ptr_sized_values_t    tlsPtr_;
+  // Method of the refs-only callee save frames the runtime stubs push
+  const Method_t*           refs_only_method;
 } OatCodeExecEnv_t;
 
 void SetupLdt();
+void SetupTlab(Gc_t* pGc);
+void RevokeTlab();
+// Runs the compiled code of the method on a managed stack fragment of its
+// own, args holds args_size bytes of arguments. The result is stored as a
+// long, false when there was no code to run or it threw.
+bool InvokeOatCode(const Method_t* pMethod, const uint32_t* args, uint32_t args_size, uint64_t* result);
 
 #endif  // CART_ENTRY_H_
 
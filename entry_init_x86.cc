@@ -16,7 +16,9 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
+#include <setjmp.h>
 #include <unistd.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
@@ -26,10 +28,54 @@
 #include "cart.h"
 #include "thread.h"
 #include "entry.h"
+#include "heap.h"
+#include "class.h"
+#include "gc.h"
+#include "asm_support_x86.h"
 
 #define MODIFY_LDT_CONTENTS_DATA 0
 
+#define TLS_PTR_OFFSET(field) (offsetof(OatCodeExecEnv_t, tlsPtr_) + offsetof(tls_ptr_sized_values_t, field))
+
+COMPILE_ASSERT(TLS_PTR_OFFSET(managed_stack) + offsetof(ManagedStack_t, top_quick_frame_) ==
+               THREAD_TOP_QUICK_FRAME_OFFSET, thread_top_quick_frame_offset);
+COMPILE_ASSERT(TLS_PTR_OFFSET(managed_stack) + offsetof(ManagedStack_t, top_quick_frame_pc_) ==
+               THREAD_TOP_QUICK_FRAME_PC_OFFSET, thread_top_quick_frame_pc_offset);
+COMPILE_ASSERT(offsetof(OatCodeExecEnv_t, refs_only_method) == THREAD_REFS_ONLY_METHOD_OFFSET,
+               thread_refs_only_method_offset);
+COMPILE_ASSERT(offsetof(Method_t, method_oat_code) == METHOD_OAT_CODE_OFFSET, method_oat_code_offset);
+COMPILE_ASSERT(offsetof(Array_t, length) == ARRAY_LENGTH_OFFSET, array_length_offset);
+COMPILE_ASSERT(sizeof(OatCodeExecEnv_t) <= PAGE_SIZE, exec_env_size);
+
+// The stubs of entry_x86.S, the runtime they call into is hidden so that
+// they reach it without the PLT
+#define RUNTIME_ENTRY extern "C" __attribute__((visibility("hidden")))
+
+extern "C" void art_quick_invoke_stub(const Method_t* method, const uint32_t* args, uint32_t args_size,
+                                      void* self, uint64_t* result, const char* shorty);
+extern "C" void art_quick_alloc_object_resolved();
+extern "C" void art_quick_alloc_object_initialized();
+extern "C" void art_quick_alloc_array_resolved();
+extern "C" void art_quick_aput_obj_with_null_and_bound_check();
+extern "C" void art_quick_aput_obj_with_bound_check();
+extern "C" void art_quick_aput_obj();
+extern "C" void art_quick_throw_null_pointer_exception();
+extern "C" void art_quick_throw_array_bounds();
+
 static OatCodeExecEnv_t bOatCodeExecEnv;
+static Gc_t* pTlabGc = NULL;
+// Where a pending exception unwinds to, NULL outside of InvokeOatCode.
+// There are no Throwable objects, an exception is known by its name.
+static jmp_buf* pInvokeJmp = NULL;
+static const char* pPendingException = NULL;
+
+// The frame SETUP_REFS_ONLY_CALLEE_SAVE_FRAME pushes: ebp, esi and edi, and
+// the return address as the pseudo register 8. It has no GC map, only its
+// spill slots are scanned.
+static OatQuickMethodHdr_t bRefsOnlyHdr = {
+  0, 0, { FRAME_SIZE_REFS_ONLY_CALLEE_SAVE, (1 << 5) | (1 << 6) | (1 << 7) | (1 << 8), 0 }, 0
+};
+static Method_t bRefsOnlyMethod;
 
 #if defined(__APPLE__)
 #include <architecture/i386/table.h>
@@ -49,8 +95,135 @@ void TestSuspend() {
   pdbg("TestSuspend is called\n");
 }
 
+// thread_local_start/pos/end/objects of the execution environment
+static inline HeapTlab_t* _GetTlab() {
+  return (HeapTlab_t*)((uint8_t*)&bOatCodeExecEnv.tlsPtr_ +
+                       offsetof(tls_ptr_sized_values_t, thread_local_start));
+}
+
+static inline void* _PendingIfNull(void* obj, const char* name) {
+  if (!obj) {
+    pPendingException = name;
+  }
+  return obj;
+}
+
+// Unwinds the compiled code to the InvokeOatCode that ran it
+RUNTIME_ENTRY void DeliverPendingException() {
+  pdbg("%s\n", pPendingException ? pPendingException : "Unknown exception");
+  if (pInvokeJmp) {
+    longjmp(*pInvokeJmp, 1);
+  }
+}
+
+// Quick entrypoints for classes already resolved, klass is a Class_t. The
+// stubs pass the return address in the method allocating.
+RUNTIME_ENTRY void* AllocObjectResolved(void* klass, void* /*method*/, uintptr_t pc) {
+  return _PendingIfNull((void*)GcAllocObjectAt(pTlabGc, _GetTlab(), (Class_t*)klass, pc),
+                        "java.lang.OutOfMemoryError");
+}
+
+RUNTIME_ENTRY void* AllocObjectInitialized(void* klass, void* /*method*/, uintptr_t pc) {
+  return _PendingIfNull((void*)GcAllocObjectAt(pTlabGc, _GetTlab(), (Class_t*)klass, pc),
+                        "java.lang.OutOfMemoryError");
+}
+
+// klass is the Class_t of the array
+RUNTIME_ENTRY void* AllocArrayResolved(void* klass, void* /*method*/, uint32_t length, uintptr_t pc) {
+  return _PendingIfNull((void*)GcAllocArrayAt(pTlabGc, _GetTlab(), (Class_t*)klass, length, pc),
+                        "java.lang.OutOfMemoryError");
+}
+
+// The stubs checked the array and the index, the element type is not
+// checked against the array, there is no ArrayStoreException
+RUNTIME_ENTRY void AputObject(Array_t* arr, uint32_t index, Object_t* value) {
+  GcStoreRef(pTlabGc, (Object_t*)arr, &((Object_t**)arr->data)[index], value);
+}
+
+RUNTIME_ENTRY void ThrowNullPointerException() {
+  pPendingException = "java.lang.NullPointerException";
+}
+
+RUNTIME_ENTRY void ThrowArrayIndexOutOfBoundsException(int32_t index, int32_t length) {
+  pdbg("length=%d, index=%d\n", (int)length, (int)index);
+  pPendingException = "java.lang.ArrayIndexOutOfBoundsException";
+}
+
+// This thread becomes the mutator, the collector finds its roots on its
+// managed stack. Compiled code marks the cards of its reference stores
+// through the biased card table.
+void SetupTlab(Gc_t* pGc) {
+  if (!GcSetManagedStack(pGc, (const struct ManagedStack*)&bOatCodeExecEnv.tlsPtr_.managed_stack)) {
+    return;
+  }
+  pTlabGc = pGc;
+  memset(_GetTlab(), 0, sizeof(HeapTlab_t));
+  bOatCodeExecEnv.tlsPtr_.card_table = pGc->card_table->biased_begin;
+  bOatCodeExecEnv.tlsPtr_.quick_entrypoints.AllocObjectResolved =
+      (void* (*)(void*, uint32_t))art_quick_alloc_object_resolved;
+  bOatCodeExecEnv.tlsPtr_.quick_entrypoints.AllocObjectInitialized =
+      (void* (*)(void*, uint32_t))art_quick_alloc_object_initialized;
+  bOatCodeExecEnv.tlsPtr_.quick_entrypoints.AllocArrayResolved =
+      (void* (*)(void*, uint32_t))art_quick_alloc_array_resolved;
+  bOatCodeExecEnv.tlsPtr_.quick_entrypoints.AputObjectWithNullAndBoundCheck =
+      (void* (*)(void*, uint32_t))art_quick_aput_obj_with_null_and_bound_check;
+  bOatCodeExecEnv.tlsPtr_.quick_entrypoints.AputObjectWithBoundCheck =
+      (void* (*)(void*, uint32_t))art_quick_aput_obj_with_bound_check;
+  bOatCodeExecEnv.tlsPtr_.quick_entrypoints.AputObject = (void* (*)(void*, uint32_t))art_quick_aput_obj;
+  bOatCodeExecEnv.tlsPtr_.quick_entrypoints.ThrowNullPointer =
+      (void* (*)(void*, uint32_t))art_quick_throw_null_pointer_exception;
+  bOatCodeExecEnv.tlsPtr_.quick_entrypoints.ThrowArrayBounds =
+      (void* (*)(void*, uint32_t))art_quick_throw_array_bounds;
+}
+
+void RevokeTlab() {
+  if (pTlabGc) {
+    GcRevokeTlab(pTlabGc, _GetTlab());
+    GcDetachMutator(pTlabGc);
+    bOatCodeExecEnv.tlsPtr_.card_table = NULL;
+    pTlabGc = NULL;
+  }
+}
+
+// Compiled code runs on a managed stack fragment of its own, linked to the
+// one it was called from so that the collector walks both. An exception
+// drops the frames of the fragment and the result.
+bool InvokeOatCode(const Method_t* pMethod, const uint32_t* args, uint32_t args_size, uint64_t* result) {
+  if (!pMethod || !pMethod->method_oat_code) {
+    pdbg("No compiled code to run\n");
+    return false;
+  }
+  const char* shorty = (const char*)pMethod->method_proto_shorty_str;
+  ManagedStack_t* stack = &bOatCodeExecEnv.tlsPtr_.managed_stack;
+  ManagedStack_t bFragment = *stack;
+  memset((void*)stack, 0, sizeof(ManagedStack_t));
+  stack->link_ = &bFragment;
+  *result = 0;
+  jmp_buf* pOuterJmp = pInvokeJmp;
+  jmp_buf bJmp;
+  bool ok = true;
+  if (setjmp(bJmp) == 0) {
+    pInvokeJmp = &bJmp;
+    art_quick_invoke_stub(pMethod, args, args_size, bOatCodeExecEnv.tlsPtr_.self, result, shorty ? shorty : "V");
+  } else {
+    pPendingException = NULL;
+    *result = 0;
+    ok = false;
+  }
+  pInvokeJmp = pOuterJmp;
+  *stack = bFragment;
+  // Once the outermost compiled code returned, its references are all in
+  // the roots, but for a returned one
+  if (pTlabGc && !pOuterJmp && !(ok && shorty && (shorty[0] == 'L'))) {
+    GcSafepoint(pTlabGc);
+  }
+  return ok;
+}
+
 void SetupLdt() {
   memset(&bOatCodeExecEnv, 0, sizeof(OatCodeExecEnv_t));
+  bRefsOnlyMethod.method_oat_code_hdr = &bRefsOnlyHdr;
+  bOatCodeExecEnv.refs_only_method = &bRefsOnlyMethod;
   bOatCodeExecEnv.tlsPtr_.quick_entrypoints.TestSuspend = TestSuspend;
   pdbg("Address of quick_entrypoints.TestSuspend = %p\n", &bOatCodeExecEnv.tlsPtr_.quick_entrypoints.TestSuspend);
   pdbg("Address of TestSuspend() = %p\n", TestSuspend);
@@ -20,7 +20,21 @@
 #include "utils.h"
 #include "macros.h"
 #include "cart.h"
+#include "heap.h"
+#include "gc.h"
+#include "entry.h"
 
 void SetupLdt() {
 }
 
+void SetupTlab(Gc_t* pGc) {
+}
+
+void RevokeTlab() {
+}
+
+bool InvokeOatCode(const Method_t* pMethod, const uint32_t* args, uint32_t args_size, uint64_t* result) {
+  pdbg("No x86_64 execution environment to run compiled code in\n");
+  return false;
+}
+
@@ -0,0 +1,1546 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "cart.h"
+#include "oat.h"
+#include "heap.h"
+#include "bitmap.h"
+#include "class.h"
+#include "thread.h"
+#include "mark.h"
+#include "card_table.h"
+#include "los.h"
+#include "gc.h"
+
+static inline uint64_t _NowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Bitmaps                                                                   //
+///////////////////////////////////////////////////////////////////////////////
+
+static inline size_t _BitmapSize(size_t nr_bits) {
+  size_t sz = BitmapWords(nr_bits) * sizeof(uint64_t);
+  return ((sz + PAGE_SIZE - 1) / PAGE_SIZE) * PAGE_SIZE;
+}
+
+// Pages are only backed once written
+static void* _MapLazy(size_t sz) {
+  void* p = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED) {
+    pdbg("Out of memory\n");
+    return NULL;
+  }
+  return p;
+}
+
+static inline uint64_t* _AllocBitmap(size_t nr_bits) {
+  return (uint64_t*)_MapLazy(_BitmapSize(nr_bits));
+}
+
+static inline void _FreeBitmap(uint64_t* map, size_t nr_bits) {
+  if (map) {
+    munmap((void*)map, _BitmapSize(nr_bits));
+  }
+}
+
+// Bits covering the committed part of the heap, nothing lives past it
+static inline size_t _CommittedBits(Gc_t* pGc) {
+  return pGc->heap_vol->ptr->nr_committed * (PAGE_SIZE / HEAP_OBJECT_ALIGN);
+}
+
+static inline size_t _BitOf(Gc_t* pGc, const void* ptr) {
+  return ((const uint8_t*)ptr - pGc->base) / HEAP_OBJECT_ALIGN;
+}
+
+// Any value may be passed in, only the start of an allocated object is live
+static inline bool _IsLiveObject(Gc_t* pGc, const void* ptr) {
+  if (((const uint8_t*)ptr < pGc->base) || ((uintptr_t)ptr % HEAP_OBJECT_ALIGN)) {
+    return false;
+  }
+  size_t idx = _BitOf(pGc, ptr);
+  return (idx < pGc->nr_bits) && BitmapTest(pGc->live_bits, idx);
+}
+
+// The heap daemon sweeps beside the mutator, so the bit is set atomically
+static inline void _SetLive(Gc_t* pGc, const void* ptr) {
+  size_t idx = _BitOf(pGc, ptr);
+  __atomic_fetch_or(&pGc->live_bits[idx / BITMAP_BITS_PER_WORD],
+                    1ULL << (idx % BITMAP_BITS_PER_WORD), __ATOMIC_RELAXED);
+}
+
+// Only the mutator changes the bits below, while it collects
+static inline void _ClearLive(Gc_t* pGc, const void* ptr) {
+  size_t idx = _BitOf(pGc, ptr);
+  pGc->live_bits[idx / BITMAP_BITS_PER_WORD] &= ~(1ULL << (idx % BITMAP_BITS_PER_WORD));
+}
+
+static inline bool _IsMarked(Gc_t* pGc, const void* ptr) {
+  return BitmapTest(pGc->mark_bits, _BitOf(pGc, ptr));
+}
+
+static inline void _SetMarked(Gc_t* pGc, const void* ptr) {
+  size_t idx = _BitOf(pGc, ptr);
+  pGc->mark_bits[idx / BITMAP_BITS_PER_WORD] |= 1ULL << (idx % BITMAP_BITS_PER_WORD);
+}
+
+static inline bool _IsLargeObject(Gc_t* pGc, const void* ptr) {
+  if (!ptr) {
+    return false;
+  }
+  pthread_mutex_lock(&pGc->los->lock);
+  bool found = (LosFind(pGc->los, ptr) != NULL);
+  pthread_mutex_unlock(&pGc->los->lock);
+  return found;
+}
+
+static inline bool _InNursery(Gc_t* pGc, const void* ptr) {
+  return ((const uint8_t*)ptr >= pGc->nursery) && ((const uint8_t*)ptr < (pGc->nursery + pGc->nursery_sz));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Roots                                                                     //
+///////////////////////////////////////////////////////////////////////////////
+
+// Only the values pointing at a live object are kept, the spill slots
+// hold anything
+static bool _GatherRoot(Gc_t* pGc, Object_t* obj) {
+  if (!_IsLiveObject(pGc, obj) && !_IsLargeObject(pGc, obj)) {
+    return true;
+  }
+  if (pGc->nr_root_objs == pGc->root_objs_cap) {
+    size_t cap = pGc->root_objs_cap * 2;
+    Object_t** objs = (Object_t**)realloc((void*)pGc->root_objs, sizeof(Object_t*) * cap);
+    if (!objs) {
+      pdbg("Out of memory\n");
+      return false;
+    }
+    pGc->root_objs = objs;
+    pGc->root_objs_cap = cap;
+  }
+  pGc->root_objs[pGc->nr_root_objs++] = obj;
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Quick frames                                                              //
+///////////////////////////////////////////////////////////////////////////////
+
+static inline const CodeItem_t* _CodeItemOf(const Method_t* pMethod) {
+  if (!pMethod->method_dex_code) {
+    return NULL;
+  }
+  return (const CodeItem_t*)((const uint8_t*)pMethod->method_dex_code - offsetof(CodeItem_t, insns_));
+}
+
+// Where a quick frame keeps dex register reg: the locals sit below the
+// callee saves, the ins in the caller's outs past the method slot
+static inline size_t _VRegOffset(const CodeItem_t* pCodeItem, const OatQuickMethodFrameInfo_t* info, uint32_t reg) {
+  size_t spill_sz = (__builtin_popcount(info->core_spill_mask_) * sizeof(uint32_t)) +
+                    (__builtin_popcount(info->fp_spill_mask_) * sizeof(uint64_t)) +
+                    sizeof(uint32_t);
+  size_t nr_locals = pCodeItem->registers_size_ - pCodeItem->ins_size_;
+  if (reg < nr_locals) {
+    return info->frame_size_in_bytes_ - spill_sz - (nr_locals * sizeof(uint32_t)) + (reg * sizeof(uint32_t));
+  }
+  return info->frame_size_in_bytes_ + ((reg - nr_locals) * sizeof(uint32_t)) + sizeof(uint32_t);
+}
+
+static bool _ScanQuickFrame(Gc_t* pGc, const Method_t* pMethod, uint8_t* sp, uintptr_t pc) {
+  const OatQuickMethodFrameInfo_t* info = &pMethod->method_oat_code_hdr->frame_info_;
+
+  // Dex registers holding references at this safepoint
+  const CodeItem_t* pCodeItem = _CodeItemOf(pMethod);
+  size_t nr_bytes = 0;
+  const uint8_t* refs = FindOatGcMapRefBitmap(pMethod->method_gc_map,
+                                              (uint32_t)(pc - (uintptr_t)pMethod->method_oat_code),
+                                              &nr_bytes);
+  if (refs && pCodeItem) {
+    for (uint32_t reg = 0; reg < (nr_bytes * BITS_PER_BYTE); ++reg) {
+      if (!(refs[reg / BITS_PER_BYTE] & (1 << (reg % BITS_PER_BYTE))) ||
+          (reg >= pCodeItem->registers_size_)) {
+        continue;
+      }
+      uint32_t ref = *(uint32_t*)(sp + _VRegOffset(pCodeItem, info, reg));
+      if (!_GatherRoot(pGc, (Object_t*)(uintptr_t)ref)) {
+        return false;
+      }
+    }
+  }
+
+  // References promoted to callee save registers are only described by the
+  // vmap table, so the spill slots are taken as roots when they point at a
+  // live object
+  size_t nr_spills = __builtin_popcount(info->core_spill_mask_);
+  uintptr_t* spills = (uintptr_t*)(sp + info->frame_size_in_bytes_ - (nr_spills * sizeof(uintptr_t)));
+  for (size_t i = 0; i < nr_spills; ++i) {
+    if (!_GatherRoot(pGc, (Object_t*)spills[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Each quick frame starts with its method, the return address ends it
+static bool _ScanManagedStack(Gc_t* pGc) {
+  const ManagedStack_t* stack = (const ManagedStack_t*)pGc->stack;
+  for (; stack; stack = stack->link_) {
+    uint8_t* sp = (uint8_t*)stack->top_quick_frame_;
+    uintptr_t pc = stack->top_quick_frame_pc_;
+    while (sp) {
+      const Method_t* pMethod = *(const Method_t**)sp;
+      if (!pMethod || !pMethod->method_oat_code_hdr) {
+        break;
+      }
+      if (!_ScanQuickFrame(pGc, pMethod, sp, pc)) {
+        return false;
+      }
+      size_t frame_sz = pMethod->method_oat_code_hdr->frame_info_.frame_size_in_bytes_;
+      pc = *(uintptr_t*)(sp + frame_sz - sizeof(uintptr_t));
+      sp += frame_sz;
+    }
+  }
+  return true;
+}
+
+static bool _GatherRoots(Gc_t* pGc) {
+  pGc->nr_root_objs = 0;
+  for (size_t i = 0; i < pGc->nr_roots; ++i) {
+    if (!_GatherRoot(pGc, *pGc->roots[i])) {
+      return false;
+    }
+  }
+  return _ScanManagedStack(pGc);
+}
+
+// Mark what the roots reach, in parallel once the heap is big enough
+static bool _Mark(Gc_t* pGc, size_t nr_bits, HeapVisitor_t visit, void* arg, size_t* nr_marked) {
+  if (!_GatherRoots(pGc)) {
+    return false;
+  }
+  MarkSpace_t bSpace;
+  bSpace.base = pGc->base;
+  bSpace.nr_bits = nr_bits;
+  bSpace.live_bits = pGc->live_bits;
+  bSpace.mark_bits = pGc->mark_bits;
+  bSpace.los = pGc->los;
+  MarkJob_t bJob;
+  memset((void*)&bJob, 0, sizeof(MarkJob_t));
+  bJob.space = &bSpace;
+  bJob.roots = pGc->root_objs;
+  bJob.nr_roots = pGc->nr_root_objs;
+  bJob.visit = visit;
+  bJob.arg = arg;
+  bJob.nr_threads = (pGc->live_sz >= GC_PARALLEL_MARK_MIN) ? pGc->mark_pool->nr_threads : 1;
+  pthread_mutex_lock(&pGc->los->lock);
+  bool ok = MarkPoolTrace(pGc->mark_pool, &bJob);
+  pthread_mutex_unlock(&pGc->los->lock);
+  *nr_marked = bJob.nr_marked;
+  return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Sweeping                                                                  //
+///////////////////////////////////////////////////////////////////////////////
+
+// Free what was live at the mark but is not anymore. Allocations since only
+// set live bits of memory that was free, the words are read atomically for
+// them.
+static void _SweepWords(Gc_t* pGc, uint64_t* old_live, size_t first, size_t last,
+                        size_t* freed_objects, size_t* freed_bytes) {
+  void* batch[GC_SWEEP_BATCH];
+  size_t nr = 0;
+  size_t nursery_first = 0;
+  size_t nursery_last = 0;
+  if (pGc->nursery) {
+    nursery_first = _BitOf(pGc, pGc->nursery) / BITMAP_BITS_PER_WORD;
+    nursery_last = nursery_first + ((pGc->nursery_sz / HEAP_OBJECT_ALIGN) / BITMAP_BITS_PER_WORD);
+  }
+  for (size_t w = first; w < last; ++w) {
+    // Pinned objects are left to the minor collections
+    if ((w >= nursery_first) && (w < nursery_last)) {
+      old_live[w] = 0;
+      continue;
+    }
+    uint64_t dead = old_live[w] & ~__atomic_load_n(&pGc->live_bits[w], __ATOMIC_RELAXED);
+    old_live[w] = 0;
+    while (dead) {
+      size_t bit = (size_t)__builtin_ctzll(dead);
+      dead &= dead - 1;
+      Object_t* obj = (Object_t*)(pGc->base + (((w * BITMAP_BITS_PER_WORD) + bit) * HEAP_OBJECT_ALIGN));
+      *freed_bytes += GcObjectSize(obj);
+      (*freed_objects)++;
+      batch[nr++] = (void*)obj;
+      if (nr == GC_SWEEP_BATCH) {
+        HeapFreeList(pGc->heap_vol, batch, nr);
+        nr = 0;
+      }
+    }
+  }
+  if (nr) {
+    HeapFreeList(pGc->heap_vol, batch, nr);
+  }
+}
+
+// Sweep batches of words until none is left to claim, run by the heap
+// daemon and by the collector waiting for it
+static void _SweepClaimed(Gc_t* pGc) {
+  MutexLock(&pGc->sweep_lock);
+  while (pGc->sweep_bits && (pGc->sweep_next < pGc->sweep_words)) {
+    uint64_t* old_live = pGc->sweep_bits;
+    size_t first = pGc->sweep_next;
+    size_t last = first + GC_SWEEP_WORDS;
+    if (last > pGc->sweep_words) {
+      last = pGc->sweep_words;
+    }
+    pGc->sweep_next = last;
+    MutexUnlock(&pGc->sweep_lock);
+
+    size_t freed_objects = 0;
+    size_t freed_bytes = 0;
+    _SweepWords(pGc, old_live, first, last, &freed_objects, &freed_bytes);
+
+    MutexLock(&pGc->sweep_lock);
+    pGc->sweep_freed_objects += freed_objects;
+    pGc->sweep_freed_bytes += freed_bytes;
+    pGc->sweep_done += last - first;
+    if (pGc->sweep_done == pGc->sweep_words) {
+      pthread_cond_broadcast(&pGc->sweep_cond);
+    }
+  }
+  MutexUnlock(&pGc->sweep_lock);
+}
+
+// The marks become the live bits, the former live bits are swept and then
+// serve as the mark bits again
+static void _StartSweep(Gc_t* pGc, size_t nr_bits) {
+  uint64_t* live = pGc->live_bits;
+  pGc->live_bits = pGc->mark_bits;
+  pGc->mark_bits = live;
+  MutexLock(&pGc->sweep_lock);
+  pGc->sweep_bits = live;
+  pGc->sweep_words = BitmapWords(nr_bits);
+  pGc->sweep_next = 0;
+  pGc->sweep_done = 0;
+  pGc->sweep_freed_objects = 0;
+  pGc->sweep_freed_bytes = 0;
+  pthread_cond_broadcast(&pGc->sweep_cond);
+  MutexUnlock(&pGc->sweep_lock);
+}
+
+// Help the sweep in progress and wait for the rest of it, returns the bytes
+// it freed. Called with the collector lock held.
+static size_t _FinishSweep(Gc_t* pGc) {
+  if (!pGc->sweep_bits) {
+    return 0;
+  }
+  _SweepClaimed(pGc);
+  MutexLock(&pGc->sweep_lock);
+  while (pGc->sweep_done < pGc->sweep_words) {
+    MutexWait(&pGc->sweep_lock, &pGc->sweep_cond);
+  }
+  size_t freed_objects = pGc->sweep_freed_objects;
+  size_t freed_bytes = pGc->sweep_freed_bytes;
+  pGc->sweep_bits = NULL;
+  MutexUnlock(&pGc->sweep_lock);
+
+  pGc->stats.freed_objects += freed_objects;
+  pGc->stats.freed_bytes += freed_bytes;
+  pGc->live_sz = HeapAllocedSize(pGc->heap_vol) - pGc->nursery_sz;
+  pdbg("GC freed %u objects (%u bytes)\n", (unsigned int)freed_objects, (unsigned int)freed_bytes);
+  return freed_bytes;
+}
+
+// Without the heap daemon the sweep is done before returning, and so are
+// the bytes it freed
+static size_t _MajorLocked(Gc_t* pGc) {
+  _FinishSweep(pGc);
+  uint64_t t0 = _NowNs();
+  size_t nr_bits = _CommittedBits(pGc);
+  size_t nr_marked = 0;
+
+  // Mark, mark stacks that cannot grow leave everything in place
+  if (!_Mark(pGc, nr_bits, NULL, NULL, &nr_marked)) {
+    pdbg("GC aborted, out of memory for the mark stacks\n");
+    memset((void*)pGc->mark_bits, 0, BitmapWords(nr_bits) * sizeof(uint64_t));
+    LosClearMarks(pGc->los);
+    return 0;
+  }
+  uint64_t t1 = _NowNs();
+  _StartSweep(pGc, nr_bits);
+  size_t freed = pGc->daemon_running ? 0 : _FinishSweep(pGc);
+
+  // Large objects are unmapped right away, then may take GC_LOS_MIN_FREE
+  // past what is left or what fills the target utilization
+  size_t los_freed_objects = 0;
+  size_t los_freed = LosSweep(pGc->los, &los_freed_objects);
+  size_t los_live = LosAllocedSize(pGc->los);
+  pGc->los_limit = (los_live * 100) / pGc->target_utilization;
+  if (pGc->los_limit < (los_live + GC_LOS_MIN_FREE)) {
+    pGc->los_limit = los_live + GC_LOS_MIN_FREE;
+  }
+  pGc->stats.freed_objects += los_freed_objects;
+  pGc->stats.freed_bytes += los_freed;
+  freed += los_freed;
+
+  // Statistics
+  uint64_t ns = _NowNs() - t0;
+  pGc->stats.last_mark_ns = t1 - t0;
+  pGc->stats.collections++;
+  pGc->stats.last_pause_ns = ns;
+  pGc->stats.total_pause_ns += ns;
+  if (ns > pGc->stats.max_pause_ns) {
+    pGc->stats.max_pause_ns = ns;
+  }
+  return freed;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Minor collections                                                         //
+///////////////////////////////////////////////////////////////////////////////
+
+// Reached nursery objects get their mark bit. A pinned one stays live where
+// it is, a copied one loses its live bit and points at its copy.
+static inline void _PushGrey(Gc_t* pGc, Object_t* obj) {
+  pGc->grey[pGc->nr_grey++] = obj;
+}
+
+static inline void _Pin(Gc_t* pGc, Object_t* obj) {
+  _SetMarked(pGc, obj);
+  _PushGrey(pGc, obj);
+  pGc->stats.pinned_objects++;
+}
+
+// Returns true when the slot still refers to the nursery
+static bool _Evacuate(Gc_t* pGc, Object_t** slot) {
+  Object_t* obj = *slot;
+  if (!_InNursery(pGc, obj)) {
+    return false;
+  }
+  if (_IsMarked(pGc, obj)) {
+    if (_IsLiveObject(pGc, obj)) {
+      return true;
+    }
+    *slot = (Object_t*)obj->klass;
+    return false;
+  }
+
+  // Promote into the heap proper, an object that cannot be copied stays
+  size_t sz = GcObjectSize(obj);
+  Object_t* copy = (Object_t*)HeapAlloc(pGc->heap_vol, sz);
+  if (!copy) {
+    _Pin(pGc, obj);
+    return true;
+  }
+  memcpy((void*)copy, (void*)obj, sz);
+  _SetLive(pGc, copy);
+  _ClearLive(pGc, obj);
+  _SetMarked(pGc, obj);
+  obj->klass = (struct _Class*)copy;
+  *slot = copy;
+  _PushGrey(pGc, copy);
+  pGc->stats.promoted_objects++;
+  pGc->stats.promoted_bytes += sz;
+  return false;
+}
+
+// Returns true when obj still refers to the nursery
+static bool _EvacuateFields(Gc_t* pGc, Object_t* obj) {
+  Class_t* pClass = obj->klass;
+  bool young = false;
+  if (!pClass) {
+    return false;
+  }
+  if (pClass->class_flags & CLASS_FLAG_REF_ARRAY) {
+    Array_t* arr = (Array_t*)obj;
+    Object_t** elems = (Object_t**)arr->data;
+    for (uint32_t i = 0; i < arr->length; ++i) {
+      young |= _Evacuate(pGc, &elems[i]);
+    }
+    return young;
+  }
+  for (uint32_t i = 0; i < pClass->nr_ref_offsets; ++i) {
+    young |= _Evacuate(pGc, (Object_t**)((uint8_t*)obj + pClass->ref_offsets[i]));
+  }
+  return young;
+}
+
+// Objects of the heap proper that refer to pinned objects keep their card
+// dirty for the next minor collection
+static void _ScanGrey(Gc_t* pGc) {
+  while (pGc->nr_grey) {
+    Object_t* obj = pGc->grey[--pGc->nr_grey];
+    if (_EvacuateFields(pGc, obj) && !_InNursery(pGc, obj)) {
+      CardMark(pGc->card_table, obj);
+    }
+  }
+}
+
+// Cards are marked for the object a reference is stored into, so the
+// objects starting in the dirty cards are the ones to scan
+static void _ScanDirtyCards(void* arg, uint8_t* begin, uint8_t* end) {
+  Gc_t* pGc = (Gc_t*)arg;
+  size_t first = _BitOf(pGc, begin);
+  size_t last = _BitOf(pGc, end);
+  for (size_t idx = first; idx < last; ++idx) {
+    uint64_t word = pGc->live_bits[idx / BITMAP_BITS_PER_WORD] >> (idx % BITMAP_BITS_PER_WORD);
+    if (!word) {
+      idx += BITMAP_BITS_PER_WORD - 1 - (idx % BITMAP_BITS_PER_WORD);
+      continue;
+    }
+    idx += (size_t)__builtin_ctzll(word);
+    if (idx >= last) {
+      break;
+    }
+    Object_t* obj = (Object_t*)(pGc->base + (idx * HEAP_OBJECT_ALIGN));
+    if (_EvacuateFields(pGc, obj)) {
+      CardMark(pGc->card_table, obj);
+    }
+  }
+}
+
+// Blocks left with live objects hold pinned ones, the others are free again
+static size_t _ResetNursery(Gc_t* pGc) {
+  size_t first = _BitOf(pGc, pGc->nursery) / BITMAP_BITS_PER_WORD;
+  size_t words_per_block = (GC_NURSERY_BLOCK / HEAP_OBJECT_ALIGN) / BITMAP_BITS_PER_WORD;
+  size_t nr_freed = 0;
+  for (size_t b = 0; b < pGc->nr_blocks; ++b) {
+    uint64_t pinned = 0;
+    for (size_t w = first + (b * words_per_block); w < (first + ((b + 1) * words_per_block)); ++w) {
+      pGc->live_bits[w] &= pGc->mark_bits[w];
+      pGc->mark_bits[w] = 0;
+      pinned |= pGc->live_bits[w];
+    }
+    if (pGc->block_state[b] != kGcBlockFree) {
+      nr_freed += pinned ? 0 : 1;
+    }
+    pGc->block_state[b] = pinned ? kGcBlockPinned : kGcBlockFree;
+  }
+  pGc->next_block = 0;
+  CardClearRange(pGc->card_table, pGc->nursery, pGc->nursery + pGc->nursery_sz);
+  return nr_freed * GC_NURSERY_BLOCK;
+}
+
+// The TLABs bumping through the nursery are all the mutator's. Those of a
+// mutator that exited are gone and only forgotten.
+static void _DropNurseryTlabs(Gc_t* pGc, bool reset) {
+  for (size_t b = 0; b < pGc->nr_blocks; ++b) {
+    if (pGc->block_tlab[b]) {
+      if (reset) {
+        memset((void*)pGc->block_tlab[b], 0, sizeof(HeapTlab_t));
+      }
+      pGc->block_tlab[b] = NULL;
+    }
+  }
+}
+
+// Copies the reachable nursery objects into the heap proper, then collects
+// it as well if that made it outgrow its limit. Only the mutator collects,
+// from an allocation or between its calls into compiled code, so its
+// frames are published and the nursery holds no other thread's objects in
+// the making.
+static size_t _MinorLocked(Gc_t* pGc) {
+  if (!pGc->nursery) {
+    return 0;
+  }
+  // Forwarded objects are told by their mark bit
+  _FinishSweep(pGc);
+  uint64_t t0 = _NowNs();
+  HeapVolume_t* pHeapVol = pGc->heap_vol;
+
+  // The managed stack is only scanned conservatively, what it holds stays
+  pGc->nr_root_objs = 0;
+  if (!_ScanManagedStack(pGc)) {
+    pdbg("Minor GC aborted, out of memory for the roots\n");
+    return 0;
+  }
+
+  // Start the TLABs over, they are refilled after the collection, and make
+  // room in the heap for everything the nursery holds
+  _DropNurseryTlabs(pGc, true);
+  size_t used_sz = 0;
+  for (size_t b = 0; b < pGc->nr_blocks; ++b) {
+    used_sz += (pGc->block_state[b] != kGcBlockFree) ? GC_NURSERY_BLOCK : 0;
+  }
+  size_t limit = pHeapVol->growth_limit;
+  if ((pHeapVol->total_sz + used_sz + HEAP_TLAB_SIZE) > limit) {
+    HeapSetGrowthLimit(pHeapVol, pHeapVol->total_sz + used_sz + HEAP_TLAB_SIZE);
+  }
+
+  // Pin the stack roots first, then copy from the registered roots and the
+  // dirty cards of the heap proper, then from whatever got copied
+  pGc->nr_grey = 0;
+  for (size_t i = 0; i < pGc->nr_root_objs; ++i) {
+    Object_t* obj = pGc->root_objs[i];
+    if (_InNursery(pGc, obj) && !_IsMarked(pGc, obj)) {
+      _Pin(pGc, obj);
+    }
+  }
+  for (size_t i = 0; i < pGc->nr_roots; ++i) {
+    _Evacuate(pGc, pGc->roots[i]);
+  }
+  uint8_t* heap_end = pGc->base + (pHeapVol->ptr->nr_committed * PAGE_SIZE);
+  CardScanDirty(pGc->card_table, pGc->base, pGc->nursery, _ScanDirtyCards, (void*)pGc);
+  CardScanDirty(pGc->card_table, pGc->nursery + pGc->nursery_sz, heap_end, _ScanDirtyCards, (void*)pGc);
+  _ScanGrey(pGc);
+  size_t freed = _ResetNursery(pGc);
+
+  // Statistics
+  uint64_t ns = _NowNs() - t0;
+  pGc->stats.minor_collections++;
+  pGc->stats.last_minor_pause_ns = ns;
+  pGc->stats.total_minor_pause_ns += ns;
+  if (ns > pGc->stats.max_minor_pause_ns) {
+    pGc->stats.max_minor_pause_ns = ns;
+  }
+
+  // Promotions that made the heap grow call for a full collection, what
+  // they committed is kept
+  if (pHeapVol->total_sz > limit) {
+    _MajorLocked(pGc);
+    limit = pHeapVol->total_sz;
+  }
+  HeapSetGrowthLimit(pHeapVol, limit);
+  return freed;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Compaction                                                                //
+///////////////////////////////////////////////////////////////////////////////
+
+static int _ComparePtr(const void* a, const void* b) {
+  uintptr_t x = *(const uintptr_t*)a;
+  uintptr_t y = *(const uintptr_t*)b;
+  return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+// A moved object leaves its mark bit and its new place in klass behind.
+// Objects the stack holds stay, and so do the slots of the heap that are
+// not objects at all.
+static bool _MoveObject(void* arg, void* from, void* to, size_t sz) {
+  Gc_t* pGc = (Gc_t*)arg;
+  if (!_IsLiveObject(pGc, from) ||
+      bsearch(&from, pGc->root_objs, pGc->nr_root_objs, sizeof(Object_t*), _ComparePtr)) {
+    return false;
+  }
+  Class_t* pClass = ((Object_t*)from)->klass;
+  memcpy(to, from, sz);
+  _ClearLive(pGc, from);
+  _SetLive(pGc, to);
+  _SetMarked(pGc, from);
+  ((Object_t*)from)->klass = (Class_t*)to;
+  // It may still point at pinned nursery objects
+  if (pClass && (pClass->nr_ref_offsets || (pClass->class_flags & CLASS_FLAG_REF_ARRAY))) {
+    CardMark(pGc->card_table, to);
+  }
+  pGc->stats.compacted_objects++;
+  return true;
+}
+
+static inline void _FixRef(Gc_t* pGc, Object_t** slot) {
+  Object_t* obj = *slot;
+  if (((uint8_t*)obj >= pGc->base) && (_BitOf(pGc, obj) < pGc->nr_bits) && _IsMarked(pGc, obj)) {
+    *slot = (Object_t*)obj->klass;
+  }
+}
+
+static void _FixFields(Gc_t* pGc, Object_t* obj) {
+  Class_t* pClass = obj->klass;
+  if (!pClass) {
+    return;
+  }
+  if (pClass->class_flags & CLASS_FLAG_REF_ARRAY) {
+    Array_t* arr = (Array_t*)obj;
+    Object_t** elems = (Object_t**)arr->data;
+    for (uint32_t i = 0; i < arr->length; ++i) {
+      _FixRef(pGc, &elems[i]);
+    }
+    return;
+  }
+  for (uint32_t i = 0; i < pClass->nr_ref_offsets; ++i) {
+    _FixRef(pGc, (Object_t**)((uint8_t*)obj + pClass->ref_offsets[i]));
+  }
+}
+
+// Point the roots and every live object at the new places, then free the
+// old ones
+static void _FixRefs(Gc_t* pGc) {
+  size_t nr_words = BitmapWords(_CommittedBits(pGc));
+  for (size_t i = 0; i < pGc->nr_roots; ++i) {
+    _FixRef(pGc, pGc->roots[i]);
+  }
+  for (size_t w = 0; w < nr_words; ++w) {
+    uint64_t live = pGc->live_bits[w];
+    while (live) {
+      size_t bit = (size_t)__builtin_ctzll(live);
+      live &= live - 1;
+      _FixFields(pGc, (Object_t*)(pGc->base + (((w * BITMAP_BITS_PER_WORD) + bit) * HEAP_OBJECT_ALIGN)));
+    }
+  }
+
+  void* batch[GC_SWEEP_BATCH];
+  size_t nr = 0;
+  for (size_t w = 0; w < nr_words; ++w) {
+    uint64_t moved = pGc->mark_bits[w];
+    pGc->mark_bits[w] = 0;
+    while (moved) {
+      size_t bit = (size_t)__builtin_ctzll(moved);
+      moved &= moved - 1;
+      batch[nr++] = (void*)(pGc->base + (((w * BITMAP_BITS_PER_WORD) + bit) * HEAP_OBJECT_ALIGN));
+      if (nr == GC_SWEEP_BATCH) {
+        HeapFreeList(pGc->heap_vol, batch, nr);
+        nr = 0;
+      }
+    }
+  }
+  if (nr) {
+    HeapFreeList(pGc->heap_vol, batch, nr);
+  }
+}
+
+// Runs right after a full collection whose sweep is over, so what the runs
+// hold is live. Returns the bytes moved.
+static size_t _CompactLocked(Gc_t* pGc) {
+  uint64_t t0 = _NowNs();
+  HeapVolume_t* pHeapVol = pGc->heap_vol;
+  unsigned int before = HeapFragmentation(pHeapVol);
+
+  // What the managed stack holds, sorted for the lookups
+  pGc->nr_root_objs = 0;
+  if (!_ScanManagedStack(pGc)) {
+    pdbg("Compaction aborted, out of memory for the roots\n");
+    return 0;
+  }
+  qsort((void*)pGc->root_objs, pGc->nr_root_objs, sizeof(Object_t*), _ComparePtr);
+
+  size_t moved = HeapCompactRuns(pHeapVol, _MoveObject, (void*)pGc);
+  _FixRefs(pGc);
+
+  // Statistics
+  uint64_t ns = _NowNs() - t0;
+  unsigned int after = HeapFragmentation(pHeapVol);
+  pGc->stats.compactions++;
+  pGc->stats.last_compact_ns = ns;
+  pGc->stats.total_compact_ns += ns;
+  pGc->stats.compacted_bytes += moved;
+  pGc->stats.fragmentation_before = before;
+  pGc->stats.fragmentation_after = after;
+  pdbg("Compacted %u KB in %u us, %u MB/s, fragmentation %u%% -> %u%%\n",
+       (unsigned int)(moved / 1024), (unsigned int)(ns / 1000), (unsigned int)((moved * 1000ULL) / (ns ? ns : 1)), before, after);
+  return moved;
+}
+
+static inline size_t _CollectLocked(Gc_t* pGc) {
+  return _MinorLocked(pGc) + _MajorLocked(pGc);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Thread statistics                                                         //
+///////////////////////////////////////////////////////////////////////////////
+
+// Counters of one thread, only written by it. They are stored atomically so
+// that they can be summed at any time. The block of an exited thread is
+// taken over by the next new one and keeps counting.
+typedef struct _GcThreadStats {
+  RuntimeStats_t          stats;
+  uint32_t                in_use;
+  struct _GcThreadStats*  Next;
+} __attribute__((aligned(MARK_CACHE_LINE))) GcThreadStats_t;
+
+static uint32_t gc_next_id = 0;
+static __thread uint32_t gc_stats_id = 0;
+static __thread RuntimeStats_t* gc_stats = NULL;
+
+// The block keeps the members of the packed stats aligned
+#define GC_COUNT(counter, n) __atomic_store_n(&(counter), (counter) + (n), __ATOMIC_RELAXED)
+
+static void _ReleaseThreadStats(void* arg) {
+  __atomic_store_n(&((GcThreadStats_t*)arg)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static RuntimeStats_t* _AttachThreadStats(Gc_t* pGc) {
+  GcThreadStats_t* blk = (GcThreadStats_t*)pthread_getspecific(pGc->stats_key);
+  if (!blk) {
+    pthread_mutex_lock(&pGc->stats_lock);
+    for (blk = pGc->thread_stats; blk; blk = blk->Next) {
+      if (!__atomic_load_n(&blk->in_use, __ATOMIC_ACQUIRE)) {
+        break;
+      }
+    }
+    if (!blk) {
+      if (posix_memalign((void**)&blk, MARK_CACHE_LINE, sizeof(GcThreadStats_t))) {
+        pthread_mutex_unlock(&pGc->stats_lock);
+        pdbg("Out of memory\n");
+        return NULL;
+      }
+      memset((void*)blk, 0, sizeof(GcThreadStats_t));
+      blk->Next = pGc->thread_stats;
+      pGc->thread_stats = blk;
+    }
+    __atomic_store_n(&blk->in_use, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&pGc->stats_lock);
+    pthread_setspecific(pGc->stats_key, (void*)blk);
+  }
+  gc_stats_id = pGc->id;
+  gc_stats = &blk->stats;
+  return gc_stats;
+}
+
+// Counters of the calling thread, NULL when there was no memory for them
+static inline RuntimeStats_t* _ThreadStats(Gc_t* pGc) {
+  if (gc_stats_id == pGc->id) {
+    return gc_stats;
+  }
+  return _AttachThreadStats(pGc);
+}
+
+static void _CountAlloc(Gc_t* pGc, size_t sz) {
+  RuntimeStats_t* stats = _ThreadStats(pGc);
+  if (stats) {
+    GC_COUNT(stats->allocated_objects, 1);
+    GC_COUNT(stats->allocated_bytes, sz);
+  }
+}
+
+static void _CountGcForAlloc(Gc_t* pGc) {
+  RuntimeStats_t* stats = _ThreadStats(pGc);
+  if (stats) {
+    GC_COUNT(stats->gc_for_alloc_count, 1);
+  }
+}
+
+static void _SumThreadStats(Gc_t* pGc, RuntimeStats_t* sum) {
+  memset((void*)sum, 0, sizeof(RuntimeStats_t));
+  pthread_mutex_lock(&pGc->stats_lock);
+  for (GcThreadStats_t* blk = pGc->thread_stats; blk; blk = blk->Next) {
+    sum->allocated_objects += __atomic_load_n(&blk->stats.allocated_objects, __ATOMIC_RELAXED);
+    sum->allocated_bytes += __atomic_load_n(&blk->stats.allocated_bytes, __ATOMIC_RELAXED);
+    sum->gc_for_alloc_count += __atomic_load_n(&blk->stats.gc_for_alloc_count, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&pGc->stats_lock);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Mutator                                                                   //
+///////////////////////////////////////////////////////////////////////////////
+
+static __thread uint32_t gc_mutator_id = 0;
+
+// An exited mutator lets another thread take over
+static void _ReleaseMutator(void* arg) {
+  Gc_t* pGc = (Gc_t*)arg;
+  pthread_mutex_lock(&pGc->lock);
+  if (pGc->has_mutator && pthread_equal(pGc->mutator, pthread_self())) {
+    pGc->has_mutator = false;
+    pGc->stack = NULL;
+    _DropNurseryTlabs(pGc, false);
+  }
+  pthread_mutex_unlock(&pGc->lock);
+}
+
+// Called with the lock held
+static bool _AttachMutatorLocked(Gc_t* pGc) {
+  if (pGc->has_mutator && !pthread_equal(pGc->mutator, pthread_self())) {
+    pdbg("Another thread is the mutator\n");
+    return false;
+  }
+  if (!pGc->has_mutator) {
+    pGc->mutator = pthread_self();
+    pGc->has_mutator = true;
+    pthread_setspecific(pGc->mutator_key, (void*)pGc);
+  }
+  gc_mutator_id = pGc->id;
+  return true;
+}
+
+// The mutator finds itself without the lock
+static inline bool _IsMutator(Gc_t* pGc) {
+  return (gc_mutator_id == pGc->id) || GcAttachMutator(pGc);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Allocation                                                                //
+///////////////////////////////////////////////////////////////////////////////
+
+static inline bool _IsYoung(Gc_t* pGc, HeapTlab_t* tlab, size_t sz) {
+  return tlab && pGc->nursery && (sz <= HEAP_TLAB_MAX_OBJECT);
+}
+
+// The TLAB may still be one of the heap proper from before the nursery
+static void _DetachTlab(Gc_t* pGc, HeapTlab_t* tlab) {
+  if (pGc->nursery && _InNursery(pGc, tlab->start)) {
+    pGc->block_tlab[(tlab->start - pGc->nursery) / GC_NURSERY_BLOCK] = NULL;
+    memset((void*)tlab, 0, sizeof(HeapTlab_t));
+  } else {
+    HeapRevokeTlab(pGc->heap_vol, tlab);
+  }
+}
+
+// Called with the lock held. The block that was in use stays so until the
+// next minor collection.
+static bool _RefillNurseryTlab(Gc_t* pGc, HeapTlab_t* tlab) {
+  for (size_t i = 0; i < pGc->nr_blocks; ++i) {
+    size_t b = (pGc->next_block + i) % pGc->nr_blocks;
+    if (pGc->block_state[b] != kGcBlockFree) {
+      continue;
+    }
+    uint8_t* block = pGc->nursery + (b * GC_NURSERY_BLOCK);
+    _DetachTlab(pGc, tlab);
+    memset((void*)block, 0, GC_NURSERY_BLOCK);
+    pGc->block_state[b] = kGcBlockUsed;
+    pGc->block_tlab[b] = tlab;
+    pGc->next_block = b + 1;
+    tlab->start = block;
+    tlab->pos = block;
+    tlab->end = block + GC_NURSERY_BLOCK;
+    tlab->objects = 0;
+    return true;
+  }
+  return false;
+}
+
+// Without the lock, young objects are only bumped from the current block
+static inline void* _TryAlloc(Gc_t* pGc, HeapTlab_t* tlab, size_t sz) {
+  if (_IsYoung(pGc, tlab, sz)) {
+    sz = (sz + HEAP_OBJECT_ALIGN - 1) & ~(size_t)(HEAP_OBJECT_ALIGN - 1);
+    if ((size_t)(tlab->end - tlab->pos) < sz) {
+      return NULL;
+    }
+    uint8_t* p = tlab->pos;
+    tlab->pos += sz;
+    tlab->objects++;
+    return (void*)p;
+  }
+  // TLAB memory is already zeroed
+  if (tlab && (sz <= HEAP_TLAB_MAX_OBJECT)) {
+    return HeapTlabAlloc(pGc->heap_vol, tlab, sz);
+  }
+  void* p = HeapAlloc(pGc->heap_vol, sz);
+  if (p) {
+    memset(p, 0, sz);
+  }
+  return p;
+}
+
+static inline void* _TryAllocLocked(Gc_t* pGc, HeapTlab_t* tlab, size_t sz) {
+  void* p = _TryAlloc(pGc, tlab, sz);
+  if (!p && _IsYoung(pGc, tlab, sz) && _RefillNurseryTlab(pGc, tlab)) {
+    p = _TryAlloc(pGc, tlab, sz);
+  }
+  return p;
+}
+
+// Let the heap grow until what is live fills the target utilization of it
+// but at least GC_MIN_FREE past it, or by the request if that is more. A
+// TLAB refill or a new run may need more than the object itself.
+static void _GrowLocked(Gc_t* pGc, size_t sz) {
+  HeapVolume_t* pHeapVol = pGc->heap_vol;
+  size_t need = sz + HEAP_TLAB_SIZE;
+  size_t target = ((pGc->live_sz * 100) / pGc->target_utilization) + need;
+  size_t limit = pHeapVol->total_sz + need;
+  if (limit < target) {
+    limit = target;
+  }
+  if (limit < (pGc->live_sz + GC_MIN_FREE)) {
+    limit = pGc->live_sz + GC_MIN_FREE;
+  }
+  HeapSetGrowthLimit(pHeapVol, limit);
+}
+
+// A full nursery takes a minor collection, and the object goes to the heap
+// proper if every block is pinned. The heap proper is collected before it
+// is allowed to grow, the daemon may still be sweeping it by then. It is
+// never compacted here, the runtime allocating may hold references the
+// collector does not know of. The object is made live before the lock is
+// dropped.
+static Object_t* _AllocAfterGc(Gc_t* pGc, HeapTlab_t* tlab, Class_t* pClass, size_t sz) {
+  pthread_mutex_lock(&pGc->lock);
+  void* p = _TryAllocLocked(pGc, tlab, sz);
+  if (!p && _IsYoung(pGc, tlab, sz)) {
+    _CountGcForAlloc(pGc);
+    _MinorLocked(pGc);
+    p = _TryAllocLocked(pGc, tlab, sz);
+    if (!p) {
+      // Every block is pinned, the heap proper takes the object
+      tlab = NULL;
+      p = _TryAllocLocked(pGc, tlab, sz);
+    }
+  }
+  if (!p) {
+    _CountGcForAlloc(pGc);
+    _CollectLocked(pGc);
+    p = _TryAllocLocked(pGc, tlab, sz);
+  }
+  if (!p && pGc->sweep_bits) {
+    _FinishSweep(pGc);
+    p = _TryAllocLocked(pGc, tlab, sz);
+  }
+  if (!p) {
+    _GrowLocked(pGc, sz);
+    p = _TryAllocLocked(pGc, tlab, sz);
+  }
+  if (p) {
+    ((Object_t*)p)->klass = pClass;
+    _SetLive(pGc, p);
+  }
+  pthread_mutex_unlock(&pGc->lock);
+  return (Object_t*)p;
+}
+
+// Only the mutator collects, so nothing runs beside the lock-free bump but
+// the sweep of the heap daemon
+static Object_t* _AllocObject(Gc_t* pGc, HeapTlab_t* tlab, Class_t* pClass, size_t sz) {
+  Object_t* obj = (Object_t*)_TryAlloc(pGc, tlab, sz);
+  if (obj) {
+    obj->klass = pClass;
+    _SetLive(pGc, obj);
+  } else {
+    obj = _AllocAfterGc(pGc, tlab, pClass, sz);
+    if (!obj) {
+      pdbg("Out of memory for a %u byte object\n", (unsigned int)sz);
+      return NULL;
+    }
+  }
+  _CountAlloc(pGc, sz);
+  return obj;
+}
+
+// Large objects are not in the bitmaps, nor do they need a live bit. They
+// are collected once those mapped since the last collection pass the limit.
+// The object is mapped and given its class under the lock, so that no
+// trace or sweep sees it half made.
+static Object_t* _AllocLargeObject(Gc_t* pGc, Class_t* pClass, size_t sz) {
+  pthread_mutex_lock(&pGc->lock);
+  if ((LosAllocedSize(pGc->los) + sz) > pGc->los_limit) {
+    _CountGcForAlloc(pGc);
+    _CollectLocked(pGc);
+    if ((LosAllocedSize(pGc->los) + sz) > pGc->los_limit) {
+      pGc->los_limit = LosAllocedSize(pGc->los) + sz + GC_LOS_MIN_FREE;
+    }
+  }
+  Object_t* obj = (Object_t*)LosAlloc(pGc->los, sz);
+  if (obj) {
+    obj->klass = pClass;
+  }
+  pthread_mutex_unlock(&pGc->lock);
+  if (!obj) {
+    pdbg("Out of memory for a %u byte object\n", (unsigned int)sz);
+    return NULL;
+  }
+  _CountAlloc(pGc, sz);
+  return obj;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Heap daemon                                                               //
+///////////////////////////////////////////////////////////////////////////////
+
+static size_t _TrimLocked(Gc_t* pGc) {
+  size_t sz = HeapTrim(pGc->heap_vol);
+  if (sz) {
+    pGc->stats.trims++;
+    pGc->stats.trimmed_bytes += sz;
+  }
+  return sz;
+}
+
+// Trims unless the heap is used up to its target, or a sweep is pending
+static void _TrimIfUnderused(Gc_t* pGc) {
+  pthread_mutex_lock(&pGc->lock);
+  HeapVolume_t* pHeapVol = pGc->heap_vol;
+  size_t alloced = HeapAllocedSize(pHeapVol);
+  if (!pGc->sweep_bits && ((alloced * 100) < (pHeapVol->total_sz * pGc->target_utilization))) {
+    _TrimLocked(pGc);
+  }
+  pthread_mutex_unlock(&pGc->lock);
+}
+
+// Sweeps as soon as a collection leaves something to sweep, trims after
+// GC_TRIM_INTERVAL_MS without one. The collector lock is only taken to
+// trim, a collector holding it may be waiting for the sweep.
+static void* _HeapDaemon(void* arg) {
+  Gc_t* pGc = (Gc_t*)arg;
+  bool trimmed = true;
+  MutexLock(&pGc->sweep_lock);
+  while (!pGc->daemon_stop) {
+    if (pGc->sweep_bits && (pGc->sweep_next < pGc->sweep_words)) {
+      MutexUnlock(&pGc->sweep_lock);
+      _SweepClaimed(pGc);
+      trimmed = false;
+      MutexLock(&pGc->sweep_lock);
+      continue;
+    }
+    if (!MutexTimedWait(&pGc->sweep_lock, &pGc->sweep_cond, GC_TRIM_INTERVAL_MS) && !trimmed) {
+      MutexUnlock(&pGc->sweep_lock);
+      _TrimIfUnderused(pGc);
+      trimmed = true;
+      MutexLock(&pGc->sweep_lock);
+    }
+  }
+  MutexUnlock(&pGc->sweep_lock);
+  return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Interface                                                                 //
+///////////////////////////////////////////////////////////////////////////////
+
+Gc_t* AllocGc(HeapVolume_t* pHeapVol) {
+  // Allocate a collector structure
+  Gc_t* pGc = (Gc_t*)malloc(sizeof(Gc_t));
+  if (!pGc) {
+    pdbg("Out of memory\n");
+    return NULL;
+  }
+  memset((void*)pGc, 0, sizeof(Gc_t));
+  if (pthread_key_create(&pGc->stats_key, _ReleaseThreadStats) != 0) {
+    pdbg("Failed to create the statistics key\n");
+    free((void*)pGc);
+    return NULL;
+  }
+  if (pthread_key_create(&pGc->mutator_key, _ReleaseMutator) != 0) {
+    pdbg("Failed to create the mutator key\n");
+    pthread_key_delete(pGc->stats_key);
+    free((void*)pGc);
+    return NULL;
+  }
+  pthread_mutex_init(&pGc->stats_lock, NULL);
+  pGc->id = __atomic_add_fetch(&gc_next_id, 1, __ATOMIC_RELAXED);
+  pGc->heap_vol = pHeapVol;
+  pGc->base = (uint8_t*)pHeapVol->ptr->ptr;
+  pGc->nr_bits = pHeapVol->max_sz / HEAP_OBJECT_ALIGN;
+
+  // Allocate the bitmaps, the root buffers and a marking thread per CPU
+  long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  pGc->live_bits = _AllocBitmap(pGc->nr_bits);
+  pGc->mark_bits = _AllocBitmap(pGc->nr_bits);
+  pGc->root_objs = (Object_t**)malloc(sizeof(Object_t*) * GC_ROOT_OBJS_SIZE);
+  pGc->roots = (Object_t***)malloc(sizeof(Object_t**) * GC_NR_ROOTS);
+  pGc->mark_pool = AllocMarkPool((nr_cpus > 0) ? (int)nr_cpus : 1);
+  pGc->card_table = AllocCardTable(pGc->base, pHeapVol->max_sz);
+  pGc->los = AllocLargeObjectSpace(pHeapVol->max_sz);
+  if (!pGc->live_bits || !pGc->mark_bits || !pGc->root_objs || !pGc->roots || !pGc->mark_pool ||
+      !pGc->card_table || !pGc->los) {
+    pdbg("Out of memory\n");
+    FreeGc(pGc);
+    return NULL;
+  }
+  pGc->root_objs_cap = GC_ROOT_OBJS_SIZE;
+  pGc->roots_cap = GC_NR_ROOTS;
+  pGc->target_utilization = GC_TARGET_UTILIZATION;
+  pGc->los_limit = GC_LOS_MIN_FREE;
+  pthread_mutex_init(&pGc->lock, NULL);
+  InitMutex(&pGc->sweep_lock, "sweep lock", kRosAllocBulkFreeLock);
+  pthread_cond_init(&pGc->sweep_cond, NULL);
+
+  // Carve the nursery from the heap, without it every object goes to the
+  // heap proper. The grey stack has room for as many objects as it holds.
+  size_t min_object_sz = (CLASS_OBJECT_HDR_SIZE + HEAP_OBJECT_ALIGN - 1) & ~(size_t)(HEAP_OBJECT_ALIGN - 1);
+  pGc->nursery = (uint8_t*)HeapAlloc(pHeapVol, GC_NURSERY_SIZE);
+  if (pGc->nursery) {
+    pGc->nursery_sz = GC_NURSERY_SIZE;
+    pGc->nr_blocks = GC_NURSERY_SIZE / GC_NURSERY_BLOCK;
+    pGc->block_state = (uint8_t*)calloc(pGc->nr_blocks, sizeof(uint8_t));
+    pGc->block_tlab = (HeapTlab_t**)calloc(pGc->nr_blocks, sizeof(HeapTlab_t*));
+    pGc->grey_cap = GC_NURSERY_SIZE / min_object_sz;
+    pGc->grey = (Object_t**)_MapLazy(sizeof(Object_t*) * pGc->grey_cap);
+    if (!pGc->block_state || !pGc->block_tlab || !pGc->grey) {
+      pdbg("Out of memory\n");
+      FreeGc(pGc);
+      return NULL;
+    }
+  } else {
+    pdbg("No room for a nursery\n");
+  }
+
+  // Collect before committing more than what the heap starts with
+  HeapSetGrowthLimit(pHeapVol, pHeapVol->total_sz);
+  return pGc;
+}
+
+void FreeGc(Gc_t* pGc) {
+  if (pGc->daemon_running) {
+    GcStopDaemon(pGc);
+  }
+  _FreeBitmap(pGc->live_bits, pGc->nr_bits);
+  _FreeBitmap(pGc->mark_bits, pGc->nr_bits);
+  if (pGc->mark_pool) {
+    FreeMarkPool(pGc->mark_pool);
+  }
+  if (pGc->card_table) {
+    FreeCardTable(pGc->card_table);
+  }
+  if (pGc->los) {
+    FreeLargeObjectSpace(pGc->los);
+  }
+  if (pGc->nursery) {
+    HeapFree(pGc->heap_vol, (void*)pGc->nursery);
+  }
+  if (pGc->grey) {
+    munmap((void*)pGc->grey, sizeof(Object_t*) * pGc->grey_cap);
+  }
+  free((void*)pGc->block_state);
+  free((void*)pGc->block_tlab);
+  free((void*)pGc->root_objs);
+  free((void*)pGc->roots);
+  pthread_cond_destroy(&pGc->sweep_cond);
+  DestroyMutex(&pGc->sweep_lock);
+  pthread_mutex_destroy(&pGc->lock);
+  // The allocating threads must be done with it
+  pthread_key_delete(pGc->stats_key);
+  pthread_key_delete(pGc->mutator_key);
+  while (pGc->thread_stats) {
+    GcThreadStats_t* next = pGc->thread_stats->Next;
+    free((void*)pGc->thread_stats);
+    pGc->thread_stats = next;
+  }
+  pthread_mutex_destroy(&pGc->stats_lock);
+  free((void*)pGc);
+}
+
+bool GcAddRoot(Gc_t* pGc, Object_t** slot) {
+  pthread_mutex_lock(&pGc->lock);
+  if (pGc->nr_roots == pGc->roots_cap) {
+    size_t cap = pGc->roots_cap * 2;
+    Object_t*** roots = (Object_t***)realloc((void*)pGc->roots, sizeof(Object_t**) * cap);
+    if (!roots) {
+      pthread_mutex_unlock(&pGc->lock);
+      pdbg("Out of memory\n");
+      return false;
+    }
+    pGc->roots = roots;
+    pGc->roots_cap = cap;
+  }
+  pGc->roots[pGc->nr_roots++] = slot;
+  pthread_mutex_unlock(&pGc->lock);
+  return true;
+}
+
+void GcRemoveRoot(Gc_t* pGc, Object_t** slot) {
+  pthread_mutex_lock(&pGc->lock);
+  for (size_t i = 0; i < pGc->nr_roots; ++i) {
+    if (pGc->roots[i] == slot) {
+      pGc->roots[i] = pGc->roots[--pGc->nr_roots];
+      break;
+    }
+  }
+  pthread_mutex_unlock(&pGc->lock);
+}
+
+bool GcAttachMutator(Gc_t* pGc) {
+  pthread_mutex_lock(&pGc->lock);
+  bool ok = _AttachMutatorLocked(pGc);
+  pthread_mutex_unlock(&pGc->lock);
+  return ok;
+}
+
+// Its stack goes with it, and its TLABs are emptied if still in the nursery
+void GcDetachMutator(Gc_t* pGc) {
+  pthread_mutex_lock(&pGc->lock);
+  if (pGc->has_mutator && pthread_equal(pGc->mutator, pthread_self())) {
+    pGc->has_mutator = false;
+    pGc->stack = NULL;
+    _DropNurseryTlabs(pGc, true);
+    pthread_setspecific(pGc->mutator_key, NULL);
+  }
+  pthread_mutex_unlock(&pGc->lock);
+  if (gc_mutator_id == pGc->id) {
+    gc_mutator_id = 0;
+  }
+}
+
+bool GcSetManagedStack(Gc_t* pGc, const struct ManagedStack* stack) {
+  pthread_mutex_lock(&pGc->lock);
+  bool ok = _AttachMutatorLocked(pGc);
+  if (ok) {
+    pGc->stack = stack;
+  }
+  pthread_mutex_unlock(&pGc->lock);
+  return ok;
+}
+
+static inline void _TrackAlloc(Gc_t* pGc, Class_t* pClass, size_t sz, uintptr_t pc) {
+  AllocTracker_t* tracker = __atomic_load_n(&pGc->alloc_tracker, __ATOMIC_RELAXED);
+  if (tracker && AllocTrackerCount(sz)) {
+    AllocTrackerRecord(tracker, pc, pClass, sz);
+  }
+}
+
+Object_t* GcAllocObjectAt(Gc_t* pGc, HeapTlab_t* tlab, Class_t* pClass, uintptr_t pc) {
+  if (!_IsMutator(pGc)) {
+    return NULL;
+  }
+  Object_t* obj = _AllocObject(pGc, tlab, pClass, pClass->object_size);
+  if (obj) {
+    _TrackAlloc(pGc, pClass, pClass->object_size, pc);
+  }
+  return obj;
+}
+
+Array_t* GcAllocArrayAt(Gc_t* pGc, HeapTlab_t* tlab, Class_t* pClass, uint32_t length, uintptr_t pc) {
+  if (!_IsMutator(pGc)) {
+    return NULL;
+  }
+  size_t sz = CLASS_ARRAY_HDR_SIZE + ((size_t)length * pClass->component_size);
+  Array_t* arr;
+  if ((sz >= GC_LARGE_OBJECT_MIN) && !(pClass->class_flags & CLASS_FLAG_REF_ARRAY)) {
+    arr = (Array_t*)_AllocLargeObject(pGc, pClass, sz);
+  } else {
+    arr = (Array_t*)_AllocObject(pGc, tlab, pClass, sz);
+  }
+  if (arr) {
+    arr->length = length;
+    _TrackAlloc(pGc, pClass, sz, pc);
+  }
+  return arr;
+}
+
+Object_t* GcAllocObject(Gc_t* pGc, HeapTlab_t* tlab, Class_t* pClass) {
+  return GcAllocObjectAt(pGc, tlab, pClass, (uintptr_t)__builtin_return_address(0));
+}
+
+Array_t* GcAllocArray(Gc_t* pGc, HeapTlab_t* tlab, Class_t* pClass, uint32_t length) {
+  return GcAllocArrayAt(pGc, tlab, pClass, length, (uintptr_t)__builtin_return_address(0));
+}
+
+size_t GcObjectSize(const Object_t* obj) {
+  const Class_t* pClass = obj->klass;
+  if (!pClass) {
+    return CLASS_OBJECT_HDR_SIZE;
+  }
+  if (pClass->class_flags & CLASS_FLAG_ARRAY) {
+    return CLASS_ARRAY_HDR_SIZE + ((size_t)((const Array_t*)obj)->length * pClass->component_size);
+  }
+  return pClass->object_size;
+}
+
+void GcRevokeTlab(Gc_t* pGc, HeapTlab_t* tlab) {
+  pthread_mutex_lock(&pGc->lock);
+  _DetachTlab(pGc, tlab);
+  pthread_mutex_unlock(&pGc->lock);
+}
+
+// A failed allocation of the mutator collects by itself, but objects only
+// move here, when a compaction was asked for, and in GcCompact. The sweep
+// is over on return.
+size_t GcCollect(Gc_t* pGc) {
+  pthread_mutex_lock(&pGc->lock);
+  size_t freed = 0;
+  if (_AttachMutatorLocked(pGc)) {
+    freed = _CollectLocked(pGc);
+    freed += _FinishSweep(pGc);
+    if (__atomic_exchange_n(&pGc->compact_requested, false, __ATOMIC_RELAXED)) {
+      _CompactLocked(pGc);
+    }
+  }
+  pthread_mutex_unlock(&pGc->lock);
+  return freed;
+}
+
+size_t GcCollectYoung(Gc_t* pGc) {
+  pthread_mutex_lock(&pGc->lock);
+  size_t freed = _AttachMutatorLocked(pGc) ? _MinorLocked(pGc) : 0;
+  pthread_mutex_unlock(&pGc->lock);
+  return freed;
+}
+
+// Marks are cleared again, the next collection starts from scratch. The
+// objects are read as the mutator left them.
+size_t GcVisitReachable(Gc_t* pGc, HeapVisitor_t visit, void* arg) {
+  pthread_mutex_lock(&pGc->lock);
+  if (!_AttachMutatorLocked(pGc)) {
+    pthread_mutex_unlock(&pGc->lock);
+    return 0;
+  }
+  _FinishSweep(pGc);
+  size_t nr_bits = _CommittedBits(pGc);
+  size_t nr_marked = 0;
+  _Mark(pGc, nr_bits, visit, arg, &nr_marked);
+  memset((void*)pGc->mark_bits, 0, BitmapWords(nr_bits) * sizeof(uint64_t));
+  LosClearMarks(pGc->los);
+  pthread_mutex_unlock(&pGc->lock);
+  return nr_marked;
+}
+
+size_t GcCompact(Gc_t* pGc) {
+  pthread_mutex_lock(&pGc->lock);
+  if (!_AttachMutatorLocked(pGc)) {
+    pthread_mutex_unlock(&pGc->lock);
+    return 0;
+  }
+  __atomic_store_n(&pGc->compact_requested, false, __ATOMIC_RELAXED);
+  _CollectLocked(pGc);
+  _FinishSweep(pGc);
+  size_t moved = _CompactLocked(pGc);
+  pthread_mutex_unlock(&pGc->lock);
+  return moved;
+}
+
+void GcRequestCompaction(Gc_t* pGc) {
+  __atomic_store_n(&pGc->compact_requested, true, __ATOMIC_RELAXED);
+}
+
+// A heap the last compaction could not help is not compacted again until
+// it gets more fragmented
+size_t GcSafepoint(Gc_t* pGc) {
+  pthread_mutex_lock(&pGc->lock);
+  size_t moved = 0;
+  if (_AttachMutatorLocked(pGc)) {
+    unsigned int frag = HeapFragmentation(pGc->heap_vol);
+    bool fragmented = (frag >= GC_COMPACT_FRAGMENTATION) && (frag > pGc->stats.fragmentation_after);
+    if (__atomic_exchange_n(&pGc->compact_requested, false, __ATOMIC_RELAXED) || fragmented) {
+      _CollectLocked(pGc);
+      _FinishSweep(pGc);
+      moved = _CompactLocked(pGc);
+    }
+  }
+  pthread_mutex_unlock(&pGc->lock);
+  return moved;
+}
+
+bool GcStartDaemon(Gc_t* pGc) {
+  pthread_mutex_lock(&pGc->lock);
+  bool ok = pGc->daemon_running;
+  if (!ok) {
+    pGc->daemon_stop = false;
+    ok = (pthread_create(&pGc->daemon, NULL, _HeapDaemon, (void*)pGc) == 0);
+    pGc->daemon_running = ok;
+  }
+  pthread_mutex_unlock(&pGc->lock);
+  if (!ok) {
+    pdbg("Failed to start the heap daemon\n");
+  }
+  return ok;
+}
+
+// What the daemon left of a sweep is done by the caller
+void GcStopDaemon(Gc_t* pGc) {
+  pthread_mutex_lock(&pGc->lock);
+  bool running = pGc->daemon_running;
+  pGc->daemon_running = false;
+  pthread_mutex_unlock(&pGc->lock);
+  if (!running) {
+    return;
+  }
+  MutexLock(&pGc->sweep_lock);
+  pGc->daemon_stop = true;
+  pthread_cond_broadcast(&pGc->sweep_cond);
+  MutexUnlock(&pGc->sweep_lock);
+  pthread_join(pGc->daemon, NULL);
+  pthread_mutex_lock(&pGc->lock);
+  _FinishSweep(pGc);
+  pthread_mutex_unlock(&pGc->lock);
+}
+
+void GcSetTargetUtilization(Gc_t* pGc, unsigned int percent) {
+  pthread_mutex_lock(&pGc->lock);
+  pGc->target_utilization = ((percent > 0) && (percent <= 100)) ? percent : GC_TARGET_UTILIZATION;
+  pthread_mutex_unlock(&pGc->lock);
+}
+
+void GcSetAllocTracker(Gc_t* pGc, AllocTracker_t* tracker) {
+  __atomic_store_n(&pGc->alloc_tracker, tracker, __ATOMIC_RELAXED);
+}
+
+size_t GcTrim(Gc_t* pGc) {
+  pthread_mutex_lock(&pGc->lock);
+  _FinishSweep(pGc);
+  size_t sz = _TrimLocked(pGc);
+  pthread_mutex_unlock(&pGc->lock);
+  return sz;
+}
+
+void GcGetStats(Gc_t* pGc, GcStats_t* stats) {
+  RuntimeStats_t bSum;
+  _SumThreadStats(pGc, &bSum);
+  pthread_mutex_lock(&pGc->lock);
+  *stats = pGc->stats;
+  pthread_mutex_unlock(&pGc->lock);
+  stats->compact_pending = __atomic_load_n(&pGc->compact_requested, __ATOMIC_RELAXED);
+  stats->allocated_objects = bSum.allocated_objects;
+  stats->allocated_bytes = bSum.allocated_bytes;
+  stats->gc_for_alloc = bSum.gc_for_alloc_count;
+}
+
+void GcGetRuntimeStats(Gc_t* pGc, RuntimeStats_t* stats) {
+  _SumThreadStats(pGc, stats);
+  pthread_mutex_lock(&pGc->lock);
+  stats->freed_objects = pGc->stats.freed_objects;
+  stats->freed_bytes = pGc->stats.freed_bytes;
+  pthread_mutex_unlock(&pGc->lock);
+}
+
+// The heap is collected before it commits past its growth limit
+void GcGetHeapInfo(Gc_t* pGc, GcHeapInfo_t* info) {
+  HeapVolume_t* pHeapVol = pGc->heap_vol;
+  pthread_mutex_lock(&pGc->lock);
+  size_t alloced = HeapAllocedSize(pHeapVol);
+  size_t los_sz = LosAllocedSize(pGc->los);
+  info->total = pHeapVol->total_sz + los_sz;
+  info->alloced = alloced + los_sz;
+  info->free = pHeapVol->total_sz - alloced;
+  info->max = pHeapVol->max_sz;
+  info->until_gc = (pHeapVol->growth_limit > alloced) ? (pHeapVol->growth_limit - alloced) : 0;
+  info->until_oome = pHeapVol->max_sz - alloced;
+  pthread_mutex_unlock(&pGc->lock);
+}
+
+void DumpGcStats(Gc_t* pGc) {
+  GcStats_t bStats;
+  GcGetStats(pGc, &bStats);
+  fprintf(stderr, "---------------------------------------------------------------------------\n");
+  fprintf(stderr, " GC statistics\n");
+  fprintf(stderr, "---------------------------------------------------------------------------\n");
+  fprintf(stderr, "collections       : %llu (%llu for allocation)\n",
+          (unsigned long long)bStats.collections, (unsigned long long)bStats.gc_for_alloc);
+  fprintf(stderr, "pause total       : %llu us\n", (unsigned long long)(bStats.total_pause_ns / 1000));
+  fprintf(stderr, "pause max         : %llu us\n", (unsigned long long)(bStats.max_pause_ns / 1000));
+  fprintf(stderr, "pause last        : %llu us\n", (unsigned long long)(bStats.last_pause_ns / 1000));
+  fprintf(stderr, "mark last         : %llu us\n", (unsigned long long)(bStats.last_mark_ns / 1000));
+  fprintf(stderr, "minor collections : %llu\n", (unsigned long long)bStats.minor_collections);
+  fprintf(stderr, "minor pause total : %llu us\n", (unsigned long long)(bStats.total_minor_pause_ns / 1000));
+  fprintf(stderr, "minor pause max   : %llu us\n", (unsigned long long)(bStats.max_minor_pause_ns / 1000));
+  fprintf(stderr, "minor pause last  : %llu us\n", (unsigned long long)(bStats.last_minor_pause_ns / 1000));
+  fprintf(stderr, "promoted          : %llu objects, %llu bytes\n",
+          (unsigned long long)bStats.promoted_objects, (unsigned long long)bStats.promoted_bytes);
+  fprintf(stderr, "pinned            : %llu objects\n", (unsigned long long)bStats.pinned_objects);
+  fprintf(stderr, "compactions       : %llu, %llu objects, %llu bytes\n",
+          (unsigned long long)bStats.compactions, (unsigned long long)bStats.compacted_objects,
+          (unsigned long long)bStats.compacted_bytes);
+  fprintf(stderr, "compaction last   : %llu us, fragmentation %u%% -> %u%%\n",
+          (unsigned long long)(bStats.last_compact_ns / 1000),
+          (unsigned int)bStats.fragmentation_before, (unsigned int)bStats.fragmentation_after);
+  fprintf(stderr, "large objects     : %llu bytes mapped\n", (unsigned long long)LosAllocedSize(pGc->los));
+  fprintf(stderr, "trimmed           : %llu bytes in %llu trims\n",
+          (unsigned long long)bStats.trimmed_bytes, (unsigned long long)bStats.trims);
+  fprintf(stderr, "allocated         : %llu objects, %llu bytes\n",
+          (unsigned long long)bStats.allocated_objects, (unsigned long long)bStats.allocated_bytes);
+  fprintf(stderr, "freed             : %llu objects, %llu bytes\n",
+          (unsigned long long)bStats.freed_objects, (unsigned long long)bStats.freed_bytes);
+}
@@ -0,0 +1,289 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Garbage collector header support
+ *
+ * A mark-sweep collector over the objects of one heap volume, for a single
+ * mutator. One thread at a time allocates and collects, see
+ * GcAttachMutator, so a collection never runs beside the code it collects
+ * for and no thread has to be stopped.
+ * Objects are found through a live bitmap with a bit for every
+ * HEAP_OBJECT_ALIGN bytes of the heap reservation, set when the object is
+ * allocated. The roots are the registered slots and the quick frames of the
+ * managed stack, whose references are given by the OAT GC maps. The
+ * parallel tracer of mark.h marks what they reach in a mark bitmap of the
+ * same shape, and whatever is live but not marked is swept back into the
+ * heap.
+ *
+ * Small objects allocated through a TLAB start in a nursery, blocks carved
+ * from the heap that TLABs bump through. A minor collection copies the
+ * nursery objects still reachable into the heap proper and hands the blocks
+ * out again. It only looks at the roots, the objects it copies and the
+ * cards dirtied by reference stores since the last one, so its pause
+ * follows the survivors and not the heap size. Objects the managed stack
+ * holds may sit in registers the collector cannot update, so they are
+ * pinned and their block stays out of use until a later minor collection
+ * finds it free. A full collection starts with a minor one.
+ *
+ * With the heap daemon running, the pause of a full collection ends once
+ * the marks become the live bits. The daemon frees the dead objects in
+ * batches afterwards, and whoever needs the bitmaps or the freed memory
+ * first helps it finish. When idle it gives the contents of free pages
+ * back to the system while the heap is used below its target utilization.
+ *
+ * Big arrays of primitives are mapped one by one in the large object space
+ * of los.h instead, and unmapped when a full collection finds them dead.
+ * Arrays of references stay in the heap, the card table only covers it.
+ *
+ * GcCompact, or a GcCollect or GcSafepoint after GcRequestCompaction,
+ * compacts the heap: the objects slide down into the free slots of the
+ * lowest runs of their size bracket and the references to them are fixed
+ * up, which empties the runs at the top. Objects the managed stack holds
+ * stay. GcSafepoint also compacts a heap that got fragmented past
+ * GC_COMPACT_FRAGMENTATION, the runtime calls it when compiled code
+ * returns. A collection for an allocation never compacts, the runtime
+ * allocating may hold references the collector does not know of.
+ */
+
+#ifndef CART_GC_H_
+#define CART_GC_H_
+
+#include <pthread.h>
+
+#include "heap.h"
+#include "class.h"
+#include "mark.h"
+#include "mutex.h"
+#include "card_table.h"
+#include "los.h"
+#include "alloc_tracker.h"
+
+struct ManagedStack;
+struct _RuntimeStats;
+struct _GcThreadStats;
+
+#define GC_ROOT_OBJS_SIZE   1024
+#define GC_SWEEP_BATCH      256
+// Bitmap words swept at a time, a claim of the heap daemon covers 512KB
+#define GC_SWEEP_WORDS      1024
+#define GC_NR_ROOTS         16
+// Free space the heap may grow to after a collection, at the least
+#define GC_MIN_FREE         (512 * 1024)
+// Smaller heaps are traced by the collecting thread alone
+#define GC_PARALLEL_MARK_MIN  (4 * 1024 * 1024)
+// Primitive arrays of this size and more go to the large object space
+#define GC_LARGE_OBJECT_MIN (12 * 1024)
+// Bytes of large objects mapped past what was live before a collection
+#define GC_LOS_MIN_FREE     (4 * 1024 * 1024)
+#define GC_NURSERY_SIZE     (512 * 1024)
+#define GC_NURSERY_BLOCK    HEAP_TLAB_SIZE
+// Percent of the committed heap meant to be in use. The heap grows to the
+// live size over it after a collection, and is trimmed when used below it.
+#define GC_TARGET_UTILIZATION 50
+// Percent of the pages in use left unallocated that makes a safepoint
+// compact the heap, unless the last compaction left it as fragmented
+#define GC_COMPACT_FRAGMENTATION 30
+// Idle time of the heap daemon before it trims
+#define GC_TRIM_INTERVAL_MS 1000
+
+// Nursery block states
+enum {
+  kGcBlockFree = 0,
+  kGcBlockUsed,             // handed to a TLAB since the last minor collection
+  kGcBlockPinned,           // holds pinned objects
+};
+
+// The allocation counters and gc_for_alloc are summed from the threads by
+// GcGetStats
+typedef struct {
+  uint64_t  collections;
+  uint64_t  gc_for_alloc;       // collections triggered by a failed allocation
+  uint64_t  last_pause_ns;
+  uint64_t  max_pause_ns;
+  uint64_t  total_pause_ns;
+  uint64_t  last_mark_ns;
+  uint64_t  minor_collections;
+  uint64_t  last_minor_pause_ns;
+  uint64_t  max_minor_pause_ns;
+  uint64_t  total_minor_pause_ns;
+  uint64_t  promoted_objects;
+  uint64_t  promoted_bytes;
+  uint64_t  pinned_objects;
+  uint64_t  compactions;
+  uint64_t  last_compact_ns;
+  uint64_t  total_compact_ns;
+  uint64_t  compacted_objects;
+  uint64_t  compacted_bytes;
+  uint32_t  fragmentation_before;   // percent, around the last compaction
+  uint32_t  fragmentation_after;
+  uint32_t  compact_pending;        // asked for, not done yet
+  uint64_t  trims;
+  uint64_t  trimmed_bytes;
+  uint64_t  allocated_objects;
+  uint64_t  allocated_bytes;
+  uint64_t  freed_objects;
+  uint64_t  freed_bytes;
+} GcStats_t;
+
+// Bytes of the heap and the large objects
+typedef struct PACKED {
+  size_t  total;          // committed or mapped
+  size_t  free;           // committed but not allocated
+  size_t  max;            // reserved
+  size_t  until_gc;       // allocated before a full collection runs
+  size_t  until_oome;
+  size_t  alloced;
+} GcHeapInfo_t;
+
+// Holds a pthread mutex, so it is not PACKED
+typedef struct {
+  HeapVolume_t*               heap_vol;
+  uint8_t*                    base;         // start of the heap reservation
+  size_t                      nr_bits;      // bits of each bitmap
+  uint64_t*                   live_bits;
+  uint64_t*                   mark_bits;
+  MarkPool_t*                 mark_pool;
+  // Objects the roots hold, gathered for the tracer
+  Object_t**                  root_objs;
+  size_t                      nr_root_objs;
+  size_t                      root_objs_cap;
+  // Slots registered by GcAddRoot
+  Object_t***                 roots;
+  size_t                      nr_roots;
+  size_t                      roots_cap;
+  // The thread allocating and collecting, and the quick frames it runs
+  pthread_t                   mutator;
+  bool                        has_mutator;
+  pthread_key_t               mutator_key;
+  const struct ManagedStack*  stack;
+  CardTable_t*                card_table;
+  LargeObjectSpace_t*         los;
+  // Samples the allocations, NULL when they are not
+  AllocTracker_t*             alloc_tracker;
+  size_t                      los_limit;    // mapped bytes before a collection
+  // Young objects, NULL when the heap had no room for a nursery
+  uint8_t*                    nursery;
+  size_t                      nursery_sz;
+  size_t                      nr_blocks;
+  uint8_t*                    block_state;
+  HeapTlab_t**                block_tlab;   // TLAB of the mutator bumping through it
+  size_t                      next_block;
+  // Objects copied or pinned by a minor collection, waiting to be scanned.
+  // Each nursery object is pushed once at most, so it never grows.
+  Object_t**                  grey;
+  size_t                      nr_grey;
+  size_t                      grey_cap;
+  // Live bytes after the last collection
+  size_t                      live_sz;
+  unsigned int                target_utilization;
+  bool                        compact_requested;
+  pthread_mutex_t             lock;
+  // Sweep in progress, the live bits of the last mark are freed from and
+  // cleared for the next one. Words before next are claimed.
+  Mutex_t                     sweep_lock;
+  pthread_cond_t              sweep_cond;   // sweep pending, done or stop
+  uint64_t*                   sweep_bits;   // NULL when there is none
+  size_t                      sweep_words;
+  size_t                      sweep_next;
+  size_t                      sweep_done;
+  size_t                      sweep_freed_objects;
+  size_t                      sweep_freed_bytes;
+  // Heap daemon
+  pthread_t                   daemon;
+  bool                        daemon_running;
+  bool                        daemon_stop;
+  // Allocation counters of the threads, summed on demand. Each has cache
+  // lines of its own, a thread finds its counters again through id.
+  uint32_t                    id;
+  pthread_key_t               stats_key;
+  struct _GcThreadStats*      thread_stats;
+  pthread_mutex_t             stats_lock;
+  GcStats_t                   stats;
+} Gc_t;
+
+Gc_t* AllocGc(HeapVolume_t* pHeapVol);
+void FreeGc(Gc_t* pGc);
+bool GcAddRoot(Gc_t* pGc, Object_t** slot);
+void GcRemoveRoot(Gc_t* pGc, Object_t** slot);
+// The first thread allocating or collecting becomes the mutator, others
+// fail until it detaches or exits. Returns false when another thread is.
+bool GcAttachMutator(Gc_t* pGc);
+void GcDetachMutator(Gc_t* pGc);
+// The stack of the mutator, setting one attaches the caller
+bool GcSetManagedStack(Gc_t* pGc, const struct ManagedStack* stack);
+
+// Objects are zeroed and come from the TLAB when one is given and they fit
+// in it, the TLAB then bumps through a nursery block. A failed allocation
+// collects, then lets the heap grow. NULL as well when the caller is not
+// the mutator.
+Object_t* GcAllocObject(Gc_t* pGc, HeapTlab_t* tlab, Class_t* pClass);
+Array_t* GcAllocArray(Gc_t* pGc, HeapTlab_t* tlab, Class_t* pClass, uint32_t length);
+// Same, an allocation sampled by the tracker is charged to pc instead of
+// the caller
+Object_t* GcAllocObjectAt(Gc_t* pGc, HeapTlab_t* tlab, Class_t* pClass, uintptr_t pc);
+Array_t* GcAllocArrayAt(Gc_t* pGc, HeapTlab_t* tlab, Class_t* pClass, uint32_t length, uintptr_t pc);
+size_t GcObjectSize(const Object_t* obj);
+void GcRevokeTlab(Gc_t* pGc, HeapTlab_t* tlab);
+
+// Must follow every store of a reference into an object
+static inline void GcWriteBarrier(Gc_t* pGc, Object_t* obj) {
+  CardMark(pGc->card_table, obj);
+}
+
+static inline void GcStoreRef(Gc_t* pGc, Object_t* obj, Object_t** slot, Object_t* ref) {
+  *slot = ref;
+  if (ref) {
+    CardMark(pGc->card_table, obj);
+  }
+}
+
+// Returns the bytes freed, 0 when the caller is not the mutator. Objects
+// may move when a compaction was asked for, the caller holds no references
+// but through the roots and the managed stack then.
+size_t GcCollect(Gc_t* pGc);
+size_t GcCollectYoung(Gc_t* pGc);
+// Visits every object reachable from the roots once, for heap verification
+// and dumps. Returns the number visited, 0 when the caller is not the
+// mutator.
+size_t GcVisitReachable(Gc_t* pGc, HeapVisitor_t visit, void* arg);
+
+// Collects and compacts the heap, returns the bytes moved. The caller holds
+// no references but through the roots and the managed stack.
+size_t GcCompact(Gc_t* pGc);
+// The next GcCollect or GcSafepoint compacts, safe to call from any thread
+void GcRequestCompaction(Gc_t* pGc);
+// Called by the mutator where it holds no references but through the roots
+// and the managed stack. Collects and compacts when a compaction was asked
+// for or the heap is too fragmented, returns the bytes moved.
+size_t GcSafepoint(Gc_t* pGc);
+
+// Runs the sweeps and the trims in the background until stopped. FreeGc
+// stops it as well.
+bool GcStartDaemon(Gc_t* pGc);
+void GcStopDaemon(Gc_t* pGc);
+void GcSetTargetUtilization(Gc_t* pGc, unsigned int percent);
+// The tracker stays owned by the caller, NULL stops the sampling
+void GcSetAllocTracker(Gc_t* pGc, AllocTracker_t* tracker);
+// Finishes the sweep and releases every free page, returns the bytes
+size_t GcTrim(Gc_t* pGc);
+void GcGetStats(Gc_t* pGc, GcStats_t* stats);
+// Counters of every thread allocating so far, the exited ones included
+void GcGetRuntimeStats(Gc_t* pGc, struct _RuntimeStats* stats);
+void GcGetHeapInfo(Gc_t* pGc, GcHeapInfo_t* info);
+void DumpGcStats(Gc_t* pGc);
+
+#endif  // CART_GC_H_
@@ -17,67 +17,453 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdarg.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "utils.h"
 #include "hash.h"
 #include "heap.h"
+#include "arena.h"
 
-static size_t _ComputeHashMemSize(size_t nr) {
-  return (sizeof(HashEntry_t) * nr) + sizeof(HashTable_t);
-}
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 //
-// Memory layout of HashTable_t:
+// Open addressing hash table with SwissTable-style control bytes:
 //   ----------------------
-//   Hash table header of 0 --> *Next: Hash table of 1
+//   HashTable_t header (never moves, so callers can hold the pointer)
+//   ----------------------
+//   Control bytes: ctrl[0 .. nr - 1]
 //   ----------------------
 //   Hash entry 0
 //   Hash entry 1
 //   ....
-//   ....
-//   Hash entry n
+//   Hash entry nr - 1
 //   ----------------------
 //
-HashTable_t* AllocHashTable(void* pHeapVol, size_t nr) {
-  uint8_t* p;
-  HashTable_t* pHashTbl;
+// Slots are probed a group (HASH_GROUP_WIDTH control bytes) at a time, and
+// the group index follows a triangular sequence which visits every group once
+// since the number of groups is a power of two.  A full table is rehashed into
+// a larger slot array rather than chained.
+//
+static inline size_t _ComputeHashMemSize(size_t nr) {
+  return (sizeof(int8_t) * nr) + (sizeof(HashEntry_t) * nr);
+}
+
+static inline size_t _ComputeHashCapacity(size_t nr) {
+  // Keep the load factor under 7/8
+  size_t want = nr + (nr / 7) + 1;
+  size_t cap = HASH_GROUP_WIDTH;
+  while (cap < want) {
+    cap <<= 1;
+  }
+  return cap;
+}
+
+static inline size_t _ComputeHashGrowth(size_t cap) {
+  return cap - (cap / 8);
+}
+
+static inline size_t _MixHash(size_t key) {
+  uint64_t h = (uint64_t)key * 0x9E3779B97F4A7C15ULL;
+  h ^= (h >> 32);
+  return (size_t)h;
+}
+
+static inline size_t _HashH1(size_t hash) {
+  return hash >> 7;
+}
+
+static inline int8_t _HashH2(size_t hash) {
+  return (int8_t)(hash & 0x7F);
+}
+
+// Writers are serialized by the owner of the table, but the statistics
+// report reads the shape of the table without that lock
+static inline void _SetShape(size_t* p, size_t v) {
+  __atomic_store_n(p, v, __ATOMIC_RELAXED);
+}
+
+static inline size_t _GetShape(const size_t* p) {
+  return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+// Counters are bumped by concurrent lookups too
+static inline void _CountStat(size_t* p, size_t n) {
+  __atomic_fetch_add(p, n, __ATOMIC_RELAXED);
+}
+
+static inline void _MaxStat(size_t* p, size_t v) {
+  size_t old = __atomic_load_n(p, __ATOMIC_RELAXED);
+  while ((v > old) && !__atomic_compare_exchange_n(p, &old, v, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+#if defined(__SSE2__)
+static inline uint32_t _GroupMatch(const int8_t* ctrl, int8_t h2) {
+  __m128i g = _mm_loadu_si128((const __m128i*)ctrl);
+  return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(h2)));
+}
+
+static inline uint32_t _GroupMatchEmptyOrDeleted(const int8_t* ctrl) {
+  // Both kHashCtrlEmpty and kHashCtrlDeleted have the sign bit set
+  __m128i g = _mm_loadu_si128((const __m128i*)ctrl);
+  return (uint32_t)_mm_movemask_epi8(g);
+}
+#else
+static inline uint32_t _GroupMatch(const int8_t* ctrl, int8_t h2) {
+  uint32_t mask = 0;
+  for (uint32_t i = 0; i < HASH_GROUP_WIDTH; ++i) {
+    if (ctrl[i] == h2) {
+      mask |= (1U << i);
+    }
+  }
+  return mask;
+}
+
+static inline uint32_t _GroupMatchEmptyOrDeleted(const int8_t* ctrl) {
+  uint32_t mask = 0;
+  for (uint32_t i = 0; i < HASH_GROUP_WIDTH; ++i) {
+    if (ctrl[i] < 0) {
+      mask |= (1U << i);
+    }
+  }
+  return mask;
+}
+#endif
+
+static inline uint32_t _GroupMatchEmpty(const int8_t* ctrl) {
+  return _GroupMatch(ctrl, kHashCtrlEmpty);
+}
+
+static inline uint32_t _LowestBit(uint32_t mask) {
+  return (uint32_t)__builtin_ctz(mask);
+}
+
+// Memory of a table comes from its heap volume, its arena or malloc. Arena
+// memory is only given back with the whole arena.
+static void* _AllocHashMem(HashTable_t* tbl, size_t sz) {
+  if (tbl->pHeapVol) {
+    return HeapAlloc((HeapVolume_t*)tbl->pHeapVol, sz);
+  }
+  if (tbl->pArena) {
+    return ArenaAlloc((Arena_t*)tbl->pArena, sz);
+  }
+  return malloc(sz);
+}
+
+static void _FreeHashMem(HashTable_t* tbl, void* p) {
+  if (tbl->pHeapVol) {
+    HeapFree((HeapVolume_t*)tbl->pHeapVol, p);
+  } else if (!tbl->pArena) {
+    free(p);
+  }
+}
+
+static void* _AllocHashSlots(HashTable_t* tbl, size_t nr) {
   size_t sz = _ComputeHashMemSize(nr);
-  HeapVolume_t* ppHeapVol = (HeapVolume_t*)pHeapVol;
+  void* p = _AllocHashMem(tbl, sz);
+  if (!p) {
+    return NULL;
+  }
+  // Every slot starts out empty
+  memset(p, kHashCtrlEmpty, nr);
+  memset((uint8_t*)p + nr, 0, sizeof(HashEntry_t) * nr);
+  return p;
+}
 
-  // Allocate memory and clean up
-  if (ppHeapVol) {
-    p = (uint8_t*)HeapAlloc(ppHeapVol, sz);
-  } else {
-    p = (uint8_t*)malloc(sz);
+static inline void _SetHashSlots(HashTable_t* tbl, void* p, size_t nr) {
+  _SetShape(&tbl->nr, nr);
+  tbl->ctrl = (int8_t*)p;
+  tbl->ptr = (HashEntry_t*)((uint8_t*)p + nr);
+  _SetShape(&tbl->growth_left, _ComputeHashGrowth(nr) - tbl->cnt);
+}
+
+// Groups between the home group of hash and the group of slot
+static inline size_t _ProbeDistance(HashTable_t* tbl, size_t hash, size_t slot) {
+  size_t mask = (tbl->nr / HASH_GROUP_WIDTH) - 1;
+  size_t g = _HashH1(hash) & mask;
+  size_t distance = 0;
+  for (size_t step = 1; g != (slot / HASH_GROUP_WIDTH); ++step) {
+    g = (g + step) & mask;
+    distance++;
+  }
+  return distance;
+}
+
+// Account an entry placed into, or taken out of, slot
+static inline void _AddDisplacement(HashTable_t* tbl, size_t hash, size_t slot) {
+  size_t distance = _ProbeDistance(tbl, hash, slot);
+  if (distance) {
+    _SetShape(&tbl->displaced, tbl->displaced + 1);
+    _SetShape(&tbl->distance, tbl->distance + distance);
+    if (distance > tbl->max_distance) {
+      _SetShape(&tbl->max_distance, distance);
+    }
+  }
+}
+
+static inline void _SubDisplacement(HashTable_t* tbl, size_t hash, size_t slot) {
+  size_t distance = _ProbeDistance(tbl, hash, slot);
+  if (distance) {
+    _SetShape(&tbl->displaced, tbl->displaced - 1);
+    _SetShape(&tbl->distance, tbl->distance - distance);
   }
+}
+
+// Find the first empty or deleted slot on the probe sequence of hash
+static inline size_t _FindInsertSlot(HashTable_t* tbl, size_t hash) {
+  size_t mask = (tbl->nr / HASH_GROUP_WIDTH) - 1;
+  size_t g = _HashH1(hash) & mask;
+  for (size_t step = 1;; ++step) {
+    const int8_t* ctrl = tbl->ctrl + (g * HASH_GROUP_WIDTH);
+    uint32_t m = _GroupMatchEmptyOrDeleted(ctrl);
+    if (m) {
+      return (g * HASH_GROUP_WIDTH) + _LowestBit(m);
+    }
+    g = (g + step) & mask;
+  }
+}
+
+static bool _RehashTable(HashTable_t* tbl, size_t nr) {
+  int8_t* old_ctrl = tbl->ctrl;
+  HashEntry_t* old_ptr = tbl->ptr;
+  size_t old_nr = tbl->nr;
+
+  // Allocate the new slot array
+  void* p = _AllocHashSlots(tbl, nr);
   if (!p) {
+    return false;
+  }
+  _SetHashSlots(tbl, p, nr);
+  _SetShape(&tbl->displaced, 0);
+  _SetShape(&tbl->distance, 0);
+  _SetShape(&tbl->max_distance, 0);
+
+  // Move each live entry over, tombstones are dropped on the floor
+  for (size_t i = 0; i < old_nr; ++i) {
+    if (old_ctrl[i] < 0) {
+      continue;
+    }
+    size_t hash = _MixHash(old_ptr[i].key);
+    size_t slot = _FindInsertSlot(tbl, hash);
+    tbl->ctrl[slot] = _HashH2(hash);
+    tbl->ptr[slot] = old_ptr[i];
+    _AddDisplacement(tbl, hash, slot);
+  }
+
+  // Release the old slots
+  _FreeHashMem(tbl, (void*)old_ctrl);
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Statistics registry                                                       //
+///////////////////////////////////////////////////////////////////////////////
+
+#define HASH_STATS_GROUPS       32
+#define HASH_STATS_SOURCES      8
+#define HASH_STATS_UNNAMED      "unnamed"
+
+typedef struct {
+  HashStatsSource_t fn;
+  void*             arg;
+} HashStatsSourceEntry_t;
+
+// Every thread keeps its tables in a registry of its own, so allocating a
+// table never waits on another thread. A registry outlives its thread since
+// its tables may, and is adopted by the next new thread.
+typedef struct _HashStatsRegistry {
+  pthread_mutex_t               lock;
+  bool                          owned;
+  HashTable_t*                  tables;
+  HashTableInfo_t               retired[HASH_STATS_GROUPS];
+  struct _HashStatsRegistry*    Next;
+} HashStatsRegistry_t;
+
+// The list of registries, locked before any registry lock
+static pthread_mutex_t hash_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static HashStatsRegistry_t* hash_stats_registries = NULL;
+static pthread_once_t hash_stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t hash_stats_key;
+static __thread HashStatsRegistry_t* hash_stats_registry = NULL;
+// Sources are called with it held, and may take the locks of their tables
+static pthread_mutex_t hash_stats_sources_lock = PTHREAD_MUTEX_INITIALIZER;
+static HashStatsSourceEntry_t hash_stats_sources[HASH_STATS_SOURCES];
+
+static void _MergeHashStats(HashStats_t* dst, const HashStats_t* src) {
+  dst->lookups += src->lookups;
+  dst->probes += src->probes;
+  dst->inserts += src->inserts;
+  dst->rejected += src->rejected;
+  dst->removes += src->removes;
+  dst->rehashes += src->rehashes;
+  if (src->max_probe > dst->max_probe) {
+    dst->max_probe = src->max_probe;
+  }
+}
+
+static void _MergeHashTableInfo(HashTableInfo_t* dst, const HashTableInfo_t* src) {
+  dst->tables += src->tables;
+  dst->retired += src->retired;
+  dst->entries += src->entries;
+  dst->capacity += src->capacity;
+  dst->tombstones += src->tombstones;
+  dst->displaced += src->displaced;
+  dst->distance += src->distance;
+  if (src->max_distance > dst->max_distance) {
+    dst->max_distance = src->max_distance;
+  }
+  _MergeHashStats(&dst->stats, &src->stats);
+}
+
+// Find or claim the group of name, the last group takes the overflow
+static HashTableInfo_t* _GetHashStatsGroup(HashTableInfo_t* groups, const char* name) {
+  size_t i;
+  for (i = 0; i < (HASH_STATS_GROUPS - 1); ++i) {
+    if (!groups[i].name) {
+      groups[i].name = name;
+      return groups + i;
+    } else if (!strcmp(groups[i].name, name)) {
+      return groups + i;
+    }
+  }
+  groups[i].name = "others";
+  return groups + i;
+}
+
+static void _ReleaseHashStatsRegistry(void* arg) {
+  HashStatsRegistry_t* r = (HashStatsRegistry_t*)arg;
+  pthread_mutex_lock(&hash_stats_lock);
+  r->owned = false;
+  pthread_mutex_unlock(&hash_stats_lock);
+}
+
+static void _InitHashStatsKey() {
+  if (pthread_key_create(&hash_stats_key, _ReleaseHashStatsRegistry) != 0) {
+    pdbg("Failed to create the statistics key\n");
+  }
+}
+
+// Registry of the calling thread, the global lock is only taken on its first
+// table
+static HashStatsRegistry_t* _GetHashStatsRegistry() {
+  HashStatsRegistry_t* r = hash_stats_registry;
+  if (r) {
+    return r;
+  }
+  pthread_once(&hash_stats_once, _InitHashStatsKey);
+  pthread_mutex_lock(&hash_stats_lock);
+  for (r = hash_stats_registries; r; r = r->Next) {
+    if (!r->owned) {
+      break;
+    }
+  }
+  if (!r) {
+    r = (HashStatsRegistry_t*)calloc(1, sizeof(HashStatsRegistry_t));
+    if (!r) {
+      pthread_mutex_unlock(&hash_stats_lock);
+      pdbg("Out of memory\n");
+      return NULL;
+    }
+    pthread_mutex_init(&r->lock, NULL);
+    r->Next = hash_stats_registries;
+    hash_stats_registries = r;
+  }
+  r->owned = true;
+  pthread_mutex_unlock(&hash_stats_lock);
+  pthread_setspecific(hash_stats_key, (void*)r);
+  hash_stats_registry = r;
+  return r;
+}
+
+// A table the registry could not be allocated for is left out of the report
+static void _RegisterHashTable(HashTable_t* tbl) {
+  HashStatsRegistry_t* r = _GetHashStatsRegistry();
+  if (!r) {
+    return;
+  }
+  pthread_mutex_lock(&r->lock);
+  tbl->registry = r;
+  tbl->Prev = NULL;
+  tbl->Next = r->tables;
+  if (r->tables) {
+    r->tables->Prev = tbl;
+  }
+  r->tables = tbl;
+  pthread_mutex_unlock(&r->lock);
+}
+
+// Unlink the table and keep its counters for the report, the caller holds
+// the lock of its registry
+static void _RetireHashTable(HashTable_t* tbl) {
+  HashStatsRegistry_t* r = tbl->registry;
+  if (tbl->Prev) {
+    tbl->Prev->Next = tbl->Next;
+  } else {
+    r->tables = tbl->Next;
+  }
+  if (tbl->Next) {
+    tbl->Next->Prev = tbl->Prev;
+  }
+  HashTableInfo_t* g = _GetHashStatsGroup(r->retired, tbl->name);
+  g->retired++;
+  _MergeHashStats(&g->stats, &tbl->stats);
+  tbl->registry = NULL;
+}
+
+static void _DeregisterHashTable(HashTable_t* tbl) {
+  HashStatsRegistry_t* r = tbl->registry;
+  if (!r) {
+    return;
+  }
+  pthread_mutex_lock(&r->lock);
+  _RetireHashTable(tbl);
+  pthread_mutex_unlock(&r->lock);
+}
+
+static HashTable_t* _AllocHashTable(void* pHeapVol, void* pArena, size_t nr) {
+  HashTable_t bTmp;
+  size_t cap = _ComputeHashCapacity(nr);
+
+  // Allocate the header
+  memset(&bTmp, 0, sizeof(HashTable_t));
+  bTmp.pHeapVol = pHeapVol;
+  bTmp.pArena = pArena;
+  HashTable_t* pHashTbl = (HashTable_t*)_AllocHashMem(&bTmp, sizeof(HashTable_t));
+  if (!pHashTbl) {
     return NULL;
   }
-  memset(p, 0, sz);
+  *pHashTbl = bTmp;
 
-  // Initialize data
-  pHashTbl = (HashTable_t*)p;
-  pHashTbl->nr = nr;
-  pHashTbl->ptr = (HashEntry_t*)(p + sizeof(HashTable_t));
-  pHashTbl->pHeapVol = ppHeapVol;
+  // Allocate the slots
+  void* p = _AllocHashSlots(pHashTbl, cap);
+  if (!p) {
+    _FreeHashMem(&bTmp, (void*)pHashTbl);
+    return NULL;
+  }
+  _SetHashSlots(pHashTbl, p, cap);
+  pHashTbl->name = HASH_STATS_UNNAMED;
+  _RegisterHashTable(pHashTbl);
 
   // Return
   return pHashTbl;
 }
 
+HashTable_t* AllocHashTable(void* pHeapVol, size_t nr) {
+  return _AllocHashTable(pHeapVol, NULL, nr);
+}
+
+HashTable_t* AllocArenaHashTable(void* pArena, size_t nr) {
+  return _AllocHashTable(NULL, pArena, nr);
+}
+
 void FreeHashTable(HashTable_t* tbl) {
-  HashTable_t* tmp = tbl;
-  // Free the list list
-  while (tbl) {
-    tmp = tbl;
-    tbl = tbl->Next;
-    if (tmp->pHeapVol) {
-      HeapFree((HeapVolume_t*)tmp->pHeapVol, (void*)tmp);
-    } else {
-      free((void*)tmp);
-    }
-  }
+  _DeregisterHashTable(tbl);
+  _FreeHashMem(tbl, (void*)tbl->ctrl);
+  _FreeHashMem(tbl, (void*)tbl);
 }
 
 size_t GenHashKey(const uint8_t* string) {
@@ -101,123 +487,442 @@ size_t GenHashKeyLen(const uint8_t* string, size_t len) {
   return hash;
 }
 
-HashEntry_t* IsHashExist(HashTable_t* tbl, size_t hash) {
-  HashTable_t* p;
-  HashEntry_t* e;
-  // Iterate each table
-  for (p = tbl; p; p = p->Next) {
-    // Iterate each entry
-    for (size_t i = 0; i < p->nr; ++i) {
-      e = p->ptr + i;
-      if (e->key == 0) {
-        // If key == 0, means it's not assigned
-        continue;
-      } else if (e->key == hash) {
-        // If the key matches, return the entry
-        return e;
+#define HASH_PRIME64_1  0x9E3779B185EBCA87ULL
+#define HASH_PRIME64_2  0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME64_3  0x165667B19E3779F9ULL
+#define HASH_PRIME64_4  0x85EBCA77C2B2AE63ULL
+#define HASH_PRIME64_5  0x27D4EB2F165667C5ULL
+
+static inline uint64_t _Rotl64(uint64_t x, uint32_t r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t _Read64(const uint8_t* p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint32_t _Read32(const uint8_t* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint64_t _Hash64Round(uint64_t acc, uint64_t input) {
+  acc += input * HASH_PRIME64_2;
+  acc = _Rotl64(acc, 31);
+  return acc * HASH_PRIME64_1;
+}
+
+static inline uint64_t _Hash64Merge(uint64_t acc, uint64_t val) {
+  acc ^= _Hash64Round(0, val);
+  return (acc * HASH_PRIME64_1) + HASH_PRIME64_4;
+}
+
+// XXH64 (seed 0) of a string of known length, used for descriptor keys
+uint64_t GenHashKey64(const uint8_t* string, size_t len) {
+  const uint8_t* p = string;
+  const uint8_t* end = string + len;
+  uint64_t h;
+
+  if (len >= 32) {
+    uint64_t v1 = HASH_PRIME64_1 + HASH_PRIME64_2;
+    uint64_t v2 = HASH_PRIME64_2;
+    uint64_t v3 = 0;
+    uint64_t v4 = 0 - HASH_PRIME64_1;
+    for (; p + 32 <= end; p += 32) {
+      v1 = _Hash64Round(v1, _Read64(p));
+      v2 = _Hash64Round(v2, _Read64(p + 8));
+      v3 = _Hash64Round(v3, _Read64(p + 16));
+      v4 = _Hash64Round(v4, _Read64(p + 24));
+    }
+    h = _Rotl64(v1, 1) + _Rotl64(v2, 7) + _Rotl64(v3, 12) + _Rotl64(v4, 18);
+    h = _Hash64Merge(h, v1);
+    h = _Hash64Merge(h, v2);
+    h = _Hash64Merge(h, v3);
+    h = _Hash64Merge(h, v4);
+  } else {
+    h = HASH_PRIME64_5;
+  }
+  h += (uint64_t)len;
+
+  for (; p + 8 <= end; p += 8) {
+    h ^= _Hash64Round(0, _Read64(p));
+    h = (_Rotl64(h, 27) * HASH_PRIME64_1) + HASH_PRIME64_4;
+  }
+  if (p + 4 <= end) {
+    h ^= (uint64_t)_Read32(p) * HASH_PRIME64_1;
+    h = (_Rotl64(h, 23) * HASH_PRIME64_2) + HASH_PRIME64_3;
+    p += 4;
+  }
+  for (; p < end; ++p) {
+    h ^= (*p) * HASH_PRIME64_5;
+    h = _Rotl64(h, 11) * HASH_PRIME64_1;
+  }
+
+  // Avalanche
+  h ^= h >> 33;
+  h *= HASH_PRIME64_2;
+  h ^= h >> 29;
+  h *= HASH_PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+static inline bool _IsEntryMatch(HashEntry_t* e, size_t hash, const uint8_t* str, size_t len) {
+  if (e->key != hash) {
+    return false;
+  }
+  // Plain hash keyed lookup, the hash is the identity
+  if (!str) {
+    return true;
+  }
+  // Length first, then the bytes
+  return (e->len == len) && !memcmp(e->str, str, len);
+}
+
+static inline void _CountLookup(HashTable_t* tbl, size_t probes) {
+  _CountStat(&tbl->stats.lookups, 1);
+  _CountStat(&tbl->stats.probes, probes);
+  _MaxStat(&tbl->stats.max_probe, probes);
+}
+
+static HashEntry_t* _FindEntry(HashTable_t* tbl, size_t hash, const uint8_t* str, size_t len) {
+  size_t h = _MixHash(hash);
+  int8_t h2 = _HashH2(h);
+  size_t mask = (tbl->nr / HASH_GROUP_WIDTH) - 1;
+  size_t g = _HashH1(h) & mask;
+  size_t step;
+  // Iterate each group on the probe sequence
+  for (step = 1; step <= (mask + 1); ++step) {
+    const int8_t* ctrl = tbl->ctrl + (g * HASH_GROUP_WIDTH);
+    HashEntry_t* e = tbl->ptr + (g * HASH_GROUP_WIDTH);
+    // Check every slot whose control byte matches
+    for (uint32_t m = _GroupMatch(ctrl, h2); m; m &= (m - 1)) {
+      uint32_t i = _LowestBit(m);
+      if (_IsEntryMatch(e + i, hash, str, len)) {
+        _CountLookup(tbl, step);
+        return e + i;
       }
     }
+    // An empty slot terminates the probe sequence
+    if (_GroupMatchEmpty(ctrl)) {
+      break;
+    }
+    g = (g + step) & mask;
   }
   // Doesn't exist, return NULL
+  _CountLookup(tbl, (step > (mask + 1)) ? (mask + 1) : step);
   return NULL;
 }
 
-HashEntry_t* InsertHashEntry(HashTable_t* tbl, size_t hash, void* ptr) {
-  HashTable_t* p;
-  HashEntry_t* e = IsHashExist(tbl, hash);
-  bool found = false;
+static HashEntry_t* _InsertEntry(HashTable_t* tbl, size_t hash, const uint8_t* str, size_t len, void* ptr) {
+  HashEntry_t* e = _FindEntry(tbl, hash, str, len);
   // If it exists, return NULL
   if (e != NULL) {
+    _CountStat(&tbl->stats.rejected, 1);
     return NULL;
   }
- Again:
-  // Iterate each table
-  for (p = tbl; p; p = p->Next) {
-    // Iterate each entry
-    for (size_t i = 0; i < p->nr; ++i) {
-      e = p->ptr + i;
-      if (e->key == 0) {
-        // If key == 0, means it's available
-        found = true;
-        p->cnt++;
-        break;
-      }
-    }
-  }
-  // Check
-  if (found == false) {
-    pdbg("Extending hash table\n");
-    // Iterate to the last one
-    for (p = tbl; p->Next; p = p->Next) {}
-    // Allocate a new one and append it
-    if (p->pHeapVol) {
-      p->Next = AllocHashTable(p->pHeapVol, p->nr);
-    } else {
-      p->Next = AllocHashTable(NULL, p->nr);
+  size_t h = _MixHash(hash);
+  size_t slot = _FindInsertSlot(tbl, h);
+  // Only reusing a tombstone is free, an empty slot needs growth budget
+  if ((tbl->ctrl[slot] == kHashCtrlEmpty) && (tbl->growth_left == 0)) {
+    // Rehash in place if most of the used slots are tombstones
+    size_t nr = tbl->nr;
+    if ((tbl->cnt * 32) > (nr * 25)) {
+      nr <<= 1;
     }
-    if (!p->Next) {
+    pdbg("Rehashing hash table to %u slots\n", (unsigned int)nr);
+    if (_RehashTable(tbl, nr) == false) {
       pdbg("Out of memory\n");
       return NULL;
     }
-    goto Again;
+    _CountStat(&tbl->stats.rehashes, 1);
+    slot = _FindInsertSlot(tbl, h);
   }
   // Insert
+  if (tbl->ctrl[slot] == kHashCtrlEmpty) {
+    _SetShape(&tbl->growth_left, tbl->growth_left - 1);
+  }
+  tbl->ctrl[slot] = _HashH2(h);
+  _SetShape(&tbl->cnt, tbl->cnt + 1);
+  _AddDisplacement(tbl, h, slot);
+  _CountStat(&tbl->stats.inserts, 1);
+  e = tbl->ptr + slot;
   e->key = hash;
   e->ptr = ptr;
+  e->str = str;
+  e->len = len;
   // Return
   return e;
 }
 
+HashEntry_t* IsHashExist(HashTable_t* tbl, size_t hash) {
+  return _FindEntry(tbl, hash, NULL, 0);
+}
+
+HashEntry_t* InsertHashEntry(HashTable_t* tbl, size_t hash, void* ptr) {
+  return _InsertEntry(tbl, hash, NULL, 0, ptr);
+}
+
+HashEntry_t* IsHashStrExist(HashTable_t* tbl, size_t hash, const uint8_t* str, size_t len) {
+  return _FindEntry(tbl, hash, str, len);
+}
+
+HashEntry_t* InsertHashStrEntry(HashTable_t* tbl, size_t hash, const uint8_t* str, size_t len, void* ptr) {
+  return _InsertEntry(tbl, hash, str, len, ptr);
+}
+
+static void* _RemoveEntry(HashTable_t* tbl, HashEntry_t* e) {
+  // Doesn't exist, return NULL
+  if (e == NULL) {
+    return NULL;
+  }
+  size_t slot = e - tbl->ptr;
+  const int8_t* ctrl = tbl->ctrl + (slot - (slot % HASH_GROUP_WIDTH));
+  void* ptr = e->ptr;
+  // If the group still has an empty slot, no probe sequence ever went past
+  // it, so the slot can become empty instead of a tombstone
+  if (_GroupMatchEmpty(ctrl)) {
+    tbl->ctrl[slot] = kHashCtrlEmpty;
+    _SetShape(&tbl->growth_left, tbl->growth_left + 1);
+  } else {
+    tbl->ctrl[slot] = kHashCtrlDeleted;
+  }
+  _SetShape(&tbl->cnt, tbl->cnt - 1);
+  _SubDisplacement(tbl, _MixHash(e->key), slot);
+  _CountStat(&tbl->stats.removes, 1);
+  e->key = 0;
+  e->ptr = (void*)0;
+  e->str = NULL;
+  e->len = 0;
+  return ptr;
+}
+
 void* RemoveHashEntry(HashTable_t* tbl, size_t hash) {
-  HashTable_t* p;
-  HashEntry_t* e;
-  // Iterate each table
-  for (p = tbl; p; p = p->Next) {
-    // Iterate each entry
-    for (size_t i = 0; i < p->nr; ++i) {
-      e = p->ptr + i;
-      if (e->key == 0) {
-        // If key == 0, means it's not assigned
-        continue;
-      } else if (e->key == hash) {
-        // If the key matches, erase the entry
-        p->cnt--;
-        e->key = 0;
-        e->ptr = (void*)0;
+  return _RemoveEntry(tbl, IsHashExist(tbl, hash));
+}
+
+void* RemoveHashStrEntry(HashTable_t* tbl, size_t hash, const uint8_t* str, size_t len) {
+  return _RemoveEntry(tbl, IsHashStrExist(tbl, hash, str, len));
+}
+
+// Tables living in a heap volume or an arena are gone with it, whether or
+// not they were freed, so retire them before the memory is released
+static void _RetireHashTablesOf(void* pHeapVol, void* pArena) {
+  pthread_mutex_lock(&hash_stats_lock);
+  for (HashStatsRegistry_t* r = hash_stats_registries; r; r = r->Next) {
+    pthread_mutex_lock(&r->lock);
+    HashTable_t* tbl = r->tables;
+    while (tbl) {
+      HashTable_t* next = tbl->Next;
+      if ((pHeapVol && (tbl->pHeapVol == pHeapVol)) || (pArena && (tbl->pArena == pArena))) {
+        _RetireHashTable(tbl);
       }
+      tbl = next;
     }
+    pthread_mutex_unlock(&r->lock);
   }
-  // Doesn't exist, return NULL
-  return NULL;
+  pthread_mutex_unlock(&hash_stats_lock);
+}
+
+void RetireHashTablesOfHeap(void* pHeapVol) {
+  _RetireHashTablesOf(pHeapVol, NULL);
+}
+
+void RetireHashTablesOfArena(void* pArena) {
+  _RetireHashTablesOf(NULL, pArena);
+}
+
+void MoveHashTablesOfArena(void* pFrom, void* pTo) {
+  pthread_mutex_lock(&hash_stats_lock);
+  for (HashStatsRegistry_t* r = hash_stats_registries; r; r = r->Next) {
+    pthread_mutex_lock(&r->lock);
+    for (HashTable_t* tbl = r->tables; tbl; tbl = tbl->Next) {
+      if (tbl->pArena == pFrom) {
+        tbl->pArena = pTo;
+      }
+    }
+    pthread_mutex_unlock(&r->lock);
+  }
+  pthread_mutex_unlock(&hash_stats_lock);
+}
+
+void SetHashTableName(HashTable_t* tbl, const char* name) {
+  HashStatsRegistry_t* r = tbl->registry;
+  if (r) {
+    pthread_mutex_lock(&r->lock);
+  }
+  tbl->name = name ? name : HASH_STATS_UNNAMED;
+  if (r) {
+    pthread_mutex_unlock(&r->lock);
+  }
+}
+
+static void _LoadHashStats(HashStats_t* dst, const HashStats_t* src) {
+  dst->lookups = __atomic_load_n(&src->lookups, __ATOMIC_RELAXED);
+  dst->probes = __atomic_load_n(&src->probes, __ATOMIC_RELAXED);
+  dst->max_probe = __atomic_load_n(&src->max_probe, __ATOMIC_RELAXED);
+  dst->inserts = __atomic_load_n(&src->inserts, __ATOMIC_RELAXED);
+  dst->rejected = __atomic_load_n(&src->rejected, __ATOMIC_RELAXED);
+  dst->removes = __atomic_load_n(&src->removes, __ATOMIC_RELAXED);
+  dst->rehashes = __atomic_load_n(&src->rehashes, __ATOMIC_RELAXED);
+}
+
+// Fill in the shape of the table from what the writers keep up to date, the
+// slots are never touched since a rehash may free them under us. The fields
+// are read one by one, so a snapshot taken during an insert may be off by it.
+void GetHashTableInfo(HashTable_t* tbl, HashTableInfo_t* info) {
+  memset(info, 0, sizeof(HashTableInfo_t));
+  info->name = tbl->name;
+  info->tables = 1;
+  size_t nr = _GetShape(&tbl->nr);
+  size_t cnt = _GetShape(&tbl->cnt);
+  size_t growth_left = _GetShape(&tbl->growth_left);
+  info->capacity = nr;
+  info->entries = cnt;
+  // Taking an empty slot spends growth budget, a tombstone never gives it back
+  size_t used = _ComputeHashGrowth(nr) - growth_left;
+  info->tombstones = (used > cnt) ? (used - cnt) : 0;
+  info->displaced = _GetShape(&tbl->displaced);
+  info->distance = _GetShape(&tbl->distance);
+  info->max_distance = _GetShape(&tbl->max_distance);
+  _LoadHashStats(&info->stats, &tbl->stats);
+}
+
+bool RegisterHashStatsSource(HashStatsSource_t fn, void* arg) {
+  bool ret = false;
+  pthread_mutex_lock(&hash_stats_sources_lock);
+  for (size_t i = 0; i < HASH_STATS_SOURCES; ++i) {
+    if (!hash_stats_sources[i].fn) {
+      hash_stats_sources[i].fn = fn;
+      hash_stats_sources[i].arg = arg;
+      ret = true;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&hash_stats_sources_lock);
+  return ret;
+}
+
+void UnregisterHashStatsSource(HashStatsSource_t fn, void* arg) {
+  pthread_mutex_lock(&hash_stats_sources_lock);
+  for (size_t i = 0; i < HASH_STATS_SOURCES; ++i) {
+    if ((hash_stats_sources[i].fn == fn) && (hash_stats_sources[i].arg == arg)) {
+      hash_stats_sources[i].fn = NULL;
+      hash_stats_sources[i].arg = NULL;
+    }
+  }
+  pthread_mutex_unlock(&hash_stats_sources_lock);
+}
+
+static size_t _AppendStats(char* buf, size_t size, size_t pos, const char* fmt, ...) {
+  if (pos >= size) {
+    return pos;
+  }
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf(buf + pos, size - pos, fmt, args);
+  va_end(args);
+  return (n < 0) ? pos : pos + n;
+}
+
+// Aggregate report of every table, grouped by name, one line per group
+size_t FormatHashTableStats(char* buf, size_t size) {
+  HashTableInfo_t groups[HASH_STATS_GROUPS];
+  HashTableInfo_t info;
+  size_t pos = 0;
+
+  memset(groups, 0, sizeof(groups));
+  pthread_mutex_lock(&hash_stats_lock);
+  for (HashStatsRegistry_t* r = hash_stats_registries; r; r = r->Next) {
+    // Holding the registry keeps its tables from being freed
+    pthread_mutex_lock(&r->lock);
+    for (HashTable_t* tbl = r->tables; tbl; tbl = tbl->Next) {
+      GetHashTableInfo(tbl, &info);
+      _MergeHashTableInfo(_GetHashStatsGroup(groups, tbl->name), &info);
+    }
+    for (size_t i = 0; i < HASH_STATS_GROUPS; ++i) {
+      if (r->retired[i].name) {
+        _MergeHashTableInfo(_GetHashStatsGroup(groups, r->retired[i].name), r->retired + i);
+      }
+    }
+    pthread_mutex_unlock(&r->lock);
+  }
+  pthread_mutex_unlock(&hash_stats_lock);
+  pthread_mutex_lock(&hash_stats_sources_lock);
+  for (size_t i = 0; i < HASH_STATS_SOURCES; ++i) {
+    if (hash_stats_sources[i].fn) {
+      memset(&info, 0, sizeof(info));
+      hash_stats_sources[i].fn(hash_stats_sources[i].arg, &info);
+      if (info.name) {
+        _MergeHashTableInfo(_GetHashStatsGroup(groups, info.name), &info);
+      }
+    }
+  }
+  pthread_mutex_unlock(&hash_stats_sources_lock);
+
+  if (size) {
+    buf[0] = '\0';
+  }
+  pos = _AppendStats(buf, size, pos, "%-24s %6s %6s %8s %8s %5s %6s %6s %6s %4s %10s %6s %5s %8s %8s\n",
+                     "table", "live", "freed", "entries", "slots", "load", "tombs", "displ",
+                     "avgdis", "max", "lookups", "avgprb", "max", "rejected", "rehashes");
+  for (size_t i = 0; (i < HASH_STATS_GROUPS) && groups[i].name; ++i) {
+    HashTableInfo_t* g = groups + i;
+    pos = _AppendStats(buf, size, pos, "%-24s %6u %6u %8u %8u %4u%% %6u %6u %6.2f %4u %10lu %6.2f %5u %8u %8u\n",
+                       g->name,
+                       (unsigned int)g->tables,
+                       (unsigned int)g->retired,
+                       (unsigned int)g->entries,
+                       (unsigned int)g->capacity,
+                       (unsigned int)(g->capacity ? (g->entries * 100) / g->capacity : 0),
+                       (unsigned int)g->tombstones,
+                       (unsigned int)g->displaced,
+                       g->entries ? (double)g->distance / (double)g->entries : 0.0,
+                       (unsigned int)g->max_distance,
+                       (unsigned long)g->stats.lookups,
+                       g->stats.lookups ? (double)g->stats.probes / (double)g->stats.lookups : 0.0,
+                       (unsigned int)g->stats.max_probe,
+                       (unsigned int)g->stats.rejected,
+                       (unsigned int)g->stats.rehashes);
+  }
+  return pos;
+}
+
+void DumpHashTableStats() {
+  char buf[HASH_STATS_GROUPS * 160];
+  FormatHashTableStats(buf, sizeof(buf));
+  fprintf(stderr, "---------------------------------------------------------------------------\n");
+  fprintf(stderr, " HASH table statistics\n");
+  fprintf(stderr, "---------------------------------------------------------------------------\n");
+  fprintf(stderr, "%s", buf);
 }
 
 #ifdef CART_DEBUG
 void DumpHashTable(HashTable_t* tbl) {
-  HashTable_t* p;
   HashEntry_t* e;
-  uint32_t idx = 0;
-  uint32_t cel;
   fprintf(stderr, "---------------------------------------------------------------------------\n");
   fprintf(stderr, " HASH table dumping\n");
   fprintf(stderr, "---------------------------------------------------------------------------\n");
-  // Iterate each table
-  for (p = tbl; p; p = p->Next, ++idx) {
-    fprintf(stderr, "Chaining No.          : %d\n", idx);
-    fprintf(stderr, "Number of amount cell : %u\n", (unsigned int)p->nr);
-    fprintf(stderr, "Number of used   cell : %u\n", (unsigned int)p->cnt);
-    // Iterate each entry
-    cel = 0;
-    for (size_t i = 0; i < p->nr; ++i, ++cel) {
-      e = p->ptr + i;
-      if (e->key == 0) {
-        // If key == 0, means it's not assigned
-        continue;
-      } else {
-        fprintf(stderr, " [%d][%d] Key[0x%8.8X] = %p\n", idx, cel,
-                (unsigned int)e->key,
-                e->ptr);
-      }
+  fprintf(stderr, "Number of amount cell : %u\n", (unsigned int)tbl->nr);
+  fprintf(stderr, "Number of used   cell : %u\n", (unsigned int)tbl->cnt);
+  fprintf(stderr, "Growth left           : %u\n", (unsigned int)tbl->growth_left);
+  // Iterate each entry
+  for (size_t i = 0; i < tbl->nr; ++i) {
+    e = tbl->ptr + i;
+    if (tbl->ctrl[i] < 0) {
+      // Empty or deleted
+      continue;
     }
+    fprintf(stderr, " [%u][%u] Key[0x%8.8X] = %p \"%.*s\"\n",
+            (unsigned int)(i / HASH_GROUP_WIDTH),
+            (unsigned int)(i % HASH_GROUP_WIDTH),
+            (unsigned int)e->key,
+            e->ptr,
+            (int)e->len,
+            e->str ? (const char*)e->str : "");
   }
   fprintf(stderr, "---------------------------------------------------------------------------\n");
 }
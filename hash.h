@@ -23,26 +23,110 @@
 
 #include "macros.h"
 
+// Control byte of each slot: kHashCtrlEmpty/kHashCtrlDeleted, or the low 7
+// bits (H2) of the mixed hash when the slot is in use
+#define kHashCtrlEmpty      ((int8_t)-128)
+#define kHashCtrlDeleted    ((int8_t)-2)
+#define HASH_GROUP_WIDTH    16
+
 typedef struct PACKED {
-  size_t key;
-  void* ptr;
+  size_t          key;
+  void*           ptr;
+  // Full key of string keyed entries, NULL for plain hash keyed entries
+  const uint8_t*  str;
+  size_t          len;
 } HashEntry_t;
 
-typedef struct PACKED _HashTable {
-  struct _HashTable *Next;
-  size_t            nr;
-  size_t            cnt;
-  void*             pHeapVol;
-  HashEntry_t*      ptr;
+// Counters kept by every table, cheap enough to be always on. They are bumped
+// with relaxed atomics since lookups run concurrently, so not PACKED.
+typedef struct {
+  size_t  lookups;      // key searches, including the one done by inserts
+  size_t  probes;       // groups visited by those searches
+  size_t  max_probe;    // most groups visited by a single search
+  size_t  inserts;
+  size_t  rejected;     // inserts refused because the key already existed
+  size_t  removes;
+  size_t  rehashes;
+} HashStats_t;
+
+struct _HashStatsRegistry;
+
+// Not PACKED, the statistics are read without the owner's lock, so the
+// shape fields are stored atomically by the writers
+typedef struct _HashTable {
+  size_t              nr;
+  size_t              cnt;
+  size_t              growth_left;
+  void*               pHeapVol;
+  void*               pArena;
+  int8_t*             ctrl;
+  HashEntry_t*        ptr;
+  // Entries outside of their home group and their total probe distance,
+  // kept up to date by the writers. The maximum is since the last rehash.
+  size_t              displaced;
+  size_t              distance;
+  size_t              max_distance;
+  // Statistics, tables with the same name are reported together
+  const char*         name;
+  HashStats_t         stats;
+  struct _HashStatsRegistry* registry;
+  struct _HashTable*  Prev;
+  struct _HashTable*  Next;
 } HashTable_t;
 
+// Shape and counters of one table, or of all tables sharing a name, not
+// PACKED as it embeds HashStats_t
+typedef struct {
+  const char*   name;
+  size_t        tables;       // live tables
+  size_t        retired;      // freed tables, their counters are included
+  size_t        entries;
+  size_t        capacity;
+  size_t        tombstones;
+  size_t        displaced;    // entries stored outside of their home group
+  size_t        distance;     // sum of the probe distances of all entries
+  size_t        max_distance;
+  HashStats_t   stats;
+} HashTableInfo_t;
+
+// Tables that are not HashTable_t can add themselves to the report
+typedef void (*HashStatsSource_t)(void* arg, HashTableInfo_t* info);
+
 HashTable_t* AllocHashTable(void* pHeapVol, size_t nr);
+HashTable_t* AllocArenaHashTable(void* pArena, size_t nr);
 void FreeHashTable(HashTable_t* tbl);
 size_t GenHashKey(const uint8_t* string);
 size_t GenHashKeyLen(const uint8_t* string, size_t len);
+uint64_t GenHashKey64(const uint8_t* string, size_t len);
 HashEntry_t* IsHashExist(HashTable_t* tbl, size_t hash);
 HashEntry_t* InsertHashEntry(HashTable_t* tbl, size_t hash, void* ptr);
+// Removes the first entry with this hash, for tables keyed by the hash alone
 void* RemoveHashEntry(HashTable_t* tbl, size_t hash);
+HashEntry_t* IsHashStrExist(HashTable_t* tbl, size_t hash, const uint8_t* str, size_t len);
+HashEntry_t* InsertHashStrEntry(HashTable_t* tbl, size_t hash, const uint8_t* str, size_t len, void* ptr);
+// Removes the entry of this full key, others sharing its hash stay
+void* RemoveHashStrEntry(HashTable_t* tbl, size_t hash, const uint8_t* str, size_t len);
+
+void RetireHashTablesOfHeap(void* pHeapVol);
+void RetireHashTablesOfArena(void* pArena);
+// Tables of pFrom grow into pTo from now on, its memory having been handed over
+void MoveHashTablesOfArena(void* pFrom, void* pTo);
+void SetHashTableName(HashTable_t* tbl, const char* name);
+// Safe without the owner's lock as long as the table is not freed
+void GetHashTableInfo(HashTable_t* tbl, HashTableInfo_t* info);
+bool RegisterHashStatsSource(HashStatsSource_t fn, void* arg);
+void UnregisterHashStatsSource(HashStatsSource_t fn, void* arg);
+size_t FormatHashTableStats(char* buf, size_t size);
+void DumpHashTableStats();
+
+// Fold a 64-bit string hash into a table key
+static inline size_t HashKeyOf64(uint64_t hash) {
+#ifdef __LP64__
+  return (size_t)hash;
+#else
+  return (size_t)(hash ^ (hash >> 32));
+#endif
+}
 
 #ifdef CART_DEBUG
 void DumpHashTable(HashTable_t* tbl);
@@ -18,343 +18,747 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 
 #include "utils.h"
 #include "hash.h"
 #include "heap.h"
+#include "bitmap.h"
 #include "cart.h"
 
-static inline size_t _ComputeBitmapSize(size_t sz) {
-  return ((sz / SZ_SLOT) / BITS_PER_BYTE);
-}
-
-static inline size_t _ComputeEntryMemSize(size_t mem_sz) {
-  return sizeof(HeapVolume_t) + sizeof(HeapEntry_t) + _ComputeBitmapSize(mem_sz) + mem_sz;
-}
-
-static inline size_t _ComputeFundmantalMemSize(size_t mem_sz) {
-  return sizeof(HeapVolume_t) + _ComputeEntryMemSize(mem_sz);
-}
-
-static inline void _FillHeapEntry(HeapEntry_t* pHeapEnt, HashTable_t* pHashTable, size_t sz) {
-  uint8_t* p = (uint8_t*)pHeapEnt;
-  pHeapEnt->Next = NULL;
-  pHeapEnt->alloced_sz = 0;
-  pHeapEnt->avail_sz = sz;
-  pHeapEnt->bitmap_sz = _ComputeBitmapSize(sz);
-  pHeapEnt->bitmap = p + sizeof(HeapEntry_t);
-  pHeapEnt->ptr = pHeapEnt->bitmap + pHeapEnt->bitmap_sz;
-  pHeapEnt->records = pHashTable;
-}
-
 //
 // Memory layout of HeapVolume_t:
 //   ----------------------
-//   Heap volume header
+//   Heap volume header, with the list of runs of each size bracket
 //   ----------------------
-//   Heap entry header of 0 --> *Next: Heap entry of 1
+//   Heap entry header
+//   page bitmap, one bit per page in use
+//   page map, one byte per page
 //   ----------------------
-//   bitmap start
-//   ....
-//   ....
-//   bitmap end
+//
+//   Pages of the heap entry, one reservation of max_sz bytes:
 //   ----------------------
-//   memory pool start
-//   ....
-//   ....
-//   memory pool end
+//   run: header | bitmap | slot 0 | slot 1 | ... (1 or more pages)
+//   ----------------------
+//   large allocation (1 or more pages)
 //   ----------------------
+//   TLAB chunk: header | objects bumped by one thread (1 or more pages)
+//   ----------------------
+//   free page
+//   ....
+//   ----------------------  <-- committed up to here, grown by doubling
+//   reserved, PROT_NONE
+//   ----------------------  <-- max_sz
+//
+// Requests up to HEAP_MAX_BRACKET_SIZE are rounded up to a size bracket and
+// served from a run of that bracket: finding a free slot only looks at the
+// run's own bitmap, so it costs the same whatever the size of the heap.
+// Larger requests take whole pages.
+//
+// Threads allocating objects do it from their TLAB chunk and only come here
+// to get a new one. All of the functions below run under pHeapVol->lock.
 //
-HeapVolume_t* AllocHeapVolume(size_t sz) {
-  size_t req_sz;
-  HeapVolume_t* pHeapVol;
-  uint8_t* p;
-  HashTable_t* records;
 
-  // Align to the page boundary
-  if (sz % PAGE_SIZE) {
-    sz = ((sz / PAGE_SIZE) + 1) * PAGE_SIZE;
-    pdbg("Align heap volume size to %u\n", (unsigned int)sz);
+#define BITS_PER_WORD         32
+
+static inline size_t _BracketIndex(size_t sz) {
+  if (sz <= (HEAP_NR_SMALL_BRACKETS * HEAP_SMALL_BRACKET_STEP)) {
+    return (sz <= HEAP_SMALL_BRACKET_STEP) ? 0 : ((sz - 1) / HEAP_SMALL_BRACKET_STEP);
+  } else if (sz <= (HEAP_MAX_BRACKET_SIZE / 2)) {
+    return HEAP_NR_SMALL_BRACKETS;
   }
+  return HEAP_NR_SMALL_BRACKETS + 1;
+}
 
-  // Compute the requesting memory size, and then clean up
-  req_sz = _ComputeFundmantalMemSize(sz);
-  p = (uint8_t*)malloc(req_sz);
-  if (!p) {
-    pdbg("Out of memory\n");
-    return NULL;
+static inline size_t _BracketSize(size_t idx) {
+  if (idx < HEAP_NR_SMALL_BRACKETS) {
+    return (idx + 1) * HEAP_SMALL_BRACKET_STEP;
+  }
+  return (HEAP_MAX_BRACKET_SIZE / 2) << (idx - HEAP_NR_SMALL_BRACKETS);
+}
+
+// Runs are sized to hold about 32 slots
+static inline size_t _BracketPages(size_t idx) {
+  size_t pages = ((_BracketSize(idx) * 32) + PAGE_SIZE - 1) / PAGE_SIZE;
+  return pages ? pages : 1;
+}
+
+static inline size_t _ComputeRunHdrSize(size_t nr_slots) {
+  size_t sz = sizeof(HeapRun_t) + (((nr_slots + BITS_PER_WORD - 1) / BITS_PER_WORD) * sizeof(uint32_t));
+  return (sz + SZ_SLOT - 1) & ~(size_t)(SZ_SLOT - 1);
+}
+
+static inline size_t _ComputePages(size_t sz) {
+  return (sz + PAGE_SIZE - 1) / PAGE_SIZE;
+}
+
+static inline uint8_t* _PageAddr(HeapEntry_t* e, size_t page) {
+  return (uint8_t*)e->ptr + (page * PAGE_SIZE);
+}
+
+static inline bool _IsInEntry(HeapEntry_t* e, const void* ptr) {
+  return ((const uint8_t*)ptr >= (uint8_t*)e->ptr) &&
+         ((const uint8_t*)ptr < _PageAddr(e, e->nr_pages));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Heap entries and pages                                                    //
+///////////////////////////////////////////////////////////////////////////////
+
+static inline size_t _ComputeEntryHdrSize() {
+  return (sizeof(HeapEntry_t) + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+}
+
+// Volumes get huge pages when set
+static bool heap_huge_pages = false;
+
+// Reserve nr_pages of address space starting on a huge page boundary, so
+// whole huge pages fit in it, and ask for them. Falls back on small pages.
+static void* _ReserveHugePages(size_t nr_pages, bool* huge) {
+  size_t sz = nr_pages * PAGE_SIZE;
+  *huge = false;
+  if (IsHugePageEnabled()) {
+    uint8_t* p = (uint8_t*)mmap(NULL, sz + HUGE_PAGE_SIZE, PROT_NONE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p != MAP_FAILED) {
+      uint8_t* pages = (uint8_t*)(((uintptr_t)p + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+      if (pages > p) {
+        munmap(p, pages - p);
+      }
+      munmap(pages + sz, (p + HUGE_PAGE_SIZE) - pages);
+      if (madvise(pages, sz, MADV_HUGEPAGE) == 0) {
+        *huge = true;
+        return (void*)pages;
+      }
+      munmap(pages, sz);
+    }
   }
-  memset(p, 0, req_sz);
-  pHeapVol = (HeapVolume_t*)p;
+  pdbg("No huge pages for the heap, using %u byte pages\n", (unsigned int)PAGE_SIZE);
+  return mmap(NULL, sz, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+}
 
-  // Allocate hash table
-  records = AllocHashTable(NULL, NR_HASH_TBL);
-  if (!records) {
+// Reserve nr_pages of address space, the page bitmap and the page map cover
+// all of it. Nothing is committed yet.
+static HeapEntry_t* _AllocHeapEntry(size_t nr_pages) {
+  // Header, page bitmap, page map
+  size_t bits_sz = BitmapWords(nr_pages) * sizeof(uint64_t);
+  size_t hdr_sz = _ComputeEntryHdrSize() + bits_sz + nr_pages;
+  HeapEntry_t* e = (HeapEntry_t*)malloc(hdr_sz);
+  if (!e) {
     pdbg("Out of memory\n");
-    free(p);
     return NULL;
   }
-
+  memset(e, 0, hdr_sz);
+  bool huge = false;
+  void* pages = heap_huge_pages ? _ReserveHugePages(nr_pages, &huge) :
+                mmap(NULL, nr_pages * PAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (pages == MAP_FAILED) {
+    pdbg("Failed to reserve %u pages for the heap\n", (unsigned int)nr_pages);
+    free((void*)e);
+    return NULL;
+  }
+  e->ptr = pages;
   // Initialize data
-  pHeapVol->nr = 1;
-  pHeapVol->total_sz = sz;
-  pHeapVol->ptr = (HeapEntry_t*)(p + sizeof(HeapVolume_t));
-  _FillHeapEntry(pHeapVol->ptr, records, sz);
+  e->page_bits = (uint64_t*)((uint8_t*)e + _ComputeEntryHdrSize());
+  e->page_map = (uint8_t*)e->page_bits + bits_sz;
+  e->nr_pages = nr_pages;
+  e->nr_align = huge ? (HUGE_PAGE_SIZE / PAGE_SIZE) : 1;
+  return e;
+}
 
-  // Succeed and return
-  return pHeapVol;
+static void _FreeHeapEntry(HeapEntry_t* e) {
+  munmap(e->ptr, e->nr_pages * PAGE_SIZE);
+  free((void*)e);
 }
 
-void FreeHeapVolume(HeapVolume_t* pHeapVol) {
-  HeapEntry_t* pHeapEnt;
-  HeapEntry_t* tmpHeapEnt;
-
-  // Free each subsequent HeapEntry_t, but not the first one
-  for (pHeapEnt = pHeapVol->ptr->Next; pHeapEnt;) {
-    tmpHeapEnt = pHeapEnt;
-    pHeapEnt = pHeapEnt->Next;
-    // Free the hash table of records
-    FreeHashTable(tmpHeapEnt->records);
-    // Free the entry
-    free((void*)tmpHeapEnt);
-  }
-  // Free the first HeapEntry_t and the HeapVolume header
-  FreeHashTable(pHeapVol->ptr->records);
-  free((void*)pHeapVol);
+// Make the pages up to nr_committed usable, rounded up to a whole huge page
+// while the growth limit allows
+static bool _CommitPages(HeapVolume_t* pHeapVol, size_t nr_committed) {
+  HeapEntry_t* e = pHeapVol->ptr;
+  size_t nr_aligned = ((nr_committed + e->nr_align - 1) / e->nr_align) * e->nr_align;
+  if (nr_aligned > (pHeapVol->growth_limit / PAGE_SIZE)) {
+    nr_aligned = pHeapVol->growth_limit / PAGE_SIZE;
+  }
+  if (nr_aligned > nr_committed) {
+    nr_committed = nr_aligned;
+  }
+  size_t nr = nr_committed - e->nr_committed;
+  if (mprotect(_PageAddr(e, e->nr_committed), nr * PAGE_SIZE, PROT_READ | PROT_WRITE) != 0) {
+    pdbg("Failed to commit %u heap pages\n", (unsigned int)nr);
+    return false;
+  }
+  e->nr_committed = nr_committed;
+  e->avail_sz = nr_committed * PAGE_SIZE;
+  pHeapVol->total_sz = e->avail_sz;
+  return true;
 }
 
-static inline uint8_t NextBit(uint8_t byte) {
-  switch (byte) {
-    case 0x01:
-      return 1;
-    case 0x03:
-      return 2;
-    case 0x07:
-      return 3;
-    case 0x0F:
-      return 4;
-    case 0x1F:
-      return 5;
-    case 0x3F:
-      return 6;
-    case 0x7F:
-      return 7;
-    default:
-      break;
+// Drop the contents of free pages, they stay committed and read as zero
+// when touched again
+static inline void _ReleasePages(HeapEntry_t* e, size_t page, size_t nr) {
+  madvise(_PageAddr(e, page), nr * PAGE_SIZE, MADV_DONTNEED);
+}
+
+// Shrink the span of free pages to the whole huge pages in it, releasing
+// part of a huge page would split it. False when none is left.
+static inline bool _AlignRelease(HeapEntry_t* e, size_t* page, size_t* nr) {
+  size_t first = ((*page + e->nr_align - 1) / e->nr_align) * e->nr_align;
+  size_t end = ((*page + *nr) / e->nr_align) * e->nr_align;
+  if (end <= first) {
+    return false;
   }
-  return 0x00;
+  *page = first;
+  *nr = end - first;
+  return true;
 }
 
-static inline void* HeapRecordEncode(uint32_t start_bits, uint32_t nr_bits) {
-#ifdef CART_DEBUG
-  uint32_t test = start_bits << HEAP_RECORD_BITS;
-  test >>= HEAP_RECORD_BITS;
-  if (test != start_bits) {
-    pdbg("!!!Overflow of start_bits!!!\n");
+// Number of free pages at the end of the committed range
+static inline size_t _CountFreeTailPages(HeapEntry_t* e) {
+  size_t page = e->nr_committed;
+  while ((page > 0) && !BitmapTest(e->page_bits, page - 1)) {
+    page--;
+  }
+  return e->nr_committed - page;
+}
+
+// First fit search for nr contiguous free committed pages
+static inline size_t _FindFreePages(HeapEntry_t* e, size_t nr) {
+  return BitmapFindClearRun(e->page_bits, e->nr_committed, nr);
+}
+
+// Take nr pages, committing more of the reservation if none are free
+static uint8_t* _AllocPages(HeapVolume_t* pHeapVol, size_t nr, uint8_t kind, HeapEntry_t** owner) {
+  HeapEntry_t* e = pHeapVol->ptr;
+  size_t page = _FindFreePages(e, nr);
+  if (page >= e->nr_committed) {
+    // Double the committed range, or grow by what the request still lacks
+    // past the free pages at its end if that is more
+    size_t lack = nr - _CountFreeTailPages(e);
+    size_t nr_committed = e->nr_committed * 2;
+    if (nr_committed < (e->nr_committed + lack)) {
+      nr_committed = e->nr_committed + lack;
+    }
+    if (nr_committed > (pHeapVol->growth_limit / PAGE_SIZE)) {
+      nr_committed = pHeapVol->growth_limit / PAGE_SIZE;
+    }
+    if ((e->nr_committed + lack) > nr_committed) {
+      pdbg("Out of memory, the heap is limited to %u bytes\n", (unsigned int)pHeapVol->growth_limit);
+      return NULL;
+    }
+    pdbg("Growing the heap to %u pages\n", (unsigned int)nr_committed);
+    if (!_CommitPages(pHeapVol, nr_committed)) {
+      return NULL;
+    }
+    page = _FindFreePages(e, nr);
   }
-  test = 0xFFFFFFFF;
-  test >>= HEAP_RECORD_BITS;
-  test <<= HEAP_RECORD_BITS;
-  if ((nr_bits & ~test) != nr_bits) {
-    pdbg("!!!Overflow of nr_bits!!!\n");
+  // Mark the pages
+  if (e->nr_dirty < (page + nr)) {
+    e->nr_dirty = page + nr;
   }
-#endif
-  return (void*)(size_t)((start_bits << HEAP_RECORD_BITS) | nr_bits);
+  BitmapSetRange(e->page_bits, page, nr);
+  e->page_map[page] = kind;
+  memset(e->page_map + page + 1, kind + 1, nr - 1);
+  *owner = e;
+  return _PageAddr(e, page);
 }
 
-static inline uint32_t HeapRecordDecodeStartBits(void* ptr) {
-  uint32_t value = (uint32_t)(size_t)ptr;
-  value >>= HEAP_RECORD_BITS;
-  return value;
+// Return the pages starting at ptr and the number of pages released
+static size_t _FreePages(HeapEntry_t* e, void* ptr) {
+  size_t first = ((uint8_t*)ptr - (uint8_t*)e->ptr) / PAGE_SIZE;
+  size_t page = first;
+  uint8_t part = e->page_map[page] + 1;
+  size_t nr = 1;
+  e->page_map[page] = kHeapPageFree;
+  for (++page; (page < e->nr_pages) && (e->page_map[page] == part); ++page, ++nr) {
+    e->page_map[page] = kHeapPageFree;
+  }
+  BitmapClearRange(e->page_bits, first, nr);
+  return nr;
 }
 
-static inline uint32_t HeapRecordDecodeNrBits(void* ptr) {
-  uint32_t value = (uint32_t)(size_t)ptr;
-  uint32_t mask = 0xFFFFFFFF;
-  mask >>= HEAP_RECORD_BITS;
-  mask <<= HEAP_RECORD_BITS;
-  value &= ~mask;
-  return value;
+///////////////////////////////////////////////////////////////////////////////
+// Runs                                                                      //
+///////////////////////////////////////////////////////////////////////////////
+
+static inline void _LinkRun(HeapBracket_t* b, HeapRun_t* run) {
+  run->Prev = NULL;
+  run->Next = b->non_full;
+  if (b->non_full) {
+    b->non_full->Prev = run;
+  }
+  b->non_full = run;
 }
 
-static inline void* _HeapAlloc(HeapEntry_t* pHeapEnt, size_t sz) {
-  size_t has_size = 0;
-  uint32_t start_byte = 0;
-  uint32_t start_byte_cnt = 0;
-  size_t start_bit = 0;
-  size_t start_bit_cnt = 0;
-  bool found = false;
+static inline void _UnlinkRun(HeapBracket_t* b, HeapRun_t* run) {
+  if (run->Prev) {
+    run->Prev->Next = run->Next;
+  } else {
+    b->non_full = run->Next;
+  }
+  if (run->Next) {
+    run->Next->Prev = run->Prev;
+  }
+  run->Next = NULL;
+  run->Prev = NULL;
+}
 
-  // Check if available for the allocation
-  if ((pHeapEnt->avail_sz - pHeapEnt->alloced_sz) < sz) {
+static HeapRun_t* _AllocRun(HeapVolume_t* pHeapVol, size_t idx) {
+  size_t size = _BracketSize(idx);
+  size_t nr_pages = _BracketPages(idx);
+  size_t run_sz = nr_pages * PAGE_SIZE;
+  HeapEntry_t* e = NULL;
+
+  HeapRun_t* run = (HeapRun_t*)_AllocPages(pHeapVol, nr_pages, kHeapPageRun, &e);
+  if (!run) {
     return NULL;
   }
+  // As many slots as fit next to the header and its bitmap
+  size_t nr_slots = (run_sz - sizeof(HeapRun_t)) / size;
+  while ((_ComputeRunHdrSize(nr_slots) + (nr_slots * size)) > run_sz) {
+    nr_slots--;
+  }
+  size_t hdr_sz = _ComputeRunHdrSize(nr_slots);
+  memset(run, 0, hdr_sz);
+  run->magic = HEAP_RUN_MAGIC;
+  run->bracket = idx;
+  run->nr_pages = nr_pages;
+  run->nr_slots = nr_slots;
+  run->nr_free = nr_slots;
+  run->owner = e;
+  run->slots = (uint8_t*)run + hdr_sz;
+  // Bits past the last slot are marked used so the search never picks them
+  size_t words = (nr_slots + BITS_PER_WORD - 1) / BITS_PER_WORD;
+  if (nr_slots % BITS_PER_WORD) {
+    run->bitmap[words - 1] = ~((1U << (nr_slots % BITS_PER_WORD)) - 1);
+  }
+  return run;
+}
 
-  // Iterate each entry
-  for (; pHeapEnt; pHeapEnt = pHeapEnt->Next) {
-    // Search in the bitmap for the needed size of memory
-    for (uint32_t i = 0; i < pHeapEnt->bitmap_sz; ++i) {
-      // Read from memory to a temporary variable
-      uint8_t tmp = *(pHeapEnt->bitmap + i);
-      if (tmp == 0xFF) {
-        continue;
+static inline void* _AllocSlot(HeapRun_t* run) {
+  size_t words = (run->nr_slots + BITS_PER_WORD - 1) / BITS_PER_WORD;
+  for (size_t w = run->first_free; w < words; ++w) {
+    uint32_t free_bits = ~run->bitmap[w];
+    if (!free_bits) {
+      continue;
+    }
+    uint32_t bit = __builtin_ctz(free_bits);
+    run->bitmap[w] |= (1U << bit);
+    run->nr_free--;
+    run->first_free = w;
+    return run->slots + (((w * BITS_PER_WORD) + bit) * _BracketSize(run->bracket));
+  }
+  return NULL;
+}
+
+static void* _AllocSmall(HeapVolume_t* pHeapVol, size_t sz) {
+  size_t idx = _BracketIndex(sz);
+  HeapBracket_t* b = pHeapVol->brackets + idx;
+  HeapRun_t* run = b->current;
+
+  // Switch to another run once the current one is full, a full run is on
+  // no list until one of its slots is freed
+  if (!run || !run->nr_free) {
+    run = b->non_full;
+    if (run) {
+      _UnlinkRun(b, run);
+    } else {
+      run = _AllocRun(pHeapVol, idx);
+      if (!run) {
+        return NULL;
       }
-      uint8_t j = NextBit(tmp);
-      // Iterate each bit
-      for (; j < BITS_PER_BYTE; ++j) {
-        // If there's already a gotten size suffices the request, just break it
-        if (has_size >= sz) {
-          goto DoneScan;
-        }
-        // Iterate each bit
-        if (tmp & (1 << j)) {
-          // If this bit is in use, try next one
-          continue;
-        }
-        // If this bit is not in use, record it
-        if (found == false) {
-          start_byte = i;
-          start_bit = j;
-          found = true;
-        }
-        start_bit_cnt++;
-        has_size += SZ_SLOT;
+    }
+    b->current = run;
+  }
+
+  void* p = _AllocSlot(run);
+  run->owner->alloced_sz += _BracketSize(idx);
+  return p;
+}
+
+static bool _FreeSmall(HeapVolume_t* pHeapVol, HeapEntry_t* e, size_t page, void* ptr) {
+  // Rewind to the first page of the run
+  while (e->page_map[page] == kHeapPageRunPart) {
+    page--;
+  }
+  HeapRun_t* run = (HeapRun_t*)_PageAddr(e, page);
+  size_t size = _BracketSize(run->bracket);
+  size_t off = (uint8_t*)ptr - run->slots;
+  size_t slot = off / size;
+  uint32_t w = slot / BITS_PER_WORD;
+  uint32_t bit = 1U << (slot % BITS_PER_WORD);
+  if (((uint8_t*)ptr < run->slots) || (off % size) || (slot >= run->nr_slots) ||
+      !(run->bitmap[w] & bit)) {
+    return false;
+  }
+  run->bitmap[w] &= ~bit;
+  run->nr_free++;
+  if (w < run->first_free) {
+    run->first_free = w;
+  }
+  e->alloced_sz -= size;
+
+  HeapBracket_t* b = pHeapVol->brackets + run->bracket;
+  if (run == b->current) {
+    return true;
+  }
+  if (run->nr_free == run->nr_slots) {
+    // Empty, give the pages back. It was on the non-full list unless this
+    // was its only slot.
+    if (run->nr_free > 1) {
+      _UnlinkRun(b, run);
+    }
+    _FreePages(e, (void*)run);
+  } else if (run->nr_free == 1) {
+    // Was full, can serve allocations again
+    _LinkRun(b, run);
+  }
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Large allocations                                                         //
+///////////////////////////////////////////////////////////////////////////////
+
+static void* _AllocLarge(HeapVolume_t* pHeapVol, size_t sz) {
+  size_t nr = _ComputePages(sz);
+  HeapEntry_t* e = NULL;
+  uint8_t* p = _AllocPages(pHeapVol, nr, kHeapPageLarge, &e);
+  if (!p) {
+    return NULL;
+  }
+  e->alloced_sz += nr * PAGE_SIZE;
+  return (void*)p;
+}
+
+// The size comes from the page map, the allocation is its first page and
+// the following pages marked as part of it
+static bool _FreeLarge(HeapEntry_t* e, void* ptr) {
+  if (((uint8_t*)ptr - (uint8_t*)e->ptr) % PAGE_SIZE) {
+    return false;
+  }
+  size_t nr = _FreePages(e, ptr);
+  e->alloced_sz -= nr * PAGE_SIZE;
+  // Big ones give their memory back to the system right away
+  size_t first = ((uint8_t*)ptr - (uint8_t*)e->ptr) / PAGE_SIZE;
+  if ((nr >= HEAP_RELEASE_PAGES) && _AlignRelease(e, &first, &nr)) {
+    _ReleasePages(e, first, nr);
+    memset(e->page_map + first, kHeapPageReleased, nr);
+  }
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Thread-local allocation buffers                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+static inline size_t _ComputeTlabHdrSize() {
+  return HEAP_TLAB_HDR_SIZE;
+}
+
+static inline HeapTlabChunk_t* _TlabChunkOf(HeapTlab_t* tlab) {
+  return (HeapTlabChunk_t*)(tlab->start - _ComputeTlabHdrSize());
+}
+
+static void _FreeTlabChunk(HeapTlabChunk_t* chunk) {
+  HeapEntry_t* e = chunk->owner;
+  e->alloced_sz -= _FreePages(e, (void*)chunk) * PAGE_SIZE;
+}
+
+// Hand the chunk back to the heap: the pages past the bump pointer are freed
+// now, the rest once every object in it is freed
+static void _RetireTlab(HeapTlab_t* tlab) {
+  if (!tlab->start) {
+    return;
+  }
+  HeapTlabChunk_t* chunk = _TlabChunkOf(tlab);
+  HeapEntry_t* e = chunk->owner;
+  size_t used = _ComputePages(tlab->pos - (uint8_t*)chunk);
+  chunk->objects = tlab->objects;
+  chunk->top = tlab->pos - (uint8_t*)chunk;
+  chunk->retired = 1;
+  memset(tlab, 0, sizeof(HeapTlab_t));
+  if (chunk->freed == chunk->objects) {
+    _FreeTlabChunk(chunk);
+    return;
+  }
+  size_t first = ((uint8_t*)chunk - (uint8_t*)e->ptr) / PAGE_SIZE;
+  memset(e->page_map + first + used, kHeapPageFree, chunk->nr_pages - used);
+  BitmapClearRange(e->page_bits, first + used, chunk->nr_pages - used);
+  e->alloced_sz -= (chunk->nr_pages - used) * PAGE_SIZE;
+  chunk->nr_pages = used;
+}
+
+static bool _RefillTlab(HeapVolume_t* pHeapVol, HeapTlab_t* tlab) {
+  size_t nr_pages = HEAP_TLAB_SIZE / PAGE_SIZE;
+  size_t nr_dirty = pHeapVol->ptr->nr_dirty;
+  HeapEntry_t* e = NULL;
+
+  _RetireTlab(tlab);
+  HeapTlabChunk_t* chunk = (HeapTlabChunk_t*)_AllocPages(pHeapVol, nr_pages, kHeapPageTlab, &e);
+  if (!chunk) {
+    return false;
+  }
+  // Objects come out of the chunk zeroed, pages never written are already
+  size_t page = ((uint8_t*)chunk - (uint8_t*)e->ptr) / PAGE_SIZE;
+  if (page < nr_dirty) {
+    size_t nr = nr_dirty - page;
+    memset(chunk, 0, ((nr < nr_pages) ? nr : nr_pages) * PAGE_SIZE);
+  }
+  chunk->magic = HEAP_TLAB_MAGIC;
+  chunk->nr_pages = nr_pages;
+  chunk->owner = e;
+  e->alloced_sz += nr_pages * PAGE_SIZE;
+  tlab->start = (uint8_t*)chunk + _ComputeTlabHdrSize();
+  tlab->pos = tlab->start;
+  tlab->end = (uint8_t*)chunk + (nr_pages * PAGE_SIZE);
+  tlab->objects = 0;
+  return true;
+}
+
+static bool _FreeTlabObject(HeapEntry_t* e, size_t page, void* ptr) {
+  // Rewind to the first page of the chunk
+  while (e->page_map[page] == kHeapPageTlabPart) {
+    page--;
+  }
+  HeapTlabChunk_t* chunk = (HeapTlabChunk_t*)_PageAddr(e, page);
+  if (chunk->magic != HEAP_TLAB_MAGIC) {
+    return false;
+  }
+  // Only an object start below the bump pointer, and only once
+  size_t hdr = _ComputeTlabHdrSize();
+  size_t off = (uint8_t*)ptr - (uint8_t*)chunk;
+  size_t top = chunk->retired ? chunk->top : (chunk->nr_pages * PAGE_SIZE);
+  if ((off < hdr) || (off >= top) || ((off - hdr) % HEAP_OBJECT_ALIGN)) {
+    return false;
+  }
+  size_t idx = (off - hdr) / HEAP_OBJECT_ALIGN;
+  uint32_t bit = 1U << (idx % BITS_PER_WORD);
+  if (!(__atomic_load_n(&chunk->starts[idx / BITS_PER_WORD], __ATOMIC_RELAXED) & bit) ||
+      (chunk->frees[idx / BITS_PER_WORD] & bit)) {
+    return false;
+  }
+  chunk->frees[idx / BITS_PER_WORD] |= bit;
+  chunk->freed++;
+  if (chunk->retired && (chunk->freed == chunk->objects)) {
+    _FreeTlabChunk(chunk);
+  }
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Compaction                                                                //
+///////////////////////////////////////////////////////////////////////////////
+
+static inline bool _SlotInUse(HeapRun_t* run, size_t slot) {
+  return (run->bitmap[slot / BITS_PER_WORD] >> (slot % BITS_PER_WORD)) & 1;
+}
+
+static inline bool _SlotBefore(size_t run1, size_t slot1, size_t run2, size_t slot2) {
+  return (run1 < run2) || ((run1 == run2) && (slot1 < slot2));
+}
+
+// Two fingers over the slots of a bracket, its runs in address order. The
+// low one looks for free slots from the first run up, the high one for
+// slots in use from the last run down, and slots move from the high one to
+// the low one until they meet.
+static size_t _CompactBracket(HeapVolume_t* pHeapVol, HeapRun_t** runs, size_t nr_runs,
+                              HeapMoveFn move, void* arg) {
+  HeapBracket_t* b = pHeapVol->brackets + runs[0]->bracket;
+  size_t size = _BracketSize(runs[0]->bracket);
+  size_t moved = 0;
+  size_t lo = 0;
+  size_t lo_slot = 0;
+  size_t hi = nr_runs - 1;
+  size_t hi_slot = runs[hi]->nr_slots;      // candidates are below it
+  for (;;) {
+    while ((lo <= hi) && ((lo_slot == runs[lo]->nr_slots) || _SlotInUse(runs[lo], lo_slot))) {
+      if (lo_slot == runs[lo]->nr_slots) {
+        lo++;
+        lo_slot = 0;
+      } else {
+        lo_slot++;
       }
-      if (found == true) {
-        start_byte_cnt++;
+    }
+    while (!hi_slot || !_SlotInUse(runs[hi], hi_slot - 1)) {
+      if (hi_slot) {
+        hi_slot--;
+      } else if (hi) {
+        hi--;
+        hi_slot = runs[hi]->nr_slots;
+      } else {
+        return moved;
       }
     }
- DoneScan:
-    // If (has_size < sz), raise Out Of Memory
-    if (has_size < sz) {
-      // FIXME:
-      return NULL;
+    if (!_SlotBefore(lo, lo_slot, hi, hi_slot - 1)) {
+      return moved;
     }
-    // Mark bits in the bitmap
-    uint8_t k = start_bit;
-    uint8_t cnt = 0;
-    for (uint32_t i = start_byte; i <= (start_byte + start_byte_cnt); ++i, k = 0) {
-      // Read from memory to a temporary variable
-      uint8_t tmp = *(pHeapEnt->bitmap + i);
-      for (; k < BITS_PER_BYTE; ++k) {
-        // If there's already all marked
-        if (cnt >= start_bit_cnt) {
-          *(pHeapEnt->bitmap + i) = tmp;
-          goto DoneMark;
-        }
-        // Update the value & counter
-        tmp |= (1 << k);
-        cnt++;
-      }
-      // Sync the tmp variable to memory
-      *(pHeapEnt->bitmap + i) = tmp;
+    // The free slot waits for the next candidate if this one stays
+    hi_slot--;
+    HeapRun_t* run = runs[lo];
+    uint8_t* from = runs[hi]->slots + (hi_slot * size);
+    uint8_t* to = run->slots + (lo_slot * size);
+    if (!move(arg, (void*)from, (void*)to, size)) {
+      continue;
     }
+    run->bitmap[lo_slot / BITS_PER_WORD] |= 1U << (lo_slot % BITS_PER_WORD);
+    run->nr_free--;
+    run->owner->alloced_sz += size;
+    if (!run->nr_free && (run != b->current)) {
+      _UnlinkRun(b, run);
+    }
+    lo_slot++;
+    moved += size;
   }
- DoneMark:
-  // Deduct the size from allocated size
-  pHeapEnt->alloced_sz += has_size;
-  // Calculate the pointer
-  uint8_t* ptr = ((uint8_t*)pHeapEnt->ptr) + (((start_byte * BITS_PER_BYTE) + start_bit) * SZ_SLOT);
-  // Record this allocation
-  InsertHashEntry(pHeapEnt->records,
-                  (size_t)ptr,
-                  HeapRecordEncode((start_byte * BITS_PER_BYTE) + start_bit, start_bit_cnt));
-  // Return the address of the pointer
-  return (void*)ptr;
 }
 
-void* HeapAlloc(HeapVolume_t* pHeapVol, size_t sz) {
-  HeapEntry_t* e = pHeapVol->ptr;
-  size_t mem_size;
-  void* p;
- Again:
-  for (; e; e = e->Next) {
-    p = _HeapAlloc(e, sz);
-    if (p) {
-      // Succeed, return the pointer
-      return p;
-    }
+///////////////////////////////////////////////////////////////////////////////
+// Interface                                                                 //
+///////////////////////////////////////////////////////////////////////////////
+
+void HeapUseHugePages(bool enable) {
+  heap_huge_pages = enable;
+}
+
+HeapVolume_t* AllocHeapVolume(size_t sz) {
+  return AllocHeapVolumeWithLimit(sz, HEAP_MAX_SIZE);
+}
+
+HeapVolume_t* AllocHeapVolumeWithLimit(size_t sz, size_t max_sz) {
+  HeapVolume_t* pHeapVol;
+
+  // Align to the page boundary
+  if (sz % PAGE_SIZE) {
+    sz = ((sz / PAGE_SIZE) + 1) * PAGE_SIZE;
+    pdbg("Align heap volume size to %u\n", (unsigned int)sz);
   }
-  pdbg("Growing the heap by appending a new entry\n");
-  mem_size = pHeapVol->ptr->avail_sz;
-  e = (HeapEntry_t*)malloc(_ComputeEntryMemSize(mem_size));
-  if (!e) {
+  if (max_sz % PAGE_SIZE) {
+    max_sz = ((max_sz / PAGE_SIZE) + 1) * PAGE_SIZE;
+  }
+  if (max_sz < sz) {
+    max_sz = sz;
+  }
+  if (heap_huge_pages && (max_sz % HUGE_PAGE_SIZE)) {
+    max_sz = ((max_sz / HUGE_PAGE_SIZE) + 1) * HUGE_PAGE_SIZE;
+  }
+
+  // Allocate the volume header, then clean up
+  pHeapVol = (HeapVolume_t*)malloc(sizeof(HeapVolume_t));
+  if (!pHeapVol) {
     pdbg("Out of memory\n");
     return NULL;
   }
-  // Allocate hash table
-  e->records = AllocHashTable(NULL, NR_HASH_TBL);
-  if (!e->records) {
-    pdbg("Out of memory\n");
-    free((void*)e);
+  memset(pHeapVol, 0, sizeof(HeapVolume_t));
+
+  // Reserve the whole heap, then commit the start size of it
+  pHeapVol->ptr = _AllocHeapEntry(max_sz / PAGE_SIZE);
+  if (!pHeapVol->ptr) {
+    free((void*)pHeapVol);
+    return NULL;
+  }
+  pHeapVol->max_sz = max_sz;
+  pHeapVol->growth_limit = max_sz;
+  if (!_CommitPages(pHeapVol, sz / PAGE_SIZE)) {
+    _FreeHeapEntry(pHeapVol->ptr);
+    free((void*)pHeapVol);
     return NULL;
   }
+
   // Initialize data
-  pHeapVol->nr++;
-  pHeapVol->total_sz += mem_size;
-  _FillHeapEntry(e, e->records, mem_size);
-  // Chain this entry
-  HeapEntry_t* tmp = pHeapVol->ptr;
-  for (; tmp->Next; tmp = tmp->Next) {}
-  tmp->Next = e;
-  // Resume the heap allocation
-  goto Again;
-  // Non-reachable
-  return NULL;
+  pthread_mutex_init(&pHeapVol->lock, NULL);
+
+  // Succeed and return
+  return pHeapVol;
 }
 
-static inline void* _HeapFree(HeapEntry_t* pHeapEnt, void* ptr) {
-  HashEntry_t* pHashEntry = IsHashExist(pHeapEnt->records, (size_t)ptr);
-  if (!pHashEntry) {
-    pdbg("Cannot find pointer(%p) in the heap\n", ptr);
-    return NULL;
+void FreeHeapVolume(HeapVolume_t* pHeapVol) {
+  // Tables allocated from this volume must not outlive it in the statistics
+  RetireHashTablesOfHeap((void*)pHeapVol);
+
+  // Release the reservation and then the HeapVolume header
+  _FreeHeapEntry(pHeapVol->ptr);
+  pthread_mutex_destroy(&pHeapVol->lock);
+  free((void*)pHeapVol);
+}
+
+void* HeapAlloc(HeapVolume_t* pHeapVol, size_t sz) {
+  void* p;
+  pthread_mutex_lock(&pHeapVol->lock);
+  if (sz <= HEAP_MAX_BRACKET_SIZE) {
+    p = _AllocSmall(pHeapVol, sz);
+  } else {
+    p = _AllocLarge(pHeapVol, sz);
   }
-  // Retrieve the control parameters from the record
-  size_t index = (size_t)HeapRecordDecodeStartBits(pHashEntry->ptr);
-  size_t nr = (size_t)HeapRecordDecodeNrBits(pHashEntry->ptr);
-  uint32_t start_byte = index / BITS_PER_BYTE;
-  uint32_t start_byte_cnt = nr / BITS_PER_BYTE;
-  if (nr % BITS_PER_BYTE) {
-    start_byte_cnt++;
-  }
-  size_t start_bit = index % BITS_PER_BYTE;
-  size_t start_bit_cnt = nr;
-  // Unmark bits in the bitmap
-  uint8_t k = start_bit;
-  uint8_t cnt = 0;
-  for (uint32_t i = start_byte; i <= (start_byte + start_byte_cnt); ++i, k = 0) {
-    // Read from memory to a temporary variable
-    uint8_t tmp = *(pHeapEnt->bitmap + i);
-    for (; k < BITS_PER_BYTE; ++k) {
-      // If there's already all marked
-      if (cnt >= start_bit_cnt) {
-        *(pHeapEnt->bitmap + i) = tmp;
-        goto DoneUnmark;
-      }
-      // Update the value & counter
-      tmp &= ~(1 << k);
-      cnt++;
-    }
-    // Sync the tmp variable to memory
-    *(pHeapEnt->bitmap + i) = tmp;
+  pthread_mutex_unlock(&pHeapVol->lock);
+  return p;
+}
+
+static bool _Free(HeapVolume_t* pHeapVol, void* ptr) {
+  HeapEntry_t* e = pHeapVol->ptr;
+  if (!_IsInEntry(e, ptr)) {
+    return false;
   }
- DoneUnmark:
-  // Deduct the size from allocated size
-  pHeapEnt->alloced_sz -= (start_bit_cnt * SZ_SLOT);
-  // Remove this record from the map
-  return RemoveHashEntry(pHeapEnt->records, (size_t)ptr);
+  size_t page = ((uint8_t*)ptr - (uint8_t*)e->ptr) / PAGE_SIZE;
+  switch (e->page_map[page]) {
+    case kHeapPageRun:
+    case kHeapPageRunPart:
+      return _FreeSmall(pHeapVol, e, page, ptr);
+    case kHeapPageLarge:
+      return _FreeLarge(e, ptr);
+    case kHeapPageTlab:
+    case kHeapPageTlabPart:
+      return _FreeTlabObject(e, page, ptr);
+    default:
+      break;
+  }
+  return false;
 }
 
 void HeapFree(HeapVolume_t* pHeapVol, void* ptr) {
-  HeapEntry_t* e = pHeapVol->ptr;
-  void* p;
-  for (; e; e = e->Next) {
-    p = _HeapFree(e, ptr);
-    if (p) {
-      // Succeed
-      return;
+  pthread_mutex_lock(&pHeapVol->lock);
+  bool freed = _Free(pHeapVol, ptr);
+  pthread_mutex_unlock(&pHeapVol->lock);
+  if (!freed) {
+    pdbg("Cannot find pointer(%p) in the heap\n", ptr);
+  }
+}
+
+// Free a batch under a single lock, as a sweep does
+void HeapFreeList(HeapVolume_t* pHeapVol, void** ptrs, size_t nr) {
+  pthread_mutex_lock(&pHeapVol->lock);
+  for (size_t i = 0; i < nr; ++i) {
+    if (!_Free(pHeapVol, ptrs[i])) {
+      pdbg("Cannot find pointer(%p) in the heap\n", ptrs[i]);
     }
   }
+  pthread_mutex_unlock(&pHeapVol->lock);
+}
+
+void* HeapTlabAllocSlow(HeapVolume_t* pHeapVol, HeapTlab_t* tlab, size_t sz) {
+  // Big objects would waste most of a chunk
+  if (sz > HEAP_TLAB_MAX_OBJECT) {
+    return HeapAlloc(pHeapVol, sz);
+  }
+  pthread_mutex_lock(&pHeapVol->lock);
+  bool refilled = _RefillTlab(pHeapVol, tlab);
+  pthread_mutex_unlock(&pHeapVol->lock);
+  if (!refilled) {
+    return NULL;
+  }
+  uint8_t* p = tlab->pos;
+  tlab->pos += sz;
+  tlab->objects++;
+  HeapTlabMarkObject(tlab, p);
+  return (void*)p;
+}
+
+void HeapRevokeTlab(HeapVolume_t* pHeapVol, HeapTlab_t* tlab) {
+  pthread_mutex_lock(&pHeapVol->lock);
+  _RetireTlab(tlab);
+  pthread_mutex_unlock(&pHeapVol->lock);
+}
+
+HashTable_t* AllocHashTableFromHeap(HeapVolume_t* pHeapVol, size_t nr) {
+  return AllocHashTable((void*)pHeapVol, nr);
 }
 
 size_t HeapAvailableSize(HeapVolume_t* pHeapVol) {
@@ -362,11 +766,9 @@ size_t HeapAvailableSize(HeapVolume_t* pHeapVol) {
 }
 
 size_t HeapAllocedSize(HeapVolume_t* pHeapVol) {
-  size_t sum = 0;
-  HeapEntry_t* e = pHeapVol->ptr;
-  for (; e; e = e->Next) {
-    sum += e->alloced_sz;
-  }
+  pthread_mutex_lock(&pHeapVol->lock);
+  size_t sum = pHeapVol->ptr->alloced_sz;
+  pthread_mutex_unlock(&pHeapVol->lock);
   return sum;
 }
 
@@ -375,29 +777,304 @@ size_t HeapFreeSize(HeapVolume_t* pHeapVol) {
   return pHeapVol->total_sz - alloced;
 }
 
+void HeapSetGrowthLimit(HeapVolume_t* pHeapVol, size_t limit) {
+  limit = ((limit + PAGE_SIZE - 1) / PAGE_SIZE) * PAGE_SIZE;
+  pthread_mutex_lock(&pHeapVol->lock);
+  pHeapVol->growth_limit = (limit < pHeapVol->max_sz) ? limit : pHeapVol->max_sz;
+  pthread_mutex_unlock(&pHeapVol->lock);
+}
+
+size_t HeapTrim(HeapVolume_t* pHeapVol) {
+  pthread_mutex_lock(&pHeapVol->lock);
+  HeapEntry_t* e = pHeapVol->ptr;
+  size_t nr_released = 0;
+  size_t page = 0;
+  while (page < e->nr_committed) {
+    // Skip the pages in use, a word at a time while they fill it
+    if (!(page % BITMAP_BITS_PER_WORD) && (e->page_bits[page / BITMAP_BITS_PER_WORD] == ~0ULL)) {
+      page += BITMAP_BITS_PER_WORD;
+      continue;
+    }
+    if (BitmapTest(e->page_bits, page)) {
+      page++;
+      continue;
+    }
+    // Free pages next to each other make one span, whatever they were used
+    // for. It is released again only if part of it was written since.
+    // With huge pages, only the whole ones in the span are.
+    size_t first = page;
+    for (; (page < e->nr_committed) && !BitmapTest(e->page_bits, page); ++page) {}
+    size_t nr = page - first;
+    if (!_AlignRelease(e, &first, &nr)) {
+      continue;
+    }
+    size_t nr_new = 0;
+    for (size_t i = first; i < (first + nr); ++i) {
+      nr_new += (e->page_map[i] != kHeapPageReleased) ? 1 : 0;
+    }
+    if (nr_new) {
+      _ReleasePages(e, first, nr);
+      memset(e->page_map + first, kHeapPageReleased, nr);
+      nr_released += nr_new;
+    }
+    if (((first + nr) == e->nr_committed) && (e->nr_dirty > first)) {
+      e->nr_dirty = first;
+    }
+  }
+  pthread_mutex_unlock(&pHeapVol->lock);
+  return nr_released * PAGE_SIZE;
+}
+
+size_t HeapCompactRuns(HeapVolume_t* pHeapVol, HeapMoveFn move, void* arg) {
+  pthread_mutex_lock(&pHeapVol->lock);
+  HeapEntry_t* e = pHeapVol->ptr;
+
+  // Sort the runs by bracket, then by address as the page map has them
+  size_t nr_runs[HEAP_NR_BRACKETS];
+  size_t first[HEAP_NR_BRACKETS];
+  memset(nr_runs, 0, sizeof(nr_runs));
+  for (size_t page = 0; page < e->nr_committed; ++page) {
+    if (e->page_map[page] == kHeapPageRun) {
+      nr_runs[((HeapRun_t*)_PageAddr(e, page))->bracket]++;
+    }
+  }
+  size_t total = 0;
+  for (size_t i = 0; i < HEAP_NR_BRACKETS; ++i) {
+    first[i] = total;
+    total += nr_runs[i];
+  }
+  HeapRun_t** runs = total ? (HeapRun_t**)malloc(sizeof(HeapRun_t*) * total) : NULL;
+  if (!runs) {
+    pthread_mutex_unlock(&pHeapVol->lock);
+    return 0;
+  }
+  size_t next[HEAP_NR_BRACKETS];
+  memcpy(next, first, sizeof(next));
+  for (size_t page = 0; page < e->nr_committed; ++page) {
+    if (e->page_map[page] == kHeapPageRun) {
+      HeapRun_t* run = (HeapRun_t*)_PageAddr(e, page);
+      runs[next[run->bracket]++] = run;
+    }
+  }
+
+  size_t moved = 0;
+  for (size_t i = 0; i < HEAP_NR_BRACKETS; ++i) {
+    if (nr_runs[i]) {
+      moved += _CompactBracket(pHeapVol, runs + first[i], nr_runs[i], move, arg);
+    }
+  }
+  free((void*)runs);
+  pthread_mutex_unlock(&pHeapVol->lock);
+  return moved;
+}
+
+unsigned int HeapFragmentation(HeapVolume_t* pHeapVol) {
+  pthread_mutex_lock(&pHeapVol->lock);
+  HeapEntry_t* e = pHeapVol->ptr;
+  size_t used = BitmapCountSet(e->page_bits, e->nr_committed) * PAGE_SIZE;
+  size_t alloced = (e->alloced_sz < used) ? e->alloced_sz : used;
+  pthread_mutex_unlock(&pHeapVol->lock);
+  return used ? (unsigned int)(((used - alloced) * 100) / used) : 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Verification                                                              //
+///////////////////////////////////////////////////////////////////////////////
+
+// Problems found in the run at page, whose slots in use add to alloced
+static size_t _VerifyRun(HeapVolume_t* pHeapVol, HeapEntry_t* e, size_t page, size_t nr_pages,
+                         size_t* alloced) {
+  HeapRun_t* run = (HeapRun_t*)_PageAddr(e, page);
+  if ((run->magic != HEAP_RUN_MAGIC) || (run->bracket >= HEAP_NR_BRACKETS) || (run->owner != e)) {
+    pdbg("Page %u: bad run header\n", (unsigned int)page);
+    return 1;
+  }
+  size_t nr_problems = 0;
+  if ((run->nr_pages != nr_pages) || (nr_pages != _BracketPages(run->bracket))) {
+    pdbg("Page %u: run of %u pages in %u pages of the map\n", (unsigned int)page,
+         (unsigned int)run->nr_pages, (unsigned int)nr_pages);
+    nr_problems++;
+  }
+  if ((run->nr_free > run->nr_slots) ||
+      (run->slots != ((uint8_t*)run + _ComputeRunHdrSize(run->nr_slots))) ||
+      ((run->slots + (run->nr_slots * _BracketSize(run->bracket))) > _PageAddr(e, page + nr_pages))) {
+    pdbg("Page %u: bad run layout\n", (unsigned int)page);
+    return nr_problems + 1;
+  }
+  // The bitmap counts the slots in use, the bits past the last slot are set
+  size_t words = (run->nr_slots + BITS_PER_WORD - 1) / BITS_PER_WORD;
+  size_t nr_used = 0;
+  for (size_t w = 0; w < words; ++w) {
+    nr_used += __builtin_popcount(run->bitmap[w]);
+    if ((w < run->first_free) && (run->bitmap[w] != ~0U)) {
+      pdbg("Page %u: free slot before the first free word\n", (unsigned int)page);
+      nr_problems++;
+    }
+  }
+  nr_used -= (words * BITS_PER_WORD) - run->nr_slots;
+  if ((run->nr_slots % BITS_PER_WORD) &&
+      ((run->bitmap[words - 1] | ((1U << (run->nr_slots % BITS_PER_WORD)) - 1)) != ~0U)) {
+    pdbg("Page %u: bits past the last slot are clear\n", (unsigned int)page);
+    nr_problems++;
+  }
+  if (nr_used != (run->nr_slots - run->nr_free)) {
+    pdbg("Page %u: %u slots in use, %u counted\n", (unsigned int)page,
+         (unsigned int)nr_used, (unsigned int)(run->nr_slots - run->nr_free));
+    nr_problems++;
+  }
+  // An empty run gives its pages back unless it is the current one
+  if (!nr_used && (pHeapVol->brackets[run->bracket].current != run)) {
+    pdbg("Page %u: empty run kept\n", (unsigned int)page);
+    nr_problems++;
+  }
+  *alloced += (run->nr_slots - run->nr_free) * _BracketSize(run->bracket);
+  return nr_problems;
+}
+
+// Problems found in the lists of runs of a size bracket, non_full counts the
+// runs of the page map that should be on them
+static size_t _VerifyBracket(HeapVolume_t* pHeapVol, size_t idx, size_t nr_non_full) {
+  HeapEntry_t* e = pHeapVol->ptr;
+  HeapBracket_t* b = pHeapVol->brackets + idx;
+  size_t nr_problems = 0;
+  if (b->current && (!_IsInEntry(e, b->current) || (b->current->magic != HEAP_RUN_MAGIC) ||
+                     (b->current->bracket != idx) || b->current->Next || b->current->Prev)) {
+    pdbg("Bracket %u: bad current run\n", (unsigned int)_BracketSize(idx));
+    nr_problems++;
+  }
+  size_t nr = 0;
+  HeapRun_t* prev = NULL;
+  for (HeapRun_t* run = b->non_full; run && (nr <= nr_non_full); prev = run, run = run->Next, ++nr) {
+    if (!_IsInEntry(e, run) || (run->magic != HEAP_RUN_MAGIC) || (run->bracket != idx) ||
+        (run->Prev != prev) || !run->nr_free || (run == b->current)) {
+      pdbg("Bracket %u: bad run %p on the non-full list\n", (unsigned int)_BracketSize(idx), run);
+      return nr_problems + 1;
+    }
+  }
+  if (nr != nr_non_full) {
+    pdbg("Bracket %u: %u runs on the non-full list of %u\n", (unsigned int)_BracketSize(idx),
+         (unsigned int)nr, (unsigned int)nr_non_full);
+    nr_problems++;
+  }
+  return nr_problems;
+}
+
+size_t HeapVerify(HeapVolume_t* pHeapVol) {
+  pthread_mutex_lock(&pHeapVol->lock);
+  HeapEntry_t* e = pHeapVol->ptr;
+  size_t nr_problems = 0;
+  size_t alloced = 0;
+  size_t nr_non_full[HEAP_NR_BRACKETS];
+  memset(nr_non_full, 0, sizeof(nr_non_full));
+
+  // Sizes
+  if ((e->nr_committed > e->nr_pages) || (e->nr_dirty > e->nr_committed) ||
+      (pHeapVol->total_sz != (e->nr_committed * PAGE_SIZE)) || (e->avail_sz != pHeapVol->total_sz) ||
+      (pHeapVol->max_sz != (e->nr_pages * PAGE_SIZE))) {
+    pdbg("Bad sizes, %u of %u pages committed\n", (unsigned int)e->nr_committed, (unsigned int)e->nr_pages);
+    nr_problems++;
+  }
+
+  // Every page in use is in the page bitmap and belongs to the allocation
+  // started by the first page before it which is not a part
+  size_t page = 0;
+  while (page < e->nr_pages) {
+    uint8_t kind = e->page_map[page];
+    bool in_use = BitmapTest(e->page_bits, page);
+    if ((kind == kHeapPageFree) || (kind == kHeapPageReleased)) {
+      if (in_use || ((kind == kHeapPageReleased) && (page >= e->nr_committed))) {
+        pdbg("Page %u: free page in use\n", (unsigned int)page);
+        nr_problems++;
+      }
+      page++;
+      continue;
+    }
+    if ((kind > kHeapPageReleased) || (kind == kHeapPageRunPart) || (kind == kHeapPageLargePart) ||
+        (kind == kHeapPageTlabPart) || (page >= e->nr_committed)) {
+      pdbg("Page %u: stray page of kind %u\n", (unsigned int)page, (unsigned int)kind);
+      nr_problems++;
+      page++;
+      continue;
+    }
+    size_t first = page;
+    for (++page; (page < e->nr_pages) && (e->page_map[page] == (kind + 1)); ++page) {}
+    size_t nr = page - first;
+    for (size_t i = first; i < page; ++i) {
+      if (!BitmapTest(e->page_bits, i) || (i >= e->nr_committed)) {
+        pdbg("Page %u: page in use not in the page bitmap\n", (unsigned int)i);
+        nr_problems++;
+        break;
+      }
+    }
+    if (kind == kHeapPageRun) {
+      HeapRun_t* run = (HeapRun_t*)_PageAddr(e, first);
+      nr_problems += _VerifyRun(pHeapVol, e, first, nr, &alloced);
+      if ((run->bracket < HEAP_NR_BRACKETS) && run->nr_free &&
+          (pHeapVol->brackets[run->bracket].current != run)) {
+        nr_non_full[run->bracket]++;
+      }
+    } else if (kind == kHeapPageTlab) {
+      HeapTlabChunk_t* chunk = (HeapTlabChunk_t*)_PageAddr(e, first);
+      size_t nr_freed = 0;
+      for (size_t i = 0; i < HEAP_TLAB_BITMAP_WORDS; ++i) {
+        nr_freed += __builtin_popcount(chunk->frees[i]);
+      }
+      if ((chunk->magic != HEAP_TLAB_MAGIC) || (chunk->owner != e) || (chunk->nr_pages != nr) ||
+          (chunk->retired && (chunk->freed >= chunk->objects)) || (nr_freed != chunk->freed)) {
+        pdbg("Page %u: bad TLAB chunk\n", (unsigned int)first);
+        nr_problems++;
+      }
+      alloced += nr * PAGE_SIZE;
+    } else {
+      alloced += nr * PAGE_SIZE;
+    }
+  }
+
+  // The runs with free slots are on the lists of their size bracket
+  for (size_t i = 0; i < HEAP_NR_BRACKETS; ++i) {
+    nr_problems += _VerifyBracket(pHeapVol, i, nr_non_full[i]);
+  }
+  if (alloced != e->alloced_sz) {
+    pdbg("%u bytes in use, %u counted\n", (unsigned int)alloced, (unsigned int)e->alloced_sz);
+    nr_problems++;
+  }
+  pthread_mutex_unlock(&pHeapVol->lock);
+  return nr_problems;
+}
+
 #ifdef CART_DEBUG
 void DumpHeap(HeapVolume_t* pHeapVol) {
-  HeapEntry_t* e;
-  uint32_t idx = 0;
+  HeapEntry_t* e = pHeapVol->ptr;
 
   fprintf(stderr, "---------------------------------------------------------------------------\n");
   fprintf(stderr, " HEAP table dumping\n");
   fprintf(stderr, "---------------------------------------------------------------------------\n");
-  fprintf(stderr, "Number of heap entries: %u\n", (unsigned int)pHeapVol->nr);
-  fprintf(stderr, "Total memory capacity : %u\n", (unsigned int)pHeapVol->total_sz);
-  for (e = pHeapVol->ptr; e; e = e->Next, ++idx) {
-    fprintf(stderr, "  [%d] Entry No.         : %d\n", idx, idx);
-    fprintf(stderr, "  [%d] Bitmap size       : %u\n", idx, (unsigned int)e->bitmap_sz);
-    fprintf(stderr, "  [%d] Allocated size    : %u\n", idx, (unsigned int)e->alloced_sz);
-    fprintf(stderr, "  [%d] Available size    : %u\n", idx, (unsigned int)e->avail_sz);
-    fprintf(stderr, "  [%d] Memory start addr : %p\n", idx, e->ptr);
-    fprintf(stderr, "  [%d] Dump bitmap START\n", idx);
-    DumpData((const uint32_t*)e->bitmap, e->bitmap_sz, 0);
-    fprintf(stderr, "  [%d] Dump bitmap END\n", idx);
-    fprintf(stderr, "  [%d] Dump record START\n", idx);
-    DumpHashTable(e->records);
-    fprintf(stderr, "  [%d] Dump record END\n", idx);
+  fprintf(stderr, "Committed size        : %u\n", (unsigned int)pHeapVol->total_sz);
+  fprintf(stderr, "Maximum size          : %u\n", (unsigned int)pHeapVol->max_sz);
+  for (size_t i = 0; i < HEAP_NR_BRACKETS; ++i) {
+    HeapBracket_t* b = pHeapVol->brackets + i;
+    size_t nr_non_full = 0;
+    for (HeapRun_t* run = b->non_full; run; run = run->Next) {
+      nr_non_full++;
+    }
+    if (!b->current && !nr_non_full) {
+      continue;
+    }
+    fprintf(stderr, "  Bracket %4u bytes   : current %p (%u/%u free), %u non-full runs\n",
+            (unsigned int)_BracketSize(i),
+            b->current,
+            b->current ? (unsigned int)b->current->nr_free : 0,
+            b->current ? (unsigned int)b->current->nr_slots : 0,
+            (unsigned int)nr_non_full);
+  }
+  fprintf(stderr, "  Committed pages     : %u of %u\n", (unsigned int)e->nr_committed, (unsigned int)e->nr_pages);
+  fprintf(stderr, "  Allocated size      : %u\n", (unsigned int)e->alloced_sz);
+  fprintf(stderr, "  Memory start addr   : %p\n", e->ptr);
+  fprintf(stderr, "  Page map            : ");
+  for (size_t i = 0; i < e->nr_committed; ++i) {
+    fputc(".RrLlTt_"[e->page_map[i]], stderr);
   }
+  fprintf(stderr, "\n");
 
   fprintf(stderr, "---------------------------------------------------------------------------\n");
 }
@@ -21,34 +21,180 @@
 #ifndef CART_HEAP_H_
 #define CART_HEAP_H_
 
+#include <pthread.h>
+
 #include "hash.h"
 
-#define HEAP_RECORD_BITS   20
 #define BITS_PER_BYTE      8
 
+// Size brackets: 16 to 512 bytes in steps of 16, then 1KB and 2KB. Bigger
+// requests are served by whole pages.
+#define HEAP_NR_BRACKETS        34
+#define HEAP_NR_SMALL_BRACKETS  32
+#define HEAP_SMALL_BRACKET_STEP 16
+#define HEAP_MAX_BRACKET_SIZE   2048
+#define HEAP_RUN_MAGIC          0x52
+
+// Thread-local allocation buffers are carved in chunks of this size, objects
+// bigger than a quarter of it bypass them
+#define HEAP_TLAB_SIZE          (32 * 1024)
+#define HEAP_TLAB_MAX_OBJECT    (HEAP_TLAB_SIZE / 4)
+#define HEAP_TLAB_MAGIC         0x54
+#define HEAP_OBJECT_ALIGN       8
+
+// Freed large allocations of at least this many pages are released to the
+// system at once
+#define HEAP_RELEASE_PAGES      64
+
+// Page map values
+enum {
+  kHeapPageFree = 0,
+  kHeapPageRun,           // first page of a run
+  kHeapPageRunPart,       // following pages of a run
+  kHeapPageLarge,         // first page of a large allocation
+  kHeapPageLargePart,     // following pages of a large allocation
+  kHeapPageTlab,          // first page of a TLAB chunk
+  kHeapPageTlabPart,      // following pages of a TLAB chunk
+  kHeapPageReleased,      // free, its contents given back to the system
+};
+
+struct _HeapEntry;
+
+// A run carves a few pages into slots of a single bracket size. The header
+// sits at the start of the first page, the slots follow it.
+typedef struct PACKED _HeapRun {
+  uint8_t             magic;
+  uint8_t             bracket;
+  uint16_t            nr_pages;
+  uint32_t            nr_slots;
+  uint32_t            nr_free;
+  uint32_t            first_free;     // no free slot in the words before this
+  struct _HeapRun*    Next;
+  struct _HeapRun*    Prev;
+  struct _HeapEntry*  owner;
+  uint8_t*            slots;
+  uint32_t            bitmap[0];      // one bit per slot, set when in use
+} HeapRun_t;
+
+// A TLAB chunk is handed to a single thread which bumps through it without
+// locking. The owning thread marks where each object starts, frees mark it
+// again under the heap lock, so a repeated or interior free is caught. The
+// chunk goes back once it is retired and all of its objects are freed.
+#define HEAP_TLAB_GRANULES      (HEAP_TLAB_SIZE / HEAP_OBJECT_ALIGN)
+#define HEAP_TLAB_BITMAP_WORDS  (HEAP_TLAB_GRANULES / 32)
+
+// The starts words are accessed atomically, so it is not PACKED
+typedef struct {
+  uint8_t             magic;
+  uint8_t             retired;
+  uint16_t            nr_pages;
+  uint32_t            freed;
+  size_t              objects;        // valid once retired
+  struct _HeapEntry*  owner;
+  uint32_t            top;            // bump pointer offset, valid once retired
+  uint32_t            starts[HEAP_TLAB_BITMAP_WORDS];   // written by the owning thread only
+  uint32_t            frees[HEAP_TLAB_BITMAP_WORDS];    // written under the lock only
+} HeapTlabChunk_t;
+
+#define HEAP_TLAB_HDR_SIZE \
+  ((sizeof(HeapTlabChunk_t) + HEAP_OBJECT_ALIGN - 1) & ~(size_t)(HEAP_OBJECT_ALIGN - 1))
+
+// Same layout as thread_local_start/pos/end/objects of a thread
+typedef struct PACKED {
+  uint8_t*  start;
+  uint8_t*  pos;
+  uint8_t*  end;
+  size_t    objects;
+} HeapTlab_t;
+
+typedef struct PACKED {
+  HeapRun_t*  current;          // run allocations are served from
+  HeapRun_t*  non_full;         // runs with free slots besides current
+} HeapBracket_t;
+
 typedef struct PACKED _HeapEntry {
-  _HeapEntry*   Next;
-  uint8_t*      bitmap;
-  size_t        bitmap_sz;
+  uint64_t*     page_bits;      // set for pages in use, searched for free pages
+  uint8_t*      page_map;
+  size_t        nr_pages;       // reserved
+  size_t        nr_committed;   // usable, from the start of the reservation
+  size_t        nr_dirty;       // pages past this were never written
+  size_t        nr_align;       // committed and released in multiples of it
   size_t        avail_sz;
   size_t        alloced_sz;
   void*         ptr;
-  HashTable_t*  records;
 } HeapEntry_t;
 
-typedef struct PACKED {
-  size_t       nr;
-  size_t       total_sz;
-  HeapEntry_t* ptr;
+// Shared by threads refilling their TLABs, the lock keeps it naturally
+// aligned so it is not PACKED
+typedef struct {
+  size_t           total_sz;      // committed
+  size_t           max_sz;        // reserved
+  size_t           growth_limit;  // never committed past this
+  HeapEntry_t*     ptr;
+  HeapBracket_t    brackets[HEAP_NR_BRACKETS];
+  pthread_mutex_t  lock;
 } HeapVolume_t;
 
+// Volumes allocated afterwards are backed by transparent huge pages when
+// the system has them. They are committed and trimmed a huge page at a time.
+void HeapUseHugePages(bool enable);
 HeapVolume_t* AllocHeapVolume(size_t sz);
+HeapVolume_t* AllocHeapVolumeWithLimit(size_t sz, size_t max_sz);
 void FreeHeapVolume(HeapVolume_t* pHeapVol);
 void* HeapAlloc(HeapVolume_t* pHeapVol, size_t sz);
 void HeapFree(HeapVolume_t* pHeapVol, void* ptr);
+void HeapFreeList(HeapVolume_t* pHeapVol, void** ptrs, size_t nr);
 size_t HeapAvailableSize(HeapVolume_t* pHeapVol);
 size_t HeapAllocedSize(HeapVolume_t* pHeapVol);
 size_t HeapFreeSize(HeapVolume_t* pHeapVol);
+// Give the contents of the free pages back to the system, one call per
+// span of them. They stay committed and read as zero when touched again.
+// Returns how many bytes that was, pages released before are not counted.
+size_t HeapTrim(HeapVolume_t* pHeapVol);
+// Allocations that would commit past limit bytes fail instead, so a
+// collector can run before the heap grows
+void HeapSetGrowthLimit(HeapVolume_t* pHeapVol, size_t limit);
+
+// Asked to move the slot at from to the free slot at to, both of sz bytes.
+// Moving is up to the callee, returning false leaves the slot where it is.
+typedef bool (*HeapMoveFn)(void* arg, void* from, void* to, size_t sz);
+// Slides the slots of each size bracket down into the free slots of its
+// runs at the lowest addresses, so the runs at the top empty out. Moved
+// slots stay allocated in their old place, the caller frees them once done
+// with them. Returns the bytes moved.
+size_t HeapCompactRuns(HeapVolume_t* pHeapVol, HeapMoveFn move, void* arg);
+// Percent of the bytes of the pages in use that are not allocated
+unsigned int HeapFragmentation(HeapVolume_t* pHeapVol);
+// Checks the page bitmap, the page map, the runs and their lists and the
+// allocated size against each other. Returns the number of problems found,
+// each is logged. No thread may use the heap meanwhile.
+size_t HeapVerify(HeapVolume_t* pHeapVol);
+
+void* HeapTlabAllocSlow(HeapVolume_t* pHeapVol, HeapTlab_t* tlab, size_t sz);
+void HeapRevokeTlab(HeapVolume_t* pHeapVol, HeapTlab_t* tlab);
+
+// Record the object starting at p in the chunk of the TLAB. Frees read the
+// word under the heap lock meanwhile, hence the relaxed atomics.
+static inline void HeapTlabMarkObject(HeapTlab_t* tlab, uint8_t* p) {
+  HeapTlabChunk_t* chunk = (HeapTlabChunk_t*)(tlab->start - HEAP_TLAB_HDR_SIZE);
+  size_t idx = (size_t)(p - tlab->start) / HEAP_OBJECT_ALIGN;
+  uint32_t* word = &chunk->starts[idx / 32];
+  __atomic_store_n(word, __atomic_load_n(word, __ATOMIC_RELAXED) | (1U << (idx % 32)), __ATOMIC_RELAXED);
+}
+
+// Allocate from the thread's TLAB, refilling it when exhausted. Only the
+// owning thread may call this with its TLAB.
+static inline void* HeapTlabAlloc(HeapVolume_t* pHeapVol, HeapTlab_t* tlab, size_t sz) {
+  sz = (sz + HEAP_OBJECT_ALIGN - 1) & ~(size_t)(HEAP_OBJECT_ALIGN - 1);
+  if ((size_t)(tlab->end - tlab->pos) >= sz) {
+    uint8_t* p = tlab->pos;
+    tlab->pos += sz;
+    tlab->objects++;
+    HeapTlabMarkObject(tlab, p);
+    return (void*)p;
+  }
+  return HeapTlabAllocSlow(pHeapVol, tlab, sz);
+}
 
 HashTable_t* AllocHashTableFromHeap(HeapVolume_t* pHeapVol, size_t nr);
 
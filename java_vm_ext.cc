@@ -20,8 +20,10 @@
 #include "java_vm_ext.h"
 #include "jni_env_ext.h"
 
+#include "hash.h"
 #include "thread.h"
 #include "entry.h"
+#include "gc.h"
 
 namespace cart {
 
@@ -30,6 +32,14 @@ class JII {
   static jint DestroyJavaVM(JavaVM* vm) {
     printf("%s\n", __func__);
     JavaVMExt* pJvmE = reinterpret_cast<JavaVMExt*>(vm);
+    // Report how the hash tables and the collector behaved before they go away
+    DumpHashTableStats();
+    if (pJvmE->IsReady() == true) {
+      DumpGcStats(pJvmE->GetJniEnvExt()->GetGc());
+      if (pJvmE->GetJniEnvExt()->GetAllocTracker()) {
+        DumpAllocSites(pJvmE->GetJniEnvExt()->GetAllocTracker());
+      }
+    }
     delete pJvmE;
     return JNI_OK;
   }
@@ -77,12 +87,17 @@ JavaVMExt::JavaVMExt()
   if (jni_env_ == NULL) {
     return;
   }
+  // Objects allocated by OAT code come from this thread's TLAB
+  if (jni_env_->IsReady() == true) {
+    SetupTlab(jni_env_->GetGc());
+  }
   // Assign the function pointers
   functions = &gJniInvokeInterface;
 }
 
 JavaVMExt::~JavaVMExt() {
   if (jni_env_ != NULL) {
+    RevokeTlab();
     delete jni_env_;
     jni_env_ = NULL;
   }
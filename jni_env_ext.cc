@@ -28,9 +28,43 @@
 #include "debugger.h"
 #include "cart.h"
 #include "class.h"
+#include "gc.h"
+#include "entry.h"
 
 namespace cart {
 
+// Method of the class or of its nearest superclass declaring one of this
+// name and signature, NULL if there is none or it is static and is_static
+// is not, or the other way round
+static jmethodID FindMethodID(JNIEnv* env, jclass java_class, const char* name, const char* sig,
+                              bool is_static) {
+  if ((java_class == NULL) || (name == NULL) || (sig == NULL)) {
+    return NULL;
+  }
+  JNIEnvExt* pEnv = reinterpret_cast<JNIEnvExt*>(env);
+  Class_t* pClass = reinterpret_cast<Class_t*>(java_class);
+  Method_t* pMethod = NULL;
+  // Hashed once for every class walked
+  size_t len = strlen(name);
+  uint64_t hash = ClMethodHash((const uint8_t*)name, len, (const uint8_t*)sig);
+  while (pClass != NULL) {
+    pMethod = ClFindMethodHashed(pClass, hash, (const uint8_t*)name, len, (const uint8_t*)sig);
+    if ((pMethod != NULL) || (pClass->superclass_str == NULL)) {
+      break;
+    }
+    pClass = ClFindClass(pEnv->GetClassLinker(), pClass->superclass_str);
+  }
+  if (pMethod == NULL) {
+    pdbg("Cannot find method: \"%s%s\"\n", name, sig);
+    return NULL;
+  }
+  if (((pMethod->method_access_flags & CLASS_ACC_STATIC) != 0) != is_static) {
+    pdbg("Method \"%s%s\" is %sstatic\n", name, sig, is_static ? "not " : "");
+    return NULL;
+  }
+  return reinterpret_cast<jmethodID>(pMethod);
+}
+
 class JNI {
  public:
   static jint GetVersion(JNIEnv*) {
@@ -197,15 +231,13 @@ class JNI {
 
   static jmethodID GetMethodID(JNIEnv* env, jclass java_class, const char* name, const char* sig) {
     printf("%s\n", __func__);
-    jobject my = new _jobject();
-    return reinterpret_cast<jmethodID>(my);
+    return FindMethodID(env, java_class, name, sig, false);
   }
 
   static jmethodID GetStaticMethodID(JNIEnv* env, jclass java_class, const char* name,
                                      const char* sig) {
     printf("%s\n", __func__);
-    jobject my = new _jobject();
-    return reinterpret_cast<jmethodID>(my);
+    return FindMethodID(env, java_class, name, sig, true);
   }
 
   static jobject CallObjectMethod(JNIEnv* env, jobject obj, jmethodID mid, ...) {
@@ -815,16 +847,22 @@ class JNI {
 
   static void CallStaticVoidMethodV(JNIEnv* env, jclass klass, jmethodID mid, va_list args) {
     printf("%s\n", __func__);
-    Class_t* pClass = reinterpret_cast<Class_t*>(klass);
-    Method_t* pMethod = ClFindMethod(pClass, (const uint8_t*)"main");
+    Method_t* pMethod = reinterpret_cast<Method_t*>(mid);
     if (pMethod == NULL) {
-      pdbg("Cannot find method MAIN\n");
+      pdbg("Invalid method ID\n");
       return;
     }
-    // OAT code dump
-    DumpData(reinterpret_cast<const uint32_t*>(pMethod->method_oat_code), pMethod->method_oat_code_hdr->code_size_, 0);
-    // Execute the code
-    ExecuteOatCode(pMethod->method_oat_code);
+    // OAT code dump, abstract and native methods have no code
+    if (pMethod->method_oat_code && pMethod->method_oat_code_hdr) {
+      DumpData(reinterpret_cast<const uint32_t*>(pMethod->method_oat_code),
+               pMethod->method_oat_code_hdr->code_size_, 0);
+    }
+    // Execute the code, main takes its String[] as a null reference
+    uint32_t main_args[1] = { 0 };
+    uint64_t result;
+    if (!InvokeOatCode(pMethod, main_args, sizeof(main_args), &result)) {
+      pdbg("%s did not complete\n", pMethod->method_name_str);
+    }
   }
 
   static void CallStaticVoidMethodA(JNIEnv* env, jclass, jmethodID mid, jvalue* args) {
@@ -1408,13 +1446,16 @@ const JNINativeInterface gJniNativeInterface = {
 
 JNIEnvExt::JNIEnvExt()
   : oatdex_files_(NULL),
-    class_linker_(NULL) {
+    class_linker_(NULL),
+    gc_(NULL),
+    alloc_tracker_(NULL) {
   // Allocate a hash table for storing the list of OATDEX files
   oatdex_files_ = AllocHashTable(NULL, 5);
   if (!oatdex_files_) {
     pdbg("Out of memory\n");
     return;
   }
+  SetHashTableName(oatdex_files_, "jni.oatdex_files");
   // Allocate a classlinker
   class_linker_ = AllocateClassLinker(HEAP_START_SIZE);
   if (!class_linker_) {
@@ -1422,12 +1463,36 @@ JNIEnvExt::JNIEnvExt()
     FreeHashTable(oatdex_files_);
     return;
   }
+  // Objects in the class linker's heap are collected
+  gc_ = AllocGc(class_linker_->heap_vol);
+  if (!gc_) {
+    pdbg("Failed to allocate the garbage collector\n");
+    FreeClassLinker(class_linker_);
+    class_linker_ = NULL;
+    FreeHashTable(oatdex_files_);
+    return;
+  }
+  // Sweeping and trimming go on in the background, or inline without it
+  GcStartDaemon(gc_);
+  // Allocations are sampled by site, the VM runs without it as well
+  alloc_tracker_ = AllocAllocTracker(class_linker_, ALLOC_TRACKER_INTERVAL);
+  if (alloc_tracker_) {
+    GcSetAllocTracker(gc_, alloc_tracker_);
+  }
   // Register JNI interfaces
   functions = &gJniNativeInterface;
 }
 
 JNIEnvExt::~JNIEnvExt() {
   functions = NULL;
+  if (gc_) {
+    FreeGc(gc_);
+    gc_ = NULL;
+  }
+  if (alloc_tracker_) {
+    FreeAllocTracker(alloc_tracker_);
+    alloc_tracker_ = NULL;
+  }
   if (class_linker_) {
     DeregisterAllClasses(class_linker_);
     FreeClassLinker(class_linker_);
@@ -1447,8 +1512,16 @@ ClassLinker_t* JNIEnvExt::GetClassLinker() const {
   return class_linker_;
 }
 
+Gc_t* JNIEnvExt::GetGc() const {
+  return gc_;
+}
+
+AllocTracker_t* JNIEnvExt::GetAllocTracker() const {
+  return alloc_tracker_;
+}
+
 bool JNIEnvExt::IsReady() const {
-  if ((oatdex_files_ != NULL) && (class_linker_ != NULL)) {
+  if ((oatdex_files_ != NULL) && (class_linker_ != NULL) && (gc_ != NULL)) {
     return true;
   }
   return false;
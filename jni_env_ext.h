@@ -20,6 +20,7 @@
 #include "jni.h"
 #include "hash.h"
 #include "class.h"
+#include "gc.h"
 
 namespace cart {
 
@@ -29,11 +30,15 @@ struct JNIEnvExt : public JNIEnv {
 
   HashTable_t* GetOatDexFiles() const;
   ClassLinker_t* GetClassLinker() const;
+  Gc_t* GetGc() const;
+  AllocTracker_t* GetAllocTracker() const;
   bool IsReady() const;
 
  private:
   HashTable_t* oatdex_files_;
   ClassLinker_t* class_linker_;
+  Gc_t* gc_;
+  AllocTracker_t* alloc_tracker_;
 };
 
 }  // namespace cart
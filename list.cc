@@ -21,7 +21,7 @@
 void _LlAddObjectToHead(CommonLinkList **Phead, CommonLinkList *Pll) {
   if (*Phead) {
     Pll->Next = *Phead;
-    (*Phead)->Next = Pll;
+    *Phead = Pll;
   } else {
     *Phead = Pll;
   }
@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "macros.h"
+#include "cart.h"
+#include "los.h"
+
+static inline size_t _MapSize(size_t sz) {
+  return ((sz + PAGE_SIZE - 1) / PAGE_SIZE) * PAGE_SIZE;
+}
+
+// Index of the first object at or after ptr
+static size_t _LowerBound(LargeObjectSpace_t* pLos, const void* ptr) {
+  size_t lo = 0;
+  size_t hi = pLos->nr_objs;
+  while (lo < hi) {
+    size_t mid = lo + ((hi - lo) / 2);
+    if (pLos->objs[mid].begin < (const uint8_t*)ptr) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+LargeObjectSpace_t* AllocLargeObjectSpace(size_t max_sz) {
+  // Allocate a space structure and its first entries
+  LargeObjectSpace_t* pLos = (LargeObjectSpace_t*)malloc(sizeof(LargeObjectSpace_t));
+  if (!pLos) {
+    pdbg("Out of memory\n");
+    return NULL;
+  }
+  memset((void*)pLos, 0, sizeof(LargeObjectSpace_t));
+  pLos->objs = (LosObject_t*)malloc(sizeof(LosObject_t) * LOS_INIT_OBJECTS);
+  if (!pLos->objs) {
+    pdbg("Out of memory\n");
+    free((void*)pLos);
+    return NULL;
+  }
+  pLos->objs_cap = LOS_INIT_OBJECTS;
+  pLos->max_sz = max_sz;
+  pthread_mutex_init(&pLos->lock, NULL);
+  return pLos;
+}
+
+void FreeLargeObjectSpace(LargeObjectSpace_t* pLos) {
+  for (size_t i = 0; i < pLos->nr_objs; ++i) {
+    munmap((void*)pLos->objs[i].begin, _MapSize(pLos->objs[i].size));
+  }
+  free((void*)pLos->objs);
+  pthread_mutex_destroy(&pLos->lock);
+  free((void*)pLos);
+}
+
+// Fresh anonymous pages read as zero, nothing to clear
+void* LosAlloc(LargeObjectSpace_t* pLos, size_t sz) {
+  size_t map_sz = _MapSize(sz);
+  pthread_mutex_lock(&pLos->lock);
+  if ((pLos->alloced_sz + map_sz) > pLos->max_sz) {
+    pthread_mutex_unlock(&pLos->lock);
+    pdbg("Out of memory, large objects are limited to %u bytes\n", (unsigned int)pLos->max_sz);
+    return NULL;
+  }
+  if (pLos->nr_objs == pLos->objs_cap) {
+    size_t cap = pLos->objs_cap * 2;
+    LosObject_t* objs = (LosObject_t*)realloc((void*)pLos->objs, sizeof(LosObject_t) * cap);
+    if (!objs) {
+      pthread_mutex_unlock(&pLos->lock);
+      pdbg("Out of memory\n");
+      return NULL;
+    }
+    pLos->objs = objs;
+    pLos->objs_cap = cap;
+  }
+  void* p = mmap(NULL, map_sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    pthread_mutex_unlock(&pLos->lock);
+    pdbg("Failed to map a %u byte object\n", (unsigned int)sz);
+    return NULL;
+  }
+  // Keep the entries sorted
+  size_t idx = _LowerBound(pLos, p);
+  memmove((void*)(pLos->objs + idx + 1), (void*)(pLos->objs + idx),
+          sizeof(LosObject_t) * (pLos->nr_objs - idx));
+  pLos->objs[idx].begin = (uint8_t*)p;
+  pLos->objs[idx].size = sz;
+  pLos->objs[idx].marked = 0;
+  pLos->objs[idx].pad = 0;
+  pLos->nr_objs++;
+  pLos->alloced_sz += map_sz;
+  pthread_mutex_unlock(&pLos->lock);
+  return p;
+}
+
+bool LosFree(LargeObjectSpace_t* pLos, void* ptr) {
+  pthread_mutex_lock(&pLos->lock);
+  size_t idx = _LowerBound(pLos, ptr);
+  if ((idx == pLos->nr_objs) || (pLos->objs[idx].begin != (uint8_t*)ptr)) {
+    pthread_mutex_unlock(&pLos->lock);
+    pdbg("Cannot find pointer(%p) in the large object space\n", ptr);
+    return false;
+  }
+  size_t map_sz = _MapSize(pLos->objs[idx].size);
+  munmap(ptr, map_sz);
+  pLos->alloced_sz -= map_sz;
+  memmove((void*)(pLos->objs + idx), (void*)(pLos->objs + idx + 1),
+          sizeof(LosObject_t) * (pLos->nr_objs - idx - 1));
+  pLos->nr_objs--;
+  pthread_mutex_unlock(&pLos->lock);
+  return true;
+}
+
+size_t LosAllocedSize(LargeObjectSpace_t* pLos) {
+  pthread_mutex_lock(&pLos->lock);
+  size_t sz = pLos->alloced_sz;
+  pthread_mutex_unlock(&pLos->lock);
+  return sz;
+}
+
+LosObject_t* LosFind(LargeObjectSpace_t* pLos, const void* ptr) {
+  size_t idx = _LowerBound(pLos, ptr);
+  if ((idx == pLos->nr_objs) || (pLos->objs[idx].begin != (const uint8_t*)ptr)) {
+    return NULL;
+  }
+  return pLos->objs + idx;
+}
+
+// The survivors are compacted in place, they stay sorted
+size_t LosSweep(LargeObjectSpace_t* pLos, size_t* freed_objects) {
+  size_t freed_sz = 0;
+  size_t map_sz = 0;
+  size_t nr = 0;
+  pthread_mutex_lock(&pLos->lock);
+  for (size_t i = 0; i < pLos->nr_objs; ++i) {
+    LosObject_t* o = pLos->objs + i;
+    if (!o->marked) {
+      munmap((void*)o->begin, _MapSize(o->size));
+      map_sz += _MapSize(o->size);
+      freed_sz += o->size;
+      (*freed_objects)++;
+      continue;
+    }
+    o->marked = 0;
+    pLos->objs[nr++] = *o;
+  }
+  pLos->nr_objs = nr;
+  pLos->alloced_sz -= map_sz;
+  pthread_mutex_unlock(&pLos->lock);
+  return freed_sz;
+}
+
+void LosClearMarks(LargeObjectSpace_t* pLos) {
+  pthread_mutex_lock(&pLos->lock);
+  for (size_t i = 0; i < pLos->nr_objs; ++i) {
+    pLos->objs[i].marked = 0;
+  }
+  pthread_mutex_unlock(&pLos->lock);
+}
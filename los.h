@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Large object space header support
+ *
+ * Objects too big for the runs of the heap get a mapping of their own,
+ * given back to the system as soon as they are freed, so they never
+ * fragment the heap nor keep its pages committed. They are kept in an
+ * array sorted by address and take part in a trace through the mark flag
+ * of their entry.
+ */
+
+#ifndef CART_LOS_H_
+#define CART_LOS_H_
+
+#include <pthread.h>
+
+#define LOS_INIT_OBJECTS    64
+
+typedef struct PACKED {
+  uint8_t*  begin;
+  size_t    size;           // as requested, the mapping is rounded to pages
+  uint32_t  marked;         // set by a trace
+  uint32_t  pad;
+} LosObject_t;
+
+// Holds a pthread mutex, so it is not PACKED
+typedef struct _LargeObjectSpace {
+  LosObject_t*      objs;
+  size_t            nr_objs;
+  size_t            objs_cap;
+  size_t            alloced_sz;     // mapped bytes
+  size_t            max_sz;         // never maps past this
+  pthread_mutex_t   lock;
+} LargeObjectSpace_t;
+
+LargeObjectSpace_t* AllocLargeObjectSpace(size_t max_sz);
+void FreeLargeObjectSpace(LargeObjectSpace_t* pLos);
+// Zeroed, NULL past max_sz
+void* LosAlloc(LargeObjectSpace_t* pLos, size_t sz);
+bool LosFree(LargeObjectSpace_t* pLos, void* ptr);
+size_t LosAllocedSize(LargeObjectSpace_t* pLos);
+// Entry of the object starting at ptr, NULL if there is none. The caller
+// holds the lock or keeps the space from changing otherwise.
+LosObject_t* LosFind(LargeObjectSpace_t* pLos, const void* ptr);
+// Free the objects a trace did not mark and clear the marks of the others,
+// returns the bytes of the objects freed
+size_t LosSweep(LargeObjectSpace_t* pLos, size_t* freed_objects);
+void LosClearMarks(LargeObjectSpace_t* pLos);
+
+// True for the worker setting the flag, several may race for it
+static inline bool LosMark(LosObject_t* o) {
+  return !__atomic_exchange_n(&o->marked, 1, __ATOMIC_RELAXED);
+}
+
+#endif  // CART_LOS_H_
@@ -19,6 +19,9 @@
 
 #define PACKED __attribute__((packed))
 
+// Fails to compile when expr is false, msg names the check
+#define COMPILE_ASSERT(expr, msg) typedef char msg[(expr) ? 1 : -1] __attribute__((unused))
+
 #ifdef CART_DEBUG
 #define pdbg(fmt, ...) fprintf(stderr, \
                                "%s:%d:%s(): " fmt, \
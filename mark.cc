@@ -0,0 +1,410 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include "cart.h"
+#include "heap.h"
+#include "bitmap.h"
+#include "class.h"
+#include "mark.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Work-stealing deques                                                      //
+///////////////////////////////////////////////////////////////////////////////
+
+static MarkArray_t* _AllocMarkArray(size_t nr) {
+  MarkArray_t* array = (MarkArray_t*)malloc(sizeof(MarkArray_t) + (sizeof(Object_t*) * nr));
+  if (!array) {
+    pdbg("Out of memory\n");
+    return NULL;
+  }
+  array->Next = NULL;
+  array->mask = nr - 1;
+  return array;
+}
+
+static void _FreeMarkArrays(MarkArray_t* array) {
+  while (array) {
+    MarkArray_t* next = array->Next;
+    free((void*)array);
+    array = next;
+  }
+}
+
+static inline Object_t* _LoadSlot(MarkArray_t* array, intptr_t i) {
+  return __atomic_load_n(&array->slots[i & array->mask], __ATOMIC_RELAXED);
+}
+
+static inline void _StoreSlot(MarkArray_t* array, intptr_t i, Object_t* obj) {
+  __atomic_store_n(&array->slots[i & array->mask], obj, __ATOMIC_RELAXED);
+}
+
+// Only the owner grows its deque. Thieves may still read the old array, it
+// is freed once the trace is over.
+static MarkArray_t* _GrowDeque(MarkDeque_t* deque, intptr_t top, intptr_t bottom) {
+  MarkArray_t* old = deque->array;
+  MarkArray_t* array = _AllocMarkArray((old->mask + 1) * 2);
+  if (!array) {
+    return NULL;
+  }
+  for (intptr_t i = top; i < bottom; ++i) {
+    _StoreSlot(array, i, _LoadSlot(old, i));
+  }
+  old->Next = deque->retired;
+  deque->retired = old;
+  __atomic_store_n(&deque->array, array, __ATOMIC_RELEASE);
+  return array;
+}
+
+static bool _Push(MarkDeque_t* deque, Object_t* obj) {
+  intptr_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+  intptr_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  MarkArray_t* array = deque->array;
+  if ((size_t)(bottom - top) > array->mask) {
+    array = _GrowDeque(deque, top, bottom);
+    if (!array) {
+      return false;
+    }
+  }
+  _StoreSlot(array, bottom, obj);
+  __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+// The owner takes the newest entry, racing the thieves for the last one
+static Object_t* _Pop(MarkDeque_t* deque) {
+  intptr_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+  MarkArray_t* array = deque->array;
+  __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  intptr_t top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+  if (top > bottom) {
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  Object_t* obj = _LoadSlot(array, bottom);
+  if (top == bottom) {
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+      obj = NULL;
+    }
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+  }
+  return obj;
+}
+
+// Thieves take the oldest entry, NULL when empty or when another thief won
+static Object_t* _Steal(MarkDeque_t* deque) {
+  intptr_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  intptr_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+  if (top >= bottom) {
+    return NULL;
+  }
+  MarkArray_t* array = __atomic_load_n(&deque->array, __ATOMIC_ACQUIRE);
+  Object_t* obj = _LoadSlot(array, top);
+  if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    return NULL;
+  }
+  return obj;
+}
+
+static inline bool _IsDequeEmpty(MarkDeque_t* deque) {
+  return __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE) >=
+         __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Tracing                                                                   //
+///////////////////////////////////////////////////////////////////////////////
+
+// Values that are not the start of a live object are ignored. Workers race
+// for the mark, the one setting it owns the object.
+static inline bool _SetMark(const MarkSpace_t* space, Object_t* obj) {
+  if (!obj || ((uintptr_t)obj % HEAP_OBJECT_ALIGN)) {
+    return false;
+  }
+  size_t idx = ((uint8_t*)obj - space->base) / HEAP_OBJECT_ALIGN;
+  if (((uint8_t*)obj < space->base) || (idx >= space->nr_bits)) {
+    LosObject_t* o = space->los ? LosFind(space->los, obj) : NULL;
+    return o && LosMark(o);
+  }
+  if (!BitmapTest(space->live_bits, idx)) {
+    return false;
+  }
+  uint64_t bit = 1ULL << (idx % BITMAP_BITS_PER_WORD);
+  uint64_t* word = &space->mark_bits[idx / BITMAP_BITS_PER_WORD];
+  return !(__atomic_load_n(word, __ATOMIC_RELAXED) & bit) &&
+         !(__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit);
+}
+
+static inline void _MarkObject(MarkWorker_t* w, Object_t* obj) {
+  MarkPool_t* pool = w->pool;
+  if (!_SetMark(pool->job->space, obj)) {
+    return;
+  }
+  w->nr_marked++;
+  if (pool->job->visit) {
+    pool->job->visit(pool->job->arg, obj);
+  }
+  if (!_Push(&w->deque, obj)) {
+    __atomic_store_n(&pool->failed, true, __ATOMIC_RELAXED);
+  }
+}
+
+static void _ScanObject(MarkWorker_t* w, Object_t* obj) {
+  Class_t* pClass = obj->klass;
+  if (!pClass) {
+    return;
+  }
+  if (pClass->class_flags & CLASS_FLAG_REF_ARRAY) {
+    Array_t* arr = (Array_t*)obj;
+    Object_t** elems = (Object_t**)arr->data;
+    for (uint32_t i = 0; i < arr->length; ++i) {
+      _MarkObject(w, elems[i]);
+    }
+    return;
+  }
+  for (uint32_t i = 0; i < pClass->nr_ref_offsets; ++i) {
+    _MarkObject(w, *(Object_t**)((uint8_t*)obj + pClass->ref_offsets[i]));
+  }
+}
+
+static Object_t* _StealWork(MarkWorker_t* w) {
+  MarkPool_t* pool = w->pool;
+  int nr = pool->nr_workers;
+  w->seed = (w->seed * 1103515245) + 12345;
+  int start = (int)((w->seed >> 16) % nr);
+  for (int i = 0; i < nr; ++i) {
+    int victim = (start + i) % nr;
+    if (victim == w->id) {
+      continue;
+    }
+    Object_t* obj = _Steal(&pool->workers[victim].deque);
+    if (obj) {
+      return obj;
+    }
+  }
+  return NULL;
+}
+
+static bool _AnyWork(MarkPool_t* pool) {
+  for (int i = 0; i < pool->nr_workers; ++i) {
+    if (!_IsDequeEmpty(&pool->workers[i].deque)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Drain the own deque, then steal. A worker out of both waits at the
+// barrier until all of them are, or until some deque fills up again.
+static void _Work(MarkWorker_t* w) {
+  MarkPool_t* pool = w->pool;
+  for (;;) {
+    Object_t* obj;
+    while ((obj = _Pop(&w->deque))) {
+      _ScanObject(w, obj);
+    }
+    obj = _StealWork(w);
+    if (obj) {
+      _ScanObject(w, obj);
+      continue;
+    }
+
+    __atomic_add_fetch(&pool->nr_idle, 1, __ATOMIC_SEQ_CST);
+    for (;;) {
+      if (__atomic_load_n(&pool->nr_idle, __ATOMIC_SEQ_CST) == pool->nr_workers) {
+        return;
+      }
+      if (_AnyWork(pool)) {
+        break;
+      }
+      sched_yield();
+    }
+    __atomic_sub_fetch(&pool->nr_idle, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+static void* _WorkerMain(void* arg) {
+  MarkWorker_t* w = (MarkWorker_t*)arg;
+  MarkPool_t* pool = w->pool;
+  uint32_t seen = 0;
+  MutexLock(&pool->job_lock);
+  for (;;) {
+    while (!pool->quit && (pool->generation == seen)) {
+      MutexWait(&pool->job_lock, &pool->job_cond);
+    }
+    if (pool->quit) {
+      break;
+    }
+    seen = pool->generation;
+    if (w->id < pool->nr_workers) {
+      MutexUnlock(&pool->job_lock);
+      _Work(w);
+      MutexLock(&pool->job_lock);
+    }
+    if (--pool->nr_running == 0) {
+      pthread_cond_signal(&pool->done_cond);
+    }
+  }
+  MutexUnlock(&pool->job_lock);
+  return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Interface                                                                 //
+///////////////////////////////////////////////////////////////////////////////
+
+MarkPool_t* AllocMarkPool(int nr_threads) {
+  if (nr_threads < 1) {
+    nr_threads = 1;
+  } else if (nr_threads > MARK_MAX_THREADS) {
+    nr_threads = MARK_MAX_THREADS;
+  }
+
+  // Allocate a pool structure and the workers, a deque apiece
+  MarkPool_t* pool = (MarkPool_t*)malloc(sizeof(MarkPool_t));
+  if (!pool) {
+    pdbg("Out of memory\n");
+    return NULL;
+  }
+  memset((void*)pool, 0, sizeof(MarkPool_t));
+  void* workers = NULL;
+  if (posix_memalign(&workers, MARK_CACHE_LINE, sizeof(MarkWorker_t) * nr_threads)) {
+    pdbg("Out of memory\n");
+    free((void*)pool);
+    return NULL;
+  }
+  memset(workers, 0, sizeof(MarkWorker_t) * nr_threads);
+  pool->workers = (MarkWorker_t*)workers;
+  for (int i = 0; i < nr_threads; ++i) {
+    MarkWorker_t* w = &pool->workers[i];
+    w->pool = pool;
+    w->id = i;
+    w->seed = ((uint32_t)i * 2654435761U) + 1;
+    w->deque.array = _AllocMarkArray(MARK_DEQUE_SIZE);
+    if (!w->deque.array) {
+      for (int j = 0; j < i; ++j) {
+        free((void*)pool->workers[j].deque.array);
+      }
+      free(workers);
+      free((void*)pool);
+      return NULL;
+    }
+  }
+  InitMutex(&pool->bitmap_lock, "heap bitmap lock", kHeapBitmapLock);
+  InitMutex(&pool->job_lock, "mark sweep mark stack lock", kMarkSweepMarkStackLock);
+  pthread_cond_init(&pool->job_cond, NULL);
+  pthread_cond_init(&pool->done_cond, NULL);
+
+  // The caller is worker 0, the others get a thread. Tracing goes on with
+  // fewer workers when threads cannot be had.
+  pool->nr_threads = 1;
+  for (int i = 1; i < nr_threads; ++i) {
+    if (pthread_create(&pool->workers[i].thread, NULL, _WorkerMain, (void*)&pool->workers[i])) {
+      pdbg("Marking with %d threads only\n", i);
+      for (int j = i; j < nr_threads; ++j) {
+        free((void*)pool->workers[j].deque.array);
+      }
+      break;
+    }
+    pool->nr_threads++;
+  }
+  return pool;
+}
+
+void FreeMarkPool(MarkPool_t* pool) {
+  MutexLock(&pool->job_lock);
+  pool->quit = true;
+  pthread_cond_broadcast(&pool->job_cond);
+  MutexUnlock(&pool->job_lock);
+  for (int i = 0; i < pool->nr_threads; ++i) {
+    if (i) {
+      pthread_join(pool->workers[i].thread, NULL);
+    }
+    free((void*)pool->workers[i].deque.array);
+  }
+  DestroyMutex(&pool->bitmap_lock);
+  DestroyMutex(&pool->job_lock);
+  pthread_cond_destroy(&pool->job_cond);
+  pthread_cond_destroy(&pool->done_cond);
+  free((void*)pool->workers);
+  free((void*)pool);
+}
+
+// Marks set by earlier traces stay, their objects are neither visited nor
+// scanned again
+bool MarkPoolTrace(MarkPool_t* pool, MarkJob_t* job) {
+  MutexLock(&pool->bitmap_lock);
+  int nr = job->nr_threads;
+  if (nr < 1) {
+    nr = 1;
+  } else if (nr > pool->nr_threads) {
+    nr = pool->nr_threads;
+  }
+  pool->job = job;
+  pool->nr_workers = nr;
+  pool->nr_idle = 0;
+  pool->failed = false;
+  for (int i = 0; i < nr; ++i) {
+    pool->workers[i].deque.top = 0;
+    pool->workers[i].deque.bottom = 0;
+    pool->workers[i].nr_marked = 0;
+  }
+
+  // Spread the roots over the deques, the pool threads are still waiting
+  for (size_t i = 0; i < job->nr_roots; ++i) {
+    _MarkObject(&pool->workers[i % nr], job->roots[i]);
+  }
+
+  // Trace along with the pool threads and wait for all of them
+  if (nr > 1) {
+    MutexLock(&pool->job_lock);
+    pool->nr_running = pool->nr_threads - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->job_cond);
+    MutexUnlock(&pool->job_lock);
+  }
+  _Work(&pool->workers[0]);
+  if (nr > 1) {
+    MutexLock(&pool->job_lock);
+    while (pool->nr_running) {
+      MutexWait(&pool->job_lock, &pool->done_cond);
+    }
+    MutexUnlock(&pool->job_lock);
+  }
+
+  job->nr_marked = 0;
+  for (int i = 0; i < nr; ++i) {
+    job->nr_marked += pool->workers[i].nr_marked;
+    _FreeMarkArrays(pool->workers[i].deque.retired);
+    pool->workers[i].deque.retired = NULL;
+  }
+  bool ok = !pool->failed;
+  pool->job = NULL;
+  MutexUnlock(&pool->bitmap_lock);
+  if (!ok) {
+    pdbg("Trace incomplete, out of memory for the mark stacks\n");
+  }
+  return ok;
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Mark header support
+ *
+ * A parallel tracer over the objects of a heap. It marks everything
+ * reachable from a set of roots in a mark bitmap, calling a visitor once
+ * for every object it marks, so the same engine serves collections, heap
+ * verification and heap dumps.
+ *
+ * The calling thread and up to MARK_MAX_THREADS - 1 pool threads trace
+ * together. Each one pops grey objects from the bottom of its own Chase-Lev
+ * deque and steals from the top of the others' when it runs dry. The trace
+ * ends once every worker is idle at the same time, nothing can be left in
+ * any deque then since only a busy worker pushes.
+ */
+
+#ifndef CART_MARK_H_
+#define CART_MARK_H_
+
+#include <pthread.h>
+
+#include "class.h"
+#include "mutex.h"
+#include "los.h"
+
+#define MARK_MAX_THREADS    16
+// Initial deque slots, a power of two
+#define MARK_DEQUE_SIZE     4096
+#define MARK_CACHE_LINE     64
+
+// Mark bits of a heap, one for each HEAP_OBJECT_ALIGN bytes from base. Only
+// values hitting a live bit or a large object are taken as objects, so
+// roots may be conservative.
+typedef struct {
+  uint8_t*              base;
+  size_t                nr_bits;
+  const uint64_t*       live_bits;
+  uint64_t*             mark_bits;
+  LargeObjectSpace_t*   los;          // may be NULL, not changing meanwhile
+} MarkSpace_t;
+
+// Called by whichever worker marks obj, possibly from several threads at once
+typedef void (*HeapVisitor_t)(void* arg, Object_t* obj);
+
+typedef struct _MarkArray {
+  struct _MarkArray*  Next;     // arrays retired by a resize
+  size_t              mask;
+  Object_t*           slots[0];
+} MarkArray_t;
+
+// The owner pushes and pops at bottom, thieves take from top. Each deque
+// sits on its own cache lines.
+typedef struct {
+  intptr_t      top __attribute__((aligned(MARK_CACHE_LINE)));
+  intptr_t      bottom __attribute__((aligned(MARK_CACHE_LINE)));
+  MarkArray_t*  array;
+  MarkArray_t*  retired;
+} MarkDeque_t;
+
+struct _MarkPool;
+
+typedef struct {
+  MarkDeque_t         deque;
+  struct _MarkPool*   pool;
+  int                 id;
+  pthread_t           thread;
+  uint32_t            seed;         // picks the first victim to steal from
+  size_t              nr_marked;
+} MarkWorker_t;
+
+typedef struct {
+  const MarkSpace_t*  space;
+  Object_t**          roots;
+  size_t              nr_roots;
+  HeapVisitor_t       visit;        // may be NULL
+  void*               arg;
+  int                 nr_threads;   // workers wanted, the caller included
+  size_t              nr_marked;    // out
+} MarkJob_t;
+
+// Holds pthread mutexes, so it is not PACKED
+typedef struct _MarkPool {
+  int               nr_threads;
+  MarkWorker_t*     workers;
+  // One trace at a time over the mark bitmap
+  Mutex_t           bitmap_lock;
+  // Hands jobs to the pool threads
+  Mutex_t           job_lock;
+  pthread_cond_t    job_cond;
+  pthread_cond_t    done_cond;
+  uint32_t          generation;
+  int               nr_running;     // pool threads not done with the job
+  bool              quit;
+  // Current job
+  MarkJob_t*        job;
+  int               nr_workers;
+  int               nr_idle;
+  bool              failed;
+} MarkPool_t;
+
+MarkPool_t* AllocMarkPool(int nr_threads);
+void FreeMarkPool(MarkPool_t* pool);
+// False when a deque could not grow, marking is then incomplete
+bool MarkPoolTrace(MarkPool_t* pool, MarkJob_t* job);
+
+#endif  // CART_MARK_H_
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "macros.h"
+#include "mutex.h"
+
+#ifdef CART_DEBUG
+// One bit per lock level, it must fit the mask
+typedef char _LockLevelsFit[(kLockLevelCount <= 64) ? 1 : -1];
+
+// Levels of the locks the current thread holds
+static __thread uint64_t held_levels = 0;
+
+static inline void _CheckLockOrder(Mutex_t* pMutex) {
+  if (held_levels & ((2ULL << pMutex->level) - 1)) {
+    pdbg("Lock order violation, %s taken while holding a lock of level %d or less\n",
+         pMutex->name, (int)pMutex->level);
+  }
+}
+#endif
+
+void InitMutex(Mutex_t* pMutex, const char* name, enum LockLevel level) {
+  pthread_mutex_init(&pMutex->mu, NULL);
+  pMutex->level = level;
+  pMutex->name = name;
+}
+
+void DestroyMutex(Mutex_t* pMutex) {
+  pthread_mutex_destroy(&pMutex->mu);
+}
+
+void MutexLock(Mutex_t* pMutex) {
+#ifdef CART_DEBUG
+  _CheckLockOrder(pMutex);
+#endif
+  pthread_mutex_lock(&pMutex->mu);
+#ifdef CART_DEBUG
+  held_levels |= 1ULL << pMutex->level;
+#endif
+}
+
+void MutexUnlock(Mutex_t* pMutex) {
+#ifdef CART_DEBUG
+  held_levels &= ~(1ULL << pMutex->level);
+#endif
+  pthread_mutex_unlock(&pMutex->mu);
+}
+
+void MutexWait(Mutex_t* pMutex, pthread_cond_t* cond) {
+  pthread_cond_wait(cond, &pMutex->mu);
+}
+
+bool MutexTimedWait(Mutex_t* pMutex, pthread_cond_t* cond, unsigned int ms) {
+  // Condition variables wait for a deadline of the realtime clock
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += ms / 1000;
+  ts.tv_nsec += (long)(ms % 1000) * 1000000L;
+  if (ts.tv_nsec >= 1000000000L) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000L;
+  }
+  return pthread_cond_timedwait(cond, &pMutex->mu, &ts) == 0;
+}
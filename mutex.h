@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Mutex header support
+ *
+ * Locks are ranked by the ART lock levels. A thread may only take a lock of
+ * a lower level than every lock it already holds, which CART_DEBUG builds
+ * check on each acquisition.
+ */
+
+#ifndef CART_MUTEX_H_
+#define CART_MUTEX_H_
+
+#include <pthread.h>
+
+enum LockLevel {
+  kLoggingLock = 0,
+  kMemMapsLock,
+  kSwapMutexesLock,
+  kUnexpectedSignalLock,
+  kThreadSuspendCountLock,
+  kAbortLock,
+  kJdwpSocketLock,
+  kReferenceQueueSoftReferencesLock,
+  kReferenceQueuePhantomReferencesLock,
+  kReferenceQueueFinalizerReferencesLock,
+  kReferenceQueueWeakReferencesLock,
+  kReferenceQueueClearedReferencesLock,
+  kReferenceProcessorLock,
+  kRosAllocGlobalLock,
+  kRosAllocBracketLock,
+  kRosAllocBulkFreeLock,
+  kAllocSpaceLock,
+  kDexFileMethodInlinerLock,
+  kDexFileToMethodInlinerMapLock,
+  kMarkSweepMarkStackLock,
+  kTransactionLogLock,
+  kInternTableLock,
+  kOatFileSecondaryLookupLock,
+  kDefaultMutexLevel,
+  kMarkSweepLargeObjectLock,
+  kPinTableLock,
+  kLoadLibraryLock,
+  kJdwpObjectRegistryLock,
+  kModifyLdtLock,
+  kAllocatedThreadIdsLock,
+  kMonitorPoolLock,
+  kClassLinkerClassesLock,
+  kBreakpointLock,
+  kMonitorLock,
+  kMonitorListLock,
+  kThreadListLock,
+  kBreakpointInvokeLock,
+  kAllocTrackerLock,
+  kDeoptimizationLock,
+  kProfilerLock,
+  kJdwpEventListLock,
+  kJdwpAttachLock,
+  kJdwpStartLock,
+  kArtdbgStartLock,
+  kRuntimeShutdownLock,
+  kTraceLock,
+  kHeapBitmapLock,
+  kMutatorLock,
+  kInstrumentEntrypointsLock,
+  kThreadListSuspendThreadLock,
+  kZygoteCreationLock,
+
+  kLockLevelCount  // Must come last.
+};
+
+// Holds a pthread mutex, so it is not PACKED
+typedef struct {
+  pthread_mutex_t   mu;
+  enum LockLevel    level;
+  const char*       name;
+} Mutex_t;
+
+void InitMutex(Mutex_t* pMutex, const char* name, enum LockLevel level);
+void DestroyMutex(Mutex_t* pMutex);
+void MutexLock(Mutex_t* pMutex);
+void MutexUnlock(Mutex_t* pMutex);
+// The lock stays held by the caller as far as the level check goes
+void MutexWait(Mutex_t* pMutex, pthread_cond_t* cond);
+// Returns false when ms milliseconds passed without a signal
+bool MutexTimedWait(Mutex_t* pMutex, pthread_cond_t* cond, unsigned int ms);
+
+#endif  // CART_MUTEX_H_
@@ -81,6 +81,7 @@ int32_t isIPv4Format(const int8_t *str) {
 
 int32_t initializeSocket(int32_t *fd, int8_t *addr, int32_t port) {
   int32_t sts = 0;
+  int32_t reuse = 1;
   struct sockaddr_in servaddr;
   int8_t def_ip[] = "0.0.0.0";
 
@@ -111,6 +112,9 @@ int32_t initializeSocket(int32_t *fd, int8_t *addr, int32_t port) {
     goto ErrExit;
   }
 
+  // A restarted server takes the port over from connections still closing
+  setsockopt(*fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
   // Bind network port
   if (bind(*fd, (struct sockaddr *)&servaddr, sizeof(struct sockaddr_in)) < 0) {
     sts = -1;
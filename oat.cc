@@ -31,6 +31,50 @@
 #include "elf.h"
 #include "cart.h"
 
+// Files get their code on huge pages when set
+static bool oat_huge_pages = false;
+
+// Move the mapping of the file so that .text starts on a huge page boundary,
+// then the whole huge pages of it up to OAT_HUGE_TEXT_MAX onto huge pages
+static void _MapTextOnHugePages(OatDexFile_t* pOatDexFile) {
+  size_t text_off = pOatDexFile->oat_code - (const uint8_t*)pOatDexFile->mem_ptr;
+  size_t text_sz = pOatDexFile->oat_code_sz;
+  size_t mem_sz = pOatDexFile->mem_sz;
+  if (text_sz > OAT_HUGE_TEXT_MAX) {
+    text_sz = OAT_HUGE_TEXT_MAX;
+  }
+  if (text_sz < HUGE_PAGE_SIZE) {
+    pdbg("Code of %s is too small for huge pages\n", pOatDexFile->file_name);
+    return;
+  }
+
+  // The mapping moves into a reservation big enough to align it
+  uint8_t* r = (uint8_t*)mmap(NULL, mem_sz + HUGE_PAGE_SIZE, PROT_NONE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (r != MAP_FAILED) {
+    uintptr_t text = ((uintptr_t)r + text_off + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1);
+    uint8_t* p = (uint8_t*)(text - text_off);
+    if (mremap((void*)pOatDexFile->mem_ptr, mem_sz, mem_sz, MREMAP_MAYMOVE | MREMAP_FIXED, p) == MAP_FAILED) {
+      munmap(r, mem_sz + HUGE_PAGE_SIZE);
+    } else {
+      if (p > r) {
+        munmap(r, p - r);
+      }
+      munmap(p + mem_sz, (r + HUGE_PAGE_SIZE) - p);
+      pOatDexFile->mem_ptr = p;
+      ParseElfFile(pOatDexFile);
+    }
+  }
+
+  // What is not aligned stays on small pages
+  pOatDexFile->huge_text_sz = RemapHugePages((void*)pOatDexFile->oat_code, text_sz, PROT_READ | PROT_EXEC);
+  pdbg("%u bytes of code of %s on huge pages\n", (unsigned int)pOatDexFile->huge_text_sz, pOatDexFile->file_name);
+}
+
+void OatUseHugePages(bool enable) {
+  oat_huge_pages = enable;
+}
+
 OatDexFile_t* OpenOatDexFile(const uint8_t* path) {
   OatDexFile_t* pOatDexFile = NULL;
   int32_t fd;
@@ -88,6 +132,10 @@ OatDexFile_t* OpenOatDexFile(const uint8_t* path) {
     return NULL;
   }
 
+  if (oat_huge_pages) {
+    _MapTextOnHugePages(pOatDexFile);
+  }
+
   // Parse the OatDex file
   if (ParseOatDexFile(pOatDexFile) == false) {
     pdbg("Failed to parse OatDex file %s\n", path);
@@ -220,8 +268,13 @@ bool ParseOatDexFile(OatDexFile_t* pOatDexFile) {
     // Move to next record of the DEX table
     dex_tbl += (sizeof(*pDexFileData->oat_class_ptrs) * pDexFileData->nr_classes);
 
-    // Insert this DEX file data into linklist
-    LlAddObjectToHead(pOatDexFile->dex_files, pDexFileData);
+    // Append this DEX file data to the linklist, the DEX files stay in the
+    // order of the OAT file
+    if (pOatDexFile->dex_files) {
+      LlAddObjectToTail(pOatDexFile->dex_files, pDexFileData);
+    } else {
+      pOatDexFile->dex_files = pDexFileData;
+    }
   }
 
   // Return
@@ -297,7 +350,7 @@ const uint8_t* GetProtoReturnTypeStringById(DexFileData_t* pDexFileData, uint32_
   }
   // Get the string of the specified id
   ProtoId_t* pProtoId = (((ProtoId_t*)(pDexFileData->dex_file_ptr + pDexHdr->proto_ids_off_)) + proto_id);
-  return GetStringById(pDexFileData, pProtoId->return_type_idx_);
+  return GetTypeStringById(pDexFileData, pProtoId->return_type_idx_);
 }
 
 const TypeList_t* GetProtoTypeListById(DexFileData_t* pDexFileData, uint32_t proto_id) {
@@ -308,13 +361,17 @@ const TypeList_t* GetProtoTypeListById(DexFileData_t* pDexFileData, uint32_t pro
   }
   // Get the pointer of the specified type id
   ProtoId_t* pProtoId = (((ProtoId_t*)(pDexFileData->dex_file_ptr + pDexHdr->proto_ids_off_)) + proto_id);
+  // No parameters
+  if (pProtoId->parameters_off_ == 0) {
+    return NULL;
+  }
   return (const TypeList_t*)(pDexFileData->dex_file_ptr + pProtoId->parameters_off_);
 }
 
 uint32_t GetProtoTypeIdOfTypeListByIdx(DexFileData_t* pDexFileData, uint32_t proto_id, uint32_t type_idx) {
   const TypeList_t* pTypeList = GetProtoTypeListById(pDexFileData, proto_id);
   // Boundary check
-  if (type_idx >= pTypeList->size_) {
+  if (!pTypeList || (type_idx >= pTypeList->size_)) {
     return 0;
   }
   // Get the type id
@@ -396,6 +453,17 @@ uint32_t GetMethodProtoIdById(DexFileData_t* pDexFileData, uint32_t method_id) {
   return pMethodId->proto_idx_;
 }
 
+uint32_t GetMethodNameIdById(DexFileData_t* pDexFileData, uint32_t method_id) {
+  DexHdr_t* pDexHdr = (DexHdr_t*)pDexFileData->dex_file_ptr;
+  // Boundary check
+  if (method_id >= pDexHdr->method_ids_size_) {
+    return 0;
+  }
+  // Get the id
+  MethodId_t* pMethodId = (((MethodId_t*)(pDexFileData->dex_file_ptr + pDexHdr->method_ids_off_)) + method_id);
+  return pMethodId->name_idx_;
+}
+
 const uint8_t* GetMethodProtoStringById(DexFileData_t* pDexFileData, uint32_t method_id) {
   // Get the string
   return GetTypeStringById(pDexFileData, GetMethodProtoIdById(pDexFileData, method_id));
@@ -457,7 +525,8 @@ const uint8_t* GetSourcefileStringOfClassDefByIdx(DexFileData_t* pDexFileData, u
 
 const uint8_t* GetClassDataHdrPtrOfClassDefByIdx(DexFileData_t* pDexFileData, uint32_t class_idx) {
   const ClassDef_t* pClassDef = GetClassDefByIdx(pDexFileData, class_idx);
-  if (!pClassDef) {
+  // Classes without fields and methods have no class data
+  if (!pClassDef || !pClassDef->class_data_off_) {
     return 0;
   }
   return (pDexFileData->dex_file_ptr + pClassDef->class_data_off_);
@@ -471,100 +540,17 @@ const uint8_t* ComputeClassDataHdr(const uint8_t* hdr, ClassDataHdr_t* pClassDat
   return hdr;
 }
 
-const uint8_t* GetStaticFieldOfClassDataByIdx(const ClassDataHdr_t* pClassDataHdr,
-                                              const uint8_t* end,
-                                              ClassDataField_t* pClassDataField,
-                                              uint32_t field_idx) {
-  if (!pClassDataHdr->static_fields_size_) {
-    return end;
-  }
-  if (field_idx >= pClassDataHdr->static_fields_size_) {
-    field_idx = pClassDataHdr->static_fields_size_ - 1;
-  }
-  for (uint32_t i = 0; i <= field_idx; ++i) {
-    pClassDataField->field_idx_delta_ = DecodeUnsignedLeb128(&end);
-    pClassDataField->access_flags_ = DecodeUnsignedLeb128(&end);
-  }
-  return end;
-}
-
-const uint8_t* GetInstanceFieldOfClassDataByIdx(const ClassDataHdr_t* pClassDataHdr,
-                                                const uint8_t* end,
-                                                ClassDataField_t* pClassDataField,
-                                                uint32_t field_idx) {
-  if (!pClassDataHdr->instance_fields_size_) {
-    return end;
-  }
-  if (field_idx >= pClassDataHdr->instance_fields_size_) {
-    field_idx = pClassDataHdr->instance_fields_size_ - 1;
-  }
-  for (uint32_t i = 0; i <= field_idx; ++i) {
-    pClassDataField->field_idx_delta_ = DecodeUnsignedLeb128(&end);
-    pClassDataField->access_flags_ = DecodeUnsignedLeb128(&end);
-  }
-  return end;
-}
-
-const uint8_t* GetDirectMethodOfClassDataByIdx(const ClassDataHdr_t* pClassDataHdr,
-                                               const uint8_t* end,
-                                               ClassDataMethod_t* pClassDataMethod,
-                                               uint32_t method_idx) {
-  if (!pClassDataHdr->direct_methods_size_) {
-    return end;
-  }
-  if (method_idx >= pClassDataHdr->direct_methods_size_) {
-    method_idx = pClassDataHdr->direct_methods_size_ - 1;
-  }
-  for (uint32_t i = 0; i <= method_idx; ++i) {
-    pClassDataMethod->method_idx_delta_ = DecodeUnsignedLeb128(&end);
-    pClassDataMethod->access_flags_ = DecodeUnsignedLeb128(&end);
-    pClassDataMethod->code_off_ = DecodeUnsignedLeb128(&end);
-  }
-  return end;
-}
-
-const uint8_t* GetVirtualMethodOfClassDataByIdx(const ClassDataHdr_t* pClassDataHdr,
-                                                const uint8_t* end,
-                                                ClassDataMethod_t* pClassDataMethod,
-                                                uint32_t method_idx) {
-  if (!pClassDataHdr->virtual_methods_size_) {
-    return end;
-  }
-  if (method_idx >= pClassDataHdr->virtual_methods_size_) {
-    method_idx = pClassDataHdr->virtual_methods_size_ - 1;
-  }
-  for (uint32_t i = 0; i <= method_idx; ++i) {
-    pClassDataMethod->method_idx_delta_ = DecodeUnsignedLeb128(&end);
-    pClassDataMethod->access_flags_ = DecodeUnsignedLeb128(&end);
-    pClassDataMethod->code_off_ = DecodeUnsignedLeb128(&end);
+const CodeItem_t* GetDexCodeItemByOff(DexFileData_t* pDexFileData, uint32_t code_off) {
+  // Abstract and native methods have no code
+  if (!code_off) {
+    return NULL;
   }
-  return end;
-}
-
-const uint8_t* GetMethodNameStringOfCDM(DexFileData_t* pDexFileData, const ClassDataMethod_t* pCDM) {
-  return GetMethodNameStringById(pDexFileData, pCDM->method_idx_delta_);
-}
-
-uint32_t GetProtoIdOfCDM(DexFileData_t* pDexFileData, const ClassDataMethod_t* pCDM) {
-  return GetMethodProtoIdById(pDexFileData, pCDM->method_idx_delta_);
-}
-
-const uint8_t* GetProtoShortyStringOfCDM(DexFileData_t* pDexFileData, const ClassDataMethod_t* pCDM) {
-  return GetProtoShortyStringById(pDexFileData, GetProtoIdOfCDM(pDexFileData, pCDM));
+  return (const CodeItem_t*)(pDexFileData->dex_file_ptr + code_off);
 }
 
-const uint8_t* GetProtoReturnTypeStringOfCDM(DexFileData_t* pDexFileData, const ClassDataMethod_t* pCDM) {
-  return GetProtoReturnTypeStringById(pDexFileData, GetProtoIdOfCDM(pDexFileData, pCDM));
-}
-
-const CodeItem_t* GetDexCodeItemOfCDM(DexFileData_t* pDexFileData, const ClassDataMethod_t* pCDM) {
-  CodeItem_t* pCodeItem = (CodeItem_t*)(pDexFileData->dex_file_ptr + pCDM->code_off_);
-  return pCodeItem;
-}
-
-const uint16_t* GetDexCodePtrOfCDM(DexFileData_t* pDexFileData, const ClassDataMethod_t* pCDM) {
-  const CodeItem_t* pCodeItem = GetDexCodeItemOfCDM(pDexFileData, pCDM);
-  return pCodeItem->insns_;
+const uint16_t* GetDexCodePtrByOff(DexFileData_t* pDexFileData, uint32_t code_off) {
+  const CodeItem_t* pCodeItem = GetDexCodeItemByOff(pDexFileData, code_off);
+  return pCodeItem ? pCodeItem->insns_ : NULL;
 }
 
 uint32_t GetAmountOfMethodsByIdx(DexFileData_t* pDexFileData, uint32_t class_idx) {
@@ -625,7 +611,7 @@ const uint8_t* GetOatGcMapPtrByIdx(DexFileData_t* pDexFileData,
                                                         oat_base,
                                                         class_idx,
                                                         oat_method_idx);
-  if (!pOMO) {
+  if (!pOMO || !pOMO->gc_map_offset_) {
     return NULL;
   }
   return (oat_base + pOMO->gc_map_offset_);
@@ -639,3 +625,46 @@ const OatQuickMethodHdr_t* GetOatQuickMethodHdrByIdx(DexFileData_t* pDexFileData
   ptr -= sizeof(OatQuickMethodHdr_t);
   return (OatQuickMethodHdr_t*)ptr;
 }
+
+// A native GC map is a hash table of the safepoints of a method:
+//   byte 0 bits 0-2   bytes per native pc offset
+//   bytes 0-1 >> 3    bytes per reference bitmap, one bit per vreg
+//   bytes 2-3         number of entries
+// followed by the entries, each a native pc offset and its bitmap
+static inline uint32_t _HashNativePcOffset(uint32_t native_pc_offset) {
+  uint32_t hash = native_pc_offset;
+  hash ^= (hash >> 20) ^ (hash >> 12);
+  hash ^= (hash >> 7) ^ (hash >> 4);
+  return hash;
+}
+
+const uint8_t* FindOatGcMapRefBitmap(const uint8_t* gc_map,
+                                     uint32_t native_pc_offset,
+                                     size_t* nr_bytes) {
+  if (!gc_map) {
+    return NULL;
+  }
+  size_t pc_width = gc_map[0] & 7;
+  size_t reg_width = (gc_map[0] | (gc_map[1] << 8)) >> 3;
+  size_t nr_entries = gc_map[2] | (gc_map[3] << 8);
+  size_t entry_width = pc_width + reg_width;
+  const uint8_t* table = gc_map + 4;
+  if (!nr_entries) {
+    return NULL;
+  }
+  // Linear probing from the hashed slot
+  size_t idx = _HashNativePcOffset(native_pc_offset) % nr_entries;
+  for (size_t i = 0; i < nr_entries; ++i) {
+    const uint8_t* entry = table + (idx * entry_width);
+    uint32_t pc = 0;
+    for (size_t j = 0; j < pc_width; ++j) {
+      pc |= (uint32_t)entry[j] << (j * 8);
+    }
+    if (pc == native_pc_offset) {
+      *nr_bytes = reg_width;
+      return entry + pc_width;
+    }
+    idx = (idx + 1) % nr_entries;
+  }
+  return NULL;
+}
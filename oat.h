@@ -27,6 +27,8 @@
 #define OAT_DATA_SECNAME    ".rodata"
 #define OAT_TEXT_SECNAME    ".text"
 #define kSha1DigestSize     20
+// Code put on huge pages at most, from the start of .text
+#define OAT_HUGE_TEXT_MAX   (32 * 1024 * 1024)
 
 enum OatClassType {
   kOatClassAllCompiled = 0,   // OatClass is followed by an OatMethodOffsets for each method.
@@ -168,6 +170,7 @@ typedef struct PACKED {
   uint32_t           oat_data_sz;
   const uint8_t*     oat_code;
   uint32_t           oat_code_sz;
+  size_t             huge_text_sz;  // bytes of code on huge pages
   // OatDex handler
   const OatHdr_t*    oat_hdr;
   DexFileData_t*     dex_files;
@@ -230,17 +233,6 @@ typedef struct PACKED {
   uint32_t virtual_methods_size_;  // the number of virtual methods
 } ClassDataHdr_t;
 
-typedef struct PACKED {
-  uint32_t field_idx_delta_;   // delta of index into the field_ids array for FieldId
-  uint32_t access_flags_;      // access flags for the field
-} ClassDataField_t;
-
-typedef struct PACKED {
-  uint32_t method_idx_delta_;  // delta of index into the method_ids array for MethodId
-  uint32_t access_flags_;
-  uint32_t code_off_;
-} ClassDataMethod_t;
-
 typedef struct {
   uint16_t registers_size_;
   uint16_t ins_size_;
@@ -251,6 +243,9 @@ typedef struct {
   uint16_t insns_[1];
 } CodeItem_t;
 
+// Files opened afterwards have their code copied onto huge pages when the
+// system has them, it is then no longer shared with other processes
+void OatUseHugePages(bool enable);
 OatDexFile_t* OpenOatDexFile(const uint8_t* path);
 void CloseOatDexFile(OatDexFile_t* pOatDexFile);
 bool IsValidOatDexFile(OatDexFile_t* pOatDexFile);
@@ -264,6 +259,7 @@ const uint8_t* GetTypeStringById(DexFileData_t* pDexFileData, uint32_t type_id);
 // Proto
 const uint8_t* GetProtoShortyStringById(DexFileData_t* pDexFileData, uint32_t proto_id);
 const uint8_t* GetProtoReturnTypeStringById(DexFileData_t* pDexFileData, uint32_t proto_id);
+// NULL if the proto has no parameters
 const TypeList_t* GetProtoTypeListById(DexFileData_t* pDexFileData, uint32_t proto_id);
 uint32_t GetProtoTypeIdOfTypeListByIdx(DexFileData_t* pDexFileData, uint32_t proto_id, uint32_t type_idx);
 const uint8_t* GetProtoTypeStringOfTypeListByIdx(DexFileData_t* pDexFileData, uint32_t proto_id, uint32_t type_idx);
@@ -277,6 +273,7 @@ const uint8_t* GetFieldNameStringById(DexFileData_t* pDexFileData, uint32_t fiel
 uint32_t GetMethodClassIdById(DexFileData_t* pDexFileData, uint32_t method_id);
 const uint8_t* GetMethodClassStringById(DexFileData_t* pDexFileData, uint32_t method_id);
 uint32_t GetMethodProtoIdById(DexFileData_t* pDexFileData, uint32_t method_id);
+uint32_t GetMethodNameIdById(DexFileData_t* pDexFileData, uint32_t method_id);
 const uint8_t* GetMethodProtoStringById(DexFileData_t* pDexFileData, uint32_t method_id);
 const uint8_t* GetMethodNameStringById(DexFileData_t* pDexFileData, uint32_t method_id);
 // Class def
@@ -289,28 +286,8 @@ const uint8_t* GetSourcefileStringOfClassDefByIdx(DexFileData_t* pDexFileData, u
 const uint8_t* GetClassDataHdrPtrOfClassDefByIdx(DexFileData_t* pDexFileData, uint32_t class_idx);
 const uint8_t* ComputeClassDataHdr(const uint8_t* hdr, ClassDataHdr_t* pClassDataHdr);
 // Class data (methods and fields)
-const uint8_t* GetStaticFieldOfClassDataByIdx(const ClassDataHdr_t* pClassDataHdr,
-                                              const uint8_t* end,
-                                              ClassDataField_t* pClassDataField,
-                                              uint32_t field_idx);
-const uint8_t* GetInstanceFieldOfClassDataByIdx(const ClassDataHdr_t* pClassDataHdr,
-                                                const uint8_t* end,
-                                                ClassDataField_t* pClassDataField,
-                                                uint32_t field_idx);
-const uint8_t* GetDirectMethodOfClassDataByIdx(const ClassDataHdr_t* pClassDataHdr,
-                                               const uint8_t* end,
-                                               ClassDataMethod_t* pClassDataMethod,
-                                               uint32_t method_idx);
-const uint8_t* GetVirtualMethodOfClassDataByIdx(const ClassDataHdr_t* pClassDataHdr,
-                                                const uint8_t* end,
-                                                ClassDataMethod_t* pClassDataMethod,
-                                                uint32_t method_idx);
-const uint8_t* GetMethodNameStringOfCDM(DexFileData_t* pDexFileData, const ClassDataMethod_t* pCDM);
-uint32_t GetProtoIdOfCDM(DexFileData_t* pDexFileData, const ClassDataMethod_t* pCDM);
-const uint8_t* GetProtoShortyStringOfCDM(DexFileData_t* pDexFileData, const ClassDataMethod_t* pCDM);
-const uint8_t* GetProtoReturnTypeStringOfCDM(DexFileData_t* pDexFileData, const ClassDataMethod_t* pCDM);
-const CodeItem_t* GetDexCodeItemOfCDM(const ClassDataMethod_t* pCDM);
-const uint16_t* GetDexCodePtrOfCDM(DexFileData_t* pDexFileData, const ClassDataMethod_t* pCDM);
+const CodeItem_t* GetDexCodeItemByOff(DexFileData_t* pDexFileData, uint32_t code_off);
+const uint16_t* GetDexCodePtrByOff(DexFileData_t* pDexFileData, uint32_t code_off);
 uint32_t GetAmountOfMethodsByIdx(DexFileData_t* pDexFileData, uint32_t class_idx);
 // OAT method
 const OatMethodOffsets_t* GetOatMethodOffByIdx(DexFileData_t* pDexFileData,
@@ -328,6 +305,9 @@ const OatQuickMethodHdr_t* GetOatQuickMethodHdrByIdx(DexFileData_t* pDexFileData
                                                      const uint8_t* oat_base,
                                                      uint32_t class_idx,
                                                      uint32_t oat_method_idx);
+const uint8_t* FindOatGcMapRefBitmap(const uint8_t* gc_map,
+                                     uint32_t native_pc_offset,
+                                     size_t* nr_bytes);
 
 #endif  // CART_OAT_H_
 
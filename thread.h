@@ -27,66 +27,11 @@
 #include "jni_env_ext.h"
 
 #include "macros.h"
+#include "mutex.h"
 
 #define kNumRosAllocThreadLocalSizeBrackets 34
 #define kMaxCheckpoints 3
 
-enum LockLevel {
-  kLoggingLock = 0,
-  kMemMapsLock,
-  kSwapMutexesLock,
-  kUnexpectedSignalLock,
-  kThreadSuspendCountLock,
-  kAbortLock,
-  kJdwpSocketLock,
-  kReferenceQueueSoftReferencesLock,
-  kReferenceQueuePhantomReferencesLock,
-  kReferenceQueueFinalizerReferencesLock,
-  kReferenceQueueWeakReferencesLock,
-  kReferenceQueueClearedReferencesLock,
-  kReferenceProcessorLock,
-  kRosAllocGlobalLock,
-  kRosAllocBracketLock,
-  kRosAllocBulkFreeLock,
-  kAllocSpaceLock,
-  kDexFileMethodInlinerLock,
-  kDexFileToMethodInlinerMapLock,
-  kMarkSweepMarkStackLock,
-  kTransactionLogLock,
-  kInternTableLock,
-  kOatFileSecondaryLookupLock,
-  kDefaultMutexLevel,
-  kMarkSweepLargeObjectLock,
-  kPinTableLock,
-  kLoadLibraryLock,
-  kJdwpObjectRegistryLock,
-  kModifyLdtLock,
-  kAllocatedThreadIdsLock,
-  kMonitorPoolLock,
-  kClassLinkerClassesLock,
-  kBreakpointLock,
-  kMonitorLock,
-  kMonitorListLock,
-  kThreadListLock,
-  kBreakpointInvokeLock,
-  kAllocTrackerLock,
-  kDeoptimizationLock,
-  kProfilerLock,
-  kJdwpEventListLock,
-  kJdwpAttachLock,
-  kJdwpStartLock,
-  kArtdbgStartLock,
-  kRuntimeShutdownLock,
-  kTraceLock,
-  kHeapBitmapLock,
-  kMutatorLock,
-  kInstrumentEntrypointsLock,
-  kThreadListSuspendThreadLock,
-  kZygoteCreationLock,
-
-  kLockLevelCount  // Must come last.
-};
-
 // We have no control over the size of 'bool', but want our boolean fields
 // to be 4-byte quantities.
 typedef uint32_t bool32_t;
@@ -153,7 +98,7 @@ typedef struct PACKED {
   void* l;  // mirror::Object* l;
 } JValue_t;
 
-typedef struct PACKED {
+typedef struct PACKED _RuntimeStats {
   // Number of objects allocated.
   uint64_t allocated_objects;
   // Cumulative size of all objects allocated.
@@ -0,0 +1,381 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Heap allocator benchmark
+ *
+ *   mem.java : replays tests/Mem.java, three Test[] arrays of random length
+ *              replaced on every iteration, the old ones freed at once
+ *   small    : small objects allocated and freed against heaps already
+ *              holding 1MB..64MB of live objects
+ *   tlab     : small objects allocated back to back, from the size
+ *              brackets and from a thread-local allocation buffer
+ *   free     : HeapFree alone, over a heap of mixed small and large
+ *              allocations freed in random order
+ *
+ * The first two run on HeapAlloc/HeapFree and on a copy of the former
+ * first-fit bitmap heap.
+ *
+ *   allocbench [iterations]
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../hash.h"
+#include "../heap.h"
+#include "../cart.h"
+#include "bench.h"
+
+// Array header of a 32-bit ART object: class, monitor and length
+#define ARRAY_HDR_SIZE      12
+#define REF_SIZE            4
+#define MEM_ITERATIONS      20000
+#define SMALL_OPS           200000
+#define TLAB_OPS            (1000 * 1000)
+#define FREE_OPS            200000
+// Room for the 64MB live heap and the free scenario
+#define BENCH_MAX_HEAP      (1024UL * 1024 * 1024)
+// Upper bound of bitmap bytes scanned by the legacy heap per measurement
+#define LEGACY_SCAN_BUDGET  (1ULL << 31)
+
+///////////////////////////////////////////////////////////////////////////////
+// Legacy first-fit bitmap heap (as before the size bracket allocator)      //
+///////////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+  uint8_t*      bitmap;
+  size_t        bitmap_sz;
+  size_t        alloced_sz;
+  size_t        avail_sz;
+  uint8_t*      ptr;
+  HashTable_t*  records;
+  size_t        scanned;
+} LegacyHeap_t;
+
+static LegacyHeap_t* LegacyAllocHeap(size_t sz) {
+  LegacyHeap_t* h = (LegacyHeap_t*)malloc(sizeof(LegacyHeap_t));
+  if (!h) {
+    return NULL;
+  }
+  memset(h, 0, sizeof(LegacyHeap_t));
+  h->bitmap_sz = (sz / SZ_SLOT) / BITS_PER_BYTE;
+  h->avail_sz = sz;
+  h->bitmap = (uint8_t*)calloc(1, h->bitmap_sz);
+  h->ptr = (uint8_t*)malloc(sz);
+  h->records = AllocHashTable(NULL, NR_HASH_TBL);
+  if (!h->bitmap || !h->ptr || !h->records) {
+    return NULL;
+  }
+  return h;
+}
+
+static void LegacyFreeHeap(LegacyHeap_t* h) {
+  FreeHashTable(h->records);
+  free(h->bitmap);
+  free(h->ptr);
+  free(h);
+}
+
+static inline uint8_t LegacyNextBit(uint8_t byte) {
+  switch (byte) {
+    case 0x01: return 1;
+    case 0x03: return 2;
+    case 0x07: return 3;
+    case 0x0F: return 4;
+    case 0x1F: return 5;
+    case 0x3F: return 6;
+    case 0x7F: return 7;
+    default: break;
+  }
+  return 0;
+}
+
+static void* LegacyHeapAlloc(LegacyHeap_t* h, size_t sz) {
+  size_t has_size = 0;
+  size_t start_byte = 0;
+  size_t start_bit = 0;
+  size_t start_bit_cnt = 0;
+  bool found = false;
+  if ((h->avail_sz - h->alloced_sz) < sz) {
+    return NULL;
+  }
+  for (size_t i = 0; i < h->bitmap_sz; ++i) {
+    uint8_t tmp = h->bitmap[i];
+    h->scanned++;
+    if (tmp == 0xFF) {
+      found = false;
+      has_size = 0;
+      start_bit_cnt = 0;
+      continue;
+    }
+    uint8_t j = found ? 0 : LegacyNextBit(tmp);
+    for (; j < BITS_PER_BYTE; ++j) {
+      if (tmp & (1 << j)) {
+        found = false;
+        has_size = 0;
+        start_bit_cnt = 0;
+        continue;
+      }
+      if (!found) {
+        start_byte = i;
+        start_bit = j;
+        found = true;
+      }
+      start_bit_cnt++;
+      has_size += SZ_SLOT;
+      if (has_size >= sz) {
+        goto DoneScan;
+      }
+    }
+  }
+ DoneScan:
+  if (has_size < sz) {
+    return NULL;
+  }
+  size_t index = (start_byte * BITS_PER_BYTE) + start_bit;
+  for (size_t k = index; k < (index + start_bit_cnt); ++k) {
+    h->bitmap[k / BITS_PER_BYTE] |= (1 << (k % BITS_PER_BYTE));
+  }
+  h->alloced_sz += has_size;
+  uint8_t* ptr = h->ptr + (index * SZ_SLOT);
+  InsertHashEntry(h->records, (size_t)ptr, (void*)start_bit_cnt);
+  return ptr;
+}
+
+static void LegacyHeapFree(LegacyHeap_t* h, void* ptr) {
+  HashEntry_t* e = IsHashExist(h->records, (size_t)ptr);
+  if (!e) {
+    return;
+  }
+  size_t index = ((uint8_t*)ptr - h->ptr) / SZ_SLOT;
+  size_t nr = (size_t)e->ptr;
+  for (size_t k = index; k < (index + nr); ++k) {
+    h->bitmap[k / BITS_PER_BYTE] &= ~(1 << (k % BITS_PER_BYTE));
+  }
+  h->alloced_sz -= nr * SZ_SLOT;
+  RemoveHashEntry(h->records, (size_t)ptr);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Helpers                                                                   //
+///////////////////////////////////////////////////////////////////////////////
+
+static uint64_t rnd_state = 0x2545F4914F6CDD1DULL;
+
+static uint32_t NextInt(uint32_t bound) {
+  rnd_state ^= rnd_state >> 12;
+  rnd_state ^= rnd_state << 25;
+  rnd_state ^= rnd_state >> 27;
+  return (uint32_t)((rnd_state * 0x2545F4914F6CDD1DULL) >> 32) % bound;
+}
+
+static void Report(const char* impl, const char* scenario, size_t ops, uint64_t ns) {
+  printf("%-8s %-16s %9u ops  %10.3f ms  %9.1f ns/op\n",
+         impl, scenario, (unsigned int)ops, ns / 1000000.0, ops ? (double)ns / (double)ops : 0.0);
+}
+
+static inline size_t ArraySize(uint32_t length) {
+  return ARRAY_HDR_SIZE + (length * REF_SIZE);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Mem.java                                                                  //
+///////////////////////////////////////////////////////////////////////////////
+
+static void BenchMemJava(size_t iterations) {
+  static const uint32_t bounds[3] = {4096, 8192, 10240};
+  uint32_t* lengths = (uint32_t*)malloc(sizeof(uint32_t) * iterations * 3);
+  if (!lengths) {
+    return;
+  }
+  for (size_t i = 0; i < iterations * 3; ++i) {
+    lengths[i] = NextInt(bounds[i % 3]);
+  }
+
+  // Size bracket heap, starting as small as the VM does
+  HeapVolume_t* pHeapVol = AllocHeapVolumeWithLimit(HEAP_START_SIZE, BENCH_MAX_HEAP);
+  void* live[3] = {NULL, NULL, NULL};
+  uint64_t t0 = NowNs();
+  for (size_t i = 0; i < iterations * 3; ++i) {
+    if (live[i % 3]) {
+      HeapFree(pHeapVol, live[i % 3]);
+    }
+    live[i % 3] = HeapAlloc(pHeapVol, ArraySize(lengths[i]));
+  }
+  Report("bracket", "mem.java", iterations * 3, NowNs() - t0);
+  printf("         heap: %u bytes committed\n", (unsigned int)pHeapVol->total_sz);
+  FreeHeapVolume(pHeapVol);
+
+  // The legacy heap cannot grow past its first entry for these arrays, so
+  // it gets all the room the three arrays can take up front
+  LegacyHeap_t* h = LegacyAllocHeap(4 * 1024 * 1024);
+  live[0] = live[1] = live[2] = NULL;
+  t0 = NowNs();
+  for (size_t i = 0; i < iterations * 3; ++i) {
+    if (live[i % 3]) {
+      LegacyHeapFree(h, live[i % 3]);
+    }
+    live[i % 3] = LegacyHeapAlloc(h, ArraySize(lengths[i]));
+  }
+  Report("legacy", "mem.java", iterations * 3, NowNs() - t0);
+  LegacyFreeHeap(h);
+  free(lengths);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Small objects against a filled heap                                       //
+///////////////////////////////////////////////////////////////////////////////
+
+static void BenchSmall(size_t live_sz, size_t ops) {
+  char scenario[32];
+  size_t nr_live = live_sz / 64;
+  void** objs = (void**)malloc(sizeof(void*) * nr_live);
+  uint32_t* sizes = (uint32_t*)malloc(sizeof(uint32_t) * ops);
+  if (!objs || !sizes) {
+    return;
+  }
+  for (size_t i = 0; i < ops; ++i) {
+    sizes[i] = 8 + NextInt(120);
+  }
+  snprintf(scenario, sizeof(scenario), "small @%uMB", (unsigned int)(live_sz >> 20));
+
+  // Fill, then churn: each allocation replaces a random live object
+  HeapVolume_t* pHeapVol = AllocHeapVolumeWithLimit(HEAP_START_SIZE, BENCH_MAX_HEAP);
+  for (size_t i = 0; i < nr_live; ++i) {
+    objs[i] = HeapAlloc(pHeapVol, 64);
+  }
+  uint64_t t0 = NowNs();
+  for (size_t i = 0; i < ops; ++i) {
+    size_t victim = (i * 7919) % nr_live;
+    HeapFree(pHeapVol, objs[victim]);
+    objs[victim] = HeapAlloc(pHeapVol, sizes[i]);
+  }
+  Report("bracket", scenario, ops, NowNs() - t0);
+  FreeHeapVolume(pHeapVol);
+
+  // The legacy heap scans from the start of its bitmap every time
+  LegacyHeap_t* h = LegacyAllocHeap(live_sz * 2);
+  if (!h) {
+    free(objs);
+    free(sizes);
+    return;
+  }
+  for (size_t i = 0; i < nr_live; ++i) {
+    objs[i] = LegacyHeapAlloc(h, 64);
+  }
+  h->scanned = 0;
+  size_t done = 0;
+  t0 = NowNs();
+  for (; (done < ops) && (h->scanned < LEGACY_SCAN_BUDGET); ++done) {
+    size_t victim = (done * 7919) % nr_live;
+    LegacyHeapFree(h, objs[victim]);
+    objs[victim] = LegacyHeapAlloc(h, sizes[done]);
+  }
+  Report("legacy", scenario, done, NowNs() - t0);
+  LegacyFreeHeap(h);
+  free(objs);
+  free(sizes);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Thread-local allocation buffers                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+static void BenchTlab(size_t ops) {
+  uint32_t* sizes = (uint32_t*)malloc(sizeof(uint32_t) * ops);
+  void** objs = (void**)malloc(sizeof(void*) * ops);
+  if (!sizes || !objs) {
+    return;
+  }
+  for (size_t i = 0; i < ops; ++i) {
+    sizes[i] = 8 + NextInt(56);
+  }
+
+  HeapVolume_t* pHeapVol = AllocHeapVolumeWithLimit(HEAP_START_SIZE, BENCH_MAX_HEAP);
+  uint64_t t0 = NowNs();
+  for (size_t i = 0; i < ops; ++i) {
+    objs[i] = HeapAlloc(pHeapVol, sizes[i]);
+  }
+  Report("bracket", "tlab", ops, NowNs() - t0);
+  FreeHeapVolume(pHeapVol);
+
+  HeapTlab_t tlab;
+  memset(&tlab, 0, sizeof(tlab));
+  pHeapVol = AllocHeapVolumeWithLimit(HEAP_START_SIZE, BENCH_MAX_HEAP);
+  t0 = NowNs();
+  for (size_t i = 0; i < ops; ++i) {
+    objs[i] = HeapTlabAlloc(pHeapVol, &tlab, sizes[i]);
+  }
+  Report("tlab", "tlab", ops, NowNs() - t0);
+  HeapRevokeTlab(pHeapVol, &tlab);
+  FreeHeapVolume(pHeapVol);
+  free(sizes);
+  free(objs);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Free                                                                      //
+///////////////////////////////////////////////////////////////////////////////
+
+static void BenchFree(size_t nr_objs) {
+  void** objs = (void**)malloc(sizeof(void*) * nr_objs);
+  if (!objs) {
+    return;
+  }
+  // One in ten takes whole pages
+  HeapVolume_t* pHeapVol = AllocHeapVolumeWithLimit(HEAP_START_SIZE, BENCH_MAX_HEAP);
+  size_t nr_large = 0;
+  for (size_t i = 0; i < nr_objs; ++i) {
+    size_t sz = ((i % 10) == 9) ? (HEAP_MAX_BRACKET_SIZE + 1 + NextInt(16384)) : (8 + NextInt(248));
+    objs[i] = HeapAlloc(pHeapVol, sz);
+    nr_large += ((i % 10) == 9);
+  }
+  for (size_t i = nr_objs - 1; i > 0; --i) {
+    size_t j = NextInt(i + 1);
+    void* tmp = objs[i];
+    objs[i] = objs[j];
+    objs[j] = tmp;
+  }
+  uint64_t t0 = NowNs();
+  for (size_t i = 0; i < nr_objs; ++i) {
+    HeapFree(pHeapVol, objs[i]);
+  }
+  Report("bracket", "free", nr_objs, NowNs() - t0);
+  printf("         heap: %u bytes committed, %u large\n",
+         (unsigned int)pHeapVol->total_sz, (unsigned int)nr_large);
+  FreeHeapVolume(pHeapVol);
+  free(objs);
+}
+
+int main(int argc, char** argv) {
+  size_t iterations = MEM_ITERATIONS;
+  if (argc > 1) {
+    iterations = strtoul(argv[1], NULL, 0);
+  }
+
+  printf("%-8s %-16s %13s  %13s  %15s\n", "impl", "scenario", "ops", "time", "latency");
+  BenchMemJava(iterations);
+  for (size_t mb = 1; mb <= 64; mb <<= 2) {
+    BenchSmall(mb << 20, SMALL_OPS);
+  }
+  BenchTlab(TLAB_OPS);
+  BenchFree(FREE_OPS);
+  return 0;
+}
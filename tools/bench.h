@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Benchmark support
+ *
+ * The clock, the random indexes and the synthetic DEX files the benchmarks
+ * share. A synthetic DEX file has classes "L<prefix>pkgN/ClassM;" of
+ * SYNTHETIC_METHODS_PER_CLASS direct methods each, their names drawn from a
+ * pool of SYNTHETIC_METHOD_NAMES.
+ */
+
+#ifndef CART_TOOLS_BENCH_H_
+#define CART_TOOLS_BENCH_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../oat.h"
+
+#define SYNTHETIC_METHODS_PER_CLASS   8
+#define SYNTHETIC_METHOD_NAMES        256
+
+static inline uint64_t NowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+// xorshift64*, the same sequence on every run
+static inline size_t NextIndex(size_t bound) {
+  static uint64_t rnd_state = 0x2545F4914F6CDD1DULL;
+  rnd_state ^= rnd_state >> 12;
+  rnd_state ^= rnd_state << 25;
+  rnd_state ^= rnd_state >> 27;
+  return (size_t)((rnd_state * 0x2545F4914F6CDD1DULL) >> 16) % bound;
+}
+
+static inline uint8_t* EncodeLeb128(uint8_t* ptr, uint32_t value) {
+  while (value > 0x7f) {
+    *(ptr++) = (uint8_t)((value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  *(ptr++) = (uint8_t)value;
+  return ptr;
+}
+
+// Every class but the first of each chain extends the one before it, no
+// class extends another with a chain of 0. The checksum tells DEX files of
+// the same classes apart.
+static inline uint8_t* BuildSyntheticDex(const char* prefix, uint32_t checksum, uint32_t nr_classes,
+                                         uint32_t chain, size_t* size) {
+  uint32_t nr_strings = nr_classes + SYNTHETIC_METHOD_NAMES;
+  uint32_t nr_methods = nr_classes * SYNTHETIC_METHODS_PER_CLASS;
+  uint32_t string_ids_off = sizeof(DexHdr_t);
+  uint32_t type_ids_off = string_ids_off + (sizeof(StringId_t) * nr_strings);
+  uint32_t method_ids_off = type_ids_off + (sizeof(TypeId_t) * nr_classes);
+  uint32_t class_defs_off = method_ids_off + (sizeof(MethodId_t) * nr_methods);
+  uint32_t data_off = class_defs_off + (sizeof(ClassDef_t) * nr_classes);
+  size_t sz = data_off + (nr_strings * 64) + (nr_classes * (4 + (SYNTHETIC_METHODS_PER_CLASS * 8)));
+  uint8_t* dex = (uint8_t*)malloc(sz);
+  if (!dex) {
+    return NULL;
+  }
+  memset((void*)dex, 0, sz);
+  DexHdr_t* pDexHdr = (DexHdr_t*)dex;
+  memcpy(pDexHdr->magic_, "dex\n035", 8);
+  pDexHdr->checksum_ = checksum;
+  pDexHdr->string_ids_size_ = nr_strings;
+  pDexHdr->string_ids_off_ = string_ids_off;
+  pDexHdr->type_ids_size_ = nr_classes;
+  pDexHdr->type_ids_off_ = type_ids_off;
+  pDexHdr->method_ids_size_ = nr_methods;
+  pDexHdr->method_ids_off_ = method_ids_off;
+  pDexHdr->class_defs_size_ = nr_classes;
+  pDexHdr->class_defs_off_ = class_defs_off;
+
+  // Strings, a ULEB128 length and the MUTF-8 data
+  StringId_t* string_ids = (StringId_t*)(dex + string_ids_off);
+  uint8_t* ptr = dex + data_off;
+  for (uint32_t i = 0; i < nr_strings; ++i) {
+    char str[64];
+    if (i < nr_classes) {
+      snprintf(str, sizeof(str), "L%spkg%u/Class%u;", prefix, i % 97, i);
+    } else {
+      snprintf(str, sizeof(str), "method%u", i - nr_classes);
+    }
+    string_ids[i].string_data_off_ = ptr - dex;
+    *(ptr++) = (uint8_t)strlen(str);
+    memcpy(ptr, str, strlen(str) + 1);
+    ptr += strlen(str) + 1;
+  }
+  TypeId_t* type_ids = (TypeId_t*)(dex + type_ids_off);
+  MethodId_t* method_ids = (MethodId_t*)(dex + method_ids_off);
+  ClassDef_t* class_defs = (ClassDef_t*)(dex + class_defs_off);
+  for (uint32_t i = 0; i < nr_classes; ++i) {
+    type_ids[i].descriptor_idx_ = i;
+    class_defs[i].class_idx_ = i;
+    class_defs[i].superclass_idx_ = (chain && (i % chain)) ? (i - 1) : 0xFFFF;
+    class_defs[i].class_data_off_ = ptr - dex;
+    ptr = EncodeLeb128(ptr, 0);
+    ptr = EncodeLeb128(ptr, 0);
+    ptr = EncodeLeb128(ptr, SYNTHETIC_METHODS_PER_CLASS);
+    ptr = EncodeLeb128(ptr, 0);
+    for (uint32_t m = 0; m < SYNTHETIC_METHODS_PER_CLASS; ++m) {
+      uint32_t method_id = (i * SYNTHETIC_METHODS_PER_CLASS) + m;
+      method_ids[method_id].class_idx_ = i;
+      method_ids[method_id].name_idx_ = nr_classes + NextIndex(SYNTHETIC_METHOD_NAMES);
+      ptr = EncodeLeb128(ptr, m ? 1 : method_id);
+      ptr = EncodeLeb128(ptr, 0x0001);
+      ptr = EncodeLeb128(ptr, 0);
+    }
+  }
+  pDexHdr->file_size_ = ptr - dex;
+  *size = ptr - dex;
+  return dex;
+}
+
+#endif  // CART_TOOLS_BENCH_H_
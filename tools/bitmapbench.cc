@@ -0,0 +1,199 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Bitmap run finder benchmark
+ *
+ * Allocates and frees a run of slots in bitmaps covering 16KB..1GB of
+ * 16 byte slots, filled to 0..99%. The filled part sits at the start of the
+ * bitmap with a free slot every 61 slots, too small for the request, so
+ * both finders have to walk over it. Compares the word-at-a-time finder of
+ * bitmap.cc with the byte and bit scan it replaces.
+ *
+ *   bitmapbench [slots per request]
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../bitmap.h"
+#include "bench.h"
+
+#define SLOT_SIZE           16
+#define BITS_PER_BYTE       8
+#define HOLE_STRIDE         61
+#define REQUEST_SLOTS       8
+#define MIN_HEAP_SIZE       (16ULL * 1024)
+#define MAX_HEAP_SIZE       (1024ULL * 1024 * 1024)
+#define MAX_OPS             100000
+// Stop measuring a case after this long
+#define TIME_BUDGET_NS      (200ULL * 1000 * 1000)
+
+///////////////////////////////////////////////////////////////////////////////
+// Byte and bit scan (as in the former heap and code cache)                 //
+///////////////////////////////////////////////////////////////////////////////
+
+static inline uint8_t NextBit(uint8_t byte) {
+  switch (byte) {
+    case 0x01: return 1;
+    case 0x03: return 2;
+    case 0x07: return 3;
+    case 0x0F: return 4;
+    case 0x1F: return 5;
+    case 0x3F: return 6;
+    case 0x7F: return 7;
+    default: break;
+  }
+  return 0;
+}
+
+static size_t LegacyFindClearRun(const uint8_t* bitmap, size_t sz_bitmap, size_t nr) {
+  size_t start = 0;
+  size_t cnt = 0;
+  for (size_t i = 0; i < sz_bitmap; ++i) {
+    uint8_t tmp = bitmap[i];
+    if (tmp == 0xFF) {
+      cnt = 0;
+      continue;
+    }
+    uint8_t j = cnt ? 0 : NextBit(tmp);
+    for (; j < BITS_PER_BYTE; ++j) {
+      if (tmp & (1 << j)) {
+        cnt = 0;
+        continue;
+      }
+      if (!cnt) {
+        start = (i * BITS_PER_BYTE) + j;
+      }
+      if (++cnt == nr) {
+        return start;
+      }
+    }
+  }
+  return sz_bitmap * BITS_PER_BYTE;
+}
+
+static void LegacySetRange(uint8_t* bitmap, size_t start, size_t nr, bool set) {
+  for (size_t k = start; k < (start + nr); ++k) {
+    if (set) {
+      bitmap[k / BITS_PER_BYTE] |= (1 << (k % BITS_PER_BYTE));
+    } else {
+      bitmap[k / BITS_PER_BYTE] &= ~(1 << (k % BITS_PER_BYTE));
+    }
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Cases                                                                     //
+///////////////////////////////////////////////////////////////////////////////
+
+static void Fill(uint64_t* map, size_t nr_bits, uint32_t fill) {
+  size_t filled = (size_t)(((unsigned long long)nr_bits * fill) / 100);
+  memset(map, 0, BitmapWords(nr_bits) * sizeof(uint64_t));
+  BitmapSetRange(map, 0, filled);
+  for (size_t i = HOLE_STRIDE; i < filled; i += HOLE_STRIDE) {
+    BitmapClearRange(map, i, 1);
+  }
+}
+
+static double RunWord(uint64_t* map, size_t nr_bits, size_t nr, size_t* found) {
+  uint64_t t0 = NowNs();
+  uint64_t ns = 0;
+  size_t ops = 0;
+  for (; (ops < MAX_OPS) && (ns < TIME_BUDGET_NS); ++ops) {
+    size_t idx = BitmapFindClearRun(map, nr_bits, nr);
+    if (idx < nr_bits) {
+      BitmapSetRange(map, idx, nr);
+      BitmapClearRange(map, idx, nr);
+    }
+    *found = idx;
+    if (!(ops & 63)) {
+      ns = NowNs() - t0;
+    }
+  }
+  return (double)(NowNs() - t0) / (double)ops;
+}
+
+static double RunLegacy(uint8_t* bitmap, size_t nr_bits, size_t nr, size_t* found) {
+  uint64_t t0 = NowNs();
+  uint64_t ns = 0;
+  size_t ops = 0;
+  for (; (ops < MAX_OPS) && (ns < TIME_BUDGET_NS); ++ops) {
+    size_t idx = LegacyFindClearRun(bitmap, nr_bits / BITS_PER_BYTE, nr);
+    if (idx < nr_bits) {
+      LegacySetRange(bitmap, idx, nr, true);
+      LegacySetRange(bitmap, idx, nr, false);
+    }
+    *found = idx;
+    if (!(ops & 63)) {
+      ns = NowNs() - t0;
+    }
+  }
+  return (double)(NowNs() - t0) / (double)ops;
+}
+
+static void PrintSize(unsigned long long sz) {
+  char buf[16];
+  if (sz >= (1ULL << 30)) {
+    snprintf(buf, sizeof(buf), "%lluGB", sz >> 30);
+  } else if (sz >= (1ULL << 20)) {
+    snprintf(buf, sizeof(buf), "%lluMB", sz >> 20);
+  } else {
+    snprintf(buf, sizeof(buf), "%lluKB", sz >> 10);
+  }
+  printf("%6s", buf);
+}
+
+int main(int argc, char** argv) {
+  static const uint32_t fills[] = {0, 50, 90, 99};
+  size_t nr = REQUEST_SLOTS;
+  if (argc > 1) {
+    nr = strtoul(argv[1], NULL, 0);
+  }
+  if (nr < 1) {
+    nr = 1;
+  }
+
+  printf("%u slots of %u bytes per request\n", (unsigned int)nr, SLOT_SIZE);
+  printf("%6s %5s %14s %14s %9s\n", "heap", "fill", "word ns/op", "byte ns/op", "speedup");
+  for (unsigned long long sz = MIN_HEAP_SIZE; sz <= MAX_HEAP_SIZE; sz <<= 2) {
+    size_t nr_bits = sz / SLOT_SIZE;
+    uint64_t* map = (uint64_t*)malloc(BitmapWords(nr_bits) * sizeof(uint64_t));
+    if (!map) {
+      fprintf(stderr, "Out of memory\n");
+      return -1;
+    }
+    for (size_t f = 0; f < (sizeof(fills) / sizeof(fills[0])); ++f) {
+      size_t found_word = 0;
+      size_t found_byte = 0;
+      Fill(map, nr_bits, fills[f]);
+      double word = RunWord(map, nr_bits, nr, &found_word);
+      double byte = RunLegacy((uint8_t*)map, nr_bits, nr, &found_byte);
+      if (found_word != found_byte) {
+        fprintf(stderr, "Mismatch: word finder %u, byte finder %u\n",
+                (unsigned int)found_word, (unsigned int)found_byte);
+        return -1;
+      }
+      PrintSize(sz);
+      printf(" %4u%% %14.1f %14.1f %8.1fx\n", fills[f], word, byte, byte / word);
+    }
+    free(map);
+  }
+  return 0;
+}
@@ -0,0 +1,257 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Class data decoding benchmark
+ *
+ *   synthetic : class_data streams of classes with more and more methods,
+ *               decoded by looking every item up from the start of its list
+ *               as the class linker used to, and in one pass
+ *   oat       : the same over every class of an OAT file, then the time to
+ *               register its classes and the time to link all of them
+ *
+ *   cdbench [oat file]
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../utils.h"
+#include "../hash.h"
+#include "../oat.h"
+#include "../class_data.h"
+#include "../class.h"
+#include "../cart.h"
+#include "bench.h"
+
+#define BENCH_DECODES       (4 * 1000 * 1000)
+#define BENCH_LOADS         5
+
+static uint32_t synthetic_sizes[] = { 10, 100, 1000, 4000 };
+
+///////////////////////////////////////////////////////////////////////////////
+// Decoders                                                                  //
+///////////////////////////////////////////////////////////////////////////////
+
+// Decodes item idx of a list by walking it from the start, the way each
+// field and method used to be looked up
+static const uint8_t* LegacyItemByIdx(const uint8_t* start, uint32_t idx, bool method,
+                                      uint32_t* delta) {
+  const uint8_t* end = start;
+  for (uint32_t i = 0; i <= idx; ++i) {
+    *delta = DecodeUnsignedLeb128(&end);
+    DecodeUnsignedLeb128(&end);
+    if (method) {
+      DecodeUnsignedLeb128(&end);
+    }
+  }
+  return end;
+}
+
+static uint32_t LegacyDecode(const uint8_t* class_data) {
+  const uint8_t* ptr = class_data;
+  uint32_t sizes[4];
+  for (int i = 0; i < 4; ++i) {
+    sizes[i] = DecodeUnsignedLeb128(&ptr);
+  }
+  uint32_t sum = 0;
+  for (int list = 0; list < 4; ++list) {
+    const uint8_t* end = ptr;
+    uint32_t idx = 0;
+    for (uint32_t i = 0; i < sizes[list]; ++i) {
+      uint32_t delta;
+      end = LegacyItemByIdx(ptr, i, list >= 2, &delta);
+      idx += delta;
+      sum += idx;
+    }
+    ptr = end;
+  }
+  return sum;
+}
+
+static uint32_t IterDecode(const uint8_t* class_data) {
+  ClassDataIter_t bIter;
+  ClassDataIterInit(&bIter, class_data);
+  uint32_t sum = 0;
+  while (ClassDataIterNext(&bIter)) {
+    sum += bIter.idx;
+  }
+  return sum;
+}
+
+// Nanoseconds per class of decoding the classes over and over
+static double TimeDecode(uint32_t (*decode)(const uint8_t*), const uint8_t** classes,
+                         size_t nr_classes, size_t nr_rounds, uint32_t* sum) {
+  *sum = 0;
+  uint64_t t0 = NowNs();
+  for (size_t r = 0; r < nr_rounds; ++r) {
+    for (size_t i = 0; i < nr_classes; ++i) {
+      *sum += decode(classes[i]);
+    }
+  }
+  return (double)(NowNs() - t0) / (nr_rounds * nr_classes);
+}
+
+static void CompareDecode(const char* name, const uint8_t** classes, size_t nr_classes,
+                          size_t nr_items) {
+  // Roughly the same amount of work whatever the class size
+  size_t nr_rounds = BENCH_DECODES / ((nr_items ? nr_items : 1) * nr_classes);
+  if (!nr_rounds) {
+    nr_rounds = 1;
+  }
+  uint32_t legacy_sum, iter_sum;
+  double legacy_ns = TimeDecode(LegacyDecode, classes, nr_classes, nr_rounds, &legacy_sum);
+  double iter_ns = TimeDecode(IterDecode, classes, nr_classes, nr_rounds, &iter_sum);
+  printf("%-28s  %10.0f ns/class  %8.0f ns/class  x%-8.1f%s\n", name, legacy_ns, iter_ns,
+         legacy_ns / iter_ns, (legacy_sum == iter_sum) ? "" : "  MISMATCH");
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Synthetic classes                                                         //
+///////////////////////////////////////////////////////////////////////////////
+
+// A class of nr_methods methods, half direct and half virtual, and a field
+// per ten methods, the ids and offsets far enough apart to take several
+// bytes each
+static uint8_t* BuildClassData(uint32_t nr_methods) {
+  uint32_t nr_fields = nr_methods / 10;
+  uint8_t* data = (uint8_t*)malloc(16 + (nr_fields * 10) + (nr_methods * 15));
+  if (!data) {
+    return NULL;
+  }
+  uint8_t* ptr = data;
+  ptr = EncodeLeb128(ptr, nr_fields / 2);
+  ptr = EncodeLeb128(ptr, nr_fields - (nr_fields / 2));
+  ptr = EncodeLeb128(ptr, nr_methods / 2);
+  ptr = EncodeLeb128(ptr, nr_methods - (nr_methods / 2));
+  for (uint32_t i = 0; i < nr_fields; ++i) {
+    ptr = EncodeLeb128(ptr, ((i == 0) || (i == (nr_fields / 2))) ? 20000 : 3);
+    ptr = EncodeLeb128(ptr, 0x0001);
+  }
+  for (uint32_t i = 0; i < nr_methods; ++i) {
+    ptr = EncodeLeb128(ptr, ((i == 0) || (i == (nr_methods / 2))) ? 40000 : 2);
+    ptr = EncodeLeb128(ptr, 0x10001);
+    ptr = EncodeLeb128(ptr, 0x100000 + (i * 64));
+  }
+  return data;
+}
+
+static void BenchSynthetic() {
+  printf("%-28s  %16s  %17s\n", "class", "by index", "single pass");
+  for (size_t i = 0; i < sizeof(synthetic_sizes) / sizeof(synthetic_sizes[0]); ++i) {
+    const uint8_t* data = BuildClassData(synthetic_sizes[i]);
+    if (!data) {
+      fprintf(stderr, "Out of memory\n");
+      return;
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "synthetic %u methods", synthetic_sizes[i]);
+    CompareDecode(name, &data, 1, synthetic_sizes[i]);
+    free((void*)data);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// OAT file                                                                  //
+///////////////////////////////////////////////////////////////////////////////
+
+static void BenchOat(const char* path) {
+  OatDexFile_t* pOatDexFile = OpenOatDexFile((const uint8_t*)path);
+  if (!pOatDexFile) {
+    fprintf(stderr, "Failed to open %s\n", path);
+    return;
+  }
+  size_t nr_classes = 0;
+  DexFileData_t* pDexFileData = pOatDexFile->dex_files;
+  for (; pDexFileData; pDexFileData = pDexFileData->Next) {
+    nr_classes += pDexFileData->nr_classes;
+  }
+  const uint8_t** classes = (const uint8_t**)malloc(sizeof(uint8_t*) * (nr_classes + 1));
+  if (!classes) {
+    fprintf(stderr, "Out of memory\n");
+    CloseOatDexFile(pOatDexFile);
+    return;
+  }
+  size_t nr = 0, nr_items = 0, max_items = 0;
+  for (pDexFileData = pOatDexFile->dex_files; pDexFileData; pDexFileData = pDexFileData->Next) {
+    for (uint32_t class_idx = 0; class_idx < pDexFileData->nr_classes; ++class_idx) {
+      const uint8_t* data = GetClassDataHdrPtrOfClassDefByIdx(pDexFileData, class_idx);
+      if (!data) {
+        continue;
+      }
+      ClassDataIter_t bIter;
+      ClassDataIterInit(&bIter, data);
+      size_t items = ClassDataNrFields(&bIter) + ClassDataNrMethods(&bIter);
+      nr_items += items;
+      if (items > max_items) {
+        max_items = items;
+      }
+      classes[nr++] = data;
+    }
+  }
+  printf("\n%s: %u classes with data, %u members, %u at most\n", path, (unsigned int)nr,
+         (unsigned int)nr_items, (unsigned int)max_items);
+  if (nr) {
+    CompareDecode("all classes", classes, nr, nr_items / nr);
+  }
+  free((void*)classes);
+  CloseOatDexFile(pOatDexFile);
+
+  // Registering indexes the classes, linking them all is what loading
+  // used to cost. The best of a few runs.
+  uint64_t best_register_ns = 0;
+  uint64_t best_link_ns = 0;
+  for (int r = 0; r < BENCH_LOADS; ++r) {
+    ClassLinker_t* pCL = AllocateClassLinker(HEAP_START_SIZE);
+    pOatDexFile = OpenOatDexFile((const uint8_t*)path);
+    if (!pCL || !pOatDexFile) {
+      fprintf(stderr, "Failed to load %s\n", path);
+      return;
+    }
+    uint64_t t0 = NowNs();
+    bool ok = RegisterOatDexFile(pOatDexFile, pCL);
+    uint64_t t1 = NowNs();
+    for (pDexFileData = pOatDexFile->dex_files; ok && pDexFileData; pDexFileData = pDexFileData->Next) {
+      ok = ParseDexClass(pDexFileData, pCL, (const uint8_t*)pOatDexFile->oat_hdr);
+    }
+    uint64_t t2 = NowNs();
+    if (!ok) {
+      fprintf(stderr, "Failed to link the classes of %s\n", path);
+      return;
+    }
+    if (!best_register_ns || ((t1 - t0) < best_register_ns)) {
+      best_register_ns = t1 - t0;
+    }
+    if (!best_link_ns || ((t2 - t1) < best_link_ns)) {
+      best_link_ns = t2 - t1;
+    }
+    FreeClassLinker(pCL);
+    CloseOatDexFile(pOatDexFile);
+  }
+  printf("RegisterOatDexFile            %10.2f us\n", best_register_ns / 1000.0);
+  printf("ParseDexClass, all classes    %10.2f us\n", best_link_ns / 1000.0);
+}
+
+int main(int argc, char** argv) {
+  BenchSynthetic();
+  if (argc > 1) {
+    BenchOat(argv[1]);
+  }
+  return 0;
+}
@@ -0,0 +1,256 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Class index benchmark
+ *
+ *   synthetic : a DEX file of as many classes as a boot class path has,
+ *               its classes registered into a hash table of descriptors as
+ *               the class linker used to at every start, its class index
+ *               built in memory, built and written out, and mapped from the
+ *               sidecar; then the lookups of both
+ *   oat       : the start of a VM on an OAT file, opening it and registering
+ *               its classes, without the sidecar and with it
+ *
+ *   cidxbench [classes] [oat file]
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/param.h>
+
+#include "../utils.h"
+#include "../hash.h"
+#include "../class_table.h"
+#include "../oat.h"
+#include "../class_index.h"
+#include "../class.h"
+#include "../cart.h"
+#include "bench.h"
+
+#define DEFAULT_CLASSES     30000
+#define MAX_CLASSES         65000     // type ids are 16-bit in class_defs
+#define NR_LOOKUPS          (4 * 1000 * 1000)
+#define BENCH_LOADS         5
+
+///////////////////////////////////////////////////////////////////////////////
+// Synthetic DEX file                                                        //
+///////////////////////////////////////////////////////////////////////////////
+
+// Times one way of getting the classes of the DEX file ready, the best
+// of a few runs
+static uint64_t TimeTable(DexFileData_t* pDexFileData) {
+  uint64_t best_ns = 0;
+  for (int r = 0; r < BENCH_LOADS; ++r) {
+    uint64_t t0 = NowNs();
+    ClassTable_t* tbl = AllocClassTable(CLASSES_HASH_NR);
+    for (uint32_t class_idx = 0; tbl && (class_idx < pDexFileData->nr_classes); ++class_idx) {
+      const uint8_t* key;
+      size_t len;
+      ClassKeyOf(GetClassStringOfClassDefByIdx(pDexFileData, class_idx), &key, &len);
+      ClassTableInsert(tbl, GenHashKey64(key, len), key, len, (void*)pDexFileData);
+    }
+    uint64_t ns = NowNs() - t0;
+    if (tbl) {
+      FreeClassTable(tbl);
+    }
+    if (!best_ns || (ns < best_ns)) {
+      best_ns = ns;
+    }
+  }
+  return best_ns;
+}
+
+static uint64_t TimeIndex(OatDexFile_t* pOatDexFile, bool sidecar, bool cold, size_t* map_sz) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s" CLASS_INDEX_SUFFIX, (const char*)pOatDexFile->file_name);
+  uint64_t best_ns = 0;
+  ClassIndexUseSidecar(sidecar);
+  for (int r = 0; r < BENCH_LOADS; ++r) {
+    if (cold) {
+      unlink(path);
+    }
+    uint64_t t0 = NowNs();
+    ClassIndex_t* pIndex = OpenClassIndex(pOatDexFile);
+    uint64_t ns = NowNs() - t0;
+    if (!pIndex) {
+      return 0;
+    }
+    *map_sz = pIndex->map_sz;
+    CloseClassIndex(pIndex);
+    if (!best_ns || (ns < best_ns)) {
+      best_ns = ns;
+    }
+  }
+  ClassIndexUseSidecar(true);
+  return best_ns;
+}
+
+static void BenchLookups(DexFileData_t* pDexFileData, OatDexFile_t* pOatDexFile) {
+  ClassTable_t* tbl = AllocClassTable(CLASSES_HASH_NR);
+  ClassIndex_t* pIndex = OpenClassIndex(pOatDexFile);
+  const uint8_t** keys = (const uint8_t**)malloc(sizeof(uint8_t*) * pDexFileData->nr_classes);
+  size_t* lens = (size_t*)malloc(sizeof(size_t) * pDexFileData->nr_classes);
+  uint32_t* order = (uint32_t*)malloc(sizeof(uint32_t) * NR_LOOKUPS);
+  if (!tbl || !pIndex || !keys || !lens || !order) {
+    fprintf(stderr, "Out of memory\n");
+    return;
+  }
+  for (uint32_t class_idx = 0; class_idx < pDexFileData->nr_classes; ++class_idx) {
+    ClassKeyOf(GetClassStringOfClassDefByIdx(pDexFileData, class_idx), &keys[class_idx], &lens[class_idx]);
+    ClassTableInsert(tbl, GenHashKey64(keys[class_idx], lens[class_idx]), keys[class_idx], lens[class_idx],
+                     (void*)(uintptr_t)(class_idx + 1));
+  }
+  for (size_t i = 0; i < NR_LOOKUPS; ++i) {
+    order[i] = NextIndex(pDexFileData->nr_classes);
+  }
+
+  // Keys hashed by the caller in both, as ClFindClass does
+  size_t table_found = 0, index_found = 0;
+  uint64_t t0 = NowNs();
+  for (size_t i = 0; i < NR_LOOKUPS; ++i) {
+    uint32_t k = order[i];
+    table_found += (ClassTableLookup(tbl, GenHashKey64(keys[k], lens[k]), keys[k], lens[k]) != NULL);
+  }
+  uint64_t t1 = NowNs();
+  for (size_t i = 0; i < NR_LOOKUPS; ++i) {
+    uint32_t k = order[i];
+    index_found += (ClassIndexFindClass(pIndex, keys[k], lens[k], GenHashKey64(keys[k], lens[k])) != NULL);
+  }
+  uint64_t t2 = NowNs();
+  printf("lookup     hash table %7.1f ns   class index %7.1f ns%s\n",
+         (double)(t1 - t0) / NR_LOOKUPS, (double)(t2 - t1) / NR_LOOKUPS,
+         ((table_found == NR_LOOKUPS) && (index_found == NR_LOOKUPS)) ? "" : "  MISSING CLASSES");
+  free((void*)keys);
+  free((void*)lens);
+  free((void*)order);
+  CloseClassIndex(pIndex);
+  FreeClassTable(tbl);
+}
+
+static void BenchSynthetic(uint32_t nr_classes) {
+  size_t size;
+  uint8_t* dex = BuildSyntheticDex("com/example/", nr_classes, nr_classes, 0, &size);
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "/tmp/cidxbench.%d.dex", (int)getpid());
+  int32_t fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (!dex || (fd < 0) || (write(fd, dex, size) != (ssize_t)size)) {
+    fprintf(stderr, "Failed to build the synthetic DEX file\n");
+    return;
+  }
+
+  // An OatDex file of just this DEX file, the file written for its identity
+  OatHdr_t bOatHdr;
+  memset((void*)&bOatHdr, 0, sizeof(OatHdr_t));
+  DexFileData_t bDexFileData;
+  memset((void*)&bDexFileData, 0, sizeof(DexFileData_t));
+  bDexFileData.dex_file_ptr = dex;
+  bDexFileData.dex_file_size = size;
+  bDexFileData.nr_classes = nr_classes;
+  OatDexFile_t bOatDexFile;
+  memset((void*)&bOatDexFile, 0, sizeof(OatDexFile_t));
+  bOatDexFile.file_name = (const uint8_t*)path;
+  bOatDexFile.fd = fd;
+  bOatDexFile.oat_hdr = &bOatHdr;
+  bOatDexFile.dex_files = &bDexFileData;
+  bOatDexFile.nr_dex_files = 1;
+
+  size_t map_sz = 0;
+  printf("synthetic  %u classes, %u methods, %u KB of DEX\n", nr_classes, nr_classes * SYNTHETIC_METHODS_PER_CLASS,
+         (unsigned int)(size >> 10));
+  printf("start      hash table of descriptors  %9.2f ms\n", TimeTable(&bDexFileData) / 1000000.0);
+  printf("start      class index, built         %9.2f ms\n",
+         TimeIndex(&bOatDexFile, false, false, &map_sz) / 1000000.0);
+  printf("start      class index, written       %9.2f ms\n",
+         TimeIndex(&bOatDexFile, true, true, &map_sz) / 1000000.0);
+  uint64_t ns = TimeIndex(&bOatDexFile, true, false, &map_sz);
+  printf("start      class index, mapped        %9.2f ms  (%u KB sidecar)\n", ns / 1000000.0,
+         (unsigned int)(map_sz >> 10));
+  BenchLookups(&bDexFileData, &bOatDexFile);
+
+  char sidecar[PATH_MAX + sizeof(CLASS_INDEX_SUFFIX)];
+  snprintf(sidecar, sizeof(sidecar), "%s" CLASS_INDEX_SUFFIX, path);
+  unlink(sidecar);
+  close(fd);
+  unlink(path);
+  free((void*)dex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// OAT file                                                                  //
+///////////////////////////////////////////////////////////////////////////////
+
+// What JNI_CreateJavaVM does per OatDex file, opening it and registering
+// its classes
+static uint64_t TimeStart(const char* path, bool sidecar) {
+  uint64_t best_ns = 0;
+  ClassIndexUseSidecar(sidecar);
+  for (int r = 0; r < BENCH_LOADS; ++r) {
+    ClassLinker_t* pCL = AllocateClassLinker(HEAP_START_SIZE);
+    if (!pCL) {
+      return 0;
+    }
+    uint64_t t0 = NowNs();
+    OatDexFile_t* pOatDexFile = OpenOatDexFile((const uint8_t*)path);
+    bool ok = pOatDexFile && RegisterOatDexFile(pOatDexFile, pCL);
+    uint64_t ns = NowNs() - t0;
+    FreeClassLinker(pCL);
+    if (pOatDexFile) {
+      CloseOatDexFile(pOatDexFile);
+    }
+    if (!ok) {
+      return 0;
+    }
+    if (!best_ns || (ns < best_ns)) {
+      best_ns = ns;
+    }
+  }
+  ClassIndexUseSidecar(true);
+  return best_ns;
+}
+
+static void BenchOat(const char* path) {
+  uint64_t without_ns = TimeStart(path, false);
+  // The first start writes the sidecar, the next ones map it
+  TimeStart(path, true);
+  uint64_t with_ns = TimeStart(path, true);
+  if (!without_ns || !with_ns) {
+    fprintf(stderr, "Failed to load %s\n", path);
+    return;
+  }
+  printf("\n%s\n", path);
+  printf("start      without the sidecar        %9.2f us\n", without_ns / 1000.0);
+  printf("start      with the sidecar           %9.2f us  x%.2f\n", with_ns / 1000.0,
+         (double)without_ns / with_ns);
+}
+
+int main(int argc, char** argv) {
+  uint32_t nr_classes = (argc > 1) ? strtoul(argv[1], NULL, 0) : DEFAULT_CLASSES;
+  if (!nr_classes || (nr_classes > MAX_CLASSES)) {
+    fprintf(stderr, "Between 1 and %u classes\n", MAX_CLASSES);
+    return -1;
+  }
+  BenchSynthetic(nr_classes);
+  if (argc > 2) {
+    BenchOat(argv[2]);
+  }
+  return 0;
+}
@@ -0,0 +1,242 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Hammers ClFindClass from 1..N threads and reports lookups per second,
+ * next to the same lookups on a HashTable_t behind a single mutex.
+ *
+ *   clbench [oat file] [max threads] [synthetic classes]
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "../utils.h"
+#include "../hash.h"
+#include "../heap.h"
+#include "../oat.h"
+#include "../class.h"
+#include "../cart.h"
+#include "bench.h"
+
+#define BENCH_CLASSES       10000
+#define BENCH_LOOKUPS       (2 * 1000 * 1000)
+#define BENCH_NAME_SIZE     64
+
+typedef struct {
+  ClassLinker_t*    pCL;
+  HashTable_t*      locked_tbl;
+  pthread_mutex_t*  lock;
+  const uint8_t**   names;
+  size_t            nr_names;
+  uint32_t          seed;
+  size_t            found;
+} BenchArg_t;
+
+static inline uint32_t NextRand(uint32_t* state) {
+  // xorshift32
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return x;
+}
+
+static void* LockFreeWorker(void* p) {
+  BenchArg_t* arg = (BenchArg_t*)p;
+  uint32_t state = arg->seed;
+  for (size_t i = 0; i < BENCH_LOOKUPS; ++i) {
+    const uint8_t* name = arg->names[NextRand(&state) % arg->nr_names];
+    if (ClFindClass(arg->pCL, name)) {
+      arg->found++;
+    }
+  }
+  return NULL;
+}
+
+static void* LockedWorker(void* p) {
+  BenchArg_t* arg = (BenchArg_t*)p;
+  uint32_t state = arg->seed;
+  for (size_t i = 0; i < BENCH_LOOKUPS; ++i) {
+    const uint8_t* name = arg->names[NextRand(&state) % arg->nr_names];
+    size_t len = strlen((const char*)name);
+    size_t hash = HashKeyOf64(GenHashKey64(name, len));
+    pthread_mutex_lock(arg->lock);
+    if (IsHashStrExist(arg->locked_tbl, hash, name, len)) {
+      arg->found++;
+    }
+    pthread_mutex_unlock(arg->lock);
+  }
+  return NULL;
+}
+
+static double RunThreads(void* (*worker)(void*), BenchArg_t* proto, int nr_threads) {
+  pthread_t* threads = (pthread_t*)malloc(sizeof(pthread_t) * nr_threads);
+  BenchArg_t* args = (BenchArg_t*)malloc(sizeof(BenchArg_t) * nr_threads);
+  if (!threads || !args) {
+    fprintf(stderr, "Out of memory\n");
+    exit(-1);
+  }
+  uint64_t t0 = NowNs();
+  for (int i = 0; i < nr_threads; ++i) {
+    args[i] = *proto;
+    args[i].seed = 0x9E3779B9 + (i * 7919);
+    args[i].found = 0;
+    pthread_create(&threads[i], NULL, worker, (void*)&args[i]);
+  }
+  size_t found = 0;
+  for (int i = 0; i < nr_threads; ++i) {
+    pthread_join(threads[i], NULL);
+    found += args[i].found;
+  }
+  uint64_t ns = NowNs() - t0;
+  if (found != (size_t)BENCH_LOOKUPS * nr_threads) {
+    fprintf(stderr, "Lookup failures: %u of %u found\n",
+            (unsigned int)found, (unsigned int)(BENCH_LOOKUPS * nr_threads));
+  }
+  free(threads);
+  free(args);
+  return ((double)BENCH_LOOKUPS * nr_threads * 1000000000.0) / (double)ns;
+}
+
+static Class_t* AddSyntheticClass(ClassLinker_t* pCL, uint32_t idx) {
+  Class_t* pClass = (Class_t*)malloc(sizeof(Class_t));
+  uint8_t* name = (uint8_t*)malloc(BENCH_NAME_SIZE);
+  if (!pClass || !name) {
+    return NULL;
+  }
+  memset(pClass, 0, sizeof(Class_t));
+  snprintf((char*)name, BENCH_NAME_SIZE, "Lcom/example/bench/pkg%u/Class%u;", idx % 97, idx);
+  pClass->class_id = idx;
+  pClass->class_name_str = name;
+  pClass->class_key_str = name + 1;
+  pClass->class_key_len = strlen((const char*)name) - 2;
+  pClass->class_key_hash = GenHashKey64(pClass->class_key_str, pClass->class_key_len);
+  ClassTableInsert(pCL->loaded_classes, pClass->class_key_hash,
+                   pClass->class_key_str, pClass->class_key_len, (void*)pClass);
+  return pClass;
+}
+
+int main(int argc, char** argv) {
+  int max_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  size_t nr_synthetic = BENCH_CLASSES;
+  if (argc > 2) {
+    max_threads = atoi(argv[2]);
+  }
+  if (argc > 3) {
+    nr_synthetic = strtoul(argv[3], NULL, 0);
+  }
+  if (max_threads < 1) {
+    max_threads = 1;
+  }
+
+  ClassLinker_t* pCL = AllocateClassLinker(HEAP_START_SIZE);
+  if (!pCL) {
+    fprintf(stderr, "Out of memory for class linker initialization\n");
+    return -1;
+  }
+
+  // Classes of a real OAT file, if one is given
+  uint64_t load_ns = 0;
+  if (argc > 1) {
+    HashTable_t* pOatDexFiles = AllocHashTable(NULL, 5);
+    uint64_t t0 = NowNs();
+    if (!pOatDexFiles ||
+        LoadClassesOfOatDexFile(pOatDexFiles, pCL, (const uint8_t*)argv[1]) == false) {
+      fprintf(stderr, "Failed to load %s\n", argv[1]);
+      return -1;
+    }
+    load_ns = NowNs() - t0;
+  }
+  size_t nr_oat = 0;
+  for (ClassIndex_t* pIndex = pCL->class_indexes; pIndex; pIndex = pIndex->Next) {
+    nr_oat += pIndex->hdr->nr_classes;
+  }
+
+  // Synthetic classes on top, so the table is big enough to matter
+  size_t nr_names = nr_synthetic;
+  const uint8_t** names = (const uint8_t**)malloc(sizeof(uint8_t*) * (nr_names + 1));
+  HashTable_t* locked_tbl = AllocHashTable(NULL, nr_names + 1);
+  if (!names || !locked_tbl) {
+    fprintf(stderr, "Out of memory\n");
+    return -1;
+  }
+  for (size_t i = 0; i < nr_synthetic; ++i) {
+    Class_t* pClass = AddSyntheticClass(pCL, (uint32_t)i);
+    if (!pClass) {
+      fprintf(stderr, "Out of memory\n");
+      return -1;
+    }
+    // Look classes up by their internal name as FindClass does
+    uint8_t* name = (uint8_t*)malloc(pClass->class_key_len + 1);
+    if (!name) {
+      fprintf(stderr, "Out of memory\n");
+      return -1;
+    }
+    memcpy(name, pClass->class_key_str, pClass->class_key_len);
+    name[pClass->class_key_len] = '\0';
+    names[i] = name;
+    InsertHashStrEntry(locked_tbl, HashKeyOf64(pClass->class_key_hash),
+                       pClass->class_key_str, pClass->class_key_len, (void*)pClass);
+  }
+  if (nr_names == 0) {
+    fprintf(stderr, "No classes to look up\n");
+    return -1;
+  }
+
+  printf("classes: %u from OAT, %u synthetic, %u lookups per thread\n",
+         (unsigned int)nr_oat, (unsigned int)nr_synthetic, (unsigned int)BENCH_LOOKUPS);
+  if (argc > 1) {
+    printf("load: %.1f us, metadata %u KB in the arena, %u KB in the heap\n",
+           (double)load_ns / 1000.0,
+           (unsigned int)(ArenaAllocedSize(pCL->meta_arena) / 1024),
+           (unsigned int)(HeapAllocedSize(pCL->heap_vol) / 1024));
+  }
+  printf("%7s  %16s  %8s  %16s  %8s\n", "threads", "lock-free/s", "scaling", "mutex/s", "scaling");
+
+  pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  BenchArg_t proto;
+  memset(&proto, 0, sizeof(proto));
+  proto.pCL = pCL;
+  proto.locked_tbl = locked_tbl;
+  proto.lock = &lock;
+  proto.names = names;
+  proto.nr_names = nr_names;
+
+  double base_free = 0.0;
+  double base_locked = 0.0;
+  // 1, 2, 4, ... and finally max_threads
+  for (int t = 1;; t = ((t * 2) > max_threads) ? max_threads : (t * 2)) {
+    double lock_free = RunThreads(LockFreeWorker, &proto, t);
+    double locked = RunThreads(LockedWorker, &proto, t);
+    if (t == 1) {
+      base_free = lock_free;
+      base_locked = locked;
+    }
+    printf("%7d  %16.0f  %7.2fx  %16.0f  %7.2fx\n",
+           t, lock_free, lock_free / base_free, locked, locked / base_locked);
+    if (t == max_threads) {
+      break;
+    }
+  }
+  return 0;
+}
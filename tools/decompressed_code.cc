@@ -29,6 +29,8 @@
 #include <sys/mman.h>
 #include <errno.h>
 
+#include "../bitmap.h"
+
 #if 0
 #include "base/logging.h"
 #include "base/stl_util.h"
@@ -266,97 +268,29 @@ DecompressedCode::~DecompressedCode() {
   close(fd_);
 }
 
-static inline uint8_t NextBit(uint8_t byte) {
-  switch (byte) {
-    case 0x01:
-      return 1;
-    case 0x03:
-      return 2;
-    case 0x07:
-      return 3;
-    case 0x0F:
-      return 4;
-    case 0x1F:
-      return 5;
-    case 0x3F:
-      return 6;
-    case 0x7F:
-      return 7;
-    default:
-      break;
-  }
-  return 0x00;
+// The bitmap is read as 64-bit words, see bitmap.h
+static inline uint64_t* BitmapWordsOf(uint8_t* bitmap) {
+  return reinterpret_cast<uint64_t*>(bitmap);
 }
 
 void* DecompressedCode::Alloc(const size_t hash, const size_t size) {
-  size_t has_size = 0;
-  uint32_t start_byte = 0;
-  uint32_t start_byte_cnt = 0;
-  size_t start_bit = 0;
-  size_t start_bit_cnt = 0;
-  bool found = false;
-
-  // Search in the bitmap for the needed size of memory
-  for (uint32_t i = 0; i < sz_bitmap_; ++i) {
-    // Read from memory to a temporary variable
-    uint8_t tmp = *(bitmap_ + i);
-    if (tmp == 0xFF) {
-      continue;
-    }
-    uint8_t j = NextBit(tmp);
-    // Iterate each bit
-    for (; j < BitsPerByte; ++j) {
-      // If there's already a gotten size suffices the request, just break it
-      if (has_size >= size) {
-        goto DoneScan;
-      }
-      // Iterate each bit
-      if (tmp & (1 << j)) {
-        // If this bit is in use, try next one
-        continue;
-      }
-      // If this bit is not in use, record it
-      if (found == false) {
-        start_byte = i;
-        start_bit = j;
-        found = true;
-      }
-      start_bit_cnt++;
-      has_size += SlotSize;
-    }
-    if (found == true) {
-      start_byte_cnt++;
-    }
+  size_t nr_bits = sz_bitmap_ * BitsPerByte;
+  size_t nr = (size + SlotSize - 1) / SlotSize;
+  if (nr == 0) {
+    nr = 1;
   }
- DoneScan:
-  // If (has_size < size), raise Out Of Memory
-  if (has_size < size) {
+  // Search in the bitmap for enough contiguous slots
+  size_t index = BitmapFindClearRun(BitmapWordsOf(bitmap_), nr_bits, nr);
+  // If not found, raise Out Of Memory
+  if (index >= nr_bits) {
     return nullptr;
   }
   // Mark bits in the bitmap
-  uint8_t k = start_bit;
-  uint8_t cnt = 0;
-  for (uint32_t i = start_byte; i <= (start_byte + start_byte_cnt); ++i, k = 0) {
-    // Read from memory to a temporary variable
-    uint8_t tmp = *(bitmap_ + i);
-    for (; k < BitsPerByte; ++k) {
-      // If there's already all marked
-      if (cnt >= start_bit_cnt) {
-        *(bitmap_ + i) = tmp;
-        goto DoneMark;
-      }
-      // Update the value & counter
-      tmp |= (1 << k);
-      cnt++;
-    }
-    // Sync the tmp variable to memory
-    *(bitmap_ + i) = tmp;
-  }
- DoneMark:
+  BitmapSetRange(BitmapWordsOf(bitmap_), index, nr);
   // Calculate the pointer
-  uint8_t* ptr = reinterpret_cast<uint8_t*>(code_) + (((start_byte * BitsPerByte) + start_bit) * SlotSize);
+  uint8_t* ptr = reinterpret_cast<uint8_t*>(code_) + (index * SlotSize);
   // Create a record for it
-  DcRecord* rec = new DcRecord(hash, (start_byte * BitsPerByte) + start_bit, start_bit_cnt);
+  DcRecord* rec = new DcRecord(hash, index, nr);
   records_.insert(std::pair<size_t, DcRecord*>(hash, rec));
   // Return the address of the pointer
   return reinterpret_cast<void*>(ptr);
@@ -367,33 +301,8 @@ void DecompressedCode::Dealloc(const size_t hash) {
   if (it == records_.end()) {
     return;
   }
-  // Retrieve the control parameters from the record
-  uint32_t start_byte = it->second->GetIndex() / BitsPerByte;
-  uint32_t start_byte_cnt = (it->second->GetNr() % BitsPerByte)
-                              ? ((it->second->GetNr() / BitsPerByte) + 1)
-                              : (it->second->GetNr() / BitsPerByte);
-  size_t start_bit = it->second->GetIndex() % BitsPerByte;
-  size_t start_bit_cnt = it->second->GetNr();
   // Unmark bits in the bitmap
-  uint8_t k = start_bit;
-  uint8_t cnt = 0;
-  for (uint32_t i = start_byte; i <= (start_byte + start_byte_cnt); ++i, k = 0) {
-    // Read from memory to a temporary variable
-    uint8_t tmp = *(bitmap_ + i);
-    for (; k < BitsPerByte; ++k) {
-      // If there's already all marked
-      if (cnt >= start_bit_cnt) {
-        *(bitmap_ + i) = tmp;
-        goto DoneUnmark;
-      }
-      // Update the value & counter
-      tmp &= ~(1 << k);
-      cnt++;
-    }
-    // Sync the tmp variable to memory
-    *(bitmap_ + i) = tmp;
-  }
- DoneUnmark:
+  BitmapClearRange(BitmapWordsOf(bitmap_), it->second->GetIndex(), it->second->GetNr());
   // Remove this record from the map
   records_.erase(it);
 }
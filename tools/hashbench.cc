@@ -0,0 +1,249 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../hash.h"
+#include "../heap.h"
+#include "bench.h"
+
+// Upper bound of slot visits spent on the linear scan tables per measurement
+#define LEGACY_SCAN_BUDGET  (1ULL << 29)
+// Heap volume large enough to hold a table of n entries across a rehash
+#define HEAP_BENCH_SIZE(n)  (((n) * 128) + (1024 * 1024))
+
+///////////////////////////////////////////////////////////////////////////////
+// Legacy linear scan hash table (as before the open addressing rewrite)     //
+///////////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+  size_t        nr;
+  size_t        cnt;
+  HashEntry_t*  ptr;
+} LegacyHashTable_t;
+
+static LegacyHashTable_t* LegacyAllocHashTable(size_t nr) {
+  LegacyHashTable_t* tbl = (LegacyHashTable_t*)malloc(sizeof(LegacyHashTable_t));
+  if (!tbl) {
+    return NULL;
+  }
+  tbl->nr = nr;
+  tbl->cnt = 0;
+  tbl->ptr = (HashEntry_t*)calloc(nr, sizeof(HashEntry_t));
+  if (!tbl->ptr) {
+    free(tbl);
+    return NULL;
+  }
+  return tbl;
+}
+
+static void LegacyFreeHashTable(LegacyHashTable_t* tbl) {
+  free(tbl->ptr);
+  free(tbl);
+}
+
+static HashEntry_t* LegacyIsHashExist(LegacyHashTable_t* tbl, size_t hash) {
+  for (size_t i = 0; i < tbl->nr; ++i) {
+    HashEntry_t* e = tbl->ptr + i;
+    if (e->key == 0) {
+      continue;
+    } else if (e->key == hash) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+static HashEntry_t* LegacyInsertHashEntry(LegacyHashTable_t* tbl, size_t hash, void* ptr) {
+  if (LegacyIsHashExist(tbl, hash) != NULL) {
+    return NULL;
+  }
+  for (size_t i = 0; i < tbl->nr; ++i) {
+    HashEntry_t* e = tbl->ptr + i;
+    if (e->key == 0) {
+      tbl->cnt++;
+      e->key = hash;
+      e->ptr = ptr;
+      return e;
+    }
+  }
+  return NULL;
+}
+
+static void* LegacyRemoveHashEntry(LegacyHashTable_t* tbl, size_t hash) {
+  for (size_t i = 0; i < tbl->nr; ++i) {
+    HashEntry_t* e = tbl->ptr + i;
+    if (e->key == 0) {
+      continue;
+    } else if (e->key == hash) {
+      tbl->cnt--;
+      e->key = 0;
+      e->ptr = (void*)0;
+    }
+  }
+  return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Helpers                                                                   //
+///////////////////////////////////////////////////////////////////////////////
+
+static uint64_t rnd_state = 0x2545F4914F6CDD1DULL;
+
+static size_t NextKey() {
+  // xorshift64*, never returns 0 which the legacy table treats as unused
+  rnd_state ^= rnd_state >> 12;
+  rnd_state ^= rnd_state << 25;
+  rnd_state ^= rnd_state >> 27;
+  size_t key = (size_t)(rnd_state * 0x2545F4914F6CDD1DULL);
+  return key ? key : 1;
+}
+
+static void Report(const char* impl, size_t n, const char* op, size_t ops, uint64_t ns) {
+  double mops = ns ? ((double)ops * 1000.0) / (double)ns : 0.0;
+  printf("%-8s %9u  %-7s %9u ops  %12.3f ms  %10.3f Mops/s\n",
+         impl, (unsigned int)n, op, (unsigned int)ops, ns / 1000000.0, mops);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Benchmarks                                                                //
+///////////////////////////////////////////////////////////////////////////////
+
+static volatile size_t sink;
+
+static void BenchOpenAddressing(const size_t* keys, const size_t* misses, size_t n, HeapVolume_t* pHeapVol) {
+  const char* impl = pHeapVol ? "swiss(h)" : "swiss";
+  HashTable_t* tbl = pHeapVol ? AllocHashTableFromHeap(pHeapVol, 64) : AllocHashTable(NULL, 64);
+  if (!tbl) {
+    fprintf(stderr, "Out of memory for hash table initialization\n");
+    return;
+  }
+  uint64_t t0 = NowNs();
+  for (size_t i = 0; i < n; ++i) {
+    InsertHashEntry(tbl, keys[i], (void*)(keys + i));
+  }
+  Report(impl, n, "insert", n, NowNs() - t0);
+
+  t0 = NowNs();
+  for (size_t i = 0; i < n; ++i) {
+    sink += (size_t)IsHashExist(tbl, keys[i]);
+  }
+  Report(impl, n, "hit", n, NowNs() - t0);
+
+  t0 = NowNs();
+  for (size_t i = 0; i < n; ++i) {
+    sink += (size_t)IsHashExist(tbl, misses[i]);
+  }
+  Report(impl, n, "miss", n, NowNs() - t0);
+
+  t0 = NowNs();
+  for (size_t i = 0; i < n; ++i) {
+    RemoveHashEntry(tbl, keys[i]);
+  }
+  Report(impl, n, "remove", n, NowNs() - t0);
+  FreeHashTable(tbl);
+}
+
+static void BenchLegacy(const size_t* keys, const size_t* misses, size_t n) {
+  // Every operation scans all n slots, so only time as many operations as
+  // fit into the scan budget and report the rate
+  size_t ops = (size_t)(LEGACY_SCAN_BUDGET / n);
+  if (ops > n) {
+    ops = n;
+  }
+  if (ops < 1) {
+    ops = 1;
+  }
+  LegacyHashTable_t* tbl = LegacyAllocHashTable(n);
+  if (!tbl) {
+    fprintf(stderr, "Out of memory for hash table initialization\n");
+    return;
+  }
+  // Prefill everything but the keys timed by the insert run
+  for (size_t i = 0; i < n - ops; ++i) {
+    tbl->ptr[i].key = keys[i];
+    tbl->ptr[i].ptr = (void*)(keys + i);
+    tbl->cnt++;
+  }
+  uint64_t t0 = NowNs();
+  for (size_t i = n - ops; i < n; ++i) {
+    LegacyInsertHashEntry(tbl, keys[i], (void*)(keys + i));
+  }
+  Report("legacy", n, "insert", ops, NowNs() - t0);
+
+  t0 = NowNs();
+  for (size_t i = 0; i < ops; ++i) {
+    sink += (size_t)LegacyIsHashExist(tbl, keys[(i * 7919) % n]);
+  }
+  Report("legacy", n, "hit", ops, NowNs() - t0);
+
+  t0 = NowNs();
+  for (size_t i = 0; i < ops; ++i) {
+    sink += (size_t)LegacyIsHashExist(tbl, misses[i]);
+  }
+  Report("legacy", n, "miss", ops, NowNs() - t0);
+
+  t0 = NowNs();
+  for (size_t i = 0; i < ops; ++i) {
+    LegacyRemoveHashEntry(tbl, keys[i]);
+  }
+  Report("legacy", n, "remove", ops, NowNs() - t0);
+  LegacyFreeHashTable(tbl);
+}
+
+int main(int argc, char** argv) {
+  size_t sizes[] = {64, 10000, 1000000};
+  size_t nr_sizes = sizeof(sizes) / sizeof(sizes[0]);
+
+  // A single size can be given on the command line
+  if (argc > 1) {
+    sizes[0] = strtoul(argv[1], NULL, 0);
+    nr_sizes = 1;
+  }
+
+  printf("%-8s %9s  %-7s %13s  %15s  %17s\n", "impl", "entries", "op", "timed", "time", "throughput");
+  for (size_t s = 0; s < nr_sizes; ++s) {
+    size_t n = sizes[s];
+    size_t* keys = (size_t*)malloc(sizeof(size_t) * n);
+    size_t* misses = (size_t*)malloc(sizeof(size_t) * n);
+    if (!keys || !misses) {
+      fprintf(stderr, "Out of memory\n");
+      return -1;
+    }
+    for (size_t i = 0; i < n; ++i) {
+      keys[i] = NextKey();
+      misses[i] = NextKey();
+    }
+
+    BenchLegacy(keys, misses, n);
+    BenchOpenAddressing(keys, misses, n, NULL);
+
+    // Heap backed variant, as used by AllocHashTableFromHeap
+    HeapVolume_t* pHeapVol = AllocHeapVolume(HEAP_BENCH_SIZE(n));
+    if (pHeapVol) {
+      BenchOpenAddressing(keys, misses, n, pHeapVol);
+      FreeHeapVolume(pHeapVol);
+    }
+
+    free(keys);
+    free(misses);
+  }
+  return (int)(sink & 0);
+}
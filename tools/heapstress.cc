@@ -0,0 +1,385 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Heap stress test and verifier
+ *
+ * Replays random traces of allocations and frees against HeapAlloc and
+ * HeapFree. A trace only depends on its scenario, the seed and the number
+ * of operations, so a failing run is replayed by giving the seed it printed.
+ *
+ *   uniform  : sizes spread evenly over the size brackets and small large
+ *              allocations, any live block may be freed next
+ *   powerlaw : sizes and lifetimes drawn from power laws, most blocks are
+ *              small and die young, a few are big and stay
+ *   mem      : replays tests/Mem.java, three Test[] arrays of random length
+ *              replaced in turn, the old ones freed at once
+ *
+ * Each scenario fills a table of live blocks, churns through it, frees it
+ * all in random order and trims the heap. Every phase reports operations
+ * per second, the median and 99th percentile latency, the peak RSS and the
+ * fragmentation, then HeapVerify checks the heap. Blocks carry a tag at both
+ * ends which is checked when they are freed, so overlapping blocks show up.
+ * Exits with 1 on any problem.
+ *
+ *   heapstress [-s seed] [-n operations] [-v verify interval] [scenario]..
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "../heap.h"
+#include "../cart.h"
+#include "bench.h"
+
+// Array header of a 32-bit ART object: class, monitor and length
+#define ARRAY_HDR_SIZE      12
+#define REF_SIZE            4
+#define DEFAULT_OPS         (1000 * 1000)
+#define LIVE_BLOCKS         (64 * 1024)
+// Room for the live blocks of every scenario
+#define STRESS_MAX_HEAP     (1024UL * 1024 * 1024)
+#define UNIFORM_MAX_SIZE    (4 * HEAP_MAX_BRACKET_SIZE)
+#define POWERLAW_MIN_SIZE   16
+#define POWERLAW_MAX_SIZE   (256 * 1024)
+#define POWERLAW_ALPHA      1.2
+
+enum {
+  kScenarioUniform = 0,
+  kScenarioPowerLaw,
+  kScenarioMem,
+  kNrScenarios,
+};
+
+static const char* scenario_names[kNrScenarios] = { "uniform", "powerlaw", "mem" };
+
+typedef struct {
+  uint8_t*  ptr;
+  size_t    size;
+} Block_t;
+
+typedef struct {
+  int           scenario;
+  uint64_t      rnd;
+  HeapVolume_t* heap;
+  Block_t*      live;
+  size_t        nr_live;      // slots of live used by the scenario
+  size_t        next;         // slot replaced next by mem
+  uint32_t*     latencies;    // ns of each operation of the phase
+  size_t        nr_ops;
+  size_t        nr_failed;    // allocations the heap had no room for
+  size_t        nr_problems;
+  size_t        verify_interval;
+} Stress_t;
+
+static uint64_t NextRandom(Stress_t* st) {
+  st->rnd ^= st->rnd >> 12;
+  st->rnd ^= st->rnd << 25;
+  st->rnd ^= st->rnd >> 27;
+  return st->rnd * 0x2545F4914F6CDD1DULL;
+}
+
+static inline size_t NextIndex(Stress_t* st, size_t bound) {
+  return (size_t)((NextRandom(st) >> 16) % bound);
+}
+
+// In [0, 1)
+static inline double NextUnit(Stress_t* st) {
+  return (double)(NextRandom(st) >> 11) / (double)(1ULL << 53);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Peak RSS                                                                  //
+///////////////////////////////////////////////////////////////////////////////
+
+// The peak is reset where the system allows it, so each phase gets its own
+static void ResetPeakRss() {
+  FILE* fp = fopen("/proc/self/clear_refs", "w");
+  if (fp) {
+    fputs("5", fp);
+    fclose(fp);
+  }
+}
+
+static size_t PeakRssKB() {
+  char line[128];
+  size_t kb = 0;
+  FILE* fp = fopen("/proc/self/status", "r");
+  if (fp) {
+    while (fgets(line, sizeof(line), fp)) {
+      if (!strncmp(line, "VmHWM:", 6)) {
+        kb = strtoul(line + 6, NULL, 10);
+        break;
+      }
+    }
+    fclose(fp);
+  }
+  if (!kb) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    kb = ru.ru_maxrss;
+  }
+  return kb;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Traces                                                                    //
+///////////////////////////////////////////////////////////////////////////////
+
+static size_t NextSize(Stress_t* st) {
+  switch (st->scenario) {
+    case kScenarioUniform:
+      return 1 + NextIndex(st, UNIFORM_MAX_SIZE);
+    case kScenarioPowerLaw: {
+      // Pareto, the size halves as it gets 2^alpha times more likely
+      double sz = POWERLAW_MIN_SIZE / pow(1.0 - NextUnit(st), 1.0 / POWERLAW_ALPHA);
+      return (sz < POWERLAW_MAX_SIZE) ? (size_t)sz : POWERLAW_MAX_SIZE;
+    }
+    default:
+      break;
+  }
+  // new Test[nextInt(4096)], Test[nextInt(8192)] and Test[nextInt(10240)]
+  static const uint32_t bounds[3] = { 4096, 8192, 10240 };
+  return ARRAY_HDR_SIZE + (NextIndex(st, bounds[st->next % 3]) * REF_SIZE);
+}
+
+// Slot of the live block replaced next
+static size_t NextSlot(Stress_t* st) {
+  switch (st->scenario) {
+    case kScenarioUniform:
+      return NextIndex(st, st->nr_live);
+    case kScenarioPowerLaw: {
+      // The first slots are replaced far more often, their blocks die young
+      double u = NextUnit(st);
+      return (size_t)(u * u * u * st->nr_live);
+    }
+    default:
+      break;
+  }
+  size_t slot = st->next;
+  st->next = (st->next + 1) % st->nr_live;
+  return slot;
+}
+
+static inline uint64_t Tag(const Block_t* b) {
+  return (uint64_t)(uintptr_t)b->ptr ^ ((uint64_t)b->size << 40) ^ 0x5A5A5A5A5A5A5A5AULL;
+}
+
+// The tags do not overlap, blocks too small for two get one
+static void TagBlock(Block_t* b) {
+  uint64_t tag = Tag(b);
+  if (b->size >= sizeof(uint64_t)) {
+    memcpy(b->ptr, &tag, sizeof(uint64_t));
+  }
+  if (b->size >= (2 * sizeof(uint64_t))) {
+    memcpy(b->ptr + b->size - sizeof(uint64_t), &tag, sizeof(uint64_t));
+  }
+}
+
+static bool CheckBlock(const Block_t* b) {
+  uint64_t tag = Tag(b);
+  return ((b->size < sizeof(uint64_t)) || !memcmp(b->ptr, &tag, sizeof(uint64_t))) &&
+         ((b->size < (2 * sizeof(uint64_t))) ||
+          !memcmp(b->ptr + b->size - sizeof(uint64_t), &tag, sizeof(uint64_t)));
+}
+
+// Frees the block of the slot if any, then allocates a new one in it unless
+// only freeing. Only the heap calls are timed.
+static void ReplaceBlock(Stress_t* st, size_t slot, bool alloc) {
+  Block_t* b = st->live + slot;
+  uint64_t ns = 0;
+  if (b->ptr) {
+    if (!CheckBlock(b)) {
+      fprintf(stderr, "Block %p of %u bytes overwritten\n", b->ptr, (unsigned int)b->size);
+      st->nr_problems++;
+    }
+    uint64_t t0 = NowNs();
+    HeapFree(st->heap, b->ptr);
+    ns += NowNs() - t0;
+    b->ptr = NULL;
+  }
+  if (alloc) {
+    b->size = NextSize(st);
+    uint64_t t0 = NowNs();
+    b->ptr = (uint8_t*)HeapAlloc(st->heap, b->size);
+    ns += NowNs() - t0;
+    if (b->ptr) {
+      TagBlock(b);
+    } else {
+      st->nr_failed++;
+    }
+  }
+  st->latencies[st->nr_ops++] = (ns < UINT32_MAX) ? (uint32_t)ns : UINT32_MAX;
+  if (st->verify_interval && !(st->nr_ops % st->verify_interval)) {
+    st->nr_problems += HeapVerify(st->heap);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Phases                                                                    //
+///////////////////////////////////////////////////////////////////////////////
+
+static int CompareLatency(const void* a, const void* b) {
+  uint32_t x = *(const uint32_t*)a;
+  uint32_t y = *(const uint32_t*)b;
+  return (x > y) - (x < y);
+}
+
+static void BeginPhase(Stress_t* st) {
+  st->nr_ops = 0;
+  st->nr_failed = 0;
+  ResetPeakRss();
+}
+
+static void EndPhase(Stress_t* st, const char* phase, uint64_t ns) {
+  size_t nr_problems = HeapVerify(st->heap);
+  st->nr_problems += nr_problems;
+  uint32_t p50 = 0;
+  uint32_t p99 = 0;
+  if (st->nr_ops) {
+    qsort(st->latencies, st->nr_ops, sizeof(uint32_t), CompareLatency);
+    p50 = st->latencies[st->nr_ops / 2];
+    p99 = st->latencies[(st->nr_ops * 99) / 100];
+  }
+  printf("%-9s %-6s %8u ops %9.0f ops/s  p50 %5u ns  p99 %6u ns  rss %6u MB  heap %5u MB  frag %3u%%  %s",
+         scenario_names[st->scenario], phase, (unsigned int)st->nr_ops,
+         ns ? (st->nr_ops * 1e9) / ns : 0.0, p50, p99, (unsigned int)(PeakRssKB() >> 10),
+         (unsigned int)(HeapAvailableSize(st->heap) >> 20), HeapFragmentation(st->heap),
+         nr_problems ? "INVALID" : "ok");
+  if (st->nr_failed) {
+    printf("  %u out of memory", (unsigned int)st->nr_failed);
+  }
+  printf("\n");
+}
+
+static bool RunScenario(int scenario, uint64_t seed, size_t nr_ops, size_t verify_interval) {
+  Stress_t bStress;
+  Stress_t* st = &bStress;
+  memset((void*)st, 0, sizeof(Stress_t));
+  st->scenario = scenario;
+  st->rnd = seed ? seed : 1;
+  st->verify_interval = verify_interval;
+  st->nr_live = (scenario == kScenarioMem) ? 3 : LIVE_BLOCKS;
+  st->heap = AllocHeapVolumeWithLimit(HEAP_START_SIZE, STRESS_MAX_HEAP);
+  st->live = (Block_t*)calloc(st->nr_live, sizeof(Block_t));
+  size_t max_ops = (nr_ops > st->nr_live) ? nr_ops : st->nr_live;
+  st->latencies = (uint32_t*)malloc(sizeof(uint32_t) * max_ops);
+  if (!st->heap || !st->live || !st->latencies) {
+    printf("%-9s skipped, out of memory\n", scenario_names[scenario]);
+    free((void*)st->live);
+    free((void*)st->latencies);
+    if (st->heap) {
+      FreeHeapVolume(st->heap);
+    }
+    return true;
+  }
+
+  // Fill the table, churn through it, then free it all in random order
+  BeginPhase(st);
+  uint64_t t0 = NowNs();
+  for (size_t i = 0; i < st->nr_live; ++i) {
+    ReplaceBlock(st, i, true);
+  }
+  EndPhase(st, "fill", NowNs() - t0);
+
+  BeginPhase(st);
+  t0 = NowNs();
+  for (size_t i = 0; i < nr_ops; ++i) {
+    ReplaceBlock(st, NextSlot(st), true);
+  }
+  EndPhase(st, "churn", NowNs() - t0);
+
+  size_t* order = (size_t*)malloc(sizeof(size_t) * st->nr_live);
+  if (order) {
+    for (size_t i = 0; i < st->nr_live; ++i) {
+      order[i] = i;
+    }
+    for (size_t i = st->nr_live - 1; i > 0; --i) {
+      size_t j = NextIndex(st, i + 1);
+      size_t tmp = order[i];
+      order[i] = order[j];
+      order[j] = tmp;
+    }
+  }
+  BeginPhase(st);
+  t0 = NowNs();
+  for (size_t i = 0; i < st->nr_live; ++i) {
+    ReplaceBlock(st, order ? order[i] : i, false);
+  }
+  EndPhase(st, "drain", NowNs() - t0);
+  free((void*)order);
+
+  BeginPhase(st);
+  t0 = NowNs();
+  size_t trimmed = HeapTrim(st->heap);
+  EndPhase(st, "trim", NowNs() - t0);
+  if (HeapAllocedSize(st->heap)) {
+    printf("%-9s %u bytes still allocated after the drain\n", scenario_names[scenario],
+           (unsigned int)HeapAllocedSize(st->heap));
+    st->nr_problems++;
+  }
+  printf("%-9s %u MB trimmed, %u problems\n", scenario_names[scenario],
+         (unsigned int)(trimmed >> 20), (unsigned int)st->nr_problems);
+
+  free((void*)st->live);
+  free((void*)st->latencies);
+  FreeHeapVolume(st->heap);
+  return st->nr_problems == 0;
+}
+
+int main(int argc, char** argv) {
+  uint64_t seed = (uint64_t)time(NULL);
+  size_t nr_ops = DEFAULT_OPS;
+  size_t verify_interval = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:n:v:")) != -1) {
+    switch (opt) {
+      case 's':
+        seed = strtoull(optarg, NULL, 0);
+        break;
+      case 'n':
+        nr_ops = strtoul(optarg, NULL, 0);
+        break;
+      case 'v':
+        verify_interval = strtoul(optarg, NULL, 0);
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-s seed] [-n operations] [-v verify interval] [scenario]..\n", argv[0]);
+        return 2;
+    }
+  }
+
+  printf("seed %llu, %u operations\n", (unsigned long long)seed, (unsigned int)nr_ops);
+  bool passed = true;
+  for (int s = 0; s < kNrScenarios; ++s) {
+    // All of them unless some are named
+    bool selected = (optind >= argc);
+    for (int i = optind; i < argc; ++i) {
+      selected = selected || !strcmp(argv[i], scenario_names[s]);
+    }
+    if (selected) {
+      passed = RunScenario(s, seed, nr_ops, verify_interval) && passed;
+    }
+  }
+  printf("%s\n", passed ? "passed" : "FAILED");
+  return passed ? 0 : 1;
+}
@@ -0,0 +1,238 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Huge page benchmark
+ *
+ *   calls : small methods spread a page apart over a code region, called
+ *           in random order the way compiled code calls across an OAT
+ *           file, so that nearly every call needs another page of code
+ *   alloc : objects allocated back to back into a heap growing to hold
+ *           them, then followed through random references
+ *
+ * Each runs on small pages and then on huge pages, the code moved onto them
+ * the way OpenOatDexFile moves .text. An OAT file given last is opened with
+ * huge pages to show how much of its code gets them.
+ *
+ *   hugebench [code MB] [heap MB] [oat file]
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "../utils.h"
+#include "../heap.h"
+#include "../class.h"
+#include "../oat.h"
+#include "../gc.h"
+#include "../cart.h"
+#include "bench.h"
+
+#define DEFAULT_CODE_MB     64
+#define DEFAULT_HEAP_MB     256
+#define NR_CALLS            (20 * 1000 * 1000)
+#define NR_CHASES           (20 * 1000 * 1000)
+// Methods start this far apart, off the page boundary so they do not all
+// land in the same cache sets
+#define METHOD_STRIDE       (PAGE_SIZE + 64)
+
+// Node { Object_t hdr; Node* next; Node* other; }
+#define NODE_NEXT           CLASS_OBJECT_HDR_SIZE
+#define NODE_OTHER          (NODE_NEXT + sizeof(Object_t*))
+#define NODE_SIZE           (NODE_OTHER + sizeof(Object_t*))
+
+static uint32_t node_offsets[2] = { NODE_NEXT, NODE_OTHER };
+
+typedef uint32_t (*Method_fn)();
+
+static inline Object_t* GetRef(Object_t* obj, size_t offset) {
+  return *(Object_t**)((uint8_t*)obj + offset);
+}
+
+static inline void SetRef(Object_t* obj, size_t offset, Object_t* ref) {
+  *(Object_t**)((uint8_t*)obj + offset) = ref;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Method calls                                                              //
+///////////////////////////////////////////////////////////////////////////////
+
+#if defined(__i386__) || defined(__x86_64__)
+// Fills the region with methods returning their index, mov eax, imm32; ret
+static size_t EmitMethods(uint8_t* code, size_t sz) {
+  size_t nr = 0;
+  for (size_t off = 0; (off + 6) <= sz; off += METHOD_STRIDE, ++nr) {
+    code[off] = 0xB8;
+    memcpy(code + off + 1, &nr, 4);
+    code[off + 5] = 0xC3;
+  }
+  return nr;
+}
+
+static void BenchCalls(size_t code_sz) {
+  // Aligned so that the huge pages cover all of it
+  uint8_t* r = (uint8_t*)mmap(NULL, code_sz + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (r == MAP_FAILED) {
+    printf("calls  skipped, no room for %u MB of code\n", (unsigned int)(code_sz >> 20));
+    return;
+  }
+  uint8_t* code = (uint8_t*)(((uintptr_t)r + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+  size_t nr_methods = EmitMethods(code, code_sz);
+  mprotect(code, code_sz, PROT_READ | PROT_EXEC);
+
+  // The same random order for both runs
+  Method_fn* calls = (Method_fn*)malloc(sizeof(Method_fn) * NR_CALLS);
+  if (!calls) {
+    munmap(r, code_sz + HUGE_PAGE_SIZE);
+    return;
+  }
+  for (size_t i = 0; i < NR_CALLS; ++i) {
+    calls[i] = (Method_fn)(code + (NextIndex(nr_methods) * METHOD_STRIDE));
+  }
+
+  double base_ns = 0;
+  for (int huge = 0; huge < 2; ++huge) {
+    size_t huge_sz = huge ? RemapHugePages(code, code_sz, PROT_READ | PROT_EXEC) : 0;
+    if (huge && !huge_sz) {
+      printf("calls  huge   skipped, the system has no huge pages\n");
+      break;
+    }
+    uint32_t sum = 0;
+    uint64_t t0 = NowNs();
+    for (size_t i = 0; i < NR_CALLS; ++i) {
+      sum += calls[i]();
+    }
+    double ns = (double)(NowNs() - t0) / NR_CALLS;
+    if (!huge) {
+      base_ns = ns;
+    }
+    printf("calls  %-5s  %6u methods  %4u MB on huge pages  %7.2f ns/call  x%.2f  (%08x)\n",
+           huge ? "huge" : "small", (unsigned int)nr_methods, (unsigned int)(huge_sz >> 20),
+           ns, base_ns / ns, sum);
+  }
+  free((void*)calls);
+  munmap(r, code_sz + HUGE_PAGE_SIZE);
+}
+#else
+static void BenchCalls(size_t code_sz) {
+  printf("calls  skipped, methods are only emitted for x86\n");
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// Allocation                                                                //
+///////////////////////////////////////////////////////////////////////////////
+
+static void BenchAlloc(Class_t* pClass, size_t heap_sz, bool huge) {
+  HeapUseHugePages(huge);
+  HeapVolume_t* pHeapVol = AllocHeapVolumeWithLimit(HEAP_START_SIZE, heap_sz);
+  HeapUseHugePages(false);
+  if (!pHeapVol) {
+    printf("alloc  skipped, no room for a %u MB heap\n", (unsigned int)(heap_sz >> 20));
+    return;
+  }
+  Gc_t* pGc = AllocGc(pHeapVol);
+  if (!pGc) {
+    FreeHeapVolume(pHeapVol);
+    return;
+  }
+  // Room for all of the nodes without a collection
+  HeapSetGrowthLimit(pHeapVol, heap_sz);
+  size_t nr_nodes = (heap_sz / 2) / NODE_SIZE;
+  Object_t** nodes = (Object_t**)malloc(sizeof(Object_t*) * nr_nodes);
+  if (!nodes) {
+    FreeGc(pGc);
+    FreeHeapVolume(pHeapVol);
+    return;
+  }
+
+  // Allocation, the committed pages are written for the first time
+  uint64_t t0 = NowNs();
+  size_t nr = 0;
+  for (; nr < nr_nodes; ++nr) {
+    nodes[nr] = GcAllocObject(pGc, NULL, pClass);
+    if (!nodes[nr]) {
+      break;
+    }
+  }
+  uint64_t alloc_ns = NowNs() - t0;
+  for (size_t i = 1; i < nr; ++i) {
+    SetRef(nodes[i - 1], NODE_NEXT, nodes[i]);
+    SetRef(nodes[i], NODE_OTHER, nodes[NextIndex(nr)]);
+  }
+
+  // Random references across the heap
+  Object_t* obj = nr ? nodes[0] : NULL;
+  size_t nr_chased = 0;
+  t0 = NowNs();
+  for (; obj && (nr_chased < NR_CHASES); ++nr_chased) {
+    obj = GetRef(obj, NODE_OTHER);
+  }
+  uint64_t chase_ns = NowNs() - t0;
+
+  printf("alloc  %-5s  %8u objects %4u MB  %7.2f ns/alloc  %7.2f ns/reference%s\n",
+         huge ? "huge" : "small", (unsigned int)nr, (unsigned int)(HeapAllocedSize(pHeapVol) >> 20),
+         nr ? (double)alloc_ns / nr : 0.0, nr_chased ? (double)chase_ns / nr_chased : 0.0,
+         (nr == nr_nodes) ? "" : "  OUT OF MEMORY");
+  free((void*)nodes);
+  FreeGc(pGc);
+  FreeHeapVolume(pHeapVol);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// OAT code                                                                  //
+///////////////////////////////////////////////////////////////////////////////
+
+static void BenchOat(const char* path) {
+  OatUseHugePages(true);
+  uint64_t t0 = NowNs();
+  OatDexFile_t* pOatDexFile = OpenOatDexFile((const uint8_t*)path);
+  uint64_t ns = NowNs() - t0;
+  OatUseHugePages(false);
+  if (!pOatDexFile) {
+    printf("oat    failed to open %s\n", path);
+    return;
+  }
+  printf("oat    %s: %u KB of code, %u KB on huge pages, opened in %.2f ms\n", path,
+         (unsigned int)(pOatDexFile->oat_code_sz >> 10), (unsigned int)(pOatDexFile->huge_text_sz >> 10),
+         ns / 1000000.0);
+  CloseOatDexFile(pOatDexFile);
+}
+
+int main(int argc, char** argv) {
+  size_t code_mb = (argc > 1) ? strtoul(argv[1], NULL, 0) : DEFAULT_CODE_MB;
+  size_t heap_mb = (argc > 2) ? strtoul(argv[2], NULL, 0) : DEFAULT_HEAP_MB;
+
+  Class_t bNode;
+  memset((void*)&bNode, 0, sizeof(Class_t));
+  bNode.object_size = NODE_SIZE;
+  bNode.ref_offsets = node_offsets;
+  bNode.nr_ref_offsets = 2;
+
+  printf("Transparent huge pages %s\n", IsHugePageEnabled() ? "enabled" : "disabled");
+  BenchCalls(code_mb << 20);
+  BenchAlloc(&bNode, heap_mb << 20, false);
+  BenchAlloc(&bNode, heap_mb << 20, true);
+  if (argc > 3) {
+    BenchOat(argv[3]);
+  }
+  return 0;
+}
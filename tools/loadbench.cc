@@ -0,0 +1,238 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Parallel class loading benchmark
+ *
+ * A multi-dex OatDex file made up in memory, its DEX files of classes
+ * extending each other in chains, is started the way a VM linking all of
+ * its classes up front would: its class index built and every class
+ * linked, on 1, 2, 4 and 8 threads. The index built and the classes linked
+ * are checked to be the same whatever the number of threads.
+ *
+ *   loadbench [dex files] [classes per dex file]
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../utils.h"
+#include "../hash.h"
+#include "../class_table.h"
+#include "../oat.h"
+#include "../class_index.h"
+#include "../class.h"
+#include "../cart.h"
+#include "bench.h"
+
+#define DEFAULT_DEX_FILES   4
+#define DEFAULT_CLASSES     8000
+#define MAX_DEX_FILES       64
+#define MAX_CLASSES         65000     // type ids are 16-bit in class_defs
+#define CHAIN_LENGTH        16
+#define BENCH_LOADS         5
+
+static int bench_threads[] = { 1, 2, 4, 8 };
+
+///////////////////////////////////////////////////////////////////////////////
+// Synthetic OatDex file                                                     //
+///////////////////////////////////////////////////////////////////////////////
+
+// The OAT data the DEX files share: a header, and one OAT class of
+// SYNTHETIC_METHODS_PER_CLASS methods of empty code that every class
+// points to
+typedef struct PACKED {
+  OatHdr_t            hdr;
+  OatQuickMethodHdr_t code_hdr;
+  uint8_t             code[8];
+  uint16_t            status;
+  int16_t             type;
+  OatMethodOffsets_t  methods[SYNTHETIC_METHODS_PER_CLASS];
+} SyntheticOat_t;
+
+typedef struct {
+  SyntheticOat_t  oat;
+  DexFileData_t   dex_files[MAX_DEX_FILES];
+  uint32_t*       oat_class_ptrs;
+  OatDexFile_t    oat_dex_file;
+} SyntheticOatDexFile_t;
+
+static bool BuildOatDexFile(SyntheticOatDexFile_t* pSynth, uint32_t nr_dex_files, uint32_t nr_classes) {
+  memset((void*)pSynth, 0, sizeof(SyntheticOatDexFile_t));
+  pSynth->oat.type = kOatClassAllCompiled;
+  for (uint32_t m = 0; m < SYNTHETIC_METHODS_PER_CLASS; ++m) {
+    pSynth->oat.methods[m].code_offset_ = (uint32_t)offsetof(SyntheticOat_t, code);
+  }
+  pSynth->oat_class_ptrs = (uint32_t*)malloc(sizeof(uint32_t) * nr_classes);
+  if (!pSynth->oat_class_ptrs) {
+    return false;
+  }
+  for (uint32_t i = 0; i < nr_classes; ++i) {
+    pSynth->oat_class_ptrs[i] = (uint32_t)offsetof(SyntheticOat_t, status);
+  }
+  for (uint32_t dex_idx = 0; dex_idx < nr_dex_files; ++dex_idx) {
+    size_t size;
+    DexFileData_t* pDexFileData = pSynth->dex_files + dex_idx;
+    // Classes "Lcom/example/dexD/pkgN/ClassM;" in chains of CHAIN_LENGTH
+    char prefix[32];
+    snprintf(prefix, sizeof(prefix), "com/example/dex%u/", dex_idx);
+    pDexFileData->dex_file_ptr = BuildSyntheticDex(prefix, (dex_idx << 16) | nr_classes, nr_classes, CHAIN_LENGTH,
+                                                   &size);
+    if (!pDexFileData->dex_file_ptr) {
+      return false;
+    }
+    pDexFileData->dex_file_size = size;
+    pDexFileData->oat_class_ptrs = pSynth->oat_class_ptrs;
+    pDexFileData->nr_classes = nr_classes;
+    pDexFileData->Next = ((dex_idx + 1) < nr_dex_files) ? (pDexFileData + 1) : NULL;
+  }
+  pSynth->oat_dex_file.file_name = (const uint8_t*)"synthetic.oat";
+  pSynth->oat_dex_file.fd = -1;
+  pSynth->oat_dex_file.oat_hdr = &pSynth->oat.hdr;
+  pSynth->oat_dex_file.dex_files = pSynth->dex_files;
+  pSynth->oat_dex_file.nr_dex_files = nr_dex_files;
+  return true;
+}
+
+static void FreeOatDexFile(SyntheticOatDexFile_t* pSynth, uint32_t nr_dex_files) {
+  for (uint32_t dex_idx = 0; dex_idx < nr_dex_files; ++dex_idx) {
+    free((void*)pSynth->dex_files[dex_idx].dex_file_ptr);
+  }
+  free((void*)pSynth->oat_class_ptrs);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Start                                                                     //
+///////////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+  uint64_t  index_ns;
+  uint64_t  link_ns;
+  size_t    nr_linked;
+  bool      same_index;
+} StartTimes_t;
+
+// The best of a few starts on nr_threads threads, 0 for linking one DEX
+// file after the other on the calling thread as ParseDexClass does
+static bool TimeStart(OatDexFile_t* pOatDexFile, int nr_threads, const ClassIndex_t* pRefIndex,
+                      StartTimes_t* pTimes) {
+  memset((void*)pTimes, 0, sizeof(StartTimes_t));
+  pTimes->same_index = true;
+  ClassIndexUseThreads(nr_threads ? nr_threads : 1);
+  for (int r = 0; r < BENCH_LOADS; ++r) {
+    ClassLinker_t* pCL = AllocateClassLinker(HEAP_START_SIZE);
+    if (!pCL) {
+      return false;
+    }
+    uint64_t t0 = NowNs();
+    bool ok = RegisterOatDexFile(pOatDexFile, pCL);
+    uint64_t t1 = NowNs();
+    if (ok && nr_threads) {
+      ok = ClLinkAllClasses(pCL, nr_threads);
+    } else {
+      DexFileData_t* pDexFileData = pOatDexFile->dex_files;
+      for (; ok && pDexFileData; pDexFileData = pDexFileData->Next) {
+        ok = ParseDexClass(pDexFileData, pCL, (const uint8_t*)pOatDexFile->oat_hdr);
+      }
+    }
+    uint64_t t2 = NowNs();
+    if (!ok) {
+      FreeClassLinker(pCL);
+      return false;
+    }
+    const ClassIndexHdr_t* hdr = pCL->class_indexes->hdr;
+    if ((hdr->file_size != pRefIndex->hdr->file_size) || memcmp(hdr, pRefIndex->hdr, hdr->file_size)) {
+      pTimes->same_index = false;
+    }
+    pTimes->nr_linked = ClassTableSize(pCL->loaded_classes);
+    FreeClassLinker(pCL);
+    if (!pTimes->index_ns || ((t1 - t0) < pTimes->index_ns)) {
+      pTimes->index_ns = t1 - t0;
+    }
+    if (!pTimes->link_ns || ((t2 - t1) < pTimes->link_ns)) {
+      pTimes->link_ns = t2 - t1;
+    }
+  }
+  return true;
+}
+
+static void Bench(uint32_t nr_dex_files, uint32_t nr_classes) {
+  static SyntheticOatDexFile_t bSynth;
+  if (!BuildOatDexFile(&bSynth, nr_dex_files, nr_classes)) {
+    fprintf(stderr, "Failed to build the synthetic OatDex file\n");
+    FreeOatDexFile(&bSynth, nr_dex_files);
+    return;
+  }
+  printf("synthetic  %u DEX files of %u classes, %u methods each, %d processors online\n", nr_dex_files,
+         nr_classes, nr_classes * SYNTHETIC_METHODS_PER_CLASS, GetNrOnlineCpus());
+
+  // The index built on the calling thread is the reference
+  ClassIndexUseSidecar(false);
+  ClassIndexUseThreads(1);
+  ClassIndex_t* pRefIndex = OpenClassIndex(&bSynth.oat_dex_file);
+  if (!pRefIndex) {
+    fprintf(stderr, "Failed to build the class index\n");
+    FreeOatDexFile(&bSynth, nr_dex_files);
+    return;
+  }
+
+  StartTimes_t bSerial;
+  if (!TimeStart(&bSynth.oat_dex_file, 0, pRefIndex, &bSerial)) {
+    fprintf(stderr, "Failed to link the classes\n");
+    CloseClassIndex(pRefIndex);
+    FreeOatDexFile(&bSynth, nr_dex_files);
+    return;
+  }
+  printf("%-10s  %10s  %10s  %10s  %8s  %s\n", "threads", "index", "link", "start", "speedup", "classes");
+  printf("%-10s  %7.2f ms  %7.2f ms  %7.2f ms  %8s  %u\n", "serial", bSerial.index_ns / 1000000.0,
+         bSerial.link_ns / 1000000.0, (bSerial.index_ns + bSerial.link_ns) / 1000000.0, "",
+         (unsigned int)bSerial.nr_linked);
+  uint64_t base_ns = 0;
+  for (size_t i = 0; i < sizeof(bench_threads) / sizeof(bench_threads[0]); ++i) {
+    StartTimes_t bTimes;
+    if (!TimeStart(&bSynth.oat_dex_file, bench_threads[i], pRefIndex, &bTimes)) {
+      fprintf(stderr, "Failed to link the classes on %d threads\n", bench_threads[i]);
+      break;
+    }
+    uint64_t start_ns = bTimes.index_ns + bTimes.link_ns;
+    if (!base_ns) {
+      base_ns = start_ns;
+    }
+    printf("%-10d  %7.2f ms  %7.2f ms  %7.2f ms  x%-7.2f  %u%s%s\n", bench_threads[i], bTimes.index_ns / 1000000.0,
+           bTimes.link_ns / 1000000.0, start_ns / 1000000.0, (double)base_ns / start_ns,
+           (unsigned int)bTimes.nr_linked, bTimes.same_index ? "" : "  INDEX DIFFERS",
+           (bTimes.nr_linked == bSerial.nr_linked) ? "" : "  CLASSES DIFFER");
+  }
+  ClassIndexUseThreads(0);
+  ClassIndexUseSidecar(true);
+  CloseClassIndex(pRefIndex);
+  FreeOatDexFile(&bSynth, nr_dex_files);
+}
+
+int main(int argc, char** argv) {
+  uint32_t nr_dex_files = (argc > 1) ? strtoul(argv[1], NULL, 0) : DEFAULT_DEX_FILES;
+  uint32_t nr_classes = (argc > 2) ? strtoul(argv[2], NULL, 0) : DEFAULT_CLASSES;
+  if (!nr_dex_files || (nr_dex_files > MAX_DEX_FILES) || !nr_classes || (nr_classes > MAX_CLASSES)) {
+    fprintf(stderr, "Between 1 and %u DEX files of 1 to %u classes\n", MAX_DEX_FILES, MAX_CLASSES);
+    return -1;
+  }
+  Bench(nr_dex_files, nr_classes);
+  return 0;
+}
@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Parallel marking benchmark
+ *
+ * Builds object graphs of 1M..50M nodes, a binary tree whose nodes also
+ * point at a random earlier node so that workers race for shared objects,
+ * then times the tracer of mark.cc over the graph for 1, 2, 4.. threads up
+ * to the number of CPUs. Sizes the machine cannot hold are skipped.
+ *
+ *   markbench [max threads] [nodes in millions]..
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../heap.h"
+#include "../bitmap.h"
+#include "../class.h"
+#include "../mark.h"
+#include "../gc.h"
+#include "../cart.h"
+#include "bench.h"
+
+#define NR_REPEATS          3
+#define NR_DEFAULT_SIZES    4
+
+static const size_t default_sizes[NR_DEFAULT_SIZES] = { 1, 5, 10, 50 };
+
+// Node { Object_t hdr; Node* left; Node* right; Node* other; }
+#define NODE_LEFT           CLASS_OBJECT_HDR_SIZE
+#define NODE_RIGHT          (NODE_LEFT + sizeof(Object_t*))
+#define NODE_OTHER          (NODE_RIGHT + sizeof(Object_t*))
+#define NODE_SIZE           (NODE_OTHER + sizeof(Object_t*))
+
+static uint32_t node_offsets[3] = { NODE_LEFT, NODE_RIGHT, NODE_OTHER };
+
+static inline void SetRef(Object_t* obj, size_t offset, Object_t* ref) {
+  *(Object_t**)((uint8_t*)obj + offset) = ref;
+}
+
+// Node i has children 2i+1 and 2i+2, allocation order is kept so that the
+// heap is not laid out in tracing order
+static Object_t* BuildGraph(Gc_t* pGc, Class_t* pClass, size_t nr_nodes) {
+  if (!nr_nodes) {
+    return NULL;
+  }
+  Object_t** nodes = (Object_t**)malloc(sizeof(Object_t*) * nr_nodes);
+  if (!nodes) {
+    return NULL;
+  }
+  // Without a TLAB, the nodes skip the nursery
+  for (size_t i = 0; i < nr_nodes; ++i) {
+    nodes[i] = GcAllocObject(pGc, NULL, pClass);
+    if (!nodes[i]) {
+      free((void*)nodes);
+      return NULL;
+    }
+  }
+  for (size_t i = 0; i < nr_nodes; ++i) {
+    if (((2 * i) + 1) < nr_nodes) {
+      SetRef(nodes[i], NODE_LEFT, nodes[(2 * i) + 1]);
+    }
+    if (((2 * i) + 2) < nr_nodes) {
+      SetRef(nodes[i], NODE_RIGHT, nodes[(2 * i) + 2]);
+    }
+    if (i) {
+      SetRef(nodes[i], NODE_OTHER, nodes[NextIndex(i)]);
+    }
+  }
+  Object_t* root = nodes[0];
+  free((void*)nodes);
+  return root;
+}
+
+static void BenchGraph(MarkPool_t* pool, Class_t* pClass, size_t nr_nodes) {
+  // Reserve room for the graph and let the heap grow to it without a
+  // collection
+  size_t max_sz = (nr_nodes * NODE_SIZE * 2) + (64 * 1024 * 1024);
+  HeapVolume_t* pHeapVol = AllocHeapVolumeWithLimit(HEAP_START_SIZE, max_sz);
+  if (!pHeapVol) {
+    printf("%9uK  skipped, no room for a %u MB heap\n",
+           (unsigned int)(nr_nodes / 1000), (unsigned int)(max_sz >> 20));
+    return;
+  }
+  Gc_t* pGc = AllocGc(pHeapVol);
+  if (!pGc) {
+    FreeHeapVolume(pHeapVol);
+    return;
+  }
+  HeapSetGrowthLimit(pHeapVol, max_sz);
+  uint64_t t0 = NowNs();
+  Object_t* root = BuildGraph(pGc, pClass, nr_nodes);
+  if (!root) {
+    printf("%9uK  skipped, out of memory building the graph\n", (unsigned int)(nr_nodes / 1000));
+    FreeGc(pGc);
+    FreeHeapVolume(pHeapVol);
+    return;
+  }
+  printf("%9uK  built in %.1f ms, %u MB of heap\n", (unsigned int)(nr_nodes / 1000),
+         (NowNs() - t0) / 1000000.0, (unsigned int)(HeapAllocedSize(pHeapVol) >> 20));
+
+  MarkSpace_t bSpace;
+  bSpace.base = pGc->base;
+  bSpace.nr_bits = pHeapVol->ptr->nr_committed * (PAGE_SIZE / HEAP_OBJECT_ALIGN);
+  bSpace.live_bits = pGc->live_bits;
+  bSpace.mark_bits = pGc->mark_bits;
+  bSpace.los = NULL;
+  size_t map_sz = BitmapWords(bSpace.nr_bits) * sizeof(uint64_t);
+  double base_ms = 0;
+  for (int nr_threads = 1; nr_threads <= pool->nr_threads; nr_threads *= 2) {
+    // Best of a few runs, each from clear mark bits
+    uint64_t best = 0;
+    size_t nr_marked = 0;
+    for (int r = 0; r < NR_REPEATS; ++r) {
+      memset((void*)bSpace.mark_bits, 0, map_sz);
+      MarkJob_t bJob;
+      memset((void*)&bJob, 0, sizeof(MarkJob_t));
+      bJob.space = &bSpace;
+      bJob.roots = &root;
+      bJob.nr_roots = 1;
+      bJob.nr_threads = nr_threads;
+      uint64_t t1 = NowNs();
+      MarkPoolTrace(pool, &bJob);
+      uint64_t ns = NowNs() - t1;
+      if (!best || (ns < best)) {
+        best = ns;
+      }
+      nr_marked = bJob.nr_marked;
+    }
+    double ms = best / 1000000.0;
+    if (nr_threads == 1) {
+      base_ms = ms;
+    }
+    printf("%9s   %2d threads  %10.2f ms  %7.2f Mobj/s  x%.2f%s\n", "", nr_threads, ms,
+           nr_marked / (ms * 1000.0), base_ms / ms, (nr_marked == nr_nodes) ? "" : "  MISMARKED");
+    if ((nr_threads < pool->nr_threads) && ((nr_threads * 2) > pool->nr_threads)) {
+      nr_threads = pool->nr_threads / 2;
+    }
+  }
+  FreeGc(pGc);
+  FreeHeapVolume(pHeapVol);
+}
+
+int main(int argc, char** argv) {
+  long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int max_threads = (nr_cpus > 0) ? (int)nr_cpus : 1;
+  if (argc > 1) {
+    max_threads = atoi(argv[1]);
+  }
+  MarkPool_t* pool = AllocMarkPool(max_threads);
+  if (!pool) {
+    return 1;
+  }
+
+  Class_t bNode;
+  memset((void*)&bNode, 0, sizeof(Class_t));
+  bNode.object_size = NODE_SIZE;
+  bNode.ref_offsets = node_offsets;
+  bNode.nr_ref_offsets = 3;
+
+  printf("%10s  %u CPUs, up to %d marking threads\n", "nodes", (unsigned int)nr_cpus, pool->nr_threads);
+  if (argc > 2) {
+    for (int i = 2; i < argc; ++i) {
+      BenchGraph(pool, &bNode, strtoul(argv[i], NULL, 0) * 1000 * 1000);
+    }
+  } else {
+    for (int i = 0; i < NR_DEFAULT_SIZES; ++i) {
+      BenchGraph(pool, &bNode, default_sizes[i] * 1000 * 1000);
+    }
+  }
+  FreeMarkPool(pool);
+  return 0;
+}
@@ -27,7 +27,7 @@ typedef struct {
 } CodeItemOld_t;
 
 typedef struct {
-  uint32_t method_idx_diff;
+  uint32_t method_idx;
   uint32_t access_flags;
   uint32_t code_off;
   CodeItemOld_t xcode_item;
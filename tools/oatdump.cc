@@ -16,6 +16,7 @@
 #include <sys/stat.h>
 
 #include "../oat.h"
+#include "../class_data.h"
 #include "oat_addendum.h"
 #include "../elf.h"
 #include "coat.h"
@@ -69,31 +70,6 @@ bool GetStoreKeyValuePairByIndex(uint32_t* key_value_store_,
   return false;
 }
 
-static inline uint32_t DecodeUnsignedLeb128(const uint8_t** data) {
-  const uint8_t* ptr = *data;
-  int result = *(ptr++);
-  if (result > 0x7f) {
-    int cur = *(ptr++);
-    result = (result & 0x7f) | ((cur & 0x7f) << 7);
-    if (cur > 0x7f) {
-      cur = *(ptr++);
-      result |= (cur & 0x7f) << 14;
-      if (cur > 0x7f) {
-        cur = *(ptr++);
-        result |= (cur & 0x7f) << 21;
-        if (cur > 0x7f) {
-          // Note: We don't check to see if cur is out of range here,
-          // meaning we tolerate garbage in the four high-order bits.
-          cur = *(ptr++);
-          result |= cur << 28;
-        }
-      }
-    }
-  }
-  *data = ptr;
-  return static_cast<uint32_t>(result);
-}
-
 static int8_t ConvertDWordToByte(const uint32_t* Data, uint32_t Offset) {
   uint32_t tmp, off, bs;
   off = Offset / 4;
@@ -416,15 +392,14 @@ void DumpOATHeader(uint8_t* p, int32_t sz) {
 
 			DumpData((const uint32_t*)class_data, 16, 0);
 
-			printf("class_data = %p\n", class_data);
-      xClassDataItem.static_fields_size = DecodeUnsignedLeb128((const uint8_t **)&class_data);
-			printf("class_data = %p\n", class_data);
-      xClassDataItem.instance_fields_size = DecodeUnsignedLeb128((const uint8_t **)&class_data);
-			printf("class_data = %p\n", class_data);
-      xClassDataItem.direct_methods_size = DecodeUnsignedLeb128((const uint8_t **)&class_data);
-			printf("class_data = %p\n", class_data);
-      xClassDataItem.virtual_methods_size = DecodeUnsignedLeb128((const uint8_t **)&class_data);
-			printf("class_data = %p\n", class_data);
+      // Methods follow the fields, their ids accumulate over the deltas
+      ClassDataIter_t bIter;
+      ClassDataIterInit(&bIter, pClassDefItem->class_data_off ? (const uint8_t*)class_data : NULL);
+      xClassDataItem.static_fields_size = bIter.hdr.static_fields_size_;
+      xClassDataItem.instance_fields_size = bIter.hdr.instance_fields_size_;
+      xClassDataItem.direct_methods_size = bIter.hdr.direct_methods_size_;
+      xClassDataItem.virtual_methods_size = bIter.hdr.virtual_methods_size_;
+      ClassDataIterSkipFields(&bIter);
       printf("static_fields_size   = 0x%X\n", xClassDataItem.static_fields_size);
       printf("instance_fields_size = 0x%X\n", xClassDataItem.instance_fields_size);
       printf("direct_methods_size  = 0x%X\n", xClassDataItem.direct_methods_size);
@@ -437,19 +412,17 @@ void DumpOATHeader(uint8_t* p, int32_t sz) {
           malloc(sizeof(EncodedMethod_t) * xClassDataItem.direct_methods_size);
 
         for (uint32_t j = 0; j < xClassDataItem.direct_methods_size; j++, nr_method++) {
-          xClassDataItem.direct_methods[j].method_idx_diff =
-            DecodeUnsignedLeb128((const uint8_t **)&class_data);
-          xClassDataItem.direct_methods[j].access_flags =
-            DecodeUnsignedLeb128((const uint8_t **)&class_data);
-          xClassDataItem.direct_methods[j].code_off =
-            DecodeUnsignedLeb128((const uint8_t **)&class_data);
+          ClassDataIterNext(&bIter);
+          xClassDataItem.direct_methods[j].method_idx = bIter.idx;
+          xClassDataItem.direct_methods[j].access_flags = bIter.access_flags;
+          xClassDataItem.direct_methods[j].code_off = bIter.code_off;
 
           OatQuickMethodHdr_t *pOatQuickMethodHdr =
             (OatQuickMethodHdr_t *)((pOatMethodOffsets + nr_method)->code_offset_
               - sizeof(OatQuickMethodHdr_t) + p);
           uint32_t* pOatCode = (uint32_t *)((pOatMethodOffsets + nr_method)->code_offset_ + p);
 
-          printf("DIRECT  METHOD[%d] method_idx_diff           = 0x%X\n", j, xClassDataItem.direct_methods[j].method_idx_diff);
+          printf("DIRECT  METHOD[%d] method_idx                = 0x%X\n", j, xClassDataItem.direct_methods[j].method_idx);
           printf("DIRECT  METHOD[%d] access_flags              = 0x%X\n", j, xClassDataItem.direct_methods[j].access_flags);
           printf("DIRECT  METHOD[%d] code_off                  = 0x%X\n\n", j, xClassDataItem.direct_methods[j].code_off);
           printf("DIRECT  METHOD[%d] registers_size            = 0x%X\n", j, xClassDataItem.direct_methods[j].xcode_item.registers_size);
@@ -477,18 +450,16 @@ void DumpOATHeader(uint8_t* p, int32_t sz) {
           malloc(sizeof(EncodedMethod_t) * xClassDataItem.virtual_methods_size);
 
         for (uint32_t j = 0; j < xClassDataItem.virtual_methods_size; j++, nr_method++) {
-          xClassDataItem.virtual_methods[j].method_idx_diff =
-            DecodeUnsignedLeb128((const uint8_t **)&class_data);
-          xClassDataItem.virtual_methods[j].access_flags =
-            DecodeUnsignedLeb128((const uint8_t **)&class_data);
-          xClassDataItem.virtual_methods[j].code_off =
-            DecodeUnsignedLeb128((const uint8_t **)&class_data);
+          ClassDataIterNext(&bIter);
+          xClassDataItem.virtual_methods[j].method_idx = bIter.idx;
+          xClassDataItem.virtual_methods[j].access_flags = bIter.access_flags;
+          xClassDataItem.virtual_methods[j].code_off = bIter.code_off;
           OatQuickMethodHdr_t *pOatQuickMethodHdr =
             (OatQuickMethodHdr_t *)((pOatMethodOffsets + nr_method)->code_offset_
               - sizeof(OatQuickMethodHdr_t) + p);
           uint32_t* pOatCode = (uint32_t *)((pOatMethodOffsets + nr_method)->code_offset_ + p);
 
-          printf("VIRTUAL METHOD[%d] method_idx_diff           = 0x%X\n", j, xClassDataItem.virtual_methods[j].method_idx_diff);
+          printf("VIRTUAL METHOD[%d] method_idx                = 0x%X\n", j, xClassDataItem.virtual_methods[j].method_idx);
           printf("VIRTUAL METHOD[%d] access_flags              = 0x%X\n", j, xClassDataItem.virtual_methods[j].access_flags);
           printf("VIRTUAL METHOD[%d] code_off                  = 0x%X\n\n", j, xClassDataItem.virtual_methods[j].code_off);
           printf("VIRTUAL METHOD[%d] registers_size            = 0x%X\n", j, xClassDataItem.virtual_methods[j].xcode_item.registers_size);
@@ -18,6 +18,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/param.h>
 
 #include "jni.h"
@@ -26,19 +27,91 @@
 
 #include "../utils.h"
 #include "../oat.h"
+#include "../class_data.h"
+#include "../class_index.h"
 #include "../elf.h"
 #include "../heap.h"
 #include "../hash.h"
 #include "../cart.h"
 #include "../class.h"
+#include "../bitmap.h"
+#include "../mark.h"
+#include "../gc.h"
+#include "../alloc_tracker.h"
 #include "../entry.h"
 #include "../thread.h"
+#include "../net.h"
+#include "../debugger.h"
 
 static HeapVolume_t* pHeapVolume = NULL;
 static HashTable_t* pHashTable = NULL;
 static cart::JavaVMExt* java_vm_ = NULL;
 static cart::JNIEnvExt* jni_env_ = NULL;
 
+static void CountObject(void* arg, Object_t* obj) {
+  __atomic_add_fetch((size_t*)arg, 1, __ATOMIC_RELAXED);
+}
+
+// Readers of a shared table next to a thread churning tables of its own
+static void* LookupHashEntries(void* arg) {
+  HashTable_t* tbl = (HashTable_t*)arg;
+  for (int i = 0; i < 10000; ++i) {
+    IsHashExist(tbl, 123);
+  }
+  return NULL;
+}
+
+static void* ChurnHashTables(void* arg) {
+  for (int i = 0; i < 1000; ++i) {
+    HashTable_t* tbl = AllocHashTable(NULL, 5);
+    SetHashTableName(tbl, "unittest.churn");
+    for (size_t k = 0; k < 64; ++k) {
+      InsertHashEntry(tbl, k, (void*)k);
+    }
+    FreeHashTable(tbl);
+  }
+  return NULL;
+}
+
+typedef struct {
+  Gc_t*       gc;
+  Class_t*    klass;
+  HeapTlab_t* tlab;
+  int         nr;
+  int         nr_failed;
+} AllocJob_t;
+
+static void* AllocObjects(void* arg) {
+  AllocJob_t* job = (AllocJob_t*)arg;
+  for (int i = 0; i < job->nr; ++i) {
+    if (!GcAllocObject(job->gc, job->tlab, job->klass)) {
+      job->nr_failed++;
+    }
+  }
+  GcDetachMutator(job->gc);
+  return NULL;
+}
+
+// Sends OP_COMPACT_HEAP to the debugger as a client would, waiting for it
+// to listen first
+static bool RequestCompactionFromDebugger(DebuggerPktRepCompact_t* rep) {
+  int8_t ip[] = "127.0.0.1";
+  int8_t packet[PACKET_SZ];
+  int32_t fd = -1;
+  for (int i = 0; (i < 100) && (connectSocket(&fd, ip, DEBUGGER_PORT) != 0); ++i) {
+    usleep(10000);
+  }
+  if (fd < 0) {
+    return false;
+  }
+  memset(packet, 0, sizeof(packet));
+  ((DebuggerPktComm*)packet)->op = OP_COMPACT_HEAP;
+  bool ok = transferSocket(fd, packet, sizeof(packet)) && receiveSocket(fd, rep, sizeof(*rep)) &&
+            (rep->op == OP_REP_COMPACT);
+  deinitializeSocket(fd);
+  return ok;
+}
+
 bool CreateJavaVM() {
   uint8_t isa[] = "x86";
   const uint8_t cp[] = "../../Loop.jar";
@@ -158,9 +231,244 @@ int main(int argc, char** argv) {
     return -1;
   }
   DumpHashTable(pHashTable);
+
+  // Distinct string keys sharing one hash value must both be found
+  InsertHashStrEntry(pHashTable, 777, (const uint8_t*)"LFoo;", 5, (void*)0x0000F000);
+  InsertHashStrEntry(pHashTable, 777, (const uint8_t*)"LBar;", 5, (void*)0x0000BA00);
+  if ((IsHashStrExist(pHashTable, 777, (const uint8_t*)"LFoo;", 5) != NULL) &&
+      (IsHashStrExist(pHashTable, 777, (const uint8_t*)"LBar;", 5) != NULL) &&
+      (IsHashStrExist(pHashTable, 777, (const uint8_t*)"LFoo;", 5)->ptr == (void*)0x0000F000)) {
+    fprintf(stderr, "IsHashStrExist1: passed\n");
+  } else {
+    fprintf(stderr, "IsHashStrExist1: failed\n");
+    return -1;
+  }
+  if (IsHashStrExist(pHashTable, 777, (const uint8_t*)"LBaz;", 5) == NULL) {
+    fprintf(stderr, "IsHashStrExist2: passed\n");
+  } else {
+    fprintf(stderr, "IsHashStrExist2: failed\n");
+    return -1;
+  }
+  if ((RemoveHashStrEntry(pHashTable, 777, (const uint8_t*)"LBar;", 5) == (void*)0x0000BA00) &&
+      (IsHashStrExist(pHashTable, 777, (const uint8_t*)"LBar;", 5) == NULL) &&
+      (IsHashStrExist(pHashTable, 777, (const uint8_t*)"LFoo;", 5) != NULL) &&
+      (RemoveHashStrEntry(pHashTable, 777, (const uint8_t*)"LBaz;", 5) == NULL)) {
+    fprintf(stderr, "RemoveHashStrEntry: passed\n");
+  } else {
+    fprintf(stderr, "RemoveHashStrEntry: failed\n");
+    return -1;
+  }
+  FreeHashTable(pHashTable);
+  pHashTable = 0;
+
+  // Lookups are counted from several threads at once, and the report is
+  // taken while tables come and go
+  pHashTable = AllocHashTable(NULL, 5);
+  SetHashTableName(pHashTable, "unittest.stats");
+  for (size_t k = 0; k < 100; ++k) {
+    InsertHashEntry(pHashTable, k * 1000 + 123, (void*)k);
+  }
+  for (size_t k = 1; k < 100; k += 2) {
+    RemoveHashEntry(pHashTable, k * 1000 + 123);
+  }
+  HashTableInfo_t bHashInfo;
+  GetHashTableInfo(pHashTable, &bHashInfo);
+  size_t nr_lookups = bHashInfo.stats.lookups;
+  pthread_t readers[4];
+  pthread_t churner;
+  for (int i = 0; i < 4; ++i) {
+    pthread_create(readers + i, NULL, LookupHashEntries, pHashTable);
+  }
+  pthread_create(&churner, NULL, ChurnHashTables, NULL);
+  char report[4096];
+  for (int i = 0; i < 100; ++i) {
+    FormatHashTableStats(report, sizeof(report));
+  }
+  for (int i = 0; i < 4; ++i) {
+    pthread_join(readers[i], NULL);
+  }
+  pthread_join(churner, NULL);
+  GetHashTableInfo(pHashTable, &bHashInfo);
+  FormatHashTableStats(report, sizeof(report));
+  if ((bHashInfo.stats.lookups == (nr_lookups + 40000)) && (bHashInfo.entries == 50) &&
+      (bHashInfo.entries + bHashInfo.tombstones <= bHashInfo.capacity) &&
+      (bHashInfo.displaced <= bHashInfo.entries) && strstr(report, "unittest.churn")) {
+    fprintf(stderr, "HashTableStats: passed\n");
+  } else {
+    fprintf(stderr, "HashTableStats: failed\n");
+  }
   FreeHashTable(pHashTable);
   pHashTable = 0;
 
+  /////////////////////////////////////////////////////////////////////////////
+  // Test CLASS DATA
+  /////////////////////////////////////////////////////////////////////////////
+  // 1 static, 2 instance, 1 direct and 2 virtual members, the ids of each
+  // list restart from its first item, 200 taking two bytes
+  const uint8_t class_data[] = {
+    1, 2, 1, 2,
+    7, 0x08,
+    3, 0x01, 2, 0x02,
+    0xC8, 0x01, 0x01, 0x80, 0x02,
+    5, 0x01, 0x90, 0x02, 4, 0x01, 0xA0, 0x02,
+  };
+  const uint32_t class_data_ids[] = { 7, 3, 5, 200, 5, 9 };
+  ClassDataIter_t bIter;
+  ClassDataIterInit(&bIter, class_data);
+  uint32_t nr_items = 0;
+  while (ClassDataIterNext(&bIter) && (nr_items < 6) && (bIter.idx == class_data_ids[nr_items])) {
+    nr_items++;
+  }
+  if ((nr_items == 6) && (bIter.code_off == 0x120) && (bIter.ptr == (class_data + sizeof(class_data)))) {
+    fprintf(stderr, "ClassDataIterNext: passed\n");
+  } else {
+    fprintf(stderr, "ClassDataIterNext: failed at item %u\n", nr_items);
+    return -1;
+  }
+  ClassDataIterInit(&bIter, class_data);
+  ClassDataIterSkipFields(&bIter);
+  if (ClassDataIterNext(&bIter) && (bIter.idx == 200) && (bIter.code_off == 0x100)) {
+    fprintf(stderr, "ClassDataIterSkipFields: passed\n");
+  } else {
+    fprintf(stderr, "ClassDataIterSkipFields: failed\n");
+    return -1;
+  }
+
+  // Classes are only indexed when the OAT file is loaded, and linked on
+  // their first lookup. The index is written next to the OAT file.
+  unlink("../samples/test.oat" CLASS_INDEX_SUFFIX);
+  ClassLinker_t* pLazyLinker = AllocateClassLinker(HEAP_START_SIZE);
+  HashTable_t* pLazyOatDexFiles = AllocHashTable(NULL, 5);
+  if (!pLazyLinker || !pLazyOatDexFiles ||
+      !LoadClassesOfOatDexFile(pLazyOatDexFiles, pLazyLinker, (const uint8_t*)"../samples/test.oat")) {
+    fprintf(stderr, "Failed to load ../samples/test.oat\n");
+    return -1;
+  }
+  if ((ClassTableSize(pLazyLinker->loaded_classes) == 0) && pLazyLinker->class_indexes->hdr->nr_classes &&
+      ClFindClass(pLazyLinker, (const uint8_t*)"LLoop;") &&
+      (ClFindClass(pLazyLinker, (const uint8_t*)"Loop") == ClFindClass(pLazyLinker, (const uint8_t*)"LLoop;")) &&
+      (ClassTableSize(pLazyLinker->loaded_classes) == 1)) {
+    fprintf(stderr, "ClFindClass lazy linking: passed\n");
+  } else {
+    fprintf(stderr, "ClFindClass lazy linking: failed\n");
+    return -1;
+  }
+  // Methods are looked up by name and signature, direct and virtual alike
+  Class_t* pLoop = ClFindClass(pLazyLinker, (const uint8_t*)"LLoop;");
+  Method_t* pMain = ClFindMethod(pLoop, (const uint8_t*)"main", (const uint8_t*)"([Ljava/lang/String;)V");
+  Method_t* pCtor = ClFindMethod(pLoop, (const uint8_t*)"<init>", (const uint8_t*)"()V");
+  uint64_t main_hash = ClMethodHash((const uint8_t*)"main", 4, (const uint8_t*)"([Ljava/lang/String;)V");
+  if (pMain && (pMain->method_access_flags & CLASS_ACC_STATIC) &&
+      (ClFindMethod(pLoop, (const uint8_t*)"main", NULL) == pMain) &&
+      (ClFindMethodHashed(pLoop, main_hash, (const uint8_t*)"main", 4, (const uint8_t*)"([Ljava/lang/String;)V") == pMain) &&
+      !ClFindMethod(pLoop, (const uint8_t*)"main", (const uint8_t*)"()V") &&
+      pCtor && !(pCtor->method_access_flags & CLASS_ACC_STATIC) &&
+      !ClFindMethod(pLoop, (const uint8_t*)"loop", NULL)) {
+    fprintf(stderr, "ClFindMethod: passed\n");
+  } else {
+    fprintf(stderr, "ClFindMethod: failed\n");
+    return -1;
+  }
+  FreeClassLinker(pLazyLinker);
+
+  // The next load maps the index instead of building it
+  pLazyLinker = AllocateClassLinker(HEAP_START_SIZE);
+  if (!pLazyLinker ||
+      !LoadClassesOfOatDexFile(pLazyOatDexFiles, pLazyLinker, (const uint8_t*)"../samples/test.oat")) {
+    fprintf(stderr, "Failed to load ../samples/test.oat\n");
+    return -1;
+  }
+  ClassIndex_t* pIndex = pLazyLinker->class_indexes;
+  const ClassIndexClass_t* pEntry = ClassIndexFindClass(pIndex, (const uint8_t*)"Loop", 4,
+                                                        GenHashKey64((const uint8_t*)"Loop", 4));
+  if (pIndex->map_sz && pEntry &&
+      !strcmp((const char*)GetClassStringOfClassDefByIdx(ClassIndexDexFile(pIndex, pEntry), pEntry->class_idx),
+              "LLoop;") &&
+      !ClassIndexFindClass(pIndex, (const uint8_t*)"Pool", 4, GenHashKey64((const uint8_t*)"Pool", 4)) &&
+      ClFindClass(pLazyLinker, (const uint8_t*)"LLoop;")) {
+    fprintf(stderr, "Class index sidecar: passed\n");
+  } else {
+    fprintf(stderr, "Class index sidecar: failed\n");
+    return -1;
+  }
+  FreeClassLinker(pLazyLinker);
+
+  // Built on one thread or several, the index and the linked classes are
+  // the same
+  ClassIndexUseSidecar(false);
+  OatDexFile_t* pParOatDexFile = OpenOatDexFile((const uint8_t*)"../samples/test.oat");
+  if (!pParOatDexFile) {
+    fprintf(stderr, "Failed to open ../samples/test.oat\n");
+    return -1;
+  }
+  ClassIndexUseThreads(1);
+  ClassIndex_t* pSerialIndex = OpenClassIndex(pParOatDexFile);
+  ClassIndexUseThreads(4);
+  ClassIndex_t* pParIndex = OpenClassIndex(pParOatDexFile);
+  ClassIndexUseThreads(0);
+  ClassIndexUseSidecar(true);
+  ClassLinker_t* pSerialLinker = AllocateClassLinker(HEAP_START_SIZE);
+  ClassLinker_t* pParLinker = AllocateClassLinker(HEAP_START_SIZE);
+  if (!pSerialIndex || !pParIndex || !pSerialLinker || !pParLinker ||
+      !RegisterOatDexFile(pParOatDexFile, pSerialLinker) || !RegisterOatDexFile(pParOatDexFile, pParLinker)) {
+    fprintf(stderr, "Failed to load ../samples/test.oat\n");
+    return -1;
+  }
+  Class_t* pSerialLoop = NULL;
+  Class_t* pParLoop = NULL;
+  if ((pSerialIndex->hdr->file_size == pParIndex->hdr->file_size) &&
+      !memcmp(pSerialIndex->hdr, pParIndex->hdr, pSerialIndex->hdr->file_size) &&
+      ClLinkAllClasses(pSerialLinker, 1) && ClLinkAllClasses(pParLinker, 4) &&
+      ClassTableSize(pSerialLinker->loaded_classes) &&
+      (ClassTableSize(pSerialLinker->loaded_classes) == ClassTableSize(pParLinker->loaded_classes)) &&
+      (pSerialLoop = ClFindClass(pSerialLinker, (const uint8_t*)"LLoop;")) &&
+      (pParLoop = ClFindClass(pParLinker, (const uint8_t*)"LLoop;")) &&
+      (pSerialLoop->nr_methods == pParLoop->nr_methods) && (pSerialLoop->object_size == pParLoop->object_size)) {
+    fprintf(stderr, "Parallel class loading: passed\n");
+  } else {
+    fprintf(stderr, "Parallel class loading: failed\n");
+    return -1;
+  }
+  FreeClassLinker(pSerialLinker);
+  FreeClassLinker(pParLinker);
+  CloseClassIndex(pSerialIndex);
+  CloseClassIndex(pParIndex);
+  CloseOatDexFile(pParOatDexFile);
+
+  // Fields are laid out as ART does, naturally aligned, smaller ones
+  // filling the padding. LTest; of mem.oat has a double then an int.
+  ClassLinker_t* pFieldLinker = AllocateClassLinker(HEAP_START_SIZE);
+  HashTable_t* pFieldOatDexFiles = AllocHashTable(NULL, 5);
+  if (!pFieldLinker || !pFieldOatDexFiles ||
+      !LoadClassesOfOatDexFile(pFieldOatDexFiles, pFieldLinker, (const uint8_t*)"../samples/mem.oat")) {
+    fprintf(stderr, "Failed to load ../samples/mem.oat\n");
+    return -1;
+  }
+  Class_t* pTest = ClFindClass(pFieldLinker, (const uint8_t*)"LTest;");
+  Field_t* pDouble = NULL;
+  Field_t* pInt = NULL;
+  for (size_t i = 0; pTest && pTest->instance_fields && (i < pTest->instance_fields->nr); ++i) {
+    Field_t* pField = (Field_t*)pTest->instance_fields->ptr[i].ptr;
+    if (pTest->instance_fields->ctrl[i] < 0) {
+      continue;
+    } else if (!strcmp((const char*)pField->field_str, "fp")) {
+      pDouble = pField;
+    } else if (!strcmp((const char*)pField->field_str, "txt")) {
+      pInt = pField;
+    }
+  }
+  uint32_t double_offset = (CLASS_OBJECT_HDR_SIZE + 7) & ~7U;
+  // The int goes into the padding before the double if there is room
+  uint32_t int_offset = ((double_offset - CLASS_OBJECT_HDR_SIZE) >= 4) ? CLASS_OBJECT_HDR_SIZE : double_offset + 8;
+  if (pDouble && pInt && (pDouble->offset == double_offset) && (pInt->offset == int_offset) &&
+      (pTest->object_size == (((int_offset + 4) > (double_offset + 8)) ? (int_offset + 4) : (double_offset + 8)))) {
+    fprintf(stderr, "Instance field layout: passed\n");
+  } else {
+    fprintf(stderr, "Instance field layout: failed\n");
+    return -1;
+  }
+  FreeClassLinker(pFieldLinker);
+
   /////////////////////////////////////////////////////////////////////////////
   // Test HEAP
   /////////////////////////////////////////////////////////////////////////////
@@ -184,9 +492,386 @@ int main(int argc, char** argv) {
   fprintf(stderr, "Free p4\n");
   HeapFree(pHeapVolume, p4);
   DumpHeap(pHeapVolume);
+  // Free pages are released once, wherever they are
+  p1 = (uint8_t*)HeapAlloc(pHeapVolume, 8 * PAGE_SIZE);
+  p2 = (uint8_t*)HeapAlloc(pHeapVolume, 123);
+  HeapFree(pHeapVolume, p1);
+  if (HeapVerify(pHeapVolume) == 0) {
+    fprintf(stderr, "HeapVerify: passed\n");
+  } else {
+    fprintf(stderr, "HeapVerify: failed\n");
+    return -1;
+  }
+  if ((HeapTrim(pHeapVolume) >= (8 * PAGE_SIZE)) && (HeapTrim(pHeapVolume) == 0)) {
+    fprintf(stderr, "HeapTrim: passed\n");
+  } else {
+    fprintf(stderr, "HeapTrim: failed\n");
+    return -1;
+  }
+  HeapFree(pHeapVolume, p2);
+  // A TLAB chunk only counts each object start once
+  HeapTlab_t bHeapTlab;
+  memset(&bHeapTlab, 0, sizeof(HeapTlab_t));
+  size_t tlab_alloced = pHeapVolume->ptr->alloced_sz;
+  p1 = (uint8_t*)HeapTlabAlloc(pHeapVolume, &bHeapTlab, 32);
+  p2 = (uint8_t*)HeapTlabAlloc(pHeapVolume, &bHeapTlab, 32);
+  HeapFree(pHeapVolume, p1);
+  HeapFree(pHeapVolume, p1);
+  HeapFree(pHeapVolume, p2 + HEAP_OBJECT_ALIGN);
+  HeapFree(pHeapVolume, p2 + 32);
+  HeapRevokeTlab(pHeapVolume, &bHeapTlab);
+  bool tlab_live = (pHeapVolume->ptr->alloced_sz > tlab_alloced) && (HeapVerify(pHeapVolume) == 0);
+  HeapFree(pHeapVolume, p2);
+  if (p1 && p2 && tlab_live && (pHeapVolume->ptr->alloced_sz == tlab_alloced) && (HeapVerify(pHeapVolume) == 0)) {
+    fprintf(stderr, "HeapTlabFree: passed\n");
+  } else {
+    fprintf(stderr, "HeapTlabFree: failed\n");
+    return -1;
+  }
+  FreeHeapVolume(pHeapVolume);
+  pHeapVolume = 0;
+  // Huge pages are committed and trimmed whole, small ones without them
+  HeapUseHugePages(true);
+  pHeapVolume = AllocHeapVolumeWithLimit(HEAP_START_SIZE, 8 * HUGE_PAGE_SIZE);
+  HeapUseHugePages(false);
+  if (!pHeapVolume) {
+    fprintf(stderr, "Out of memory for heap initialization\n");
+    return -1;
+  }
+  size_t unit = (pHeapVolume->ptr->nr_align > 1) ? HUGE_PAGE_SIZE : PAGE_SIZE;
+  p1 = (uint8_t*)HeapAlloc(pHeapVolume, 2 * HUGE_PAGE_SIZE);
+  p2 = (uint8_t*)HeapAlloc(pHeapVolume, 123);
+  memset(p1, 0xA5, 2 * HUGE_PAGE_SIZE);
+  HeapFree(pHeapVolume, p1);
+  size_t trimmed = HeapTrim(pHeapVolume);
+  p1 = (uint8_t*)HeapAlloc(pHeapVolume, 2 * HUGE_PAGE_SIZE);
+  if (p1 && p2 && !(pHeapVolume->total_sz % unit) && trimmed && !(trimmed % unit)) {
+    fprintf(stderr, "HeapUseHugePages: passed\n");
+  } else {
+    fprintf(stderr, "HeapUseHugePages: failed\n");
+    return -1;
+  }
+  HeapFree(pHeapVolume, p1);
+  HeapFree(pHeapVolume, p2);
   FreeHeapVolume(pHeapVolume);
   pHeapVolume = 0;
 
+  /////////////////////////////////////////////////////////////////////////////
+  // Test GC
+  /////////////////////////////////////////////////////////////////////////////
+  ClassLinker_t* pClassLinker = AllocateClassLinker(HEAP_START_SIZE);
+  Gc_t* pGc = pClassLinker ? AllocGc(pClassLinker->heap_vol) : NULL;
+  if (!pGc) {
+    fprintf(stderr, "Out of memory for GC initialization\n");
+    return -1;
+  }
+  // Nodes with a single reference field, every other one is garbage
+  uint32_t next_offset = CLASS_OBJECT_HDR_SIZE;
+  Class_t bNode;
+  memset(&bNode, 0, sizeof(Class_t));
+  bNode.object_size = CLASS_OBJECT_HDR_SIZE + sizeof(Object_t*);
+  bNode.ref_offsets = &next_offset;
+  bNode.nr_ref_offsets = 1;
+  Class_t* pArrayClass = ClFindArrayClass(pClassLinker, (const uint8_t*)"[I");
+  Object_t* pList = NULL;
+  GcAddRoot(pGc, &pList);
+  for (int i = 0; i < 1000; ++i) {
+    // Link each node in before the next allocation, which may collect
+    Object_t* pNode = GcAllocObject(pGc, NULL, &bNode);
+    if (!pNode) {
+      fprintf(stderr, "GcAlloc: failed\n");
+      return -1;
+    }
+    *(Object_t**)((uint8_t*)pNode + next_offset) = pList;
+    pList = pNode;
+    if (!GcAllocObject(pGc, NULL, &bNode) || !GcAllocArray(pGc, NULL, pArrayClass, 100)) {
+      fprintf(stderr, "GcAlloc: failed\n");
+      return -1;
+    }
+  }
+  GcCollect(pGc);
+  GcStats_t bGcStats;
+  GcGetStats(pGc, &bGcStats);
+  int nr_nodes = 0;
+  for (Object_t* pNode = pList; pNode; pNode = *(Object_t**)((uint8_t*)pNode + next_offset)) {
+    nr_nodes += (pNode->klass == &bNode) ? 1 : 0;
+  }
+  if ((nr_nodes == 1000) && (bGcStats.freed_objects >= 2000)) {
+    fprintf(stderr, "GcCollect: passed\n");
+  } else {
+    fprintf(stderr, "GcCollect: failed\n");
+    return -1;
+  }
+  // The same list traced by several threads at once
+  MarkPool_t* pMarkPool = AllocMarkPool(4);
+  size_t nr_visited = 0;
+  MarkSpace_t bSpace;
+  bSpace.base = pGc->base;
+  bSpace.nr_bits = pGc->nr_bits;
+  bSpace.live_bits = pGc->live_bits;
+  bSpace.mark_bits = pGc->mark_bits;
+  bSpace.los = NULL;
+  MarkJob_t bJob;
+  memset(&bJob, 0, sizeof(MarkJob_t));
+  bJob.space = &bSpace;
+  bJob.roots = &pList;
+  bJob.nr_roots = 1;
+  bJob.visit = CountObject;
+  bJob.arg = &nr_visited;
+  bJob.nr_threads = 4;
+  if (pMarkPool && MarkPoolTrace(pMarkPool, &bJob) && (bJob.nr_marked == 1000) && (nr_visited == 1000)) {
+    fprintf(stderr, "MarkPoolTrace: passed\n");
+  } else {
+    fprintf(stderr, "MarkPoolTrace: failed\n");
+    return -1;
+  }
+  memset(pGc->mark_bits, 0, BitmapWords(pGc->nr_bits) * sizeof(uint64_t));
+  FreeMarkPool(pMarkPool);
+  if (GcVisitReachable(pGc, NULL, NULL) == 1000) {
+    fprintf(stderr, "GcVisitReachable: passed\n");
+  } else {
+    fprintf(stderr, "GcVisitReachable: failed\n");
+    return -1;
+  }
+  // A runtime call from compiled code: the refs-only callee save frame of
+  // the stub, the frame of the method that called it and the NULL method
+  // the invoke stub ends the walk with. The node is only held in a callee
+  // save register of the compiled code, which the stub spilled.
+  OatQuickMethodHdr_t bSaveHdr;
+  OatQuickMethodHdr_t bCodeHdr;
+  memset(&bSaveHdr, 0, sizeof(OatQuickMethodHdr_t));
+  memset(&bCodeHdr, 0, sizeof(OatQuickMethodHdr_t));
+  bSaveHdr.frame_info_.frame_size_in_bytes_ = 8 * sizeof(uintptr_t);
+  bSaveHdr.frame_info_.core_spill_mask_ = (1 << 5) | (1 << 6) | (1 << 7) | (1 << 8);
+  bCodeHdr.frame_info_.frame_size_in_bytes_ = 4 * sizeof(uintptr_t);
+  bCodeHdr.frame_info_.core_spill_mask_ = 1 << 8;
+  Method_t bSaveMethod;
+  Method_t bCodeMethod;
+  memset(&bSaveMethod, 0, sizeof(Method_t));
+  memset(&bCodeMethod, 0, sizeof(Method_t));
+  bSaveMethod.method_oat_code_hdr = &bSaveHdr;
+  bCodeMethod.method_oat_code_hdr = &bCodeHdr;
+  uintptr_t frames[13];
+  memset(frames, 0, sizeof(frames));
+  frames[0] = (uintptr_t)&bSaveMethod;
+  frames[5] = (uintptr_t)GcAllocObject(pGc, NULL, &bNode);
+  frames[8] = (uintptr_t)&bCodeMethod;
+  ManagedStack_t bStack;
+  memset(&bStack, 0, sizeof(ManagedStack_t));
+  bStack.top_quick_frame_ = (void*)frames;
+  GcSetManagedStack(pGc, (const struct ManagedStack*)&bStack);
+  GcCollect(pGc);
+  size_t nr_held = GcVisitReachable(pGc, NULL, NULL);
+  GcSetManagedStack(pGc, NULL);
+  if (frames[5] && (nr_held == 1001) && (GcVisitReachable(pGc, NULL, NULL) == 1000)) {
+    fprintf(stderr, "GcScanQuickFrames: passed\n");
+  } else {
+    fprintf(stderr, "GcScanQuickFrames: failed\n");
+    return -1;
+  }
+  // Young nodes hung from a node of the heap proper, the write barrier
+  // leads the minor collection to them
+  HeapTlab_t bTlab;
+  memset(&bTlab, 0, sizeof(HeapTlab_t));
+  Object_t* pHolder = GcAllocObject(pGc, NULL, &bNode);
+  GcAddRoot(pGc, &pHolder);
+  for (int i = 0; i < 100; ++i) {
+    Object_t* pNode = GcAllocObject(pGc, &bTlab, &bNode);
+    if (!pNode || !GcAllocObject(pGc, &bTlab, &bNode)) {
+      fprintf(stderr, "GcAlloc: failed\n");
+      return -1;
+    }
+    *(Object_t**)((uint8_t*)pNode + next_offset) = *(Object_t**)((uint8_t*)pHolder + next_offset);
+    GcStoreRef(pGc, pHolder, (Object_t**)((uint8_t*)pHolder + next_offset), pNode);
+  }
+  GcCollectYoung(pGc);
+  GcRevokeTlab(pGc, &bTlab);
+  nr_nodes = 0;
+  Object_t* pNode = *(Object_t**)((uint8_t*)pHolder + next_offset);
+  for (; pNode; pNode = *(Object_t**)((uint8_t*)pNode + next_offset)) {
+    bool young = ((uint8_t*)pNode >= pGc->nursery) && ((uint8_t*)pNode < (pGc->nursery + pGc->nursery_sz));
+    nr_nodes += ((pNode->klass == &bNode) && !young) ? 1 : 0;
+  }
+  GcGetStats(pGc, &bGcStats);
+  if ((nr_nodes == 100) && (bGcStats.promoted_objects == 100)) {
+    fprintf(stderr, "GcCollectYoung: passed\n");
+  } else {
+    fprintf(stderr, "GcCollectYoung: failed\n");
+    return -1;
+  }
+  // Garbage swept by the heap daemon, the list stays
+  uint64_t nr_freed = bGcStats.freed_objects;
+  if (!GcStartDaemon(pGc)) {
+    fprintf(stderr, "GcStartDaemon: failed\n");
+    return -1;
+  }
+  for (int i = 0; i < 10000; ++i) {
+    if (!GcAllocObject(pGc, NULL, &bNode) || !GcAllocArray(pGc, NULL, pArrayClass, 100)) {
+      fprintf(stderr, "GcAlloc: failed\n");
+      return -1;
+    }
+  }
+  GcStopDaemon(pGc);
+  GcGetStats(pGc, &bGcStats);
+  nr_nodes = 0;
+  for (pNode = pList; pNode; pNode = *(Object_t**)((uint8_t*)pNode + next_offset)) {
+    nr_nodes += (pNode->klass == &bNode) ? 1 : 0;
+  }
+  if ((nr_nodes == 1000) && (bGcStats.freed_objects > nr_freed)) {
+    fprintf(stderr, "GcStartDaemon: passed\n");
+  } else {
+    fprintf(stderr, "GcStartDaemon: failed\n");
+    return -1;
+  }
+  // Big primitive arrays are mapped on their own and unmapped once dead
+  Array_t* pBig = GcAllocArray(pGc, NULL, pArrayClass, 100000);
+  GcAddRoot(pGc, (Object_t**)&pBig);
+  for (int i = 0; i < 20; ++i) {
+    if (!GcAllocArray(pGc, NULL, pArrayClass, 100000)) {
+      fprintf(stderr, "GcAlloc: failed\n");
+      return -1;
+    }
+  }
+  GcCollect(pGc);
+  size_t big_sz = CLASS_ARRAY_HDR_SIZE + (100000 * sizeof(uint32_t));
+  big_sz = ((big_sz + PAGE_SIZE - 1) / PAGE_SIZE) * PAGE_SIZE;
+  if (pBig && (pBig->length == 100000) &&
+      (((uint8_t*)pBig < pGc->base) || ((uint8_t*)pBig >= (pGc->base + pGc->heap_vol->max_sz))) &&
+      (LosAllocedSize(pGc->los) == big_sz)) {
+    fprintf(stderr, "LosAlloc: passed\n");
+  } else {
+    fprintf(stderr, "LosAlloc: failed\n");
+    return -1;
+  }
+  // Only every fourth node is kept, compaction packs them and fixes the links
+  Object_t* pSparse = NULL;
+  GcAddRoot(pGc, &pSparse);
+  for (int i = 0; i < 20000; ++i) {
+    Object_t* pNode = GcAllocObject(pGc, NULL, &bNode);
+    if (!pNode) {
+      fprintf(stderr, "GcAlloc: failed\n");
+      return -1;
+    }
+    *(Object_t**)((uint8_t*)pNode + next_offset) = pSparse;
+    pSparse = pNode;
+  }
+  for (pNode = pSparse; pNode; pNode = *(Object_t**)((uint8_t*)pNode + next_offset)) {
+    Object_t** pNext = (Object_t**)((uint8_t*)pNode + next_offset);
+    for (int i = 0; (i < 3) && *pNext; ++i) {
+      *pNext = *(Object_t**)((uint8_t*)*pNext + next_offset);
+    }
+  }
+  // Neither the allocations nor the collections so far compacted, a
+  // requested compaction waits for the next GcCollect
+  GcCollect(pGc);
+  unsigned int nr_frag = HeapFragmentation(pGc->heap_vol);
+  GcGetStats(pGc, &bGcStats);
+  uint64_t nr_compactions = bGcStats.compactions;
+  size_t nr_moved = GcCompact(pGc);
+  GcRequestCompaction(pGc);
+  GcCollect(pGc);
+  GcGetStats(pGc, &bGcStats);
+  nr_nodes = 0;
+  for (pNode = pSparse; pNode; pNode = *(Object_t**)((uint8_t*)pNode + next_offset)) {
+    nr_nodes += (pNode->klass == &bNode) ? 1 : 0;
+  }
+  for (pNode = pList; pNode; pNode = *(Object_t**)((uint8_t*)pNode + next_offset)) {
+    nr_nodes += (pNode->klass == &bNode) ? 1 : 0;
+  }
+  if (nr_moved && !nr_compactions && (bGcStats.compactions == 2) && (nr_nodes == 6000) &&
+      (HeapFragmentation(pGc->heap_vol) < nr_frag) &&
+      (HeapVerify(pGc->heap_vol) == 0)) {
+    fprintf(stderr, "GcCompact: passed\n");
+  } else {
+    fprintf(stderr, "GcCompact: failed\n");
+    return -1;
+  }
+  // The debugger only asks, the compaction happens at the next safepoint
+  pthread_t debugger_th;
+  DebuggerPktRepCompact_t bRep;
+  StartDebuggerThread(&debugger_th, pGc);
+  pthread_detach(debugger_th);
+  bool requested = RequestCompactionFromDebugger(&bRep);
+  GcSafepoint(pGc);
+  GcGetStats(pGc, &bGcStats);
+  if (requested && bRep.Pending && (bRep.Compactions == 2) &&
+      !bGcStats.compact_pending && (bGcStats.compactions == 3)) {
+    fprintf(stderr, "GcSafepoint: passed\n");
+  } else {
+    fprintf(stderr, "GcSafepoint: failed\n");
+    return -1;
+  }
+  // Sampled about every 4KB, the arrays allocate 34 times the bytes of the
+  // nodes and are estimated close to it
+  AllocTracker_t* pTracker = AllocAllocTracker(pClassLinker, 4096);
+  GcSetAllocTracker(pGc, pTracker);
+  for (int i = 0; i < 20000; ++i) {
+    if (!GcAllocObject(pGc, NULL, &bNode) || !GcAllocArray(pGc, NULL, pArrayClass, 100)) {
+      fprintf(stderr, "GcAlloc: failed\n");
+      return -1;
+    }
+  }
+  GcSetAllocTracker(pGc, NULL);
+  AllocSite_t bSites[2];
+  size_t nr_sites = pTracker ? AllocTrackerTopSites(pTracker, bSites, 2) : 0;
+  uint64_t array_sz = 20000ULL * (CLASS_ARRAY_HDR_SIZE + (100 * sizeof(uint32_t)));
+  uint64_t node_sz = 20000ULL * bNode.object_size;
+  if ((nr_sites == 2) && (bSites[0].klass == pArrayClass) && (bSites[1].klass == &bNode) &&
+      (bSites[0].estimated_bytes > (array_sz * 9) / 10) && (bSites[0].estimated_bytes < (array_sz * 11) / 10) &&
+      (bSites[1].estimated_bytes > node_sz / 2) && (bSites[1].estimated_bytes < (node_sz * 3) / 2)) {
+    fprintf(stderr, "AllocTracker: passed\n");
+  } else {
+    fprintf(stderr, "AllocTracker: failed\n");
+    return -1;
+  }
+  DumpAllocSites(pTracker);
+  FreeAllocTracker(pTracker);
+  // Another thread cannot allocate while this one is the mutator. Once it
+  // may, the nursery forgets its TLAB when it detaches.
+  memset(&bTlab, 0, sizeof(HeapTlab_t));
+  AllocJob_t bJob2 = { pGc, &bNode, &bTlab, 10, 0 };
+  pthread_t th;
+  pthread_create(&th, NULL, AllocObjects, &bJob2);
+  pthread_join(th, NULL);
+  bool other_failed = (bJob2.nr_failed == 10);
+  GcDetachMutator(pGc);
+  pthread_create(&th, NULL, AllocObjects, &bJob2);
+  pthread_join(th, NULL);
+  GcCollectYoung(pGc);
+  GcDetachMutator(pGc);
+  if (other_failed && (bJob2.nr_failed == 10) && !bTlab.start) {
+    fprintf(stderr, "GcAttachMutator: passed\n");
+  } else {
+    fprintf(stderr, "GcAttachMutator: failed\n");
+    return -1;
+  }
+  // Counted by each thread on its own, summed when asked. One thread at a
+  // time is the mutator, so they take turns.
+  RuntimeStats_t bRtStats;
+  GcGetRuntimeStats(pGc, &bRtStats);
+  uint64_t nr_allocated = bRtStats.allocated_objects;
+  bJob2.tlab = NULL;
+  bJob2.nr = 10000;
+  bJob2.nr_failed = 0;
+  for (int i = 0; i < 4; ++i) {
+    pthread_create(&th, NULL, AllocObjects, &bJob2);
+    pthread_join(th, NULL);
+  }
+  GcGetRuntimeStats(pGc, &bRtStats);
+  GcHeapInfo_t bHeapInfo;
+  GcGetHeapInfo(pGc, &bHeapInfo);
+  if ((bRtStats.allocated_objects == (nr_allocated + 40000)) && !bJob2.nr_failed && bRtStats.freed_bytes &&
+      (bHeapInfo.alloced <= bHeapInfo.total) && (bHeapInfo.total <= (bHeapInfo.max + LosAllocedSize(pGc->los))) &&
+      (bHeapInfo.until_gc <= bHeapInfo.until_oome)) {
+    fprintf(stderr, "GcGetRuntimeStats: passed\n");
+  } else {
+    fprintf(stderr, "GcGetRuntimeStats: failed\n");
+    return -1;
+  }
+  DumpGcStats(pGc);
+  FreeGc(pGc);
+  FreeClassLinker(pClassLinker);
+
   /////////////////////////////////////////////////////////////////////////////
   // Test CART
   /////////////////////////////////////////////////////////////////////////////
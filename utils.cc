@@ -21,11 +21,15 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <pthread.h>
 
 #include "macros.h"
+#include "utils.h"
+#include "cart.h"
 
 #ifdef CART_DEBUG
 static int8_t ConvertDWordToByte(const uint32_t* Data, uint32_t Offset) {
@@ -206,3 +210,119 @@ bool IsFileExist(const uint8_t* file) {
   }
   return false;
 }
+
+bool IsHugePageEnabled() {
+  char mode[64];
+  FILE* fp = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+  if (!fp) {
+    return false;
+  }
+  // The mode in use is in brackets, "always [madvise] never"
+  bool enabled = fgets(mode, sizeof(mode), fp) && !strstr(mode, "[never]");
+  fclose(fp);
+  return enabled;
+}
+
+size_t RemapHugePages(void* begin, size_t sz, int prot) {
+  uint8_t* first = (uint8_t*)(((uintptr_t)begin + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+  uint8_t* end = (uint8_t*)(((uintptr_t)begin + sz) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+  if (end <= first) {
+    return 0;
+  }
+  size_t nr = end - first;
+  // Pages of hugetlbfs first, they need pages reserved for them
+  uint8_t* p = (uint8_t*)mmap(NULL, nr, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (p == MAP_FAILED) {
+    if (!IsHugePageEnabled()) {
+      pdbg("No huge pages in the system\n");
+      return 0;
+    }
+    // Then transparent huge pages, the copy starts on a huge page boundary
+    // so that they fit
+    uint8_t* r = (uint8_t*)mmap(NULL, nr + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (r == MAP_FAILED) {
+      return 0;
+    }
+    p = (uint8_t*)(((uintptr_t)r + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    if (p > r) {
+      munmap(r, p - r);
+    }
+    munmap(p + nr, (r + HUGE_PAGE_SIZE) - p);
+    if (madvise(p, nr, MADV_HUGEPAGE) != 0) {
+      munmap(p, nr);
+      return 0;
+    }
+  }
+  // Move the copy over the original, which stays if anything fails
+  memcpy(p, first, nr);
+  if ((mprotect(p, nr, prot) != 0) ||
+      (mremap(p, nr, nr, MREMAP_MAYMOVE | MREMAP_FIXED, first) == MAP_FAILED)) {
+    pdbg("Failed to remap %u bytes on huge pages\n", (unsigned int)nr);
+    munmap(p, nr);
+    return 0;
+  }
+  return nr;
+}
+
+int GetNrOnlineCpus() {
+  long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  return (nr_cpus > 0) ? (int)nr_cpus : 1;
+}
+
+// Items handed out to the workers of a RunWorkers call. Accessed with
+// atomic operations, so it is not PACKED.
+typedef struct {
+  WorkFn_t  work;
+  void*     arg;
+  uint32_t  nr_items;
+  uint32_t  next_item;
+} WorkQueue_t;
+
+typedef struct {
+  WorkQueue_t*  queue;
+  int           worker;
+} Worker_t;
+
+static void* _Work(void* arg) {
+  Worker_t* pWorker = (Worker_t*)arg;
+  WorkQueue_t* pQueue = pWorker->queue;
+  for (;;) {
+    uint32_t item = __atomic_fetch_add(&pQueue->next_item, 1, __ATOMIC_RELAXED);
+    if (item >= pQueue->nr_items) {
+      break;
+    }
+    pQueue->work(pQueue->arg, pWorker->worker, item);
+  }
+  return NULL;
+}
+
+int RunWorkers(int nr_workers, uint32_t nr_items, WorkFn_t work, void* arg) {
+  WorkQueue_t bQueue = { work, arg, nr_items, 0 };
+  Worker_t workers[MAX_WORKERS];
+  pthread_t threads[MAX_WORKERS];
+  if (nr_workers > MAX_WORKERS) {
+    nr_workers = MAX_WORKERS;
+  }
+  if ((uint32_t)nr_workers > nr_items) {
+    nr_workers = (int)nr_items;
+  }
+  // The caller is worker 0, the items are done even if no thread starts
+  int nr = 1;
+  for (; nr < nr_workers; ++nr) {
+    workers[nr].queue = &bQueue;
+    workers[nr].worker = nr;
+    if (pthread_create(&threads[nr], NULL, _Work, (void*)&workers[nr])) {
+      pdbg("Failed to start worker %d\n", nr);
+      break;
+    }
+  }
+  workers[0].queue = &bQueue;
+  workers[0].worker = 0;
+  _Work((void*)&workers[0]);
+  for (int i = 1; i < nr; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  return nr;
+}
@@ -30,6 +30,23 @@ uint32_t DecodeUnsignedLeb128(const uint8_t** data);
 size_t GenerateOatDexFilename(const uint8_t* file, const uint8_t* isa, uint8_t* out, size_t len);
 size_t GenerateOat2DexCmd(const uint8_t* file, const uint8_t* isa, uint8_t* out, size_t len);
 bool IsFileExist(const uint8_t* file);
+// True when transparent huge pages are not turned off
+bool IsHugePageEnabled();
+// Moves the whole huge pages of [begin, begin + sz) onto huge pages, the
+// contents and the addresses stay. Returns the bytes moved, 0 when the
+// system has none to give.
+size_t RemapHugePages(void* begin, size_t sz, int prot);
+
+// Threads RunWorkers starts at most, the caller included
+#define MAX_WORKERS   64
+// One item of a RunWorkers call, done by worker 0 (the caller) to nr_workers - 1
+typedef void (*WorkFn_t)(void* arg, int worker, uint32_t item);
+// Processors online, at least 1
+int GetNrOnlineCpus();
+// Does the items 0 to nr_items - 1 on up to nr_workers threads, each
+// taking the next item when done with one, and returns once all are done.
+// Returns how many threads worked.
+int RunWorkers(int nr_workers, uint32_t nr_items, WorkFn_t work, void* arg);
 
 #ifdef CART_DEBUG
 void DumpData(const uint32_t* ptr, uint32_t len, uint32_t label);